@@ -0,0 +1,67 @@
+/*
+ * Layout of the shared-memory segment to which a running Byfl-instrumented
+ * program publishes its counters -- for use both by the Byfl library and by
+ * the bf-top monitor
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#ifndef _BF_LIVE_H
+#define _BF_LIVE_H
+
+#include <stdint.h>
+
+/* Define the name of the segment a given process publishes. */
+#define BF_LIVE_SHM_FORMAT "/byfl-live-%lu"
+
+/* Identify a Byfl live-counter segment and its layout. */
+#define BF_LIVE_MAGIC   0x45564c494c465942ULL   /* "BYFLLIVE" read little-endian */
+#define BF_LIVE_VERSION 1
+
+/* Define the maximum number of functions and the maximum length of a
+ * function name (including the terminating NUL) stored in the segment. */
+#define BF_LIVE_MAX_FUNCS    64
+#define BF_LIVE_NAME_LEN     128
+
+/* Define the counters we publish for the program and for each function. */
+typedef enum {
+  BF_LIVE_BBLOCKS,      /* Basic blocks executed */
+  BF_LIVE_LOAD_INS,     /* Load instructions executed */
+  BF_LIVE_STORE_INS,    /* Store instructions executed */
+  BF_LIVE_FLOPS,        /* Floating-point operations performed */
+  BF_LIVE_INT_OPS,      /* Integer operations performed */
+  BF_LIVE_CALL_INS,     /* Function calls executed */
+  BF_LIVE_LOADS,        /* Bytes loaded */
+  BF_LIVE_STORES,       /* Bytes stored */
+  BF_LIVE_FP_BITS,      /* Bits consumed or produced by floating-point operations */
+  BF_LIVE_OP_BITS,      /* Bits consumed or produced by all non-memory operations */
+  BF_LIVE_NUM_COUNTERS
+} BF_LIVE_COUNTER_T;
+
+/* Represent one function's counters. */
+typedef struct {
+  char name[BF_LIVE_NAME_LEN];                /* Demangled function name */
+  uint64_t counters[BF_LIVE_NUM_COUNTERS];    /* Counter values */
+} bf_live_func_t;
+
+/* Lay out the entire segment.  The writer increments sequence to an odd
+ * value before updating the remaining fields and to the following even
+ * value afterwards.  A reader copies the segment, retrying if sequence was
+ * odd or changed during the copy (a "seqlock").  Readers therefore never
+ * block the writer. */
+typedef struct {
+  uint64_t magic;                             /* BF_LIVE_MAGIC */
+  uint64_t version;                           /* BF_LIVE_VERSION */
+  uint64_t sequence;                          /* Odd while an update is in progress */
+  uint64_t pid;                               /* Process ID of the writer */
+  uint64_t start_time;                        /* Time of initialization (seconds since the Epoch) */
+  uint64_t elapsed_ns;                        /* Time of the latest update (nanoseconds since initialization) */
+  uint64_t updates;                           /* Number of updates published */
+  uint64_t finished;                          /* 1=program has finished; 0=still running */
+  char program[BF_LIVE_NAME_LEN];             /* Name of the instrumented program */
+  uint64_t totals[BF_LIVE_NUM_COUNTERS];      /* Program-wide counter values */
+  uint64_t num_funcs;                         /* Number of valid entries in funcs[] */
+  bf_live_func_t funcs[BF_LIVE_MAX_FUNCS];    /* Functions in decreasing order of operations */
+} bf_live_segment_t;
+
+#endif
@@ -26,7 +26,51 @@ typedef enum {
 /* Define tags for row types in the binary output. */
 typedef enum {
   BINOUT_ROW_NONE,       /* No columns in this row (i.e., end of table) */
-  BINOUT_ROW_DATA        /* Columns will follow */
+  BINOUT_ROW_DATA,       /* Columns will follow */
+  BINOUT_ROW_SPARSE      /* Columns will follow, encoded as below */
 } BINOUT_ROW_T;
 
+/* A BINOUT_ROW_SPARSE row may appear only in a version 1 basic table whose
+ * columns are all BINOUT_COL_UINT64.  It encodes each column as its
+ * difference from the same column of the table's previous row (or from 0
+ * for the table's first row).  The row comprises a bitmap of (N+7)/8 bytes
+ * for N columns, in which bit i%8 of byte i/8 is set if column i differs
+ * from the previous row, followed by each such difference (modulo 2^64)
+ * zigzag-encoded (2*d for d >= 0 and -2*d-1 for d < 0) and written as a
+ * base-128 varint (7 bits per byte, least-significant group first, with
+ * the high bit set in all bytes but the last). */
+
+/* A compressed binary-output file begins with BINOUT_ZSTD_MAGIC instead of
+ * "BYFLBIN".  It continues with a sequence of independently decodable
+ * blocks, each comprising a 32-bit big-endian compressed size, a 32-bit
+ * big-endian uncompressed size, and that many bytes of zstd frame.
+ * Concatenating the decompressed blocks yields an ordinary binary-output
+ * file.  No block decompresses to more than BINOUT_ZSTD_MAX_BLOCK bytes. */
+#define BINOUT_ZSTD_MAGIC "BYFLZST"
+#define BINOUT_ZSTD_MAX_BLOCK (16*1024*1024)
+
+/* A version 2 (columnar) binary-output file begins with BINOUT_V2_MAGIC
+ * instead of "BYFLBIN".  Each table comprises its type (a BINOUT_TABLE_T),
+ * its name, a 64-bit column count, and each column's type (a BINOUT_COL_T)
+ * and name, followed by a sequence of chunks.  A chunk comprises a 64-bit
+ * row count (0 terminates the table), a 64-bit count of the bytes that
+ * follow, a 64-bit count of strings to append to the table's string
+ * dictionary, those strings (each followed by a 0 byte so that readers can
+ * use them in place), and finally each column's data as an array of
+ * BINOUT_V2_COLUMN_WIDTH-byte values.  String columns hold 0-based
+ * dictionary indexes.  A key:value table is stored as a single row.
+ *
+ * A BINOUT_TABLE_NONE tag follows the last table.  Then come a table of
+ * contents -- a 64-bit table count, then each table's type, name, 64-bit
+ * byte offset from the start of the file, and 64-bit row count -- and a
+ * trailer comprising the 64-bit byte offset of the table of contents and
+ * BINOUT_V2_TOC_MAGIC.  Offsets count from the start of the decompressed
+ * data, so only uncompressed files can be read randomly.  As in version 1,
+ * all integers are big-endian, and strings are a 16-bit length followed by
+ * that many characters. */
+#define BINOUT_V2_MAGIC "BYFLBI2"
+#define BINOUT_V2_TOC_MAGIC "BYFLTOC"
+#define BINOUT_V2_COLUMN_WIDTH(T)                                       \
+  ((T) == BINOUT_COL_UINT64 ? 8 : (T) == BINOUT_COL_STRING ? 4 : 1)
+
 #endif
@@ -84,6 +84,49 @@ enum {
   BF_NUM_MEM_INTRIN
 };
 
+// Define the data structures available for computing reuse distance.
+enum {
+  BF_RD_ENGINE_SPLAY,     // Splay tree keyed by access time
+  BF_RD_ENGINE_FENWICK,   // Fenwick tree indexed by access time
+  BF_RD_ENGINE_NUM
+};
+
+// Define the ways in which the levels of a modeled cache hierarchy can
+// share data.
+enum {
+  BF_CACHE_INCLUSIVE,     // Each level contains all data in the levels above it
+  BF_CACHE_EXCLUSIVE,     // Each line resides in at most one level
+  BF_CACHE_POLICY_NUM
+};
+
+// Define the capacity in entries of each thread's memory-access trace and
+// the length at which instrumented code asks the run-time library to drain
+// it.  Instrumented code appends at most BF_TRACE_LEN-BF_TRACE_DRAIN_THRESHOLD
+// entries between checks.
+#define BF_TRACE_LEN 4096
+#define BF_TRACE_DRAIN_THRESHOLD 3584
+
+// Define the analyses to which a memory-access trace entry applies.
+enum {
+  BF_TRACE_UNIQUE = 1,    // Unique bytes or memory footprint of the program
+  BF_TRACE_FUNC   = 2,    // Unique bytes or memory footprint of the function
+  BF_TRACE_CACHE  = 4,    // Cache model
+  BF_TRACE_REUSE  = 8     // Reuse distance
+};
+
+// Define one entry of a memory-access trace.  Instrumented code writes
+// these as four consecutive 64-bit words.
+typedef struct {
+  uint64_t address;       // First address accessed
+  uint64_t num_bytes;     // Number of bytes accessed
+  uint64_t analyses;      // Bit mask of BF_TRACE_* values
+  const char* funcname;   // Name of the accessing function (BF_TRACE_FUNC only)
+} bf_trace_entry_t;
+
+// Define the range into which -bf-reuse-sample hashes addresses.  An
+// address is sampled if its hash lies below a threshold in [1, modulus].
+#define BF_REUSE_SAMPLE_MODULUS (1<<24)
+
 // Define constants for "constant operand" and "no operand" for
 // instruction-dependency reporting.
 enum {
@@ -102,6 +145,80 @@ typedef struct {
   unsigned int line;     // Line number at which the symbol appears
 } bf_symbol_info_t;
 
+// Define a type for communicating a basic block's static properties and
+// its execution tally from the plugin to the run-time library.  When the
+// plugin counts a basic block's operations at compile time, flops through
+// inst_mix give the counts per execution, with inst_mix pointing to
+// inst_mix_len {opcode, tally} pairs.  Otherwise, those fields are zero and
+// the counts are tallied at run time.  syminfo is NULL unless -bf-every-bb
+// was specified.
+typedef struct {
+  uint64_t bb_id;                   // Unique identifier for the basic block
+  const bf_symbol_info_t* syminfo;  // Location of the basic block's terminator
+  uint64_t num_insts;               // Static code size in instructions
+  uint64_t* tally;                  // Number of times the basic block was executed
+  uint64_t flops;                   // Floating-point operations per execution
+  uint64_t fp_bits;                 // Bits used by all FP operations per execution
+  uint64_t ops;                     // Operations per execution
+  uint64_t op_bits;                 // Bits used by all non-memory operations per execution
+  uint64_t inst_mix_len;            // Number of opcodes appearing in inst_mix
+  const uint64_t* inst_mix;         // Instructions per execution as {opcode, tally} pairs
+} bf_bb_record_t;
+
+// Define a type for communicating from the plugin to the run-time library
+// the static properties of a load or store whose strides are tracked.
+// Each module passes the run-time library a table of these, and the
+// run-time library assigns the module's entries consecutive IDs starting
+// from a base it writes into the module.  Until then, the base is
+// BF_STRIDE_UNREGISTERED, which yields no valid ID.
+typedef struct {
+  const bf_symbol_info_t* syminfo;  // Location of the load or store
+  uint64_t is_store;                // 1=store; 0=load
+  uint64_t is_const;                // 1=provably constant address; 0=may vary
+} bf_stride_point_t;
+#define BF_STRIDE_UNREGISTERED (1ULL<<63)
+
+// Each module's constructor likewise receives from the run-time library a
+// base for dense, consecutive IDs for the module's functions.  Until then,
+// the base is BF_FUNC_UNREGISTERED, which yields no valid ID.
+#define BF_FUNC_UNREGISTERED (1ULL<<63)
+
+// Define a type for communicating from the plugin to the run-time library
+// the static properties of a kind of vector operation performed by a given
+// function.  As with bf_stride_point_t, each module passes the run-time
+// library a table of these and receives a base for their IDs, which is
+// BF_VECTOR_UNREGISTERED until then.
+typedef struct {
+  const char* funcname;             // Function performing the operation
+  uint64_t num_elements;            // Number of scalar elements in the vector
+  uint64_t element_bits;            // Number of bits per scalar element
+  uint64_t is_flop;                 // 1=floating-point operation; 0=integer operation
+} bf_vector_op_t;
+#define BF_VECTOR_UNREGISTERED (1ULL<<63)
+
+// Define a type for communicating from the plugin to the run-time library
+// a combination of an instruction's opcode and its first two operands'
+// opcodes (or BF_CONST_ARG or BF_NO_ARG) that appears in a module.
+typedef struct {
+  uint64_t opcode;   // Opcode of the instruction
+  uint64_t dep1;     // Opcode of the instruction's first operand
+  uint64_t dep2;     // Opcode of the instruction's second operand
+  uint64_t more;     // 1=more than two operands; 0=two or fewer
+} bf_inst_deps_t;
+
+// Map an instruction-dependency combination to a unique integer.
+static inline uint64_t inst_deps_to_index(uint64_t opcode,
+                                          uint64_t dep1,
+                                          uint64_t dep2,
+                                          uint64_t more)
+{
+  uint64_t idx = opcode;
+  idx = idx*NUM_LLVM_OPCODES_POW2 + dep1;
+  idx = idx*NUM_LLVM_OPCODES_POW2 + dep2;
+  idx = idx*2 + more;
+  return idx;
+}
+
 // Map a memory-access type to an index into bf_mem_insts_count[].
 static inline uint64_t mem_type_to_index(uint64_t memop,
                                          uint64_t memref,
@@ -16,7 +16,9 @@ extern "C" {
  * compile flag. */
 extern void bf_tag_data_region (void* address, const char *tag);
 
-/* Toggle suppression of Byfl counter updates. */
+/* Toggle suppression of Byfl counter updates.  With the -bf-clone-functions
+ * compile flag, functions called while counting is suppressed run
+ * uninstrumented. */
 extern void bf_enable_counting (int enable);
 
 #ifdef __cplusplus
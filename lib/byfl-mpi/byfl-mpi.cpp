@@ -0,0 +1,154 @@
+/*
+ * Reduce Byfl's counters across the processes of an MPI job
+ * (interposed on MPI_Finalize via the MPI profiling interface)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include <mpi.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "reduction.h"
+
+using namespace std;
+
+// Define the message tag we use for gathering function keys.
+static const int key_tag = 0x42464c;   // "BFL"
+
+// Merge two sorted lists of function keys, discarding duplicates.
+static vector<uint64_t> merge_keys (const vector<uint64_t>& a,
+                                    const vector<uint64_t>& b)
+{
+  vector<uint64_t> result;
+  result.reserve(a.size() + b.size());
+  size_t i = 0, j = 0;
+  while (i < a.size() || j < b.size()) {
+    uint64_t next;
+    if (j == b.size() || (i < a.size() && a[i] < b[j]))
+      next = a[i++];
+    else
+      next = b[j++];
+    if (result.empty() || result.back() != next)
+      result.push_back(next);
+  }
+  return result;
+}
+
+// Compute the union of all processes' function keys, and return it on
+// all processes.  We combine keys up a binomial tree to rank 0 then
+// broadcast the result.
+static vector<uint64_t> union_of_keys (MPI_Comm comm, vector<uint64_t> keys)
+{
+  int rank, nprocs;
+  PMPI_Comm_rank(comm, &rank);
+  PMPI_Comm_size(comm, &nprocs);
+  for (int mask = 1; mask < nprocs; mask <<= 1) {
+    if (rank & mask) {
+      PMPI_Send(keys.data(), int(keys.size()), MPI_UINT64_T,
+                rank - mask, key_tag, comm);
+      break;
+    }
+    if (rank + mask < nprocs) {
+      MPI_Status status;
+      int count;
+      PMPI_Probe(rank + mask, key_tag, comm, &status);
+      PMPI_Get_count(&status, MPI_UINT64_T, &count);
+      vector<uint64_t> more_keys(count);
+      PMPI_Recv(more_keys.data(), count, MPI_UINT64_T,
+                rank + mask, key_tag, comm, MPI_STATUS_IGNORE);
+      keys = merge_keys(keys, more_keys);
+    }
+  }
+  uint64_t num_keys = keys.size();
+  PMPI_Bcast(&num_keys, 1, MPI_UINT64_T, 0, comm);
+  keys.resize(num_keys);
+  PMPI_Bcast(keys.data(), int(num_keys), MPI_UINT64_T, 0, comm);
+  return keys;
+}
+
+// Reduce all processes' counters to rank 0 of a given communicator.  All
+// other ranks suppress their own output.
+static void reduce_counters (MPI_Comm comm, const char* scope)
+{
+  int rank, nprocs;
+  PMPI_Comm_rank(comm, &rank);
+  PMPI_Comm_size(comm, &nprocs);
+
+  // Snapshot our local counters.
+  size_t num_local_funcs = bf_reduce_snapshot();
+  vector<uint64_t> keys(num_local_funcs);
+  bf_reduce_function_keys(keys.data());
+  keys = union_of_keys(comm, keys);
+
+  // Lay out the program-wide values followed by each function's values
+  // in a common order on all processes.
+  size_t prog_width = bf_reduce_program_width();
+  size_t num_values = prog_width + keys.size()*bf_reduce_function_width();
+  vector<uint64_t> values(num_values);
+  bf_reduce_program_values(values.data());
+  bf_reduce_function_values(keys.data(), keys.size(), values.data() + prog_width);
+
+  // Reduce the values to rank 0.
+  vector<uint64_t> mins(num_values), sums(num_values), maxes(num_values);
+  PMPI_Reduce(values.data(), mins.data(), int(num_values), MPI_UINT64_T, MPI_MIN, 0, comm);
+  PMPI_Reduce(values.data(), sums.data(), int(num_values), MPI_UINT64_T, MPI_SUM, 0, comm);
+  PMPI_Reduce(values.data(), maxes.data(), int(num_values), MPI_UINT64_T, MPI_MAX, 0, comm);
+  if (rank == 0)
+    bf_reduce_results(scope, uint64_t(nprocs), keys.size(), keys.data(),
+                      mins.data(), sums.data(), maxes.data());
+  else
+    bf_reduce_silence();
+}
+
+// Reduce counters across the job or across each node, as specified by the
+// BF_MPI_REDUCE environment variable.
+static void reduce_at_finalize (void)
+{
+  const char* mode = getenv("BF_MPI_REDUCE");
+  if (mode == nullptr || mode[0] == '\0' || !strcmp(mode, "job"))
+    reduce_counters(MPI_COMM_WORLD, "job");
+  else if (!strcmp(mode, "node")) {
+    MPI_Comm node_comm;
+    int rank;
+    PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    PMPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                         MPI_INFO_NULL, &node_comm);
+    reduce_counters(node_comm, "node");
+    PMPI_Comm_free(&node_comm);
+  }
+  else if (strcmp(mode, "none")) {
+    cerr << "Failed to parse BF_MPI_REDUCE=\"" << mode
+         << "\" (expected \"job\", \"node\", or \"none\")\n";
+    PMPI_Abort(MPI_COMM_WORLD, 1);
+  }
+}
+
+// Reduce our counters then finalize MPI.
+extern "C"
+int MPI_Finalize (void)
+{
+  reduce_at_finalize();
+  return PMPI_Finalize();
+}
+
+// Do the same for Fortran programs, accommodating the common
+// name-mangling conventions.
+extern "C" {
+  void mpi_finalize_ (MPI_Fint* ierr)
+  {
+    *ierr = MPI_Finalize();
+  }
+
+  void mpi_finalize__ (MPI_Fint* ierr)
+  {
+    *ierr = MPI_Finalize();
+  }
+
+  void MPI_FINALIZE (MPI_Fint* ierr)
+  {
+    *ierr = MPI_Finalize();
+  }
+}
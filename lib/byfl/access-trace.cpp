@@ -0,0 +1,309 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (batched analysis of memory accesses)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "byfl.h"
+
+// Each thread appends its memory accesses to its own trace, which
+// instrumented code hands to bf_drain_access_trace() when it nears capacity.
+__thread bf_trace_entry_t* bf_access_trace = nullptr;  // The calling thread's trace
+__thread uint64_t bf_access_trace_len = 0;    // Number of valid entries in bf_access_trace
+
+namespace bytesflops {
+
+// Pass each entry of a thread's trace that requires a given analysis to the
+// function that implements the analysis.
+template<typename Analysis>
+static inline void analyze_trace (const bf_trace_entry_t* trace, uint64_t num_entries,
+                                  uint64_t analysis, Analysis analyze)
+{
+  for (uint64_t i = 0; i < num_entries; i++)
+    if ((trace[i].analyses & analysis) != 0)
+      analyze(trace[i]);
+}
+
+// Describe a batch of accesses awaiting analysis by a background thread.
+struct AnalysisBatch {
+  bf_trace_entry_t* trace;   // Accesses to analyze
+  uint64_t num_entries;      // Number of valid entries in trace
+  void* cache_context;       // Producing thread's cache-model state
+};
+
+// Recycle traces that background threads have finished analyzing.
+static mutex free_traces_lock;
+static vector<bf_trace_entry_t*> free_traces;
+
+// Return an empty trace, recycling an old one if possible.
+static bf_trace_entry_t* allocate_trace (void)
+{
+  {
+    lock_guard<mutex> guard(free_traces_lock);
+    if (!free_traces.empty()) {
+      bf_trace_entry_t* trace = free_traces.back();
+      free_traces.pop_back();
+      return trace;
+    }
+  }
+  return new bf_trace_entry_t[BF_TRACE_LEN];
+}
+
+// Serialize the background threads' updates to the reuse-distance state.
+// Instrumented threads never touch that state when background threads are
+// in use.
+static mutex reuse_lock;
+
+// An AnalysisWorker is a background thread that applies the cache-model and
+// reuse-distance analyses to batches of accesses produced by instrumented
+// threads.  Each instrumented thread sends all of its batches to the same
+// worker so that its private cache model sees its accesses in order.
+class AnalysisWorker {
+private:
+  static const size_t max_queued = 4;  // Maximum batches awaiting analysis
+  mutex lock;                          // Lock protecting all of the following
+  condition_variable changed;          // Signaled whenever the queue or busy changes
+  deque<AnalysisBatch> queue;          // Batches awaiting analysis
+  bool busy;                           // true=currently analyzing a batch
+
+  // Analyze one batch of accesses.
+  static void analyze (const AnalysisBatch& batch) {
+    if (bf_cache_model)
+      analyze_trace(batch.trace, batch.num_entries, BF_TRACE_CACHE,
+                    [&batch](const bf_trace_entry_t& e) {
+                      bf_touch_cache(batch.cache_context, e.address, e.num_bytes);
+                    });
+    lock_guard<mutex> guard(reuse_lock);
+    analyze_trace(batch.trace, batch.num_entries, BF_TRACE_REUSE,
+                  [](const bf_trace_entry_t& e) {
+                    bf_reuse_dist_addrs_prog(e.address, e.num_bytes);
+                  });
+  }
+
+  // Repeatedly analyze the batch at the head of the queue.
+  void run (void) {
+    while (true) {
+      unique_lock<mutex> guard(lock);
+      changed.wait(guard, [this]{ return !queue.empty(); });
+      AnalysisBatch batch = queue.front();
+      queue.pop_front();
+      busy = true;
+      changed.notify_all();
+      guard.unlock();
+
+      analyze(batch);
+      {
+        lock_guard<mutex> free_guard(free_traces_lock);
+        free_traces.push_back(batch.trace);
+      }
+
+      guard.lock();
+      busy = false;
+      changed.notify_all();
+    }
+  }
+
+public:
+  // Start a background thread.  The thread runs until the program exits.
+  AnalysisWorker() : busy(false) {
+    thread(&AnalysisWorker::run, this).detach();
+  }
+
+  // Queue a batch for analysis, blocking while the queue is full so that
+  // the memory consumed by pending batches remains bounded.
+  void enqueue (const AnalysisBatch& batch) {
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [this]{ return queue.size() < max_queued; });
+    queue.push_back(batch);
+    changed.notify_all();
+  }
+
+  // Wait until all queued batches have been analyzed.
+  void wait_until_idle (void) {
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [this]{ return queue.empty() && !busy; });
+  }
+};
+
+static vector<AnalysisWorker*>* analysis_workers = nullptr;  // All background threads
+static size_t next_worker = 0;     // Worker to assign to the next thread
+
+// Describe the trace of one instrumented thread.  This lets the trace be
+// drained by another thread, for instance at the end of the program.
+struct ThreadTrace {
+  bf_trace_entry_t** trace;   // The thread's bf_access_trace
+  uint64_t* num_entries;      // The thread's bf_access_trace_len
+  void* cache_context;        // The thread's cache-model state
+  AnalysisWorker* worker;     // Background thread analyzing the thread's accesses (or null)
+};
+static __thread ThreadTrace* my_trace = nullptr;   // The calling thread's trace
+static vector<ThreadTrace*>* all_traces = nullptr;  // Traces of all live threads
+
+// Pass every entry in a thread's trace to each analysis that requests it
+// then empty the trace.  If lock_shared is true, acquire the mega-lock
+// around analyses that update state shared by all threads.  If exiting is
+// true, the thread will produce no further accesses.
+static void drain_access_trace (ThreadTrace* tt, bool lock_shared, bool exiting)
+{
+  uint64_t n = *tt->num_entries;
+  *tt->num_entries = 0;
+  if (n == 0 || bf_suppress_counting)
+    return;
+  bf_trace_entry_t* trace = *tt->trace;
+
+  // Associate addresses with the program and with each function.
+  if (bf_unique_bytes) {
+    if (bf_mem_footprint) {
+      analyze_trace(trace, n, BF_TRACE_UNIQUE, [](const bf_trace_entry_t& e) {
+          bf_assoc_addresses_with_prog_tb(e.address, e.num_bytes);
+        });
+      analyze_trace(trace, n, BF_TRACE_FUNC, [](const bf_trace_entry_t& e) {
+          bf_assoc_addresses_with_func_tb(e.funcname, e.address, e.num_bytes);
+        });
+    }
+    else {
+      analyze_trace(trace, n, BF_TRACE_UNIQUE, [](const bf_trace_entry_t& e) {
+          bf_assoc_addresses_with_prog(e.address, e.num_bytes);
+        });
+      analyze_trace(trace, n, BF_TRACE_FUNC, [](const bf_trace_entry_t& e) {
+          bf_assoc_addresses_with_func(e.funcname, e.address, e.num_bytes);
+        });
+    }
+  }
+
+  // If we have background threads, hand them the trace for the remaining
+  // analyses and continue with an empty trace.
+  if (tt->worker != nullptr) {
+    AnalysisBatch batch;
+    batch.trace = trace;
+    batch.num_entries = n;
+    batch.cache_context = tt->cache_context;
+    tt->worker->enqueue(batch);
+    *tt->trace = exiting ? nullptr : allocate_trace();
+    return;
+  }
+
+  // Model the cache.  The cache model performs its own locking.
+  if (bf_cache_model)
+    analyze_trace(trace, n, BF_TRACE_CACHE, [tt](const bf_trace_entry_t& e) {
+        bf_touch_cache(tt->cache_context, e.address, e.num_bytes);
+      });
+
+  // Compute reuse distance, which is shared by all threads.
+  if (lock_shared)
+    bf_acquire_mega_lock();
+  analyze_trace(trace, n, BF_TRACE_REUSE, [](const bf_trace_entry_t& e) {
+      bf_reuse_dist_addrs_prog(e.address, e.num_bytes);
+    });
+  if (lock_shared)
+    bf_release_mega_lock();
+}
+
+// Drain an exiting thread's trace.  This is invoked with the mega-lock held.
+static void drain_exiting_thread (void* tt_ptr)
+{
+  ThreadTrace* tt = (ThreadTrace*) tt_ptr;
+  drain_access_trace(tt, false, true);
+  auto iter = find(all_traces->begin(), all_traces->end(), tt);
+  if (iter != all_traces->end())
+    all_traces->erase(iter);
+}
+
+// Start the number of background analysis threads specified by the
+// BF_ANALYSIS_THREADS environment variable (default: none).
+void initialize_access_trace (void)
+{
+  if (!bf_batch_accesses)
+    return;
+  all_traces = new vector<ThreadTrace*>;
+  const char* num_threads_str = getenv("BF_ANALYSIS_THREADS");
+  if (num_threads_str == nullptr || *num_threads_str == '\0')
+    return;
+  char* end;
+  unsigned long num_threads = strtoul(num_threads_str, &end, 10);
+  if (*end != '\0') {
+    cerr << "Failed to parse BF_ANALYSIS_THREADS=\"" << num_threads_str
+         << "\" as a number of threads\n";
+    bf_abend();
+  }
+  if (num_threads == 0)
+    return;
+  analysis_workers = new vector<AnalysisWorker*>;
+  for (unsigned long i = 0; i < num_threads; i++)
+    analysis_workers->push_back(new AnalysisWorker());
+}
+
+// Initialize the calling thread's trace at first use.  This must precede
+// the initialization of any per-thread data the trace feeds so that the
+// trace is drained before that data are merged.
+void initialize_thread_access_trace (void)
+{
+  if (!bf_batch_accesses)
+    return;
+  bf_access_trace = allocate_trace();
+  bf_access_trace_len = 0;
+  my_trace = new ThreadTrace;
+  my_trace->trace = &bf_access_trace;
+  my_trace->num_entries = &bf_access_trace_len;
+  my_trace->cache_context = bf_cache_model ? bf_get_cache_context() : nullptr;
+  my_trace->worker = nullptr;
+  bf_acquire_mega_lock();
+  if (analysis_workers != nullptr) {
+    my_trace->worker = (*analysis_workers)[next_worker];
+    next_worker = (next_worker + 1) % analysis_workers->size();
+  }
+  all_traces->push_back(my_trace);
+  bf_release_mega_lock();
+  bf_register_thread_shard(drain_exiting_thread, my_trace);
+}
+
+// Wait for the background threads, if any, to analyze all pending batches.
+static void wait_for_analysis_threads (void)
+{
+  if (analysis_workers == nullptr)
+    return;
+  for (auto iter = analysis_workers->begin(); iter != analysis_workers->end(); iter++)
+    (*iter)->wait_until_idle();
+}
+
+// Drain every live thread's trace and wait for all pending analyses to
+// complete.  This is intended to be called once, at the end of the
+// program, before merging the threads' private data.
+void bf_finish_access_trace (void)
+{
+  if (all_traces == nullptr)
+    return;
+  bf_acquire_mega_lock();
+  for (auto iter = all_traces->begin(); iter != all_traces->end(); iter++)
+    drain_access_trace(*iter, false, false);
+  bf_release_mega_lock();
+  wait_for_analysis_threads();
+}
+
+// Drain the calling thread's trace and complete all pending analyses from
+// any point of the program not already holding the mega-lock.
+void bf_flush_access_trace (void)
+{
+  if (my_trace == nullptr)
+    return;
+  bf_acquire_mega_lock();
+  drain_access_trace(my_trace, false, false);
+  bf_release_mega_lock();
+  wait_for_analysis_threads();
+}
+
+// Analyze all of the memory accesses in the calling thread's trace.  This
+// is invoked by instrumented code when the trace nears capacity.
+extern "C"
+void bf_drain_access_trace (uint8_t lock_shared)
+{
+  drain_access_trace(my_trace, bool(lock_shared), false);
+}
+
+} // namespace bytesflops
@@ -0,0 +1,270 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (private memory allocator)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+#include <mutex>
+#include <sys/mman.h>
+
+using namespace std;
+
+namespace bytesflops {
+
+// Small objects are rounded up to a multiple of arena_granularity bytes;
+// medium objects are rounded up to a power of two.  Objects of either
+// kind are carved from chunks of arena_chunk_size bytes and, when freed,
+// pushed onto a free list for their size class.  Large objects are mapped
+// and unmapped individually.
+static const size_t arena_granularity = 16;
+static const size_t max_small_object = 4096;
+static const unsigned int min_medium_log2 = 13;   // 8 KB
+static const unsigned int max_medium_log2 = 18;   // 256 KB
+static const size_t num_small_classes = max_small_object/arena_granularity;
+static const size_t num_size_classes = num_small_classes + max_medium_log2 - min_medium_log2 + 1;
+static const size_t arena_chunk_size = 1<<20;
+
+// Each thread caches free objects of each size class so that most
+// allocations and frees touch no shared state.  A thread refills an empty
+// list from the shared arena and returns objects to the shared arena when
+// a list grows too long, in both cases moving about arena_batch_bytes but
+// no more than max_batch_objects at a time.
+static const size_t arena_batch_bytes = 4096;
+static const size_t max_batch_objects = 64;
+
+// Link together the free objects of a given size class.
+struct FreeObject {
+  FreeObject* next;
+};
+
+// Define a thread's cache of free objects.
+struct ThreadCache {
+  FreeObject* free_lists[num_size_classes];   // Free objects of each size class
+  size_t list_lengths[num_size_classes];      // Number of objects on each of the above
+  bool registered;                            // true=flush the cache when the thread exits
+  bool exiting;                               // true=thread has exited; bypass the cache
+};
+
+// All of the following are statically initialized so the arena can be
+// used from static constructors.
+static mutex arena_lock;                          // Serialize all shared-arena operations
+static FreeObject* free_lists[num_size_classes];  // Free objects of each size class
+static char* chunk_next = nullptr;                // Next unused byte in the current chunk
+static char* chunk_end = nullptr;                 // Byte following the current chunk
+static uint64_t bytes_mapped = 0;                 // Bytes obtained from mmap()
+static uint64_t bytes_in_use = 0;                 // Bytes handed out to threads
+static uint64_t peak_bytes_in_use = 0;            // Maximum of bytes_in_use
+static __thread ThreadCache thread_cache;         // The calling thread's free objects
+static pthread_key_t thread_exit_key;             // Key whose destructor flushes a thread's cache
+static pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;  // Create the above only once
+
+// Map a region of memory, aborting on failure.
+static void* map_memory (size_t bytes)
+{
+  void* ptr = mmap(nullptr, bytes, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    cerr << "Failed to map " << bytes << " bytes of memory for Byfl's internal use ("
+         << strerror(errno) << ")\n";
+    bf_abend();
+  }
+  bytes_mapped += bytes;
+  return ptr;
+}
+
+// Round a number of bytes up to a multiple of the page size.
+static size_t round_to_pages (size_t bytes)
+{
+  static size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+  return (bytes + page_size - 1)/page_size*page_size;
+}
+
+// Return the size class of an object of a given size and the number of
+// bytes an object of that class occupies.  Return num_size_classes for
+// large objects.
+static size_t size_class (size_t bytes, size_t* class_bytes)
+{
+  if (bytes == 0)
+    bytes = 1;
+  if (bytes <= max_small_object) {
+    size_t idx = (bytes + arena_granularity - 1)/arena_granularity - 1;
+    *class_bytes = (idx + 1)*arena_granularity;
+    return idx;
+  }
+  unsigned int log2_bytes = 64 - __builtin_clzll(uint64_t(bytes - 1));
+  if (log2_bytes < min_medium_log2)
+    log2_bytes = min_medium_log2;
+  if (log2_bytes > max_medium_log2) {
+    *class_bytes = round_to_pages(bytes);
+    return num_size_classes;
+  }
+  *class_bytes = size_t(1) << log2_bytes;
+  return num_small_classes + log2_bytes - min_medium_log2;
+}
+
+// Return the number of objects of a given size to move between a thread's
+// cache and the shared arena at once.
+static inline size_t batch_size (size_t class_bytes)
+{
+  if (class_bytes >= arena_batch_bytes)
+    return 1;
+  return min(arena_batch_bytes/class_bytes, max_batch_objects);
+}
+
+// Move a number of objects of a given size class from a thread's cache
+// to the shared arena.  The caller must hold arena_lock.
+static void drain_thread_cache (ThreadCache* cache, size_t idx, size_t num_objs, size_t class_bytes)
+{
+  for (size_t i = 0; i < num_objs; i++) {
+    FreeObject* obj = cache->free_lists[idx];
+    cache->free_lists[idx] = obj->next;
+    obj->next = free_lists[idx];
+    free_lists[idx] = obj;
+  }
+  cache->list_lengths[idx] -= num_objs;
+  bytes_in_use -= num_objs*class_bytes;
+}
+
+// Return all of an exiting thread's cached objects to the shared arena.
+// Objects the thread frees after this (e.g., from other thread-exit
+// destructors) bypass the cache.
+static void flush_thread_cache (void* cache_ptr)
+{
+  ThreadCache* cache = static_cast<ThreadCache*>(cache_ptr);
+  lock_guard<mutex> guard(arena_lock);
+  for (size_t idx = 0; idx < num_size_classes; idx++) {
+    size_t class_bytes;
+    if (idx < num_small_classes)
+      class_bytes = (idx + 1)*arena_granularity;
+    else
+      class_bytes = size_t(1) << (idx - num_small_classes + min_medium_log2);
+    drain_thread_cache(cache, idx, cache->list_lengths[idx], class_bytes);
+  }
+  cache->exiting = true;
+}
+
+// Create the key whose destructor flushes an exiting thread's cache.
+static void create_thread_exit_key (void)
+{
+  if (pthread_key_create(&thread_exit_key, flush_thread_cache) != 0) {
+    cerr << "Failed to create a thread-specific data key\n";
+    bf_abend();
+  }
+}
+
+// Arrange for a thread's cache to be flushed when the thread exits.
+static inline void register_thread_cache (ThreadCache* cache)
+{
+  if (cache->registered)
+    return;
+  pthread_once(&thread_exit_key_once, create_thread_exit_key);
+  if (pthread_setspecific(thread_exit_key, cache) != 0) {
+    cerr << "Failed to set thread-specific data\n";
+    bf_abend();
+  }
+  cache->registered = true;
+}
+
+// Move a batch of objects of a given size class from the shared arena to
+// an empty list in a thread's cache.
+static void refill_thread_cache (ThreadCache* cache, size_t idx, size_t class_bytes)
+{
+  register_thread_cache(cache);
+
+  // Take previously freed objects if possible.  Carve the rest from the
+  // current chunk, starting a new chunk if necessary.  Whatever remains of
+  // the old chunk is abandoned.
+  size_t num_objs = cache->exiting ? 1 : batch_size(class_bytes);
+  lock_guard<mutex> guard(arena_lock);
+  for (size_t i = 0; i < num_objs; i++) {
+    FreeObject* obj = free_lists[idx];
+    if (obj != nullptr)
+      free_lists[idx] = obj->next;
+    else {
+      if (chunk_next + class_bytes > chunk_end) {
+        chunk_next = static_cast<char*>(map_memory(arena_chunk_size));
+        chunk_end = chunk_next + arena_chunk_size;
+      }
+      obj = reinterpret_cast<FreeObject*>(chunk_next);
+      chunk_next += class_bytes;
+    }
+    obj->next = cache->free_lists[idx];
+    cache->free_lists[idx] = obj;
+  }
+  cache->list_lengths[idx] += num_objs;
+  bytes_in_use += num_objs*class_bytes;
+  if (bytes_in_use > peak_bytes_in_use)
+    peak_bytes_in_use = bytes_in_use;
+}
+
+// Allocate memory from the arena.
+void* bf_arena_alloc (size_t bytes)
+{
+  size_t class_bytes;
+  size_t idx = size_class(bytes, &class_bytes);
+
+  // Map large objects directly.
+  if (idx == num_size_classes) {
+    lock_guard<mutex> guard(arena_lock);
+    bytes_in_use += class_bytes;
+    if (bytes_in_use > peak_bytes_in_use)
+      peak_bytes_in_use = bytes_in_use;
+    return map_memory(class_bytes);
+  }
+
+  // Take an object from the calling thread's cache, refilling the cache
+  // from the shared arena if necessary.  Clear the object's link to the
+  // next free object so a newly carved object is as zeroed as when it was
+  // mapped.
+  ThreadCache* cache = &thread_cache;
+  if (cache->free_lists[idx] == nullptr)
+    refill_thread_cache(cache, idx, class_bytes);
+  FreeObject* obj = cache->free_lists[idx];
+  cache->free_lists[idx] = obj->next;
+  cache->list_lengths[idx]--;
+  obj->next = nullptr;
+  return obj;
+}
+
+// Return memory to the arena.
+void bf_arena_free (void* ptr, size_t bytes)
+{
+  if (ptr == nullptr)
+    return;
+  size_t class_bytes;
+  size_t idx = size_class(bytes, &class_bytes);
+  if (idx == num_size_classes) {
+    lock_guard<mutex> guard(arena_lock);
+    bytes_in_use -= class_bytes;
+    munmap(ptr, class_bytes);
+    bytes_mapped -= class_bytes;
+    return;
+  }
+
+  // Put the object in the calling thread's cache.  If that makes the
+  // cache's list too long, return a batch of objects to the shared arena.
+  ThreadCache* cache = &thread_cache;
+  register_thread_cache(cache);
+  FreeObject* obj = static_cast<FreeObject*>(ptr);
+  obj->next = cache->free_lists[idx];
+  cache->free_lists[idx] = obj;
+  cache->list_lengths[idx]++;
+  size_t batch = batch_size(class_bytes);
+  if (cache->exiting || cache->list_lengths[idx] > 2*batch) {
+    lock_guard<mutex> guard(arena_lock);
+    drain_thread_cache(cache, idx, cache->exiting ? cache->list_lengths[idx] : batch, class_bytes);
+  }
+}
+
+// Report the arena's memory usage.
+void bf_arena_usage (uint64_t* mapped, uint64_t* in_use, uint64_t* peak_in_use)
+{
+  lock_guard<mutex> guard(arena_lock);
+  *mapped = bytes_mapped;
+  *in_use = bytes_in_use;
+  *peak_in_use = peak_bytes_in_use;
+}
+
+} // namespace bytesflops
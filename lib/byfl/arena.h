@@ -0,0 +1,77 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (private memory-allocator declarations)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bytesflops {
+
+// Allocate and free memory for the run-time library's own bookkeeping.
+// The memory comes from mmap()ed regions rather than from the
+// application's heap so that Byfl's allocations neither interleave with
+// nor perturb the heap layout that Byfl is trying to measure.  The size
+// passed to bf_arena_free() must match the size passed to
+// bf_arena_alloc().
+extern void* bf_arena_alloc(size_t bytes);
+extern void bf_arena_free(void* ptr, size_t bytes);
+
+// Report the number of bytes the arena has mapped from the operating
+// system, the number currently allocated, and the maximum number ever
+// allocated at once.  Allocated bytes include free objects that threads
+// hold in their private caches.
+extern void bf_arena_usage(uint64_t* mapped, uint64_t* in_use, uint64_t* peak_in_use);
+
+// Objects of any class derived from ArenaAllocated are allocated from the
+// arena when created with new.
+class ArenaAllocated {
+public:
+  static void* operator new (size_t bytes) {
+    return bf_arena_alloc(bytes);
+  }
+
+  static void operator delete (void* ptr, size_t bytes) {
+    bf_arena_free(ptr, bytes);
+  }
+};
+
+// Let STL containers store their contents in the arena.
+template<typename T>
+class ArenaAllocator {
+public:
+  typedef T value_type;
+
+  ArenaAllocator() noexcept { }
+  template<typename U> ArenaAllocator(const ArenaAllocator<U>&) noexcept { }
+
+  T* allocate (size_t n) {
+    return static_cast<T*>(bf_arena_alloc(n*sizeof(T)));
+  }
+
+  void deallocate (T* ptr, size_t n) noexcept {
+    bf_arena_free(ptr, n*sizeof(T));
+  }
+};
+
+// All arena allocators are interchangeable.
+template<typename T, typename U>
+inline bool operator== (const ArenaAllocator<T>&, const ArenaAllocator<U>&)
+{
+  return true;
+}
+
+template<typename T, typename U>
+inline bool operator!= (const ArenaAllocator<T>&, const ArenaAllocator<U>&)
+{
+  return false;
+}
+
+} // namespace bytesflops
+
+#endif
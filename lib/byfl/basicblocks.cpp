@@ -11,26 +11,31 @@
 
 using namespace std;
 
-// The following values get reset at the end of every basic block.
-uint64_t  bf_load_count       = 0;    // Tally of the number of bytes loaded
-uint64_t  bf_store_count      = 0;    // Tally of the number of bytes stored
-uint64_t* bf_mem_insts_count  = NULL; // Tally of memory instructions by type
-uint64_t* bf_inst_mix_histo   = NULL; // Tally of instruction mix (as histogram)
-uint64_t* bf_terminator_count = NULL; // Tally of terminators by type
-uint64_t* bf_mem_intrin_count = NULL; // Tally of memory intrinsic calls and data movement
-uint64_t  bf_load_ins_count   = 0;    // Tally of the number of load instructions performed
-uint64_t  bf_store_ins_count  = 0;    // Tally of the number of store instructions performed
-uint64_t  bf_call_ins_count   = 0;    // Tally of the number of function-call instructions (non-exception-throwing) performed
-uint64_t  bf_flop_count       = 0;    // Tally of the number of FP operations performed
-uint64_t  bf_fp_bits_count    = 0;    // Tally of the number of bits used by all FP operations
-uint64_t  bf_op_count         = 0;    // Tally of the number of operations performed
-uint64_t  bf_op_bits_count    = 0;    // Tally of the number of bits used by all operations except loads/stores
+// The following values get reset at the end of every basic block.  Each
+// thread increments its own copy.
+__thread uint64_t  bf_load_count       = 0;    // Tally of the number of bytes loaded
+__thread uint64_t  bf_store_count      = 0;    // Tally of the number of bytes stored
+__thread uint64_t* bf_mem_insts_count  = NULL; // Tally of memory instructions by type
+__thread uint64_t* bf_inst_mix_histo   = NULL; // Tally of instruction mix (as histogram)
+__thread uint64_t* bf_terminator_count = NULL; // Tally of terminators by type
+__thread uint64_t* bf_mem_intrin_count = NULL; // Tally of memory intrinsic calls and data movement
+__thread uint64_t  bf_load_ins_count   = 0;    // Tally of the number of load instructions performed
+__thread uint64_t  bf_store_ins_count  = 0;    // Tally of the number of store instructions performed
+__thread uint64_t  bf_call_ins_count   = 0;    // Tally of the number of function-call instructions (non-exception-throwing) performed
+__thread uint64_t  bf_flop_count       = 0;    // Tally of the number of FP operations performed
+__thread uint64_t  bf_fp_bits_count    = 0;    // Tally of the number of bits used by all FP operations
+__thread uint64_t  bf_op_count         = 0;    // Tally of the number of operations performed
+__thread uint64_t  bf_op_bits_count    = 0;    // Tally of the number of bits used by all operations except loads/stores
+__thread uint64_t  bf_bb_pending_count = 0;    // Number of basic blocks executed since the above were last flushed
+
+// With -bf-every-bb, instrumented code calls bf_flush_bb_tallies() once
+// every bf_bb_flush_threshold basic blocks.
+uint64_t bf_bb_flush_threshold = 1;
 
 namespace bytesflops {
 
 // The following values represent more persistent counter and other state.
 ByteFlopCounters global_totals;  // Global tallies of all of our counters
-static ByteFlopCounters prev_global_totals;  // Previously reported global tallies of all of our counters
 static uint64_t num_merged = 0;    // Number of basic blocks merged so far
 static uint64_t first_bb = 0;      // First basic block in a merged set
 static ByteFlopCounters bb_totals; // Tallies of all of our counters across <= num_merged basic blocks
@@ -39,7 +44,7 @@ extern ostream* bfout;
 extern BinaryOStream* bfbin;
 
 // Define a structure to keep track of dynamic basic-block accesss.
-struct BBAccessInfo {
+struct BBAccessInfo : public ArenaAllocated {
   bf_symbol_info_t syminfo;  // Information about the basic block's location
   uint64_t tally;      // Number of times the basic block was executed
   uint64_t num_insts;  // Static code size in instructions
@@ -48,8 +53,162 @@ struct BBAccessInfo {
 // Map a basic-block ID to an access tally.
 static CachedUnorderedMap<uint64_t, BBAccessInfo*>* bb_accesses;
 
+// Keep track of each module's table of basic blocks and their execution
+// tallies.
+static vector<pair<uint64_t, const bf_bb_record_t*>>* bb_record_tables = nullptr;
+
+// Indicate whether the counter variables carry over from one basic block to
+// the next until the next bf_flush_bb_tallies() rather than being reset at
+// the end of every basic block.
+static bool defer_bb_tallies = false;
+
+// Point to one thread's private counter variables.  In thread-sharded mode,
+// also hold the thread's per-function tallies.
+struct BBShard {
+  uint64_t* load_count;
+  uint64_t* store_count;
+  uint64_t* mem_insts_count;
+  uint64_t* inst_mix_histo;
+  uint64_t* terminator_count;
+  uint64_t* mem_intrin_count;
+  uint64_t* load_ins_count;
+  uint64_t* store_ins_count;
+  uint64_t* call_ins_count;
+  uint64_t* flop_count;
+  uint64_t* fp_bits_count;
+  uint64_t* op_count;
+  uint64_t* op_bits_count;
+  uint64_t* bb_pending_count;
+  key2bfc_t* func_totals;   // Per-function tallies (NULL if not sharded)
+  id2bfc_t* func_id_totals; // Per-function tallies indexed by dense function ID (NULL if not sharded)
+  ByteFlopCounters* thread_totals;  // Everything the thread has counted (NULL if not sharded)
+};
+static __thread key2bfc_t* thread_func_totals = nullptr;  // The calling thread's per-function tallies
+static __thread id2bfc_t* thread_func_id_totals = nullptr;  // The calling thread's per-function tallies by dense ID
+static id2bfc_t* func_id_totals = nullptr;   // Per-function tallies by dense ID, folded into per_func_totals() at the end
+static __thread BBShard* thread_counters = nullptr;       // The calling thread's counter variables
+static bool bblocks_finalized = false;     // true=all threads' tallies were merged by finalize_bblocks()
+
 // Initialize some of our variables at first use.
 void initialize_bblocks (void)
+{
+  if (bf_every_bb) {
+    bb_accesses = new CachedUnorderedMap<uint64_t, BBAccessInfo*>;
+    defer_bb_tallies = !bf_per_func;
+    if (!bf_user_categorizes_counters())
+      bf_bb_flush_threshold = bf_bb_merge;
+  }
+}
+
+// Accumulate a thread's counter variables into a given set of counters then
+// zero the thread's counter variables.
+static void drain_counters (BBShard* shard, ByteFlopCounters& totals)
+{
+  if (shard->thread_totals != nullptr && !bf_suppress_counting)
+    shard->thread_totals->accumulate(shard->mem_insts_count,
+                                     shard->inst_mix_histo,
+                                     shard->terminator_count,
+                                     shard->mem_intrin_count,
+                                     *shard->load_count,
+                                     *shard->store_count,
+                                     *shard->load_ins_count,
+                                     *shard->store_ins_count,
+                                     *shard->call_ins_count,
+                                     *shard->flop_count,
+                                     *shard->fp_bits_count,
+                                     *shard->op_count,
+                                     *shard->op_bits_count);
+  totals.accumulate(shard->mem_insts_count,
+                    shard->inst_mix_histo,
+                    shard->terminator_count,
+                    shard->mem_intrin_count,
+                    *shard->load_count,
+                    *shard->store_count,
+                    *shard->load_ins_count,
+                    *shard->store_ins_count,
+                    *shard->call_ins_count,
+                    *shard->flop_count,
+                    *shard->fp_bits_count,
+                    *shard->op_count,
+                    *shard->op_bits_count);
+  if (bf_types)
+    memset(shard->mem_insts_count, 0, NUM_MEM_INSTS*sizeof(uint64_t));
+  if (bf_tally_inst_mix)
+    memset(shard->inst_mix_histo, 0, NUM_LLVM_OPCODES*sizeof(uint64_t));
+  memset(shard->terminator_count, 0, BF_END_BB_NUM*sizeof(uint64_t));
+  memset(shard->mem_intrin_count, 0, BF_NUM_MEM_INTRIN*sizeof(uint64_t));
+  *shard->load_count = *shard->store_count = 0;
+  *shard->load_ins_count = *shard->store_ins_count = *shard->call_ins_count = 0;
+  *shard->flop_count = *shard->fp_bits_count = 0;
+  *shard->op_count = *shard->op_bits_count = 0;
+}
+
+// Accumulate the basic blocks a thread executed since its last
+// bf_flush_bb_tallies() into the global counters without reporting them.
+// The caller must hold the mega-lock.
+static void drain_pending_bblocks (BBShard* shard)
+{
+  if (*shard->bb_pending_count == 0)
+    return;
+  static ByteFlopCounters discarded;
+  drain_counters(shard, bf_suppress_counting ? discarded : global_totals);
+  if (!bf_suppress_counting)
+    num_merged += *shard->bb_pending_count;
+  *shard->bb_pending_count = 0;
+}
+
+// Fold one set of per-function tallies into another.  Take ownership of
+// the former's counters.
+static void merge_func_totals (ByteFlopCounters* src, ByteFlopCounters*& dest)
+{
+  if (dest == nullptr)
+    dest = src;
+  else {
+    dest->accumulate(src);
+    delete src;
+  }
+}
+
+// Fold a set of per-function tallies indexed by dense function ID into a
+// set indexed by function key and clear the former.
+static void merge_func_id_totals (id2bfc_t& id_totals, key2bfc_t& key_totals)
+{
+  for (size_t id = 0; id < id_totals.size(); id++)
+    if (id_totals[id] != nullptr)
+      merge_func_totals(id_totals[id], key_totals[func_id_to_key()[id]]);
+  id_totals.clear();
+}
+
+// Merge a thread's counters into the global counters.  The caller must hold
+// the mega-lock.
+static void merge_bblocks_shard (void* shard_ptr)
+{
+  BBShard* shard = (BBShard*) shard_ptr;
+
+  // If we're not instrumented on the basic-block level, then we need to
+  // accumulate the current values of all of the thread's counters into the
+  // global totals.  If we're instrumented on the basic-block level but
+  // defer tallies, we need to accumulate only the basic blocks that
+  // weren't yet flushed.
+  if (!bf_every_bb)
+    drain_counters(shard, global_totals);
+  else if (defer_bb_tallies)
+    drain_pending_bblocks(shard);
+
+  // Merge the thread's per-function tallies into the global per-function
+  // tallies.
+  if (shard->func_totals != nullptr) {
+    for (auto sm_iter = shard->func_totals->begin();
+         sm_iter != shard->func_totals->end();
+         sm_iter++)
+      merge_func_totals(sm_iter->second, per_func_totals()[sm_iter->first]);
+    shard->func_totals->clear();
+    merge_func_id_totals(*shard->func_id_totals, per_func_totals());
+  }
+}
+
+// Initialize the calling thread's counter variables at first use.
+void initialize_thread_bblocks (void)
 {
   if (bf_types) {
     bf_mem_insts_count = new uint64_t[NUM_MEM_INSTS];
@@ -67,8 +226,33 @@ void initialize_bblocks (void)
   bf_mem_intrin_count = new uint64_t[BF_NUM_MEM_INTRIN];
   for (unsigned int i = 0; i < BF_NUM_MEM_INTRIN; i++)
     bf_mem_intrin_count[i] = 0;
-  if (bf_every_bb)
-    bb_accesses = new CachedUnorderedMap<uint64_t, BBAccessInfo*>;
+
+  // Register the thread's counters for merging into the global counters.
+  BBShard* shard = new BBShard;
+  shard->load_count       = &bf_load_count;
+  shard->store_count      = &bf_store_count;
+  shard->mem_insts_count  = bf_mem_insts_count;
+  shard->inst_mix_histo   = bf_inst_mix_histo;
+  shard->terminator_count = bf_terminator_count;
+  shard->mem_intrin_count = bf_mem_intrin_count;
+  shard->load_ins_count   = &bf_load_ins_count;
+  shard->store_ins_count  = &bf_store_ins_count;
+  shard->call_ins_count   = &bf_call_ins_count;
+  shard->flop_count       = &bf_flop_count;
+  shard->fp_bits_count    = &bf_fp_bits_count;
+  shard->op_count         = &bf_op_count;
+  shard->op_bits_count    = &bf_op_bits_count;
+  shard->bb_pending_count = &bf_bb_pending_count;
+  shard->func_totals      = nullptr;
+  shard->func_id_totals   = nullptr;
+  shard->thread_totals    = nullptr;
+  if (bf_thread_shards) {
+    shard->func_totals = thread_func_totals = new key2bfc_t();
+    shard->func_id_totals = thread_func_id_totals = new id2bfc_t();
+    shard->thread_totals = bf_new_thread_tallies();
+  }
+  thread_counters = shard;
+  bf_register_thread_shard(merge_bblocks_shard, shard);
 }
 
 // Initialize all of the basic-block counters.
@@ -86,15 +270,14 @@ ByteFlopCounters::ByteFlopCounters (uint64_t* initial_mem_insts,
                                     uint64_t initial_ops,
                                     uint64_t initial_op_bits)
 {
-  // Initialize mem_insts only if -bf-types was specified.
-  if (bf_types) {
-    if (initial_mem_insts == NULL)
-      for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-        mem_insts[i] = 0;
-    else
-      for (size_t i = 0; i < NUM_MEM_INSTS; i++)
-        mem_insts[i] = initial_mem_insts[i];
-  }
+  // Copy initial values into mem_insts only if -bf-types was specified.
+  // Otherwise, zero it so it never contains garbage.
+  if (bf_types && initial_mem_insts != NULL)
+    for (size_t i = 0; i < NUM_MEM_INSTS; i++)
+      mem_insts[i] = initial_mem_insts[i];
+  else
+    for (size_t i = 0; i < NUM_MEM_INSTS; i++)
+      mem_insts[i] = 0;
 
   // Initialize inst_mix_histo only if -bf-inst-mix was specified.
   if (bf_tally_inst_mix) {
@@ -325,12 +508,29 @@ void ByteFlopCounters::reset (void)
   op_bits   = 0;
 }
 
+// Accumulate the current basic block's counters into the global counters
+// and into the user-defined partition's counters.
+static void accumulate_bb_totals (void)
+{
+  global_totals.accumulate(&bb_totals);
+  const char* partition = bf_string_to_symbol(bf_categorize_counters());
+  if (partition != NULL) {
+    auto sm_iter = user_defined_totals().find(partition);
+    if (sm_iter == user_defined_totals().end())
+      user_defined_totals()[partition] = new ByteFlopCounters(bb_totals);
+    else
+      user_defined_totals()[partition]->accumulate(&bb_totals);
+  }
+}
+
 // At the end of a basic block, accumulate the current counter variables
 // (bf_*_count) into the current basic block's counters and into the global
 // counters.
 extern "C"
 void bf_accumulate_bb_tallies (void)
 {
+  OverheadTimer timer(BF_OVERHEAD_BB_FLUSH);
+
   // Add the current values to the per-BB totals.
   if (bf_suppress_counting)
     return;
@@ -347,15 +547,9 @@ void bf_accumulate_bb_tallies (void)
                        bf_fp_bits_count,
                        bf_op_count,
                        bf_op_bits_count);
-  global_totals.accumulate(&bb_totals);
-  const char* partition = bf_string_to_symbol(bf_categorize_counters());
-  if (partition != NULL) {
-    auto sm_iter = user_defined_totals().find(partition);
-    if (sm_iter == user_defined_totals().end())
-      user_defined_totals()[partition] = new ByteFlopCounters(bb_totals);
-    else
-      user_defined_totals()[partition]->accumulate(&bb_totals);
-  }
+  accumulate_bb_totals();
+  if (__builtin_expect(bf_live_due, 0))
+    bf_publish_live_counters();
 }
 
 // Reset the current basic block's tallies rather than requiring a push and a
@@ -368,6 +562,28 @@ void bf_reset_bb_tallies (void)
   bb_totals.reset();
 }
 
+// Account for any basic blocks the calling thread executed since its last
+// bf_flush_bb_tallies() without reporting them.  This is invoked before
+// counting is enabled or disabled.
+void bf_drain_pending_bblocks (void)
+{
+  if (!defer_bb_tallies || thread_counters == nullptr)
+    return;
+  bf_acquire_mega_lock();
+  drain_pending_bblocks(thread_counters);
+  bf_release_mega_lock();
+}
+
+// Record a module's table of basic blocks.  Instrumented code increments
+// each basic block's tally in place; we read the tallies when reporting.
+extern "C"
+void bf_record_bb_tallies (uint64_t num_records, const bf_bb_record_t* records)
+{
+  if (bb_record_tables == nullptr)
+    bb_record_tables = new vector<pair<uint64_t, const bf_bb_record_t*>>;
+  bb_record_tables->push_back(make_pair(num_records, records));
+}
+
 // Keep track of dynamic basic-block accesses given a unique identifier and
 // static basic-block size in instructions.
 extern "C"
@@ -419,6 +635,27 @@ void bf_report_bb_execution (void)
          << uint8_t(BINOUT_COL_UINT64) << "Line number"
          << uint8_t(BINOUT_COL_NONE);
 
+  // Incorporate the tallies from each module's table of basic blocks.
+  if (bb_record_tables != nullptr)
+    for (auto tbl_iter = bb_record_tables->begin(); tbl_iter != bb_record_tables->end(); tbl_iter++)
+      for (uint64_t i = 0; i < tbl_iter->first; i++) {
+        const bf_bb_record_t& record = tbl_iter->second[i];
+        if (*record.tally == 0 || record.syminfo == nullptr)
+          continue;
+        BBAccessInfo* bb_info;
+        auto iter = bb_accesses->find(record.bb_id);
+        if (iter == bb_accesses->end()) {
+          bb_info = new BBAccessInfo;
+          bb_info->syminfo = *record.syminfo;
+          bb_info->tally = 0;
+          bb_info->num_insts = record.num_insts;
+          (*bb_accesses)[record.bb_id] = bb_info;
+        }
+        else
+          bb_info = iter->second;
+        bb_info->tally += *record.tally;
+      }
+
   // Sort the list of basic blocks in decreasing order of access count.
   vector<BBAccessInfo*> unique_bbs;
   for (auto iter = bb_accesses->begin(); iter != bb_accesses->end(); iter++)
@@ -440,6 +677,42 @@ void bf_report_bb_execution (void)
   *bfbin << uint8_t(BINOUT_ROW_NONE);
 }
 
+// Number of counter columns in the "Basic blocks" table
+static const size_t num_bb_counter_columns = 22;
+
+// Extract the "Basic blocks" table's counter columns from a set of
+// cumulative counters.  Each column is linear in the counters so the
+// difference of two extractions is the extraction of the difference.
+static void extract_bb_columns (const ByteFlopCounters& counters, uint64_t* columns)
+{
+  uint64_t other_branches = counters.terminators[BF_END_BB_ANY];
+  for (int i = 0; i < BF_END_BB_NUM; i++)
+    if (i != BF_END_BB_ANY)
+      other_branches -= counters.terminators[i];
+  *columns++ = counters.load_ins;
+  *columns++ = counters.store_ins;
+  *columns++ = counters.flops;
+  *columns++ = counters.ops - counters.flops - counters.load_ins - counters.store_ins - counters.terminators[BF_END_BB_ANY];
+  *columns++ = counters.call_ins;
+  *columns++ = counters.terminators[BF_END_BB_INVOKE];
+  *columns++ = counters.terminators[BF_END_BB_UNCOND_FAKE];
+  *columns++ = counters.terminators[BF_END_BB_UNCOND_REAL];
+  *columns++ = counters.terminators[BF_END_BB_COND_NT];
+  *columns++ = counters.terminators[BF_END_BB_COND_T];
+  *columns++ = counters.terminators[BF_END_BB_INDIRECT];
+  *columns++ = counters.terminators[BF_END_BB_SWITCH];
+  *columns++ = counters.terminators[BF_END_BB_RETURN];
+  *columns++ = other_branches;
+  *columns++ = counters.fp_bits;
+  *columns++ = counters.op_bits;
+  *columns++ = counters.loads;
+  *columns++ = counters.stores;
+  *columns++ = counters.mem_intrinsics[BF_MEMSET_CALLS];
+  *columns++ = counters.mem_intrinsics[BF_MEMSET_BYTES];
+  *columns++ = counters.mem_intrinsics[BF_MEMXFER_CALLS];
+  *columns++ = counters.mem_intrinsics[BF_MEMXFER_BYTES];
+}
+
 // Report what we've measured for the current basic block.
 static void report_bb_tallies (bf_symbol_info_t* syminfo, uint64_t bb_merge)
 {
@@ -508,51 +781,40 @@ static void report_bb_tallies (bf_symbol_info_t* syminfo, uint64_t bb_merge)
     // Output -- only to the binary output file, not the standard
     // output device -- the difference between the current counter
     // values and our previously saved values.
-    static ByteFlopCounters counter_deltas;
-    (void) global_totals.difference(&prev_global_totals, &counter_deltas);
-    *bfbin << uint8_t(BINOUT_ROW_DATA);
-    *bfbin << first_bb;
-    if (bb_merge != 1)
-      *bfbin << first_bb + num_merged - 1;
-    first_bb += num_merged;
+    static uint64_t prev_totals[num_bb_counter_columns] = {0};
+    uint64_t totals[num_bb_counter_columns];
+    uint64_t row[2 + num_bb_counter_columns];
+    extract_bb_columns(global_totals, totals);
+    uint64_t* deltas = row + (bb_merge == 1 ? 1 : 2);
+    for (size_t i = 0; i < num_bb_counter_columns; i++)
+      deltas[i] = totals[i] - prev_totals[i];
+    memcpy(prev_totals, totals, sizeof(totals));
     if (bb_merge == 1) {
+      // Individual basic blocks include strings so must be output in full.
       const char* partition = bf_categorize_counters();
-      *bfbin << (partition == NULL ? "" : partition)
+      *bfbin << uint8_t(BINOUT_ROW_DATA)
+             << first_bb
+             << (partition == NULL ? "" : partition)
              << (strcmp(syminfo->function, "*GLOBAL*") == 0 ? "" : syminfo->function)
              << (strcmp(syminfo->function, "*GLOBAL*") == 0 ? "" : demangle_func_name(syminfo->function))
              << (strcmp(syminfo->file, "??") == 0 ? "" : syminfo->file)
              << uint64_t(syminfo->line);
+      for (size_t i = 0; i < num_bb_counter_columns; i++)
+        *bfbin << deltas[i];
+    }
+    else {
+      // Groups of basic blocks tend to differ from their predecessor in
+      // only a few counters so we output them sparsely.
+      static uint64_t prev_row[2 + num_bb_counter_columns] = {0};
+      row[0] = first_bb;
+      row[1] = first_bb + num_merged - 1;
+      bfbin->write_sparse_row(row, prev_row, 2 + num_bb_counter_columns);
+      memcpy(prev_row, row, sizeof(row));
     }
-    uint64_t other_branches = counter_deltas.terminators[BF_END_BB_ANY];
-    for (int i = 0; i < BF_END_BB_NUM; i++)
-      if (i != BF_END_BB_ANY)
-        other_branches -= counter_deltas.terminators[i];
-    *bfbin << counter_deltas.load_ins
-           << counter_deltas.store_ins
-           << counter_deltas.flops
-           << counter_deltas.ops - counter_deltas.flops - counter_deltas.load_ins - counter_deltas.store_ins - counter_deltas.terminators[BF_END_BB_ANY]
-           << counter_deltas.call_ins
-           << counter_deltas.terminators[BF_END_BB_INVOKE]
-           << counter_deltas.terminators[BF_END_BB_UNCOND_FAKE]
-           << counter_deltas.terminators[BF_END_BB_UNCOND_REAL]
-           << counter_deltas.terminators[BF_END_BB_COND_NT]
-           << counter_deltas.terminators[BF_END_BB_COND_T]
-           << counter_deltas.terminators[BF_END_BB_INDIRECT]
-           << counter_deltas.terminators[BF_END_BB_SWITCH]
-           << counter_deltas.terminators[BF_END_BB_RETURN]
-           << other_branches
-           << counter_deltas.fp_bits
-           << counter_deltas.op_bits
-           << counter_deltas.loads
-           << counter_deltas.stores
-           << counter_deltas.mem_insts[BF_MEMSET_CALLS]
-           << counter_deltas.mem_insts[BF_MEMSET_BYTES]
-           << counter_deltas.mem_insts[BF_MEMXFER_CALLS]
-           << counter_deltas.mem_insts[BF_MEMXFER_BYTES];
+    first_bb += num_merged;
 
     // Prepare for the next round of output.
     num_merged = 0;
-    prev_global_totals = global_totals;
   }
 }
 
@@ -566,27 +828,61 @@ void bf_report_bb_tallies (bf_symbol_info_t* syminfo)
   report_bb_tallies(syminfo, bf_bb_merge);
 }
 
-// Associate the current counter values with a given function.
+// Accumulate the counter variables, which aggregate the most recent
+// bf_bb_pending_count basic blocks, into the global counters and report
+// them.  Instrumented code invokes this once every bf_bb_flush_threshold
+// basic blocks instead of invoking bf_accumulate_bb_tallies(),
+// bf_report_bb_tallies(), and bf_reset_bb_tallies() on every basic block.
 extern "C"
-void bf_assoc_counters_with_func (KeyType_t funcID)
+void bf_flush_bb_tallies (bf_symbol_info_t* syminfo)
 {
-  // Ensure that per_func_totals contains an ByteFlopCounters entry
-  // for funcname, then add the current counters to that entry.
+  OverheadTimer timer(BF_OVERHEAD_BB_FLUSH);
+
+  uint64_t num_bblocks = bf_bb_pending_count;
+  bf_bb_pending_count = 0;
+  if (bf_suppress_counting) {
+    static ByteFlopCounters discarded;
+    drain_counters(thread_counters, discarded);
+    return;
+  }
+  drain_counters(thread_counters, bb_totals);
+  accumulate_bb_totals();
+  num_merged += num_bblocks - 1;
+  report_bb_tallies(syminfo, bf_bb_merge);
+  bb_totals.reset();
+  if (__builtin_expect(bf_live_due, 0))
+    bf_publish_live_counters();
+}
+
+// Associate the current counter values with a given function, identified
+// by both its dense ID and its key.  The dense ID indexes an array
+// directly.  We fall back to looking up the key if we're tracking call
+// stacks, whose IDs are known only at run time, or if the function's
+// module has not yet registered its functions.
+extern "C"
+void bf_assoc_counters_with_func (uint64_t funcID, KeyType_t funcKey)
+{
+  // Ensure that per-function tallies contain an ByteFlopCounters entry
+  // for the function, then add the current counters to that entry.  In
+  // thread-sharded mode, use the calling thread's private tallies instead.
   if (bf_suppress_counting)
     return;
-  key2bfc_t::iterator sm_iter;
-  KeyType_t key;
-  if (bf_call_stack) {
-    sm_iter = per_func_totals().find(bf_func_and_parents_id);
-    key = bf_func_and_parents_id;
+  ByteFlopCounters** func_counters_ptr;
+  if (!bf_call_stack && funcID < func_id_to_key().size()) {
+    id2bfc_t*& id_totals = bf_thread_shards ? thread_func_id_totals : func_id_totals;
+    if (id_totals == nullptr)
+      id_totals = new id2bfc_t();
+    if (funcID >= id_totals->size())
+      id_totals->resize(func_id_to_key().size(), nullptr);
+    func_counters_ptr = &(*id_totals)[funcID];
   }
   else {
-    sm_iter = per_func_totals().find(funcID);
-    key = funcID;
+    key2bfc_t& func_totals = bf_thread_shards ? *thread_func_totals : per_func_totals();
+    func_counters_ptr = &func_totals[bf_call_stack ? bf_func_and_parents_id : funcKey];
   }
-  if (sm_iter == per_func_totals().end())
-    // This is the first time we've seen this function name.
-    per_func_totals()[key] =
+  if (*func_counters_ptr == nullptr)
+    // This is the first time we've seen this function.
+    *func_counters_ptr =
       new ByteFlopCounters(bf_mem_insts_count,
                            bf_inst_mix_histo,
                            bf_terminator_count,
@@ -602,8 +898,8 @@ void bf_assoc_counters_with_func (KeyType_t funcID)
                            bf_op_bits_count);
   else {
     // Accumulate the current counter values into those associated
-    // with an existing function name.
-    ByteFlopCounters* func_counters = sm_iter->second;
+    // with an existing function.
+    ByteFlopCounters* func_counters = *func_counters_ptr;
     func_counters->accumulate(bf_mem_insts_count,
                               bf_inst_mix_histo,
                               bf_terminator_count,
@@ -618,11 +914,109 @@ void bf_assoc_counters_with_func (KeyType_t funcID)
                               bf_op_count,
                               bf_op_bits_count);
   }
+
+  // In thread-sharded mode, also credit the counters to the calling thread.
+  if (thread_counters != nullptr && thread_counters->thread_totals != nullptr)
+    thread_counters->thread_totals->accumulate(bf_mem_insts_count,
+                                               bf_inst_mix_histo,
+                                               bf_terminator_count,
+                                               bf_mem_intrin_count,
+                                               bf_load_count,
+                                               bf_store_count,
+                                               bf_load_ins_count,
+                                               bf_store_ins_count,
+                                               bf_call_ins_count,
+                                               bf_flop_count,
+                                               bf_fp_bits_count,
+                                               bf_op_count,
+                                               bf_op_bits_count);
+
+  // Publish the live counters if it's time to do so.  In thread-sharded
+  // mode we may not be holding the mega-lock so we leave publication to
+  // the flush and timeline points, which are always locked.
+  if (__builtin_expect(bf_live_due, 0) && !bf_thread_shards)
+    bf_publish_live_counters();
+}
+
+// Add to a set of counters the operations that each basic block performs
+// per execution, as counted at compile time, times the number of times the
+// basic block was executed.
+static void accumulate_static_bb_tallies (ByteFlopCounters& totals)
+{
+  if (bb_record_tables == nullptr)
+    return;
+  for (auto tbl_iter = bb_record_tables->begin(); tbl_iter != bb_record_tables->end(); tbl_iter++)
+    for (uint64_t i = 0; i < tbl_iter->first; i++) {
+      const bf_bb_record_t& record = tbl_iter->second[i];
+      uint64_t tally = *record.tally;
+      if (tally == 0)
+        continue;
+      totals.flops += tally*record.flops;
+      totals.fp_bits += tally*record.fp_bits;
+      totals.ops += tally*record.ops;
+      totals.op_bits += tally*record.op_bits;
+      if (bf_tally_inst_mix)
+        for (uint64_t j = 0; j < record.inst_mix_len; j++)
+          totals.inst_mix_histo[record.inst_mix[2*j]] += tally*record.inst_mix[2*j + 1];
+    }
+}
+
+// Store in a set of counters the program's totals so far.  Other threads'
+// counters are included only up to their most recent flush.  This mirrors
+// finalize_bblocks() but leaves the global state usable.  The caller must
+// hold the mega-lock.
+void bf_snapshot_totals (ByteFlopCounters& totals)
+{
+  totals.reset();
+  if (bf_every_bb) {
+    if (defer_bb_tallies && thread_counters != nullptr)
+      drain_pending_bblocks(thread_counters);
+    totals.accumulate(&global_totals);
+    return;
+  }
+  if (thread_counters != nullptr && !bf_per_func)
+    drain_counters(thread_counters, global_totals);
+  totals.accumulate(&global_totals);
+  accumulate_static_bb_tallies(totals);
+  if (totals.terminators[BF_END_BB_ANY] == 0) {
+    key2bfc_t& func_totals = bf_thread_shards ? *thread_func_totals : per_func_totals();
+    for (auto sm_iter = func_totals.begin(); sm_iter != func_totals.end(); sm_iter++)
+      totals.accumulate(sm_iter->second);
+    id2bfc_t* id_totals = bf_thread_shards ? thread_func_id_totals : func_id_totals;
+    if (id_totals != nullptr)
+      for (auto id_iter = id_totals->begin(); id_iter != id_totals->end(); id_iter++)
+        if (*id_iter != nullptr)
+          totals.accumulate(*id_iter);
+  }
+}
+
+// Invoke a function on each function's totals so far.  A function may be
+// visited twice if it was tallied both by key and by dense ID.  The caller
+// must hold the mega-lock.  In thread-sharded mode, other threads update
+// their per-function tallies without the mega-lock so only the calling
+// thread's tallies are visited until finalize_bblocks() has merged every
+// thread's tallies into the global ones.
+void bf_snapshot_func_totals (function<void(KeyType_t, const ByteFlopCounters&)> visit)
+{
+  bool use_shard = bf_thread_shards && !bblocks_finalized;
+  key2bfc_t& func_totals = use_shard ? *thread_func_totals : per_func_totals();
+  for (auto sm_iter = func_totals.begin(); sm_iter != func_totals.end(); sm_iter++)
+    visit(sm_iter->first, *sm_iter->second);
+  id2bfc_t* id_totals = use_shard ? thread_func_id_totals : func_id_totals;
+  if (id_totals != nullptr)
+    for (size_t i = 0; i < id_totals->size(); i++)
+      if ((*id_totals)[i] != nullptr)
+        visit(func_id_to_key()[i], *(*id_totals)[i]);
 }
 
 // Finalize the basic-block tallies at the end of the run.
 void finalize_bblocks (void)
 {
+  // Associate the per-function tallies we stored by dense ID with their
+  // functions' keys.
+  if (func_id_totals != nullptr)
+    merge_func_id_totals(*func_id_totals, per_func_totals());
+
   if (bf_every_bb) {
     // Complete the basic-block table.
     if (num_merged > 0)
@@ -631,23 +1025,10 @@ void finalize_bblocks (void)
     *bfbin << uint8_t(BINOUT_ROW_NONE);
   }
   else {
-    // If we're not instrumented on the basic-block level, then we need to
-    // accumulate the current values of all of our counters into the global
-    // totals.
-    if (!bf_every_bb)
-      global_totals.accumulate(bf_mem_insts_count,
-                               bf_inst_mix_histo,
-                               bf_terminator_count,
-                               bf_mem_intrin_count,
-                               bf_load_count,
-                               bf_store_count,
-                               bf_load_ins_count,
-                               bf_store_ins_count,
-                               bf_call_ins_count,
-                               bf_flop_count,
-                               bf_fp_bits_count,
-                               bf_op_count,
-                               bf_op_bits_count);
+    // The caller has already merged every thread's counters into the global
+    // totals (cf. merge_bblocks_shard()).  Add in the counters that the
+    // plugin counted at compile time rather than at run time.
+    accumulate_static_bb_tallies(global_totals);
 
     // If the global counter totals are empty, this means that we were tallying
     // per-function data and resetting the global counts after each tally.  We
@@ -659,6 +1040,7 @@ void finalize_bblocks (void)
            sm_iter++)
         global_totals.accumulate(sm_iter->second);
   }
+  bblocks_finalized = true;
 }
 
 } // namespace bytesflops
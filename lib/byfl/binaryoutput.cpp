@@ -6,10 +6,147 @@
  */
 
 #include "byfl.h"
+#include <cerrno>
 #include <cstring>
+#include <sys/uio.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 namespace bytesflops {
 
+// Wrap an open file descriptor.  If zstd_level is nonzero, write
+// compressed blocks at the given compression level.
+BinaryOStreamReal::BinaryOStreamReal (int wrapped_fd, const string& wrapped_name,
+                                      int zstd_level) :
+  fd(wrapped_fd), filename(wrapped_name), buffer_used(0), bytes_flushed(0),
+  compression_level(zstd_level), zstd_cctx(nullptr), zbuffer(nullptr),
+  zbuffer_size(0)
+{
+  buffer = new uint8_t[buffer_size];
+  if (compression_level == 0)
+    return;
+#ifdef HAVE_ZSTD
+  zstd_cctx = ZSTD_createCCtx();
+  if (zstd_cctx == nullptr) {
+    cerr << "Failed to create a zstd compression context for " << filename << '\n';
+    bf_abend();
+  }
+  zbuffer_size = 2*sizeof(uint32_t) + ZSTD_compressBound(buffer_size);
+  zbuffer = new uint8_t[zbuffer_size];
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(BINOUT_ZSTD_MAGIC);
+  iov.iov_len = strlen(BINOUT_ZSTD_MAGIC);
+  write_iovecs(&iov, 1);
+#else
+  cerr << "Cannot compress " << filename << " because Byfl was built without zstd\n";
+  bf_abend();
+#endif
+}
+
+// Write any remaining data and close the file descriptor.
+BinaryOStreamReal::~BinaryOStreamReal()
+{
+  write_buffer();
+  close(fd);
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(zstd_cctx);
+#endif
+  delete[] zbuffer;
+  delete[] buffer;
+}
+
+// Write a list of buffers to the underlying file descriptor.  Retry partial
+// and interrupted writes.
+void BinaryOStreamReal::write_iovecs (struct iovec* iov, int iovcnt)
+{
+  struct iovec* next_iov = iov;
+  struct iovec* end_iov = iov + iovcnt;
+  while (next_iov < end_iov && next_iov->iov_len == 0)
+    next_iov++;
+  while (next_iov < end_iov) {
+    ssize_t nbytes = writev(fd, next_iov, int(end_iov - next_iov));
+    if (nbytes < 0) {
+      if (errno == EINTR)
+        continue;
+      cerr << "Failed to write to " << filename << " (" << strerror(errno) << ")\n";
+      bf_abend();
+    }
+    for (; next_iov < end_iov && size_t(nbytes) >= next_iov->iov_len; next_iov++)
+      nbytes -= next_iov->iov_len;
+    if (next_iov < end_iov) {
+      next_iov->iov_base = (uint8_t*)next_iov->iov_base + nbytes;
+      next_iov->iov_len -= nbytes;
+    }
+  }
+}
+
+// Compress the buffered data into a single, independently decodable block,
+// write the block, and empty the buffer.
+void BinaryOStreamReal::write_compressed_block (void)
+{
+  if (buffer_used == 0)
+    return;
+#ifdef HAVE_ZSTD
+  size_t zbytes = ZSTD_compressCCtx(zstd_cctx,
+                                    zbuffer + 2*sizeof(uint32_t),
+                                    zbuffer_size - 2*sizeof(uint32_t),
+                                    buffer, buffer_used, compression_level);
+  if (ZSTD_isError(zbytes)) {
+    cerr << "Failed to compress data for " << filename
+         << " (" << ZSTD_getErrorName(zbytes) << ")\n";
+    bf_abend();
+  }
+  uint32_t header[2] = {htobe32(uint32_t(zbytes)), htobe32(uint32_t(buffer_used))};
+  memcpy(zbuffer, header, sizeof(header));
+  struct iovec iov;
+  iov.iov_base = zbuffer;
+  iov.iov_len = sizeof(header) + zbytes;
+  write_iovecs(&iov, 1);
+#endif
+  bytes_flushed += buffer_used;
+  buffer_used = 0;
+}
+
+// Write all buffered data, followed by len bytes of extra data, to the
+// underlying file descriptor and empty the buffer.
+void BinaryOStreamReal::write_buffer (const void* extra, size_t len)
+{
+  // When compressing, pass the extra data through the buffer one
+  // bufferful at a time.
+  if (compression_level != 0) {
+    const uint8_t* extra_bytes = (const uint8_t*) extra;
+    while (true) {
+      size_t nbytes = min(len, buffer_size - buffer_used);
+      if (nbytes > 0)
+        memcpy(buffer + buffer_used, extra_bytes, nbytes);
+      buffer_used += nbytes;
+      extra_bytes += nbytes;
+      len -= nbytes;
+      write_compressed_block();
+      if (len == 0)
+        break;
+    }
+    return;
+  }
+
+  // When not compressing, write the buffer and the extra data directly.
+  struct iovec iov[2];
+  iov[0].iov_base = buffer;
+  iov[0].iov_len = buffer_used;
+  iov[1].iov_base = const_cast<void*>(extra);
+  iov[1].iov_len = len;
+  write_iovecs(iov, 2);
+  bytes_flushed += buffer_used + len;
+  buffer_used = 0;
+}
+
+// Write all buffered data to the underlying file descriptor.
+void BinaryOStreamReal::flush (void)
+{
+  write_buffer();
+}
+
 // Write an unsigned 8-bit integer in binary big-endian format.
 BinaryOStreamReal& BinaryOStreamReal::operator<< (const uint8_t val)
 {
@@ -28,8 +165,9 @@ BinaryOStreamReal& BinaryOStreamReal::operator<< (const uint64_t val)
 // followed by the raw string data.
 BinaryOStreamReal& BinaryOStreamReal::operator<< (const char *str)
 {
-  write_big_endian_integer(uint64_t(std::strlen(str)), 16);
-  write_null_terminated(str);
+  size_t len = std::strlen(str);
+  write_big_endian_integer(uint64_t(len), 16);
+  write_raw_string(str, len);
   return *this;
 }
 
@@ -37,7 +175,7 @@ BinaryOStreamReal& BinaryOStreamReal::operator<< (const char *str)
 // raw string data.
 BinaryOStreamReal& BinaryOStreamReal::operator<< (const string& str)
 {
-  *this << str.c_str();
+  BinaryOStreamReal::operator<<(str.c_str());
   return *this;
 }
 
@@ -48,6 +186,332 @@ BinaryOStreamReal& BinaryOStreamReal::operator<< (const bool val)
   return *this;
 }
 
+// Write a row as a bitmap of the columns that differ from the previous row
+// followed by each difference as a zigzag-encoded varint (cf. the
+// description of BINOUT_ROW_SPARSE in binarytagdefs.h).
+void BinaryOStreamReal::write_sparse_row (const uint64_t* values,
+                                          const uint64_t* prev_values,
+                                          size_t num_values)
+{
+  uint8_t encoding[1024];   // Encoded row (at most 1 + N/8 + 10*N bytes)
+  size_t bitmap_len = (num_values + 7)/8;
+  size_t len = 1 + bitmap_len;
+  if (len + 10*num_values > sizeof(encoding)) {
+    cerr << "Internal error: Too many columns (" << num_values << ") for a sparse row\n";
+    bf_abend();
+  }
+  encoding[0] = uint8_t(BINOUT_ROW_SPARSE);
+  memset(encoding + 1, 0, bitmap_len);
+  for (size_t i = 0; i < num_values; i++) {
+    uint64_t diff = values[i] - prev_values[i];
+    if (diff == 0)
+      continue;
+    encoding[1 + i/8] |= uint8_t(1 << (i%8));
+    uint64_t zigzag = (diff << 1) ^ uint64_t(int64_t(diff) >> 63);
+    while (zigzag >= 0x80) {
+      encoding[len++] = uint8_t(zigzag | 0x80);
+      zigzag >>= 7;
+    }
+    encoding[len++] = uint8_t(zigzag);
+  }
+  write_raw_string(reinterpret_cast<const char*>(encoding), len);
+}
+
+
+// Write the version 2 magic header sequence.
+BinaryOStreamColumnar::BinaryOStreamColumnar (int wrapped_fd, const string& wrapped_name,
+                                              int zstd_level) :
+  BinaryOStreamReal(wrapped_fd, wrapped_name, zstd_level),
+  expecting(EXPECT_TABLE), table_type(BINOUT_TABLE_NONE), current_column(0),
+  buffered_rows(0), table_rows(0), table_offset(0)
+{
+  write_raw_string(BINOUT_V2_MAGIC, strlen(BINOUT_V2_MAGIC));
+}
+
+// Accept an unsigned 8-bit integer, which is usually a tag.
+BinaryOStreamColumnar& BinaryOStreamColumnar::operator<< (const uint8_t val)
+{
+  accept_integer(uint64_t(val));
+  return *this;
+}
+
+// Accept an unsigned 64-bit integer datum.
+BinaryOStreamColumnar& BinaryOStreamColumnar::operator<< (const uint64_t val)
+{
+  accept_integer(val);
+  return *this;
+}
+
+// Accept a string (i.e., char *) name or datum.
+BinaryOStreamColumnar& BinaryOStreamColumnar::operator<< (const char *str)
+{
+  accept_string(string(str));
+  return *this;
+}
+
+// Accept a C++ string name or datum.
+BinaryOStreamColumnar& BinaryOStreamColumnar::operator<< (const string& str)
+{
+  accept_string(string(str.c_str()));
+  return *this;
+}
+
+// Accept a boolean datum.
+BinaryOStreamColumnar& BinaryOStreamColumnar::operator<< (const bool val)
+{
+  accept_integer(uint64_t(val));
+  return *this;
+}
+
+// Accept a row of integers.  Columns are stored in full regardless.
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+void BinaryOStreamColumnar::write_sparse_row (const uint64_t* values,
+                                              const uint64_t* prev_values,
+                                              size_t num_values)
+{
+  accept_integer(uint64_t(BINOUT_ROW_DATA));
+  for (size_t i = 0; i < num_values; i++)
+    accept_integer(values[i]);
+}
+
+// Abort on input that violates the binary-output grammar.
+void BinaryOStreamColumnar::malformed (void)
+{
+  cerr << "Internal error: Byfl attempted to write malformed binary output\n";
+  bf_abend();
+}
+
+// Store a datum in the current column.
+void BinaryOStreamColumnar::store_datum (uint64_t val)
+{
+  columns[current_column].data.push_back(val);
+}
+
+// Accept an integer or Boolean tag or datum, and advance to the next
+// state.
+void BinaryOStreamColumnar::accept_integer (uint64_t val)
+{
+  switch (expecting) {
+    case EXPECT_TABLE:
+      // Begin a new table or, if there are no more tables, finish the file.
+      table_type = BINOUT_TABLE_T(val);
+      switch (table_type) {
+        case BINOUT_TABLE_NONE:
+          write_toc();
+          expecting = EXPECT_NOTHING;
+          break;
+
+        case BINOUT_TABLE_BASIC:
+        case BINOUT_TABLE_KEYVAL:
+          columns.clear();
+          strings.clear();
+          new_strings.clear();
+          buffered_rows = 0;
+          table_rows = 0;
+          expecting = EXPECT_TABLE_NAME;
+          break;
+
+        default:
+          malformed();
+          break;
+      }
+      break;
+
+    case EXPECT_COLUMN:
+      // Define a new column or, if there are no more columns, begin the
+      // table's data.
+      if (val == BINOUT_COL_NONE) {
+        write_table_header();
+        if (table_type == BINOUT_TABLE_KEYVAL) {
+          buffered_rows = 1;
+          finish_table();
+        }
+        else
+          expecting = EXPECT_ROW;
+      }
+      else {
+        if (val > BINOUT_COL_BOOL)
+          malformed();
+        columns.push_back(Column());
+        columns.back().type = BINOUT_COL_T(val);
+        expecting = EXPECT_COLUMN_NAME;
+      }
+      break;
+
+    case EXPECT_KEYVAL_DATA:
+      // Store a key:value table's datum.
+      if (columns[current_column].type == BINOUT_COL_STRING)
+        malformed();
+      store_datum(val);
+      expecting = EXPECT_COLUMN;
+      break;
+
+    case EXPECT_ROW:
+      // Begin a new row or, if there are no more rows, finish the table.
+      switch (val) {
+        case BINOUT_ROW_NONE:
+          finish_table();
+          break;
+
+        case BINOUT_ROW_DATA:
+          current_column = 0;
+          expecting = EXPECT_ROW_DATA;
+          if (columns.empty()) {
+            buffered_rows++;
+            expecting = EXPECT_ROW;
+          }
+          break;
+
+        default:
+          malformed();
+          break;
+      }
+      break;
+
+    case EXPECT_ROW_DATA:
+      // Store a datum in the current row.
+      if (columns[current_column].type == BINOUT_COL_STRING)
+        malformed();
+      store_datum(val);
+      if (++current_column == columns.size()) {
+        if (++buffered_rows == chunk_rows)
+          write_chunk();
+        expecting = EXPECT_ROW;
+      }
+      break;
+
+    default:
+      malformed();
+      break;
+  }
+}
+
+// Accept a string name or datum, and advance to the next state.
+void BinaryOStreamColumnar::accept_string (const string& str)
+{
+  switch (expecting) {
+    case EXPECT_TABLE_NAME:
+      table_name = str;
+      expecting = EXPECT_COLUMN;
+      break;
+
+    case EXPECT_COLUMN_NAME:
+      columns.back().name = str;
+      current_column = columns.size() - 1;
+      expecting = table_type == BINOUT_TABLE_KEYVAL ? EXPECT_KEYVAL_DATA : EXPECT_COLUMN;
+      break;
+
+    case EXPECT_KEYVAL_DATA:
+    case EXPECT_ROW_DATA:
+      {
+        // Replace the string with its dictionary index, adding it to the
+        // dictionary if necessary.
+        if (columns[current_column].type != BINOUT_COL_STRING)
+          malformed();
+        auto iter = strings.find(str);
+        if (iter == strings.end()) {
+          iter = strings.emplace(str, uint32_t(strings.size())).first;
+          new_strings.push_back(&iter->first);
+        }
+        store_datum(uint64_t(iter->second));
+        if (expecting == EXPECT_KEYVAL_DATA)
+          expecting = EXPECT_COLUMN;
+        else if (++current_column == columns.size()) {
+          if (++buffered_rows == chunk_rows)
+            write_chunk();
+          expecting = EXPECT_ROW;
+        }
+      }
+      break;
+
+    default:
+      malformed();
+      break;
+  }
+}
+
+// Write the current table's type, name, and column headers.
+void BinaryOStreamColumnar::write_table_header (void)
+{
+  table_offset = tell();
+  BinaryOStreamReal::operator<<(uint8_t(table_type));
+  BinaryOStreamReal::operator<<(table_name);
+  BinaryOStreamReal::operator<<(uint64_t(columns.size()));
+  for (auto iter = columns.cbegin(); iter != columns.cend(); iter++) {
+    BinaryOStreamReal::operator<<(uint8_t(iter->type));
+    BinaryOStreamReal::operator<<(iter->name);
+  }
+}
+
+// Write all buffered rows as a chunk comprising the number of rows, the
+// number of bytes that follow, the strings added to the dictionary since
+// the previous chunk (null-terminated so readers can use them in place),
+// and each column's data in turn.
+void BinaryOStreamColumnar::write_chunk (void)
+{
+  if (buffered_rows == 0)
+    return;
+
+  // Compute the number of bytes in the chunk's payload.
+  uint64_t payload_bytes = sizeof(uint64_t);
+  for (auto iter = new_strings.cbegin(); iter != new_strings.cend(); iter++)
+    payload_bytes += sizeof(uint16_t) + (*iter)->length() + 1;
+  for (auto iter = columns.cbegin(); iter != columns.cend(); iter++)
+    payload_bytes += buffered_rows*BINOUT_V2_COLUMN_WIDTH(iter->type);
+
+  // Write the chunk header and string dictionary.
+  BinaryOStreamReal::operator<<(uint64_t(buffered_rows));
+  BinaryOStreamReal::operator<<(payload_bytes);
+  BinaryOStreamReal::operator<<(uint64_t(new_strings.size()));
+  for (auto iter = new_strings.cbegin(); iter != new_strings.cend(); iter++) {
+    BinaryOStreamReal::operator<<(**iter);
+    BinaryOStreamReal::operator<<(uint8_t(0));
+  }
+  new_strings.clear();
+
+  // Write each column's data.
+  for (auto iter = columns.begin(); iter != columns.end(); iter++) {
+    size_t valid_bits = 8*BINOUT_V2_COLUMN_WIDTH(iter->type);
+    for (auto diter = iter->data.cbegin(); diter != iter->data.cend(); diter++)
+      write_big_endian_integer(*diter, valid_bits);
+    iter->data.clear();
+  }
+  table_rows += buffered_rows;
+  buffered_rows = 0;
+}
+
+// Finish writing the current table by writing all buffered rows followed by
+// an empty chunk.
+void BinaryOStreamColumnar::finish_table (void)
+{
+  write_chunk();
+  BinaryOStreamReal::operator<<(uint64_t(0));
+  TOCEntry entry;
+  entry.type = table_type;
+  entry.name = table_name;
+  entry.offset = table_offset;
+  entry.num_rows = table_rows;
+  toc.push_back(entry);
+  expecting = EXPECT_TABLE;
+}
+
+// Write the end-of-tables tag, the table of contents, and a trailer that
+// points to the table of contents.
+void BinaryOStreamColumnar::write_toc (void)
+{
+  BinaryOStreamReal::operator<<(uint8_t(BINOUT_TABLE_NONE));
+  uint64_t toc_offset = tell();
+  BinaryOStreamReal::operator<<(uint64_t(toc.size()));
+  for (auto iter = toc.cbegin(); iter != toc.cend(); iter++) {
+    BinaryOStreamReal::operator<<(uint8_t(iter->type));
+    BinaryOStreamReal::operator<<(iter->name);
+    BinaryOStreamReal::operator<<(iter->offset);
+    BinaryOStreamReal::operator<<(iter->num_rows);
+  }
+  BinaryOStreamReal::operator<<(toc_offset);
+  write_raw_string(BINOUT_V2_TOC_MAGIC, strlen(BINOUT_V2_TOC_MAGIC));
+}
+
 
 
 // Discard an unsigned 8-bit integer.
@@ -85,4 +549,11 @@ BinaryOStream& BinaryOStream::operator<< (const bool val)
   return *this;
 }
 
+// Discard a row of integers.
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+void BinaryOStream::write_sparse_row (const uint64_t* values, const uint64_t* prev_values,
+                                      size_t num_values)
+{
+}
+
 } // namespace bytesflops
@@ -9,6 +9,10 @@
 #define _BINARYOUTPUT_H_
 
 #include "binarytagdefs.h"
+#include <endian.h>
+
+struct iovec;
+struct ZSTD_CCtx_s;
 
 namespace bytesflops {
 
@@ -23,19 +27,26 @@ public:
   virtual BinaryOStream& operator<<(const char *str);
   virtual BinaryOStream& operator<<(const string& str);
   virtual BinaryOStream& operator<<(const bool val);
+
+  // Write a row of a table whose columns are all integers, given the
+  // table's previous row (all zeroes for the first row).
+  virtual void write_sparse_row(const uint64_t* values, const uint64_t* prev_values,
+                                size_t num_values);
 };
 
 // Subclass a BinaryOStream into a version that writes its output to a
-// real stream.
+// file descriptor.  Output is accumulated in a large buffer, with integers
+// stored in bulk as byte-swapped words, and handed to the kernel with
+// write(2)/writev(2) only when the buffer fills or is explicitly flushed.
+// Optionally, each bufferful is written as a separately zstd-compressed
+// block.
 class BinaryOStreamReal : public BinaryOStream
 {
 public:
-  BinaryOStreamReal(std::ostream& wrapped_stream) : ostr(wrapped_stream) { }
-  virtual ~BinaryOStreamReal() { }
+  BinaryOStreamReal(int wrapped_fd, const string& wrapped_name, int zstd_level = 0);
+  virtual ~BinaryOStreamReal();
 
-  void flush() override {
-    ostr.flush();
-  }
+  void flush() override;
 
   BinaryOStreamReal& operator<<(const uint8_t val) override;
   BinaryOStreamReal& operator<<(const uint64_t val) override;
@@ -43,26 +54,149 @@ public:
   BinaryOStreamReal& operator<<(const string& str) override;
   BinaryOStreamReal& operator<<(const bool val) override;
 
-private:
-  std::ostream& ostr;    // Underlying output stream
+  // Write a BINOUT_ROW_SPARSE row.
+  void write_sparse_row(const uint64_t* values, const uint64_t* prev_values,
+                        size_t num_values) override;
 
-  // Write an arbitrary number of bits in binary big-endian format.
-  // The input value must be cast to a uint64_t before calling this
-  // function.
+protected:
+  // Return the number of bytes written so far, before any compression.
+  uint64_t tell() const { return bytes_flushed + buffer_used; }
+
+  // Write the low-order valid_bits bits of a value in binary big-endian
+  // format.  The input value must be cast to a uint64_t before calling
+  // this function.
   void write_big_endian_integer(const uint64_t val, const size_t valid_bits)
   {
-    uint64_t shift = uint64_t(valid_bits - 8);
-    uint64_t mask = UINT64_C(0xff) << shift;
-
-    for (; mask > 0; shift -= 8, mask >>= 8)
-      ostr << uint8_t((val&mask) >> shift);
+    size_t nbytes = valid_bits/8;
+    if (buffer_used + sizeof(uint64_t) > buffer_size)
+      write_buffer();
+    uint64_t be_val = htobe64(val << (64 - valid_bits));
+    memcpy(buffer + buffer_used, &be_val, sizeof(uint64_t));
+    buffer_used += nbytes;
   }
 
-  // Write a null-terminated string to the underlying stream.
-  void write_null_terminated(const char *str)
+  // Write a string of a given length (without its terminating null
+  // character) to the underlying file.
+  void write_raw_string(const char *str, size_t len)
   {
-    ostr << str;
+    if (buffer_used + len <= buffer_size) {
+      memcpy(buffer + buffer_used, str, len);
+      buffer_used += len;
+    }
+    else
+      write_buffer(str, len);
   }
+
+private:
+  static const size_t buffer_size = 1048576;  // Bytes to buffer before writing
+  int fd;                 // Underlying file descriptor
+  string filename;        // Name of the file associated with fd (for errors)
+  uint8_t* buffer;        // Data not yet written to fd
+  size_t buffer_used;     // Number of valid bytes in buffer
+  uint64_t bytes_flushed; // Number of bytes removed from buffer so far
+  int compression_level;  // zstd compression level (0=don't compress)
+  ZSTD_CCtx_s* zstd_cctx; // zstd compression context
+  uint8_t* zbuffer;       // Storage for a compressed block and its header
+  size_t zbuffer_size;    // Number of bytes allocated for zbuffer
+
+  // Write a list of buffers in their entirety to the underlying file.
+  void write_iovecs(struct iovec* iov, int iovcnt);
+
+  // Compress and write out all buffered data as a single block.
+  void write_compressed_block();
+
+  // Write out len bytes of extra data following the buffered data and
+  // empty the buffer.
+  void write_buffer(const void* extra = nullptr, size_t len = 0);
+};
+
+// Subclass a BinaryOStreamReal into a version that writes the version 2
+// (columnar) binary-output format.  The caller writes exactly the same
+// sequence of tags and values as for BinaryOStreamReal.  This class
+// parses that sequence and transposes each table's rows into chunks of
+// fixed-width columns.  Strings are replaced by indexes into a per-table
+// dictionary.  A table of contents recording each table's offset is
+// written at the end.
+class BinaryOStreamColumnar : public BinaryOStreamReal
+{
+public:
+  BinaryOStreamColumnar(int wrapped_fd, const string& wrapped_name, int zstd_level = 0);
+  virtual ~BinaryOStreamColumnar() { }
+
+  BinaryOStreamColumnar& operator<<(const uint8_t val) override;
+  BinaryOStreamColumnar& operator<<(const uint64_t val) override;
+  BinaryOStreamColumnar& operator<<(const char *str) override;
+  BinaryOStreamColumnar& operator<<(const string& str) override;
+  BinaryOStreamColumnar& operator<<(const bool val) override;
+
+  // Store an ordinary row; the columnar format is compact already.
+  void write_sparse_row(const uint64_t* values, const uint64_t* prev_values,
+                        size_t num_values) override;
+
+private:
+  static const size_t chunk_rows = 16384;  // Maximum number of rows per chunk
+
+  // Describe what we expect to be given next.
+  enum {
+    EXPECT_TABLE,         // Table type
+    EXPECT_TABLE_NAME,    // Table name
+    EXPECT_COLUMN,        // Column type
+    EXPECT_COLUMN_NAME,   // Column name
+    EXPECT_KEYVAL_DATA,   // Datum for the most recent key:value column
+    EXPECT_ROW,           // Row type
+    EXPECT_ROW_DATA,      // Datum for the current column of a row
+    EXPECT_NOTHING        // Nothing (the end of the file was written)
+  } expecting;
+
+  // Represent one column of the current table.
+  struct Column {
+    BINOUT_COL_T type;      // Data type
+    string name;            // Column name
+    vector<uint64_t> data;  // Values (string indexes for string columns)
+  };
+
+  // Represent one table-of-contents entry.
+  struct TOCEntry {
+    BINOUT_TABLE_T type;    // Table type
+    string name;            // Table name
+    uint64_t offset;        // Byte offset of the table from the start of the file
+    uint64_t num_rows;      // Number of rows in the table
+  };
+
+  BINOUT_TABLE_T table_type;                 // Type of the current table
+  string table_name;                         // Name of the current table
+  vector<Column> columns;                    // Columns of the current table
+  size_t current_column;                     // Column to receive the next datum
+  size_t buffered_rows;                      // Number of rows not yet written
+  uint64_t table_rows;                       // Number of rows in the current table
+  uint64_t table_offset;                     // Offset of the current table
+  unordered_map<string, uint32_t> strings;   // Map from a string to its dictionary index
+  vector<const string*> new_strings;         // Strings not yet written to the dictionary
+  vector<TOCEntry> toc;                      // Table of contents
+
+  // Accept an integer or Boolean tag or datum.
+  void accept_integer(uint64_t val);
+
+  // Accept a string name or datum.
+  void accept_string(const string& str);
+
+  // Store a datum in the current column.
+  void store_datum(uint64_t val);
+
+  // Write the current table's header.
+  void write_table_header();
+
+  // Write all buffered rows as a chunk.
+  void write_chunk();
+
+  // Finish writing the current table.
+  void finish_table();
+
+  // Write the table of contents.
+  void write_toc();
+
+  // Abort on input that violates the binary-output grammar.
+  void malformed() __attribute__ ((noreturn));
 };
 
 } // namespace bytesflops
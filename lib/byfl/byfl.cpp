@@ -10,6 +10,7 @@
 #include "byfl.h"
 #include "byfl-common.h"
 #include "callstack.h"
+#include <fcntl.h>
 
 using namespace std;
 
@@ -22,6 +23,13 @@ key2bfc_t& per_func_totals (void)
   static key2bfc_t* mapping = new key2bfc_t();
   return *mapping;
 }
+// Map each dense function ID to its function's key.
+vector<KeyType_t>& func_id_to_key (void)
+{
+  static vector<KeyType_t>* mapping = new vector<KeyType_t>();
+  return *mapping;
+}
+
 typedef CachedUnorderedMap<KeyType_t, uint64_t> key2num_t;
 static key2num_t& func_call_tallies (void)
 {
@@ -36,6 +44,14 @@ static key2name_t& key_to_func (void)
     return *mapping;
 }
 
+// Return the name of the function associated with a key or the empty
+// string if the key is unknown.
+string bf_func_key_to_name (KeyType_t key)
+{
+  auto iter = key_to_func().find(key);
+  return iter == key_to_func().end() ? string("") : iter->second;
+}
+
 typedef CachedUnorderedMap<KeyType_t, bf_symbol_info_t> key2info_t;
 static key2info_t& key_to_func_info (void)
 {
@@ -64,6 +80,27 @@ str2bfc_t& user_defined_totals (void)
   return *mapping;
 }
 
+// In thread-sharded mode, each thread tallies function calls into its own
+// maps, which are merged into the global maps when the thread exits or the
+// program ends.
+struct FuncShard {
+  key2num_t call_tallies;     // Per-thread analogue of func_call_tallies()
+  key2info_t func_info;       // Per-thread analogue of key_to_func_info()
+};
+static __thread FuncShard* func_shard = nullptr;
+
+// Return the calling thread's map of function call tallies.
+static inline key2num_t& my_func_call_tallies (void)
+{
+  return bf_thread_shards ? func_shard->call_tallies : func_call_tallies();
+}
+
+// Return the calling thread's map of function symbol information.
+static inline key2info_t& my_key_to_func_info (void)
+{
+  return bf_thread_shards ? func_shard->func_info : key_to_func_info();
+}
+
 // Associate a function name (which will not be unique across files) with a
 // unique key.  Abort if duplicate keys are detected.  (This should be
 // exceedingly unlikely.)
@@ -96,30 +133,41 @@ extern "C" {
 #endif
 }
 
+// Return true if the user may have overridden bf_categorize_counters().
+bool bf_user_categorizes_counters (void)
+{
+#ifdef HAVE_WEAK_ALIASES
+  return bf_categorize_counters != bf_categorize_counters_original;
+#else
+  return true;
+#endif
+}
+
 } // namespace bytesflops
 
 
 KeyType_t bf_categorize_counters_id = 10; // Should be unlikely that this is a duplicate.
+
+// With -bf-clone-functions, instrumented functions forward each call to an
+// uninstrumented copy of themselves while this is zero.
+extern "C" {
+  uint8_t bf_counting_enabled = 1;
+}
 extern char** environ;
 extern "C" void bf_reset_bb_tallies (void);
 
-// Define a mapping from an instruction's opcode to its arguments' opcodes to a
-// tally.  We ignore instructions with more than two arguments.
-uint64_t bf_inst_deps_histo[NUM_LLVM_OPCODES_POW2][NUM_LLVM_OPCODES_POW2][NUM_LLVM_OPCODES_POW2][2] = {{{{0}}}};
-
 namespace bytesflops {
 
-const char* bf_func_and_parents; // Top of the complete_call_stack stack
-KeyType_t bf_func_and_parents_id; // Top of the complete_call_stack stack
-KeyType_t bf_current_func_key;
+__thread KeyType_t bf_func_and_parents_id; // Top of the complete_call_stack stack
+__thread KeyType_t bf_current_func_key;
 string bf_output_prefix;         // String to output before "BYFL" on every line
 ostream* bfout;                  // Stream to which to send textual output
 BinaryOStream* bfbin;            // Stream to which to send binary output
-ofstream *bfbin_file;            // Underlying file for the above
 string bfbin_filename;           // File name associated with the above
 bool bf_abnormal_exit = false;   // false=exit normally; true=get out fast
 bool bf_suppress_counting = false;        // false=normal operation; true=don't update state
-static CallStack* call_stack = nullptr;   // The calling process's current call stack
+static __thread CallStack* call_stack = nullptr;   // The calling thread's current call stack
+static vector<const CallingContext*>* all_contexts = nullptr;   // Every calling context seen by any thread
 static string current_local_time (const char *);
 static string start_time = current_local_time("%F %T");  // Time at which the program began execution
 
@@ -152,15 +200,37 @@ static string current_local_time (const char *format)
 // Initialize some of our variables at first use.
 void initialize_byfl (void)
 {
-  bf_func_and_parents = "-";
-  bf_func_and_parents_id = KeyType_t(0);
-  bf_current_func_key = KeyType_t(0);
-  call_stack = new CallStack();
   const char* partition = bf_categorize_counters();
   if (partition != NULL)
     bf_record_key(partition, bf_categorize_counters_id);
 }
 
+// Merge a thread's function tallies into the global function tallies.  The
+// caller must hold the mega-lock.
+static void merge_func_shard (void* shard_ptr)
+{
+  FuncShard* shard = (FuncShard*) shard_ptr;
+  for (auto iter = shard->call_tallies.begin(); iter != shard->call_tallies.end(); iter++)
+    func_call_tallies()[iter->first] += iter->second;
+  for (auto iter = shard->func_info.begin(); iter != shard->func_info.end(); iter++)
+    if (key_to_func_info().find(iter->first) == key_to_func_info().end())
+      key_to_func_info()[iter->first] = iter->second;
+  shard->call_tallies.clear();
+  shard->func_info.clear();
+}
+
+// Initialize the calling thread's variables at first use.
+void initialize_thread_byfl (void)
+{
+  bf_func_and_parents_id = KeyType_t(0);
+  bf_current_func_key = KeyType_t(0);
+  call_stack = new CallStack();
+  if (bf_thread_shards) {
+    func_shard = new FuncShard();
+    bf_register_thread_shard(merge_func_shard, func_shard);
+  }
+}
+
 // Initialize on first use all top-level variables in all files.  This is a
 // kludge to work around the "C++ static initialization order fiasco" (cf. the
 // C++ FAQ).  bf_initialize_if_necessary() can safely be called multiple times.
@@ -168,6 +238,7 @@ extern "C"
 void bf_initialize_if_necessary (void)
 {
   static bool initialized = false;
+  static __thread bool thread_initialized = false;
   if (!__builtin_expect(initialized, true)) {
     initialized = true;
     initialize_byfl();
@@ -181,6 +252,22 @@ void bf_initialize_if_necessary (void)
     initialize_data_structures();
     initialize_strides();
     initialize_cache();
+    initialize_access_trace();
+    initialize_timeline();
+    initialize_sampling();
+    initialize_overhead();
+    initialize_live();
+    initialize_specialization();
+  }
+  if (!__builtin_expect(thread_initialized, true)) {
+    thread_initialized = true;
+    initialize_thread_access_trace();
+    initialize_thread_byfl();
+    initialize_thread_bblocks();
+    initialize_thread_ubytes();
+    initialize_thread_tallybytes();
+    initialize_thread_inst_deps();
+    initialize_thread_data_structures();
   }
 }
 
@@ -191,12 +278,37 @@ void bf_abend (void)
   std::exit(1);
 }
 
+// Counting is enabled only if both the user and burst sampling want it
+// enabled.
+static bool user_counting = true;     // Most recent bf_enable_counting() setting
+static bool sampler_counting = true;  // Most recent bf_sample_counting() setting
+
+// Suppress Byfl counter updates unless both the user and the sampler
+// have enabled counting.
+static void update_counting_state (void)
+{
+  bool enable = user_counting && sampler_counting;
+  bf_flush_access_trace();
+  bf_drain_pending_bblocks();
+  bf_reset_bb_tallies();
+  bf_suppress_counting = !enable;
+  bf_counting_enabled = uint8_t(enable);
+}
+
 // Toggle suppression of Byfl counter updates.
 extern "C"
 void bf_enable_counting (int enable)
 {
-  bf_reset_bb_tallies();
-  bf_suppress_counting = !bool(enable);
+  user_counting = bool(enable);
+  update_counting_state();
+}
+
+// Toggle suppression of Byfl counter updates on behalf of burst sampling.
+// This never overrides the user's bf_enable_counting(0).
+void bf_sample_counting (bool enable)
+{
+  sampler_counting = enable;
+  update_counting_state();
 }
 
 // Tally the number of calls to each function.  Store the function's symbol
@@ -206,18 +318,23 @@ void bf_incr_func_tally (KeyType_t keyID, bf_symbol_info_t* syminfo)
 {
   if (bf_suppress_counting)
     return;
-  func_call_tallies()[keyID]++;
+  my_func_call_tallies()[keyID]++;
   if (syminfo != nullptr &&
-      key_to_func_info().find(keyID) == key_to_func_info().end())
-    key_to_func_info()[keyID] = *syminfo;
+      my_key_to_func_info().find(keyID) == my_key_to_func_info().end())
+    my_key_to_func_info()[keyID] = *syminfo;
 }
 
+// Record the names of a module's functions.  Assign the functions
+// consecutive dense IDs, and tell the module the first of these.
 extern "C"
 void bf_record_funcs2keys(uint32_t cnt, const uint64_t* keys,
-                          const char** fnames)
+                          const char** fnames, uint64_t* base_id)
 {
-  for (unsigned int i = 0; i < cnt; i++)
+  *base_id = func_id_to_key().size();
+  for (unsigned int i = 0; i < cnt; i++) {
     bf_record_key(fnames[i], keys[i]);
+    func_id_to_key().push_back(keys[i]);
+  }
 }
 
 // Push a function name onto the call stack.  Increment the invocation count of
@@ -226,29 +343,56 @@ void bf_record_funcs2keys(uint32_t cnt, const uint64_t* keys,
 extern "C"
 void bf_push_function (const char* funcname, KeyType_t keyID, bf_symbol_info_t* syminfo)
 {
+  bool is_new;
+  const CallingContext* context = call_stack->push_function(funcname, keyID, is_new);
   bf_current_func_key = keyID;
-  bf_func_and_parents =  call_stack->push_function(funcname, keyID);
-  uint64_t depth = 1 << call_stack->depth();
-  bf_func_and_parents_id = bf_func_and_parents_id ^ depth ^ keyID;
-  bf_record_key(bf_func_and_parents, bf_func_and_parents_id);
+  bf_func_and_parents_id = context->id;
+  if (is_new) {
+    // The calling thread has never before seen this call stack.  Remember
+    // it so its name can be associated with its key at the end of the
+    // program.
+    if (bf_thread_shards)
+      bf_acquire_mega_lock();
+    if (all_contexts == nullptr)
+      all_contexts = new vector<const CallingContext*>;
+    all_contexts->push_back(context);
+    if (bf_thread_shards)
+      bf_release_mega_lock();
+  }
   if (bf_suppress_counting)
     return;
-  func_call_tallies()[bf_func_and_parents_id]++;
-  func_call_tallies()[keyID] += 0;
+  my_func_call_tallies()[bf_func_and_parents_id]++;
+  my_func_call_tallies()[keyID] += 0;
   if (syminfo != nullptr &&
-      key_to_func_info().find(bf_func_and_parents_id) == key_to_func_info().end())
-    key_to_func_info()[bf_func_and_parents_id] = *syminfo;
+      my_key_to_func_info().find(bf_func_and_parents_id) == my_key_to_func_info().end())
+    my_key_to_func_info()[bf_func_and_parents_id] = *syminfo;
 }
 
 // Pop the top function name from the call stack.
 extern "C"
 void bf_pop_function (void)
 {
-  uint64_t depth = 1 << call_stack->depth();
-  CallStack::StackItem_t item = call_stack->pop_function();
-  bf_func_and_parents = item.first;
-  bf_func_and_parents_id = bf_func_and_parents_id ^ depth ^ bf_current_func_key;
-  bf_current_func_key = item.second;
+  const CallingContext* context = call_stack->pop_function();
+  bf_func_and_parents_id = context == nullptr ? KeyType_t(0) : context->id;
+  bf_current_func_key = context == nullptr ? KeyType_t(0) : context->func_key;
+}
+
+// Return the name of the current function followed by the names of all of
+// its ancestors.
+const char* bf_func_and_parents (void)
+{
+  return call_stack->current_name();
+}
+
+// Associate every calling context's key with the names of its function and
+// all of its ancestors.  This is intended to be called at the end of the
+// program, after all threads have stopped pushing functions.
+static void record_call_contexts (void)
+{
+  if (all_contexts == nullptr)
+    return;
+  for (auto iter = all_contexts->begin(); iter != all_contexts->end(); iter++)
+    bf_record_key(CallStack::context_name(*iter), (*iter)->id);
 }
 
 // Expand a string like a POSIX shell would do.
@@ -269,6 +413,44 @@ static string shell_expansion(const char *str, const char *strname)
   return result;
 }
 
+// Parse the BF_BINOUT_COMPRESS environment variable, which can be "none",
+// "zstd", or "zstd:<level>", and return the corresponding zstd compression
+// level, with 0 meaning no compression.
+static int binout_compression_level (void)
+{
+  const char *compress = getenv("BF_BINOUT_COMPRESS");
+  if (compress == nullptr || compress[0] == '\0' || !strcmp(compress, "none"))
+    return 0;
+  int level = 0;
+  if (!strcmp(compress, "zstd"))
+    level = 1;    // Favor speed over compression ratio by default.
+  else if (!strncmp(compress, "zstd:", 5))
+    level = atoi(compress + 5);
+  if (level <= 0) {
+    cerr << "Failed to parse BF_BINOUT_COMPRESS (\"" << compress << "\")\n";
+    bf_abend();
+  }
+#ifndef HAVE_ZSTD
+  cerr << "BF_BINOUT_COMPRESS=" << compress << " requires a Byfl built with zstd\n";
+  bf_abend();
+#endif
+  return level;
+}
+
+// Parse the BF_BINOUT_FORMAT environment variable, which can be "1" (the
+// default, row-oriented format) or "2" (a columnar format with a table of
+// contents), and return the corresponding format version.
+static int binout_format_version (void)
+{
+  const char *format = getenv("BF_BINOUT_FORMAT");
+  if (format == nullptr || format[0] == '\0' || !strcmp(format, "1"))
+    return 1;
+  if (!strcmp(format, "2"))
+    return 2;
+  cerr << "Failed to parse BF_BINOUT_FORMAT (\"" << format << "\")\n";
+  bf_abend();
+}
+
 // Determine if we should suppress output from this process.
 bool suppress_output (void)
 {
@@ -306,14 +488,19 @@ bool suppress_output (void)
       bfbin = new BinaryOStream();
     else {
       // Non-empty string: write to the named file.
-      bfbin_file = new ofstream(bfbin_filename, ios_base::out | ios_base::trunc | ios_base::binary);
-      if (bfbin_file->fail()) {
+      int bfbin_fd = open(bfbin_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (bfbin_fd == -1) {
         cerr << "Failed to create output file " << bfbin_filename << '\n';
         bf_abend();
       }
-      bfbin = new BinaryOStreamReal(*bfbin_file);
-      *bfbin << uint8_t('B') << uint8_t('Y') << uint8_t('F') << uint8_t('L')
-             << uint8_t('B') << uint8_t('I') << uint8_t('N');
+      int zstd_level = binout_compression_level();
+      if (binout_format_version() == 2)
+        bfbin = new BinaryOStreamColumnar(bfbin_fd, bfbin_filename, zstd_level);
+      else {
+        bfbin = new BinaryOStreamReal(bfbin_fd, bfbin_filename, zstd_level);
+        *bfbin << uint8_t('B') << uint8_t('Y') << uint8_t('F') << uint8_t('L')
+               << uint8_t('B') << uint8_t('I') << uint8_t('N');
+      }
     }
 
     // If the BF_PREFIX environment variable is set, expand it and output it
@@ -439,6 +626,9 @@ private:
            << uint8_t(BINOUT_COL_UINT64) << "Bytes loaded and stored by memcpy and memmove";
     if (bf_unique_bytes)
       *bfbin << uint8_t(BINOUT_COL_UINT64) << "Unique bytes";
+    if (bf_unique_bytes_approx)
+      *bfbin << uint8_t(BINOUT_COL_UINT64) << "Unique bytes 95% confidence interval (low)"
+             << uint8_t(BINOUT_COL_UINT64) << "Unique bytes 95% confidence interval (high)";
     *bfbin << uint8_t(BINOUT_COL_UINT64) << "Invocations";
     if (bf_call_stack)
       *bfbin << uint8_t(BINOUT_COL_STRING) << "Mangled call stack"
@@ -492,12 +682,17 @@ private:
              << func_counters->op_bits
              << func_counters->loads
              << func_counters->stores
-             << func_counters->mem_insts[BF_MEMSET_CALLS]
-             << func_counters->mem_insts[BF_MEMSET_BYTES]
-             << func_counters->mem_insts[BF_MEMXFER_CALLS]
-             << func_counters->mem_insts[BF_MEMXFER_BYTES];
+             << func_counters->mem_intrinsics[BF_MEMSET_CALLS]
+             << func_counters->mem_intrinsics[BF_MEMSET_BYTES]
+             << func_counters->mem_intrinsics[BF_MEMXFER_CALLS]
+             << func_counters->mem_intrinsics[BF_MEMXFER_BYTES];
       if (bf_unique_bytes)
         *bfbin << num_uniq_bytes;
+      if (bf_unique_bytes_approx) {
+        uint64_t uniq_error = bf_unique_addresses_error(num_uniq_bytes);
+        *bfbin << num_uniq_bytes - min(num_uniq_bytes, uniq_error)
+               << num_uniq_bytes + uniq_error;
+      }
       *bfbin << invocations
              << funcname_c
              << demangle_func_name(funcname_c);
@@ -629,12 +824,13 @@ private:
       }
     };
     vector<InstInfo> deps_histo;   // Histogram of instruction-dependency tallies
-    for (int i = 0; i < NUM_LLVM_OPCODES+2; i++)
-      for (int j = 0; j < NUM_LLVM_OPCODES+2; j++)
-        for (int k = 0; k < NUM_LLVM_OPCODES+2; k++)
-          for (int l = 0; l < 2; l++)
-            if (bf_inst_deps_histo[i][j][k][l] > 0)
-              deps_histo.push_back(InstInfo(i, j, k, bool(l), bf_inst_deps_histo[i][j][k][l]));
+    vector<pair<bf_inst_deps_t, uint64_t>> all_deps;
+    bf_get_inst_deps(all_deps);
+    for (auto iter = all_deps.begin(); iter != all_deps.end(); iter++) {
+      const bf_inst_deps_t& tuple = iter->first;
+      deps_histo.push_back(InstInfo(int(tuple.opcode), int(tuple.dep1), int(tuple.dep2),
+                                    bool(tuple.more), iter->second));
+    }
     if (deps_histo.size() == 0)
       return;   // No work to do
     sort(deps_histo.begin(), deps_histo.end());
@@ -688,14 +884,18 @@ private:
     uint64_t global_bytes = counter_totals.loads + counter_totals.stores;
     uint64_t global_mem_ops = counter_totals.load_ins + counter_totals.store_ins;
     uint64_t global_unique_bytes = 0;
+    uint64_t unique_error = 0;      // Half-width of the 95% confidence interval of global_unique_bytes
     vector<uint64_t>* reuse_hist;   // Histogram of reuse distances
     uint64_t reuse_unique;          // Unique bytes as measured by the reuse-distance calculator
     bf_get_reuse_distance(&reuse_hist, &reuse_unique);
     if (reuse_unique > 0)
       global_unique_bytes = reuse_unique;
     else
-      if (bf_unique_bytes && !partition)
+      if (bf_unique_bytes && !partition) {
         global_unique_bytes = bf_mem_footprint ? bf_tally_unique_addresses_tb() : bf_tally_unique_addresses();
+        unique_error = bf_unique_addresses_error(global_unique_bytes);
+      }
+    bool unique_estimated = unique_error > 0;
     uint64_t uti = 0, mti = 0;
     if (bf_unique_bytes && bf_strides && !partition)
       bf_partition_unique_addresses(&uti, &mti);
@@ -756,7 +956,10 @@ private:
            << counter_totals.loads << " loaded + "
            << counter_totals.stores << " stored)\n";
     if (bf_unique_bytes && !partition) {
-      if (bf_strides)
+      if (unique_estimated)
+        *bfout << tag << ": " << setw(25) << global_unique_bytes
+               << " estimated unique bytes (+/- " << unique_error << ")\n";
+      else if (bf_strides)
         *bfout << tag << ": " << setw(25) << global_unique_bytes << " unique bytes ("
                << uti << " from single-target loads and stores + "
                << mti << " from multiple-target loads and stores - "
@@ -847,6 +1050,16 @@ private:
       *bfbin << uint8_t(BINOUT_COL_UINT64)
              << "Unique addresses loaded or stored"
              << global_unique_bytes;
+      if (bf_unique_bytes_approx)
+        *bfbin << uint8_t(BINOUT_COL_BOOL)
+               << "Unique addresses are estimated"
+               << unique_estimated
+               << uint8_t(BINOUT_COL_UINT64)
+               << "Unique addresses 95% confidence interval (low)"
+               << global_unique_bytes - min(global_unique_bytes, unique_error)
+               << uint8_t(BINOUT_COL_UINT64)
+               << "Unique addresses 95% confidence interval (high)"
+               << global_unique_bytes + unique_error;
       if (bf_strides)
         *bfbin << uint8_t(BINOUT_COL_UINT64)
                << "Unique addresses from single-target loads and stores"
@@ -864,12 +1077,14 @@ private:
     if (reuse_unique > 0) {
       uint64_t median_value;
       uint64_t mad_value;
+      bool reuse_estimated = bf_get_reuse_distance_scale() > 1.0;
+      const char* estimated = reuse_estimated ? " estimated" : "";
       bf_get_median_reuse_distance(&median_value, &mad_value);
       *bfout << tag << ": " << setw(25);
       if (median_value == ~(uint64_t)0)
-        *bfout << "infinite" << " median reuse distance\n";
+        *bfout << "infinite" << estimated << " median reuse distance\n";
       else
-        *bfout << median_value << " median reuse distance (+/- "
+        *bfout << median_value << estimated << " median reuse distance (+/- "
                << mad_value << ")\n";
       *bfbin << uint8_t(BINOUT_COL_UINT64)
              << "Median reuse distance"
@@ -877,6 +1092,9 @@ private:
       *bfbin << uint8_t(BINOUT_COL_UINT64)
              << "MAD reuse distance"
              << mad_value;
+      *bfbin << uint8_t(BINOUT_COL_BOOL)
+             << "Reuse distance is estimated"
+             << reuse_estimated;
     }
     *bfout << tag << ": " << separator << '\n';
 
@@ -885,7 +1103,8 @@ private:
            << counter_totals.loads*8 << " loaded + "
            << counter_totals.stores*8 << " stored)\n";
     if (bf_unique_bytes && !partition)
-      *bfout << tag << ": " << setw(25) << global_unique_bytes*8 << " unique bits\n";
+      *bfout << tag << ": " << setw(25) << global_unique_bytes*8
+             << (unique_estimated ? " estimated" : "") << " unique bits\n";
     *bfout << tag << ": " << setw(25) << counter_totals.fp_bits << " flop bits\n";
     *bfout << tag << ": " << setw(25) << counter_totals.op_bits << " op bits (excluding memory ops)\n";
     *bfout << tag << ": " << separator << '\n';
@@ -1058,16 +1277,23 @@ private:
       *bfbin << uint8_t(BINOUT_ROW_NONE);
     }
 
-    // Output a table of reuse distances in binary format.
+    // Output a table of reuse distances in binary format.  When reuse
+    // distance was sampled, scale both distances and tallies.
     if (reuse_unique > 0) {
+      double scale = bf_get_reuse_distance_scale();
+      bool reuse_estimated = scale > 1.0;
       *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "Reuse distance";
       *bfbin << uint8_t(BINOUT_COL_UINT64) << "Distance in bytes"
              << uint8_t(BINOUT_COL_UINT64) << "Tally"
+             << uint8_t(BINOUT_COL_BOOL)   << "Estimated"
              << uint8_t(BINOUT_COL_NONE);
       uint64_t dist = 0;
       for (auto iter = reuse_hist->begin(); iter != reuse_hist->end(); iter++, dist++)
         if (*iter > 0)
-          *bfbin << uint8_t(BINOUT_ROW_DATA) << dist << *iter;
+          *bfbin << uint8_t(BINOUT_ROW_DATA)
+                 << uint64_t(dist*scale + 0.5)
+                 << uint64_t(*iter*scale + 0.5)
+                 << reuse_estimated;
       *bfbin << uint8_t(BINOUT_ROW_NONE);
     }
 
@@ -1213,6 +1439,25 @@ private:
       dumpfile.close();
     }
 
+    // Break down remote shared-cache hits by the thread that incurred
+    // them to help identify false sharing and producer/consumer traffic.
+    vector<vector<unordered_map<uint64_t,uint64_t> > > thread_hits =
+      bf_get_remote_shared_cache_hits_by_thread();
+    *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "Remote shared cache hits by thread";
+    *bfbin << uint8_t(BINOUT_COL_UINT64) << "Thread"
+           << uint8_t(BINOUT_COL_UINT64) << "Set size"
+           << uint8_t(BINOUT_COL_UINT64) << "LRU search distance"
+           << uint8_t(BINOUT_COL_UINT64) << "Tally"
+           << uint8_t(BINOUT_COL_NONE);
+    for (uint64_t thread = 0; thread < thread_hits.size(); ++thread)
+      for (uint64_t set = 0; set < thread_hits[thread].size(); ++set) {
+        uint64_t num_sets = 1<<set;
+        for (const auto& elem : thread_hits[thread][set])
+          *bfbin << uint8_t(BINOUT_ROW_DATA)
+                 << thread << num_sets << elem.first << elem.second;
+      }
+    *bfbin << uint8_t(BINOUT_ROW_NONE);
+
     // Output textual summary information.
     string tag(bf_output_prefix + "BYFL_SUMMARY");
     uint64_t global_mem_ops = counter_totals.load_ins + counter_totals.store_ins;
@@ -1230,6 +1475,37 @@ private:
            << uint8_t(BINOUT_COL_UINT64) << "Aligned memory operations" << global_mem_ops - misaligned_mem_ops[0]
            << uint8_t(BINOUT_COL_UINT64) << "Misaligned memory operations" << misaligned_mem_ops[0]
            << uint8_t(BINOUT_COL_NONE);
+
+    // Report the performance of each level of the modeled cache hierarchy,
+    // if any, in both textual and binary formats.
+    vector<bf_cache_level_t> levels = bf_get_cache_hierarchy();
+    if (levels.empty())
+      return;
+    const char* policy = bf_cache_policy == BF_CACHE_EXCLUSIVE ? "exclusive" : "inclusive";
+    *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "Cache hierarchy";
+    *bfbin << uint8_t(BINOUT_COL_STRING) << "Level"
+           << uint8_t(BINOUT_COL_STRING) << "Inclusion policy"
+           << uint8_t(BINOUT_COL_UINT64) << "Capacity (bytes)"
+           << uint8_t(BINOUT_COL_UINT64) << "Associativity"
+           << uint8_t(BINOUT_COL_UINT64) << "Line size (bytes)"
+           << uint8_t(BINOUT_COL_UINT64) << "Sets"
+           << uint8_t(BINOUT_COL_UINT64) << "Accesses"
+           << uint8_t(BINOUT_COL_UINT64) << "Hits"
+           << uint8_t(BINOUT_COL_UINT64) << "Misses"
+           << uint8_t(BINOUT_COL_UINT64) << "Evictions"
+           << uint8_t(BINOUT_COL_NONE);
+    for (auto iter = levels.begin(); iter != levels.end(); iter++) {
+      *bfbin << uint8_t(BINOUT_ROW_DATA)
+             << iter->name << policy << iter->capacity << iter->ways
+             << iter->line_size << iter->sets << iter->accesses
+             << iter->hits << iter->misses << iter->evictions;
+      *bfout << tag << ": " << setw(25) << iter->misses << ' '
+             << iter->name << " misses (" << iter->accesses << " accesses; "
+             << iter->capacity << " bytes, " << iter->ways << "-way, "
+             << iter->line_size << "-byte lines, " << policy << ")\n";
+    }
+    *bfbin << uint8_t(BINOUT_ROW_NONE);
+    *bfout << tag << ": " << separator << '\n';
   }
 
   // Report miscellaneous information in the binary output file.
@@ -1328,6 +1604,15 @@ private:
       }
     }
     *bfbin << uint8_t(BINOUT_COL_NONE);
+
+    // Report how much memory Byfl itself consumed.
+    uint64_t arena_mapped, arena_in_use, arena_peak;
+    bf_arena_usage(&arena_mapped, &arena_in_use, &arena_peak);
+    *bfbin << uint8_t(BINOUT_TABLE_KEYVAL) << "Byfl memory"
+           << uint8_t(BINOUT_COL_UINT64) << "Bytes mapped" << arena_mapped
+           << uint8_t(BINOUT_COL_UINT64) << "Bytes in use" << arena_in_use
+           << uint8_t(BINOUT_COL_UINT64) << "Peak bytes in use" << arena_peak
+           << uint8_t(BINOUT_COL_NONE);
   }
 
 public:
@@ -1338,16 +1623,38 @@ public:
   ~RunAtEndOfProgram() {
     // Do nothing if our output is suppressed.
     bf_initialize_if_necessary();
-    if (suppress_output() || bf_abnormal_exit)
+    if (bf_reduce_silenced() || suppress_output() || bf_abnormal_exit)
       return;
 
+    // Analyze all threads' remaining memory accesses then merge all
+    // threads' private data into the global data.
+    bf_finish_access_trace();
+    bf_merge_thread_shards();
+    if (bf_call_stack)
+      record_call_contexts();
+
     // Complete the basic-block table.
     finalize_bblocks();
 
+    // Publish the final live counters, if any.
+    bf_finish_live();
+
     // Report the number of times each basic block was executed.
     if (bf_every_bb)
       bf_report_bb_execution();
 
+    // Report how the counters evolved over time.
+    if (bf_timeline_interval > 0)
+      bf_report_timeline();
+
+    // Extrapolate the sampled counters to the entire run.
+    if (bf_sample_period > 0)
+      bf_report_sampling();
+
+    // Report per-thread and per-parallel-region counter totals.
+    if (bf_thread_shards)
+      bf_report_thread_counters();
+
     // Report per-function counter totals.
     uint64_t uninstrumented_calls = 0;
     if (bf_per_func)
@@ -1381,9 +1688,22 @@ public:
     if (bf_cache_model)
       report_cache(global_totals);
 
+    // Report the counters reduced across all processes, if any.
+    bf_report_reduction();
+
+    // Report how much time Byfl's own analyses consumed.
+    if (bf_overhead_period > 0)
+      bf_report_overhead();
+
     // Report anything else we can think to report.
     report_misc_info();
 
+    // Tell the user how much memory Byfl needed for its bookkeeping.
+    uint64_t arena_mapped, arena_in_use, arena_peak;
+    bf_arena_usage(&arena_mapped, &arena_in_use, &arena_peak);
+    *bfout << "BYFL_INFO: Byfl's internal data structures occupied at most "
+           << arena_peak << " bytes (" << arena_mapped << " bytes mapped)\n";
+
     // Tell the user where to look for more information.
     if (bfbin_filename != "")
       *bfout << "BYFL_INFO: More detailed counter data was written to " << bfbin_filename << '\n';
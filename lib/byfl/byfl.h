@@ -13,6 +13,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <inttypes.h>
 #include <iomanip>
 #include <iostream>
@@ -35,8 +36,12 @@ namespace bytesflops {
 }
 
 #include "byfl-common.h"
+#include "arena.h"
+#include "overhead.h"
+#include "reduction.h"
 #include "cachemap.h"
 #include "pagetable.h"
+#include "hyperloglog.h"
 #include "binaryoutput.h"
 
 // The following constants are defined by the instrumented code.
@@ -47,6 +52,8 @@ extern uint64_t bf_bb_merge;         // Number of basic blocks to merge to compr
 extern uint8_t  bf_call_stack;       // 1=maintain a function call stack
 extern uint8_t  bf_every_bb;         // 1=tally and output per-basic-block data
 extern uint64_t bf_max_reuse_distance;  // Maximum reuse distance to consider */
+extern uint64_t bf_reuse_engine;     // Data structure to use for computing reuse distance (BF_RD_ENGINE_*)
+extern uint64_t bf_reuse_sample_threshold;  // Sample addresses whose hash lies below this (out of BF_REUSE_SAMPLE_MODULUS)
 extern const char* bf_option_string; // -bf-* command-line options
 extern uint8_t  bf_per_func;         // 1=tally and output per-function data
 extern uint8_t  bf_mem_footprint;    // 1=keep track of how many times each byte of memory is accessed
@@ -54,16 +61,62 @@ extern uint8_t  bf_tally_inst_mix;   // 1=maintain instruction-mix histogram
 extern uint8_t  bf_tally_inst_deps;  // 1=maintain instruction-dependency histogram
 extern uint8_t  bf_types;            // 1=count loads/stores per type
 extern uint8_t  bf_unique_bytes;     // 1=tally and output unique bytes
+extern uint8_t  bf_unique_bytes_approx;  // 1=estimate unique bytes with HyperLogLog sketches
 extern uint8_t  bf_vectors;          // 1=bin then output vector characteristics
 extern uint8_t  bf_cache_model;      // 1=use the simple cache model
 extern uint8_t  bf_data_structs;     // 1=tally and output counters by data structure
 extern uint8_t  bf_strides;          // 1=tally and output information about access strides
 extern uint64_t bf_line_size;        // cache line size in bytes
 extern uint64_t bf_max_set_bits;     // log base 2 of max number of sets to model
+extern uint64_t bf_max_ways;         // max number of lines per set to model
+extern const char* bf_cache_config;  // cache hierarchy to model ("" for none)
+extern uint64_t bf_cache_policy;     // inclusion policy of the cache hierarchy (BF_CACHE_*)
+extern uint8_t  bf_thread_shards;    // 1=give each thread private counters
+extern uint8_t  bf_batch_accesses;   // 1=buffer memory accesses and analyze them in batches
+extern uint64_t bf_timeline_interval;  // Milliseconds between counter snapshots (0=none)
+extern uint64_t bf_sample_burst;     // Function calls per counted burst
+extern uint64_t bf_sample_period;    // Function calls per sampling period (0=don't sample)
 
 // The following globals are defined by the instrumented code.
 extern uint64_t bf_fmap_cnt;
 
+// A variant of the run-time library specialized for a particular set of
+// -bf-* options (see BYFL_SPECIALIZED_RUNTIMES in CMakeLists.txt) replaces
+// the options that gate its hot paths with compile-time constants.  The
+// compiler can then discard the code for disabled features and the checks
+// for enabled ones.  initialize_specialization() verifies that the
+// instrumented code agrees with the constants.
+#ifdef BF_SPECIALIZED
+# define bf_every_bb       uint8_t(BF_SPEC_EVERY_BB)
+# define bf_per_func       uint8_t(BF_SPEC_PER_FUNC)
+# define bf_call_stack     uint8_t(BF_SPEC_CALL_STACK)
+# define bf_unique_bytes   uint8_t(BF_SPEC_UNIQUE_BYTES)
+# define bf_cache_model    uint8_t(BF_SPEC_CACHE_MODEL)
+# define bf_types          uint8_t(BF_SPEC_TYPES)
+# define bf_tally_inst_mix uint8_t(BF_SPEC_INST_MIX)
+#endif
+
+// The following per-thread memory-access trace is defined in
+// access-trace.cpp.
+extern __thread bf_trace_entry_t* bf_access_trace;
+extern __thread uint64_t bf_access_trace_len;
+
+// The following per-basic-block counters are defined in basicblocks.cpp.
+// Each thread maintains its own copy.
+extern __thread uint64_t  bf_load_count;
+extern __thread uint64_t  bf_store_count;
+extern __thread uint64_t* bf_mem_insts_count;
+extern __thread uint64_t* bf_inst_mix_histo;
+extern __thread uint64_t* bf_terminator_count;
+extern __thread uint64_t* bf_mem_intrin_count;
+extern __thread uint64_t  bf_load_ins_count;
+extern __thread uint64_t  bf_store_ins_count;
+extern __thread uint64_t  bf_call_ins_count;
+extern __thread uint64_t  bf_flop_count;
+extern __thread uint64_t  bf_fp_bits_count;
+extern __thread uint64_t  bf_op_count;
+extern __thread uint64_t  bf_op_bits_count;
+
 // The following function is expected to be overridden by user code.
 extern "C" {
   extern const char* bf_categorize_counters (void);   // Return a category in which to partition data.
@@ -72,25 +125,76 @@ extern "C" {
 namespace bytesflops {
   const bytecount_t bf_max_bytecount = ~(bytecount_t)(0);  // Clamp to this value
   typedef pair<bytecount_t, uint64_t> bf_addr_tally_t;  // Number of times a count was seen ({count, multiplier})
+  typedef void (*shard_merger_t)(void*);  // Function that merges a thread's private data into the global data
+
+  // Describe one level of a modeled cache hierarchy and how it performed.
+  typedef struct {
+    string name;          // Name of the level (e.g., "L1")
+    uint64_t capacity;    // Capacity in bytes
+    uint64_t ways;        // Associativity
+    uint64_t line_size;   // Line size in bytes
+    uint64_t sets;        // Number of sets
+    uint64_t accesses;    // Number of lines looked up in this level
+    uint64_t hits;        // Number of lookups that found the line
+    uint64_t misses;      // Number of lookups that did not find the line
+    uint64_t evictions;   // Number of lines evicted to make room for others
+  } bf_cache_level_t;
 
   // The following library functions are used in files other than the
   // one in which they're defined.
   extern void bf_get_address_tally_hist (vector<bf_addr_tally_t>& histogram, uint64_t* total);
   extern void bf_get_median_reuse_distance(uint64_t* median_value, uint64_t* mad_value);
   extern void bf_get_reuse_distance(vector<uint64_t>** hist, uint64_t* unique_addrs);
+  extern double bf_get_reuse_distance_scale(void);
   extern void bf_get_vector_statistics(const char* tag, uint64_t* num_ops, uint64_t* total_elts, uint64_t* total_bits);
   extern void bf_get_vector_statistics(uint64_t* num_ops, uint64_t* total_elts, uint64_t* total_bits);
   extern void bf_abend(void) __attribute__ ((noreturn));
   extern void bf_report_vector_operations(void);
   extern void bf_report_data_struct_counts(void);
   extern void bf_report_bb_execution(void);
+  extern void bf_report_timeline(void);
+  extern void bf_report_sampling(void);
+  extern void bf_report_overhead(void);
+  extern void bf_publish_live_counters(void);
+  extern void bf_finish_live(void);
+  extern void bf_report_reduction(void);
+  extern void bf_report_thread_counters(void);
+  extern void bf_enter_parallel_region(const void* region);
+  extern void bf_leave_parallel_region(void);
+  extern bool bf_reduce_silenced(void);
+  extern void bf_sample_counting(bool enable);
+  extern void bf_get_inst_deps(vector<pair<bf_inst_deps_t, uint64_t>>& histogram);
+  extern void bf_drain_pending_bblocks(void);
+  extern bool bf_user_categorizes_counters(void);
   extern void bf_partition_unique_addresses(uint64_t* uti, uint64_t *mti);
   extern void bf_report_strides_by_call_point(void);
   extern uint64_t bf_tally_unique_addresses(const char* funcname);
   extern uint64_t bf_tally_unique_addresses_tb(const char* funcname);
   extern uint64_t bf_tally_unique_addresses_tb(void);
   extern uint64_t bf_tally_unique_addresses(void);
+  extern uint64_t bf_unique_addresses_error(uint64_t tally);
   extern "C" const char* bf_string_to_symbol(const char *nonunique);
+  extern "C" void bf_assoc_addresses_with_prog(uint64_t baseaddr, uint64_t numaddrs);
+  extern "C" void bf_assoc_addresses_with_prog_tb(uint64_t baseaddr, uint64_t numaddrs);
+  extern "C" void bf_assoc_addresses_with_func(const char* funcname, uint64_t baseaddr, uint64_t numaddrs);
+  extern "C" void bf_assoc_addresses_with_func_tb(const char* funcname, uint64_t baseaddr, uint64_t numaddrs);
+  extern "C" void bf_reuse_dist_addrs_prog(uint64_t baseaddr, uint64_t numaddrs);
+  extern void bf_touch_cache(uint64_t baseaddr, uint64_t numaddrs);
+  extern void bf_touch_cache(void* context, uint64_t baseaddr, uint64_t numaddrs);
+  extern void* bf_get_cache_context(void);
+  extern void bf_finish_access_trace(void);
+  extern void bf_flush_access_trace(void);
+  extern "C" void bf_initialize_if_necessary(void);
+  extern "C" void bf_acquire_mega_lock(void);
+  extern "C" void bf_release_mega_lock(void);
+  extern void bf_register_thread_shard(shard_merger_t merger, void* shard);
+  extern void bf_merge_thread_shards(void);
+  extern void initialize_access_trace(void);
+  extern void initialize_timeline(void);
+  extern void initialize_sampling(void);
+  extern void initialize_overhead(void);
+  extern void initialize_live(void);
+  extern void initialize_specialization(void);
   extern void initialize_byfl(void);
   extern void initialize_bblocks(void);
   extern void initialize_reuse(void);
@@ -102,6 +206,13 @@ namespace bytesflops {
   extern void initialize_data_structures(void);
   extern void initialize_strides(void);
   extern void initialize_cache(void);
+  extern void initialize_thread_access_trace(void);
+  extern void initialize_thread_byfl(void);
+  extern void initialize_thread_bblocks(void);
+  extern void initialize_thread_ubytes(void);
+  extern void initialize_thread_tallybytes(void);
+  extern void initialize_thread_inst_deps(void);
+  extern void initialize_thread_data_structures(void);
   extern void finalize_bblocks(void);
   extern uint64_t bf_get_private_cache_accesses(void);
   extern vector<unordered_map<uint64_t,uint64_t> > bf_get_private_cache_hits(void);
@@ -112,18 +223,20 @@ namespace bytesflops {
   extern uint64_t bf_get_shared_cold_misses(void);
   extern uint64_t bf_get_shared_misaligned_mem_ops(void);
   extern vector<unordered_map<uint64_t,uint64_t> > bf_get_remote_shared_cache_hits(void);
+  extern vector<vector<unordered_map<uint64_t,uint64_t> > > bf_get_remote_shared_cache_hits_by_thread(void);
+  extern vector<bf_cache_level_t> bf_get_cache_hierarchy(void);
   extern bool suppress_output(void);
+  extern const char* bf_func_and_parents(void);
 
   // The following library variables are used in files other than the
   // one in which they're defined.
-  extern const char* bf_func_and_parents;   // Name of the current function and its parents
   extern string bf_output_prefix;           // Prefix appearing before each line of output
   extern const char* opcode2name[];         // Map from an LLVM opcode to its name
-  extern KeyType_t bf_func_and_parents_id;  // Top of the complete_call_stack stack
+  extern __thread KeyType_t bf_func_and_parents_id;  // Top of the complete_call_stack stack
   extern bool bf_suppress_counting;         // Whether to update Byfl data structures
 
   // Encapsulate of all of our basic-block counters into a single structure.
-  class ByteFlopCounters {
+  class ByteFlopCounters : public ArenaAllocated {
   public:
     uint64_t mem_insts[NUM_MEM_INSTS];  // Number of memory instructions by type
     uint64_t inst_mix_histo[NUM_LLVM_OPCODES];   // Histogram of instruction mix
@@ -196,7 +309,8 @@ namespace bytesflops {
 
 // Define datatypes for tracking basic blocks on a per-function basis.
 typedef const char* MapKey_t;
-typedef CachedUnorderedMap<KeyType_t, ByteFlopCounters*> key2bfc_t;
+typedef CachedFlatMap<KeyType_t, ByteFlopCounters*> key2bfc_t;
+typedef vector<ByteFlopCounters*> id2bfc_t;
 typedef CachedUnorderedMap<MapKey_t, ByteFlopCounters*> str2bfc_t;
 typedef str2bfc_t::iterator counter_iterator;
 
@@ -204,7 +318,13 @@ typedef str2bfc_t::iterator counter_iterator;
 // which they're defined.
 extern ByteFlopCounters global_totals;    // Global tallies of all of our counters
 extern key2bfc_t& per_func_totals(void);
+extern vector<KeyType_t>& func_id_to_key(void);
+extern string bf_func_key_to_name(KeyType_t key);
 extern str2bfc_t& user_defined_totals(void);
+extern void bf_snapshot_totals(ByteFlopCounters& totals);
+extern void bf_snapshot_func_totals(function<void(KeyType_t, const ByteFlopCounters&)> visit);
+extern ByteFlopCounters* bf_new_thread_tallies(void);
+extern volatile uint8_t bf_live_due;      // Nonzero when the live counters should be republished
 
 }
 
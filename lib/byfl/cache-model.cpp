@@ -9,6 +9,7 @@
 #include <thread>
 #include <mutex>
 #include <fstream>
+#include <memory>
 
 #include "byfl.h"
 
@@ -18,166 +19,591 @@ static __thread unsigned cache_id = 0;
 using namespace bytesflops;
 using namespace std;
 
+// A PaddedMutex is a mutex that occupies its own cache line so that an
+// array of them can stripe locks over a cache model shared by all threads
+// without false sharing among the locks themselves.
+struct PaddedMutex {
+  mutex lock;
+  char pad[64 - sizeof(mutex)%64];
+};
+
+// A CacheStats holds one thread's view of a cache's performance.
+struct CacheStats {
+  uint64_t accesses;
+  uint64_t misaligned_mem_ops;  // Number of loads and stores resulting in misaligned cache accesses
+  uint64_t cold_misses;
+  unsigned thread_id;           // Thread that made the accesses
+  // for each set count, the number of hits at each LRU search distance
+  vector<vector<uint64_t> > hits;
+  // ditto, but only for lines last accessed by a different thread
+  vector<vector<uint64_t> > remote_hits;
+
+  CacheStats(uint64_t max_set_bits, uint64_t max_ways) :
+    accesses{0}, misaligned_mem_ops{0}, cold_misses{0}, thread_id{cache_id},
+    hits(max_set_bits, vector<uint64_t>(max_ways + 1, 0)),
+    remote_hits(max_set_bits, vector<uint64_t>(max_ways + 1, 0)) {
+  }
+};
+
 class Cache {
   public:
-    void access(uint64_t baseaddr, uint64_t numaddrs);
-    Cache(uint64_t line_size, uint64_t max_set_bits, bool record_thread_id) :
-      line_size_{line_size}, accesses_{0}, misaligned_mem_ops_{0},
-      log2_line_size_{0}, max_set_bits_{max_set_bits}, cold_misses_{0},
-      hits_(max_set_bits_), record_thread_id_{record_thread_id},
-      remote_hits_(max_set_bits_) {
+    // Access the cache, tallying performance in either the cache's own
+    // statistics or the calling thread's statistics.  The latter must be
+    // used if the cache is shared.
+    void access(uint64_t baseaddr, uint64_t numaddrs) { access(baseaddr, numaddrs, stats_); }
+    void access(uint64_t baseaddr, uint64_t numaddrs, CacheStats& stats);
+    Cache(uint64_t line_size, uint64_t max_set_bits, uint64_t max_ways,
+          bool shared) :
+      line_size_{line_size}, log2_line_size_{0},
+      max_set_bits_{max_set_bits}, max_ways_{max_ways}, shared_{shared},
+      sets_(max_set_bits_), stats_(max_set_bits, max_ways) {
         auto lsize = line_size_;
         while(lsize >>= 1) ++log2_line_size_;
+        for(uint64_t set_bits = 0; set_bits < max_set_bits_; ++set_bits)
+          sets_[set_bits].resize(uint64_t(1) << set_bits);
+        if(shared_){
+          for(uint64_t set_bits = 0; set_bits < max_set_bits_; ++set_bits)
+            set_locks_.emplace_back(new PaddedMutex[num_set_locks(set_bits)]);
+          touched_locks_.reset(new PaddedMutex[num_touched_shards]);
+        }
+        for(uint64_t shard = 0; shard < (shared_ ? num_touched_shards : 1); ++shard)
+          touched_lines_.emplace_back(new BitPageTable(touched_page_lines));
     }
-    uint64_t getAccesses() const { return accesses_; }
-    vector<unordered_map<uint64_t,uint64_t> > getHits() const { return hits_; }
-    uint64_t getColdMisses() const { return cold_misses_; }
-    uint64_t getMisalignedMemOps() const { return misaligned_mem_ops_; }
-    int getRightMatch(uint64_t a, uint64_t b);
-    vector<unordered_map<uint64_t,uint64_t> > getRemoteHits() const { return remote_hits_; }
+    const CacheStats& getStats() const { return stats_; }
+    uint64_t getMaxSetBits() const { return max_set_bits_; }
+    uint64_t getMaxWays() const { return max_ways_; }
 
   private:
-    vector<uint64_t> lines_; // back is mru, front is lru
+    // One way of one set: the line it holds and the thread that last
+    // accessed that line.
+    struct Way {
+      uint64_t line;
+      unsigned thread_id;
+    };
+    typedef vector<Way, ArenaAllocator<Way> > recency_list_t;  // front is mru, back is lru
+
+    // A shared cache stripes its locks across the sets for each set count
+    // and shards its set of touched lines by page.
+    static const uint64_t max_set_locks = 256;
+    static const uint64_t num_touched_shards = 64;
+    static const uint64_t touched_page_lines = 4096;
+    static uint64_t num_set_locks(uint64_t set_bits) {
+      return min(uint64_t(1) << set_bits, max_set_locks);
+    }
+
+    uint64_t touch_lines(uint64_t first_line, uint64_t num_lines);
+    bool touch_line(uint64_t line) { return touch_lines(line, 1) == 1; }
+    void access_line(uint64_t line, CacheStats& stats);
+    void access_lines(uint64_t first_line, uint64_t num_lines, CacheStats& stats);
+    bool update_set(recency_list_t& ways, uint64_t line, uint64_t set_bits,
+                    bool searching, CacheStats& stats);
+
     uint64_t line_size_;
-    uint64_t accesses_;
-    uint64_t misaligned_mem_ops_;  // Number of loads and stores resulting in misaligned cache accesses
     uint64_t log2_line_size_; // log base 2 of line size
     uint64_t max_set_bits_; // log base 2 of max number of sets
-    uint64_t cold_misses_;
-    // for each set count, a map of distance to access count
-    vector<unordered_map<uint64_t,uint64_t> > hits_;  // back is lru, front is mru
-    bool record_thread_id_;
-    // associate thread id with each line in cache. only used if record_thread_id_.
-    vector<unsigned> thread_ids_;
-    // for each set count, a map of distance to access count
-    vector<unordered_map<uint64_t,uint64_t> > remote_hits_;  // back is lru, front is mru
+    uint64_t max_ways_;     // maximum associativity to model
+    bool shared_;           // true=accessed concurrently by multiple threads
+    // for each set count, the recency list of each set
+    vector<vector<recency_list_t> > sets_;
+    vector<unique_ptr<PaddedMutex[]> > set_locks_;   // for each set count, striped locks over sets
+    vector<unique_ptr<BitPageTable> > touched_lines_;  // every line ever accessed, sharded
+    unique_ptr<PaddedMutex[]> touched_locks_;  // one lock per shard of touched_lines_
+    CacheStats stats_;      // statistics of an unshared cache
 };
 
-inline int Cache::getRightMatch(uint64_t a, uint64_t b){
-  // number of 0s, counting from left, ignoring all line bits.
-  // also need to mask off all bits higher than max_set_bits_.
-  auto diff_bits = ((a ^ b) >> log2_line_size_) | (1 << (max_set_bits_ - 1));
-  return __builtin_ctzll(diff_bits);
-}
-
-void Cache::access(uint64_t baseaddr, uint64_t numaddrs){
-  uint64_t num_accesses = 0; // running total of number of lines accessed
-  for(uint64_t addr = baseaddr / line_size_ * line_size_;
-      addr <= (baseaddr + numaddrs - 1) / line_size_ * line_size_;
-      addr += line_size_){
-    ++num_accesses;
-    bool found = false;
-    unsigned last_thread = 0;
-    vector<uint64_t> right_match_tally(max_set_bits_, 0);
-    for(int line_idx = lines_.size() - 1; line_idx >= 0; --line_idx){
-      auto& line = lines_[line_idx];
-      int right_match = getRightMatch(addr, line); // returns 0 <= val = max_set_bits_
-      ++right_match_tally[right_match];
-      if(addr == line){
-        found = true;
-        // erase this line.
-        lines_.erase(begin(lines_) + line_idx);
-        if(record_thread_id_){
-          last_thread = thread_ids_[line_idx];
-          thread_ids_.erase(begin(thread_ids_) + line_idx);
-        }
+const uint64_t Cache::max_set_locks;
+const uint64_t Cache::num_touched_shards;
+const uint64_t Cache::touched_page_lines;
+
+// Convert per-set-count tallies of LRU search distances to maps from
+// distance to tally, omitting zero tallies.
+static vector<unordered_map<uint64_t,uint64_t> >
+tallies_to_maps(const vector<vector<uint64_t> >& tallies){
+  vector<unordered_map<uint64_t,uint64_t> > maps(tallies.size());
+  for(size_t set_bits = 0; set_bits < tallies.size(); ++set_bits){
+    const auto& tally = tallies[set_bits];
+    for(size_t dist = 0; dist < tally.size(); ++dist)
+      if(tally[dist] > 0)
+        maps[set_bits][dist] = tally[dist];
+  }
+  return maps;
+}
+
+// Add one set of per-set-count tallies to another.
+static void add_tallies(vector<vector<uint64_t> >& sum,
+                        const vector<vector<uint64_t> >& tallies){
+  for(size_t set_bits = 0; set_bits < tallies.size(); ++set_bits)
+    for(size_t dist = 0; dist < tallies[set_bits].size(); ++dist)
+      sum[set_bits][dist] += tallies[set_bits][dist];
+}
+
+// Record that a range of lines has been accessed.  Return the number of
+// lines in the range being accessed for the first time.
+uint64_t Cache::touch_lines(uint64_t first_line, uint64_t num_lines){
+  if(!shared_)
+    return touched_lines_[0]->access(first_line, num_lines);
+  uint64_t new_lines = 0;
+  while(num_lines > 0){
+    // Lock only the shard holding the page of lines we're touching.
+    uint64_t page = first_line / touched_page_lines;
+    uint64_t page_lines = min(num_lines, (page + 1)*touched_page_lines - first_line);
+    uint64_t shard = page % num_touched_shards;
+    lock_guard<mutex> guard(touched_locks_[shard].lock);
+    new_lines += touched_lines_[shard]->access(first_line, page_lines);
+    first_line += page_lines;
+    num_lines -= page_lines;
+  }
+  return new_lines;
+}
+
+// Make a line the mru line of a set, evicting the lru line if necessary.
+// If searching, first look for the line in the set and tally a hit if it's
+// found.  Return true on a hit.  The caller must hold the set's lock.
+//
+// A caller that isn't searching already knows the access is a miss, but
+// in a shared cache another thread may have inserted the same line since
+// then.  We therefore look for the line anyway and, if it's present, move
+// it rather than insert a duplicate, which would corrupt the LRU order.
+bool Cache::update_set(recency_list_t& ways, uint64_t line, uint64_t set_bits,
+                       bool searching, CacheStats& stats){
+  size_t pos = ways.size();
+  if(searching || shared_){
+    for(pos = 0; pos < ways.size(); ++pos)
+      if(ways[pos].line == line)
         break;
-      }
+    if(searching && pos < ways.size()){
+      // Hit -- tally the 1-based LRU search distance.
+      ++stats.hits[set_bits][pos + 1];
+      if(ways[pos].thread_id != stats.thread_id)
+        ++stats.remote_hits[set_bits][pos + 1];
     }
+  }
+  bool hit = searching && pos < ways.size();
+  if(pos == ways.size()){
+    // Miss -- make room for the line, evicting the lru line if necessary.
+    if(ways.size() < max_ways_)
+      ways.emplace_back();
+    pos = ways.size() - 1;
+  }
 
-    if(found){
-      // rolling sum of right match tally for reuse dists
-      uint64_t sum = 0;
-      for(auto tally = right_match_tally.rbegin();
-          tally != right_match_tally.rend();
-          ++tally){
-        *tally += sum;
-        sum = *tally;
-      }
-      for(uint64_t set = 0; set < max_set_bits_; ++set){
-        auto idx = right_match_tally[set];
-        ++hits_[set][idx];
-        if(record_thread_id_ &&
-           last_thread != cache_id){
-          ++remote_hits_[set][idx];
-        }
-      }
-    } else {
-      ++cold_misses_;
+  // Move the line to the mru position.
+  move_backward(begin(ways), begin(ways) + pos, begin(ways) + pos + 1);
+  ways[0].line = line;
+  ways[0].thread_id = stats.thread_id;
+  return hit;
+}
+
+// Access a single line for every modeled set count.  A set with 2^s sets
+// groups lines by their low s line-number bits; each set is an LRU list
+// of at most max_ways_ lines.  Because the sets for s+1 set bits
+// partition those for s set bits, a line missing from a set for some set
+// count is also missing from all sets for fewer set bits.  We therefore
+// search from the most to the fewest sets and stop searching once the line
+// is not found.  In a shared cache, each set is locked only while it is
+// being updated, so concurrent accesses to different sets proceed in
+// parallel.
+void Cache::access_line(uint64_t line, CacheStats& stats){
+  bool searching = true;
+  if(touch_line(line)){
+    ++stats.cold_misses;
+    searching = false;
+  }
+  for(int set_bits = max_set_bits_ - 1; set_bits >= 0; --set_bits){
+    uint64_t set = line & ((uint64_t(1) << set_bits) - 1);
+    auto& ways = sets_[set_bits][set];
+    mutex* lock = nullptr;
+    if(shared_){
+      lock = &set_locks_[set_bits][set % num_set_locks(set_bits)].lock;
+      lock->lock();
     }
+    searching = update_set(ways, line, set_bits, searching, stats);
+    if(lock != nullptr)
+      lock->unlock();
+  }
+}
 
-    // move up this address to mru position
-    lines_.push_back(addr);
-    if(record_thread_id_){
-      thread_ids_.push_back(cache_id);
+// Access a contiguous range of lines for every modeled set count.  The
+// lines that map to a given set reach it in increasing order regardless
+// of what happens to the other sets, so we can update one set at a time.
+// Once a set has seen max_ways_ lines from the range it holds exactly
+// those lines, so every subsequent line from the range must miss.  We
+// therefore search only for the first max_ways_ lines that map to each
+// set and then fill the set with the last max_ways_ such lines.  This
+// makes the cost of a huge memset() or memcpy() proportional to the number
+// of sets rather than to the number of lines.
+void Cache::access_lines(uint64_t first_line, uint64_t num_lines,
+                         CacheStats& stats){
+  stats.cold_misses += touch_lines(first_line, num_lines);
+  for(uint64_t set_bits = 0; set_bits < max_set_bits_; ++set_bits){
+    uint64_t num_sets = uint64_t(1) << set_bits;
+    uint64_t end_line = first_line + min(num_lines, num_sets);
+    for(uint64_t line = first_line; line < end_line; ++line){
+      uint64_t set = line & (num_sets - 1);
+      uint64_t set_lines = (num_lines - 1 - (line - first_line))/num_sets + 1;
+      auto& ways = sets_[set_bits][set];
+      mutex* lock = nullptr;
+      if(shared_){
+        lock = &set_locks_[set_bits][set % num_set_locks(set_bits)].lock;
+        lock->lock();
+      }
+      uint64_t searched = min(set_lines, max_ways_);
+      for(uint64_t i = 0; i < searched; ++i)
+        (void) update_set(ways, line + i*num_sets, set_bits, true, stats);
+      if(set_lines > max_ways_)
+        // Guaranteed misses -- the set ends up holding the last lines, mru
+        // first.
+        for(uint64_t pos = 0; pos < max_ways_; ++pos){
+          ways[pos].line = line + (set_lines - 1 - pos)*num_sets;
+          ways[pos].thread_id = stats.thread_id;
+        }
+      if(lock != nullptr)
+        lock->unlock();
     }
   }
+}
+
+void Cache::access(uint64_t baseaddr, uint64_t numaddrs, CacheStats& stats){
+  uint64_t first_line = baseaddr >> log2_line_size_;
+  uint64_t last_line = (baseaddr + numaddrs - 1) >> log2_line_size_;
+  uint64_t num_accesses = last_line - first_line + 1;  // number of lines accessed
+  if(num_accesses > max_ways_)
+    // Long range (e.g., from memcpy()) -- process it a set at a time.
+    access_lines(first_line, num_accesses, stats);
+  else
+    for(uint64_t line = first_line; line <= last_line; ++line)
+      access_line(line, stats);
 
   // we've made all our accesses
-  accesses_ += num_accesses;
+  stats.accesses += num_accesses;
   uint64_t expected_accesses = (numaddrs + line_size_ - 1)/line_size_;
   if (num_accesses != expected_accesses)
-    ++misaligned_mem_ops_;
+    ++stats.misaligned_mem_ops;
+}
+
+// A CacheLevel models one level of a set-associative cache hierarchy with
+// LRU replacement.
+class CacheLevel {
+  public:
+    CacheLevel(const bf_cache_level_t& geometry) :
+      stats_(geometry), log2_line_size_{0},
+      tags_(geometry.sets*geometry.ways), fill_(geometry.sets, 0) {
+        auto lsize = stats_.line_size;
+        while(lsize >>= 1) ++log2_line_size_;
+    }
+    const bf_cache_level_t& getStats() const { return stats_; }
+    uint64_t getLineSize() const { return stats_.line_size; }
+    uint64_t getLogLineSize() const { return log2_line_size_; }
+
+    // Look up a line, making it the mru line of its set if found.
+    bool lookup(uint64_t line);
+
+    // Insert a line not already present as the mru line of its set.
+    // Return true and the evicted line if another line had to be evicted.
+    bool insert(uint64_t line, uint64_t* victim);
+
+    // Remove a line if present.  Return true if it was present.
+    bool remove(uint64_t line);
+
+  private:
+    bf_cache_level_t stats_;   // Geometry and performance
+    uint64_t log2_line_size_;  // log base 2 of line size
+    vector<uint64_t, ArenaAllocator<uint64_t> > tags_;    // for each set, ways lines with mru first
+    vector<uint32_t> fill_;    // number of valid lines in each set
+
+    // Return a pointer to the first way of the set containing a line.
+    uint64_t* set_of(uint64_t line) {
+      return &tags_[(line % stats_.sets)*stats_.ways];
+    }
+    uint32_t& fill_of(uint64_t line) { return fill_[line % stats_.sets]; }
+};
+
+bool CacheLevel::lookup(uint64_t line){
+  ++stats_.accesses;
+  uint64_t* ways = set_of(line);
+  uint32_t fill = fill_of(line);
+  for(uint32_t pos = 0; pos < fill; ++pos)
+    if(ways[pos] == line){
+      move_backward(ways, ways + pos, ways + pos + 1);
+      ways[0] = line;
+      ++stats_.hits;
+      return true;
+    }
+  ++stats_.misses;
+  return false;
+}
+
+bool CacheLevel::insert(uint64_t line, uint64_t* victim){
+  uint64_t* ways = set_of(line);
+  uint32_t& fill = fill_of(line);
+  bool evicted = false;
+  if(fill == stats_.ways){
+    *victim = ways[fill - 1];
+    evicted = true;
+    ++stats_.evictions;
+  }
+  else
+    ++fill;
+  move_backward(ways, ways + fill - 1, ways + fill);
+  ways[0] = line;
+  return evicted;
+}
+
+bool CacheLevel::remove(uint64_t line){
+  uint64_t* ways = set_of(line);
+  uint32_t& fill = fill_of(line);
+  for(uint32_t pos = 0; pos < fill; ++pos)
+    if(ways[pos] == line){
+      move(ways + pos + 1, ways + fill, ways + pos);
+      --fill;
+      return true;
+    }
+  return false;
+}
+
+// A CacheHierarchy models a sequence of CacheLevels, ordered from the
+// level closest to the processor to the level closest to memory.
+class CacheHierarchy {
+  public:
+    CacheHierarchy(const vector<bf_cache_level_t>& geometry, uint64_t policy) :
+      policy_{policy} {
+        for(const auto& level : geometry)
+          levels_.push_back(CacheLevel(level));
+    }
+    void access(uint64_t baseaddr, uint64_t numaddrs);
+    const vector<CacheLevel>& getLevels() const { return levels_; }
+
+  private:
+    uint64_t policy_;            // BF_CACHE_INCLUSIVE or BF_CACHE_EXCLUSIVE
+    vector<CacheLevel> levels_;  // All levels, closest to the processor first
+
+    void access_inclusive(uint64_t addr);
+    void access_exclusive(uint64_t addr);
+};
+
+// Access one address in an inclusive hierarchy.  Lines are filled into
+// every level that missed, and a line evicted from a level is also
+// invalidated in all levels above it.
+void CacheHierarchy::access_inclusive(uint64_t addr){
+  size_t num_levels = levels_.size();
+  size_t hit_level;
+  for(hit_level = 0; hit_level < num_levels; ++hit_level){
+    auto& level = levels_[hit_level];
+    if(level.lookup(addr >> level.getLogLineSize()))
+      break;
+  }
+  for(size_t lvl = hit_level; lvl-- > 0; ){
+    auto& level = levels_[lvl];
+    uint64_t victim;
+    if(!level.insert(addr >> level.getLogLineSize(), &victim))
+      continue;
+    // Back-invalidate the victim's bytes in all levels above this one.
+    uint64_t first_byte = victim << level.getLogLineSize();
+    uint64_t last_byte = first_byte + level.getLineSize() - 1;
+    for(size_t inner = 0; inner < lvl; ++inner){
+      auto& inner_level = levels_[inner];
+      uint64_t shift = inner_level.getLogLineSize();
+      for(uint64_t line = first_byte >> shift; line <= last_byte >> shift; ++line)
+        inner_level.remove(line);
+    }
+  }
+}
+
+// Access one address in an exclusive hierarchy.  A line found below the
+// first level is moved to the first level, and each level's victim is
+// demoted to the next level.
+void CacheHierarchy::access_exclusive(uint64_t addr){
+  uint64_t line = addr >> levels_[0].getLogLineSize();
+  size_t num_levels = levels_.size();
+  size_t hit_level;
+  for(hit_level = 0; hit_level < num_levels; ++hit_level)
+    if(levels_[hit_level].lookup(line))
+      break;
+  if(hit_level == 0)
+    return;
+  if(hit_level < num_levels)
+    levels_[hit_level].remove(line);
+  uint64_t victim = line;
+  for(size_t lvl = 0; lvl < num_levels; ++lvl)
+    if(!levels_[lvl].insert(victim, &victim))
+      break;
+}
+
+void CacheHierarchy::access(uint64_t baseaddr, uint64_t numaddrs){
+  uint64_t line_size = levels_[0].getLineSize();
+  for(uint64_t addr = baseaddr / line_size * line_size;
+      addr <= (baseaddr + numaddrs - 1) / line_size * line_size;
+      addr += line_size)
+    if(policy_ == BF_CACHE_EXCLUSIVE)
+      access_exclusive(addr);
+    else
+      access_inclusive(addr);
 }
 
 namespace bytesflops{
 
-static __thread Cache* cache = nullptr;
+// A CacheContext holds everything the cache model maintains on behalf of
+// one thread.  The context can be updated by a thread other than its owner
+// as long as only one thread at a time does so.
+struct CacheContext {
+  Cache* cache;                    // The thread's private cache
+  CacheStats* global_cache_stats;  // The thread's view of global_cache
+  CacheHierarchy* hierarchy;       // The thread's cache hierarchy (null for none)
+};
+
+static __thread CacheContext* cache_context = nullptr;
 static vector<Cache*>* caches = nullptr;
 static Cache* global_cache = nullptr;
-static mutex cache_vector_mutex, global_cache_mutex;
+static vector<CacheStats*>* all_global_cache_stats = nullptr;  // Every thread's view of global_cache
+static mutex cache_vector_mutex;
 static unsigned thread_counter = 0;
+static vector<bf_cache_level_t> hierarchy_geometry;  // Cache hierarchy to model (empty for none)
+static vector<CacheHierarchy*>* hierarchies = nullptr;
+
+// Parse a size with an optional K, M, or G suffix.  Return 0 on error.
+static uint64_t parse_cache_size(const string& text){
+  char* suffix;
+  uint64_t value = strtoull(text.c_str(), &suffix, 10);
+  if(suffix == text.c_str())
+    return 0;
+  switch(toupper(*suffix)){
+    case 'G': value *= 1024;
+      /* Fall through. */
+    case 'M': value *= 1024;
+      /* Fall through. */
+    case 'K': value *= 1024;
+      suffix++;
+      break;
+    default:
+      break;
+  }
+  if(toupper(*suffix) == 'B')
+    suffix++;
+  return *suffix == '\0' ? value : 0;
+}
+
+// Parse bf_cache_config, a comma-separated list of
+// name:capacity:ways:line_size specifications, into hierarchy_geometry.
+static void parse_cache_config(void){
+  istringstream config(bf_cache_config);
+  string spec;
+  while(getline(config, spec, ',')){
+    istringstream fields(spec);
+    vector<string> field;
+    string one_field;
+    while(getline(fields, one_field, ':'))
+      field.push_back(one_field);
+    bf_cache_level_t level = bf_cache_level_t();
+    if(field.size() == 4){
+      level.name = field[0];
+      level.capacity = parse_cache_size(field[1]);
+      level.ways = parse_cache_size(field[2]);
+      level.line_size = parse_cache_size(field[3]);
+    }
+    if(level.capacity == 0 || level.ways == 0 || level.line_size == 0 ||
+       (level.line_size & (level.line_size - 1)) != 0 ||
+       level.capacity % (level.ways*level.line_size) != 0){
+      cerr << "Invalid cache level \"" << spec
+           << "\" (expected name:capacity:ways:line_size with a power-of-two line size dividing capacity/ways)\n";
+      bf_abend();
+    }
+    level.sets = level.capacity/(level.ways*level.line_size);
+    if(!hierarchy_geometry.empty()){
+      uint64_t prev_line_size = hierarchy_geometry.back().line_size;
+      if(bf_cache_policy == BF_CACHE_EXCLUSIVE ?
+         level.line_size != prev_line_size : level.line_size < prev_line_size){
+        cerr << "Cache level " << level.name
+             << (bf_cache_policy == BF_CACHE_EXCLUSIVE ?
+                 " must have the same line size as the level above it in an exclusive hierarchy\n" :
+                 " must not have a smaller line size than the level above it in an inclusive hierarchy\n");
+        bf_abend();
+      }
+    }
+    hierarchy_geometry.push_back(level);
+  }
+}
 
 void initialize_cache(void){
   if(caches == nullptr){
     caches = new vector<Cache*>();
+    all_global_cache_stats = new vector<CacheStats*>();
   }
-  global_cache = new Cache(bf_line_size, bf_max_set_bits, true);
+  global_cache = new Cache(bf_line_size, bf_max_set_bits, bf_max_ways, true);
+  parse_cache_config();
+  hierarchies = new vector<CacheHierarchy*>();
 }
 
-// Access the cache model with this address.
-void bf_touch_cache(uint64_t baseaddr, uint64_t numaddrs){
-  if(cache == nullptr){
+// Return the calling thread's cache-model state, creating it on first use.
+void* bf_get_cache_context(void){
+  if(cache_context == nullptr){
     // Only let one thread update caches at a time.
     lock_guard<mutex> guard(cache_vector_mutex);
-    cache = new Cache(bf_line_size, bf_max_set_bits, false);
-    caches->push_back(cache);
     cache_id = thread_counter++;
+    cache_context = new CacheContext;
+    cache_context->cache = new Cache(bf_line_size, bf_max_set_bits, bf_max_ways, false);
+    caches->push_back(cache_context->cache);
+    cache_context->global_cache_stats = new CacheStats(bf_max_set_bits, bf_max_ways);
+    all_global_cache_stats->push_back(cache_context->global_cache_stats);
+    cache_context->hierarchy = nullptr;
+    if(!hierarchy_geometry.empty()){
+      cache_context->hierarchy = new CacheHierarchy(hierarchy_geometry, bf_cache_policy);
+      hierarchies->push_back(cache_context->hierarchy);
+    }
   }
-  cache->access(baseaddr, numaddrs);
-  lock_guard<mutex> guard(global_cache_mutex);
-  global_cache->access(baseaddr, numaddrs);
+  return cache_context;
 }
 
-// Get cache accesses
-uint64_t bf_get_private_cache_accesses(void){
-  uint64_t res = 0;
+// Access the cache model with this address on behalf of the thread that
+// owns a given cache-model context.
+void bf_touch_cache(void* context, uint64_t baseaddr, uint64_t numaddrs){
+  OverheadTimer timer(BF_OVERHEAD_CACHE);
+  if(numaddrs == 0)
+    return;  // e.g., a zero-length memset()
+  CacheContext* ctx = static_cast<CacheContext*>(context);
+  ctx->cache->access(baseaddr, numaddrs);
+  if(ctx->hierarchy != nullptr)
+    ctx->hierarchy->access(baseaddr, numaddrs);
+  global_cache->access(baseaddr, numaddrs, *ctx->global_cache_stats);
+}
+
+// Access the cache model with this address.
+void bf_touch_cache(uint64_t baseaddr, uint64_t numaddrs){
+  bf_touch_cache(bf_get_cache_context(), baseaddr, numaddrs);
+}
+
+// Sum the statistics of all private caches.
+static CacheStats private_cache_stats(void){
+  CacheStats sum(bf_max_set_bits, bf_max_ways);
   for(auto& cache: *caches){
-    res += cache->getAccesses();
+    const CacheStats& stats = cache->getStats();
+    sum.accesses += stats.accesses;
+    sum.misaligned_mem_ops += stats.misaligned_mem_ops;
+    sum.cold_misses += stats.cold_misses;
+    add_tallies(sum.hits, stats.hits);
   }
-  return res;
+  return sum;
 }
 
-template<typename T>
-vector<T> vecsum(const vector<T>& a, const vector<T>& b){
-  vector<T> out(a.size());
-  transform(begin(a), end(a), begin(b), begin(out),
-            [](const T& a, const T& b){ return a + b; });
-  return out;
+// Sum all threads' statistics of the shared cache.
+static CacheStats shared_cache_stats(void){
+  CacheStats sum(bf_max_set_bits, bf_max_ways);
+  for(auto& stats: *all_global_cache_stats){
+    sum.accesses += stats->accesses;
+    sum.misaligned_mem_ops += stats->misaligned_mem_ops;
+    sum.cold_misses += stats->cold_misses;
+    add_tallies(sum.hits, stats->hits);
+    add_tallies(sum.remote_hits, stats->remote_hits);
+  }
+  return sum;
 }
 
-template<typename T>
-T mapsum(const T& a, const T& b){
-  T out(a);
-  for(const auto& elem : b){
-    out[elem.first] += elem.second;
-  }
-  return out;
+// Get cache accesses
+uint64_t bf_get_private_cache_accesses(void){
+  return private_cache_stats().accesses;
 }
 
 // Get cache hits
 uint64_t bf_get_shared_cache_accesses(void){
-  return global_cache->getAccesses();
+  return shared_cache_stats().accesses;
 }
 
 // Get cache hits
@@ -186,45 +612,59 @@ vector<unordered_map<uint64_t,uint64_t> > bf_get_private_cache_hits(void){
   // caches sized N or smaller.  We'll aggregate the cache performance across
   // all threads; global L1 accesses is equivalent to the sum of individual L1
   // accesses, etc.
-  vector<unordered_map<uint64_t,uint64_t> > tot_hits(bf_max_set_bits + 1);
-  for(auto& cache: *caches){
-    auto hits = cache->getHits();
-    transform(begin(hits), end(hits), begin(tot_hits), begin(tot_hits), mapsum<unordered_map<uint64_t,uint64_t> >);
-  }
-
+  vector<unordered_map<uint64_t,uint64_t> > tot_hits = tallies_to_maps(private_cache_stats().hits);
+  tot_hits.resize(bf_max_set_bits + 1);
   return tot_hits;
 }
 
 vector<unordered_map<uint64_t,uint64_t> > bf_get_shared_cache_hits(void){
-  return global_cache->getHits();
+  return tallies_to_maps(shared_cache_stats().hits);
 }
 
 vector<unordered_map<uint64_t,uint64_t> > bf_get_remote_shared_cache_hits(void){
-  return global_cache->getRemoteHits();
+  return tallies_to_maps(shared_cache_stats().remote_hits);
+}
+
+// Get each thread's remote hits to the shared cache, indexed by thread.
+vector<vector<unordered_map<uint64_t,uint64_t> > > bf_get_remote_shared_cache_hits_by_thread(void){
+  vector<vector<unordered_map<uint64_t,uint64_t> > > thread_hits(all_global_cache_stats->size());
+  for(auto& stats: *all_global_cache_stats)
+    thread_hits[stats->thread_id] = tallies_to_maps(stats->remote_hits);
+  return thread_hits;
 }
 
 uint64_t bf_get_private_cold_misses(void){
-  uint64_t res = 0;
-  for(auto& cache: *caches){
-    res += cache->getColdMisses();
-  }
-  return res;
+  return private_cache_stats().cold_misses;
 }
 
 uint64_t bf_get_shared_cold_misses(void){
-  return global_cache->getColdMisses();
+  return shared_cache_stats().cold_misses;
 }
 
 uint64_t bf_get_private_misaligned_mem_ops(void){
-  uint64_t res = 0;
-  for(auto& cache: *caches){
-    res += cache->getMisalignedMemOps();
-  }
-  return res;
+  return private_cache_stats().misaligned_mem_ops;
 }
 
 uint64_t bf_get_shared_misaligned_mem_ops(void){
-  return global_cache->getMisalignedMemOps();
+  return shared_cache_stats().misaligned_mem_ops;
+}
+
+// Get the geometry and performance of each level of the modeled cache
+// hierarchy, aggregated across all threads.  Return an empty vector if no
+// hierarchy was modeled.
+vector<bf_cache_level_t> bf_get_cache_hierarchy(void){
+  vector<bf_cache_level_t> levels(hierarchy_geometry);
+  for(const auto& hier: *hierarchies){
+    const auto& hier_levels = hier->getLevels();
+    for(size_t lvl = 0; lvl < levels.size(); ++lvl){
+      const auto& stats = hier_levels[lvl].getStats();
+      levels[lvl].accesses += stats.accesses;
+      levels[lvl].hits += stats.hits;
+      levels[lvl].misses += stats.misses;
+      levels[lvl].evictions += stats.evictions;
+    }
+  }
+  return levels;
 }
 
 } // namespace bytesflops
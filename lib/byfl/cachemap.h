@@ -10,33 +10,47 @@
 #define _CACHEMAP_H_
 
 #include "byfl.h"
+#include "flatmap.h"
 
 using namespace std;
 
+// Say whether a map's iterators survive the insertion and erasure of other
+// keys.  Those of the STL maps do; those of FlatHashMap do not.
+template<typename map_type>
+struct map_has_stable_iterators {
+  static const bool value = true;
+};
+template<class Key, class T, class Hash, class KeyEqual>
+struct map_has_stable_iterators<FlatHashMap<Key, T, Hash, KeyEqual> > {
+  static const bool value = false;
+};
+
 // Wrap an STL map or unordered_map with a simple cache.  We expect to have
-// many hits to the same key.
+// many hits to a few keys.  The cache holds the cache_size most useful
+// keys inline, contiguously, so searching it is a short loop over a small
+// array that the compiler can unroll or vectorize.  A hit moves the entry
+// one slot towards the front; a miss that finds the key in the underlying
+// map replaces the cache's last entry.
 template<typename map_type,
          class Key,
          class T,
-         class KeyEqual = std::equal_to<Key> >
+         class KeyEqual = std::equal_to<Key>,
+         size_t cache_size = 4>
 class CachedAnyMap {
 private:
-  static const size_t cache_size = 1;  // Number of previous entries to cache
-  struct CacheElt {
-    Key key;                           // Key previously searched for
-    typename map_type::iterator iter;  // Iterator previously returned
-  };
-  CacheElt* cache[cache_size];         // The cache proper
+  static_assert(cache_size > 0, "CachedAnyMap requires a nonempty cache");
+  typedef typename map_type::iterator map_iterator;
+  Key cache_keys[cache_size];          // Keys previously searched for
+  map_iterator cache_iters[cache_size];  // Iterators previously returned
+  size_t num_cached = 0;               // Number of valid entries at the front of the cache
   KeyEqual compare_keys;               // Functor for comparing two keys for equality
   map_type* the_map;                   // The underlying map
-  size_t null_entries = cache_size;    // Number of null entries in the cache
+  uint64_t hits = 0;                   // Number of find() calls satisfied by the cache
+  uint64_t misses = 0;                 // Number of find() calls that searched the underlying map
 
 public:
-  // The constructor initializes all cache entries to null (no entry).
   CachedAnyMap() {
     the_map = new map_type();
-    for (size_t i = 0; i < cache_size; i++)
-      cache[i] = nullptr;
   }
 
   // All iterator types and methods get delegated to the underlying map.
@@ -50,43 +64,37 @@ public:
   // Ditto for the size() method.
   size_t size() const { return the_map->size(); }
 
+  // Report how effective the cache has been, to help choose a cache size
+  // for each use.
+  uint64_t cache_hits() const { return hits; }
+  uint64_t cache_misses() const { return misses; }
+
   // The find() method first checks the cache then falls back to the
   // underlying map.
   iterator find (const Key& key) {
     // Linear-search the cache.
-    for (size_t i = 0; i < cache_size; i++) {
-      if (cache[i] != nullptr && compare_keys(key, cache[i]->key)) {
+    for (size_t i = 0; i < num_cached; i++)
+      if (compare_keys(key, cache_keys[i])) {
         // Hit!
-        typename map_type::iterator found_iter;
-        if (i > 0) {
-          // Hit was not in the first cache entry -- bubble up.
-          CacheElt* prev_elt = cache[i - 1];
-          cache[i - 1] = cache[i];
-          cache[i] = prev_elt;
-          found_iter = cache[i - 1]->iter;
-        }
-        else
+        hits++;
+        if (i == 0)
           // Hit was in the first cache entry -- don't bubble up.
-          found_iter = cache[0]->iter;
-        return found_iter;
+          return cache_iters[0];
+
+        // Hit was not in the first cache entry -- bubble up.
+        swap(cache_keys[i - 1], cache_keys[i]);
+        swap(cache_iters[i - 1], cache_iters[i]);
+        return cache_iters[i - 1];
       }
-    }
 
     // The item wasn't found in the cache -- search the underlying map.
+    misses++;
     iterator iter = the_map->find(key);
-    if (iter != end() && cache_size > 0) {
+    if (iter != end()) {
       // Cache only successful searches.
-      CacheElt* new_ent = cache[cache_size - 1];
-      if (null_entries > 0)
-        for (size_t i = 0; i < cache_size; i++)
-          if (cache[i] == nullptr) {
-            // Insert a new entry into the cache.
-            new_ent = cache[i] = new CacheElt;
-            null_entries--;
-            break;
-          }
-      new_ent->key = key;
-      new_ent->iter = iter;
+      size_t slot = num_cached < cache_size ? num_cached++ : cache_size - 1;
+      cache_keys[slot] = key;
+      cache_iters[slot] = iter;
     }
     return iter;
   }
@@ -94,13 +102,21 @@ public:
   // The erase() method erases the key:value pair from both the cache
   // and the underlying map.
   size_t erase (const Key& key) {
+    // Flush the entire cache if erasing a key may move other keys.
+    if (!map_has_stable_iterators<map_type>::value) {
+      num_cached = 0;
+      return the_map->erase(key);
+    }
+
     // Linear-search the cache.
-    for (size_t i = 0; i < cache_size; i++)
-      if (cache[i] != nullptr && compare_keys(key, cache[i]->key)) {
-        // Hit -- mark as invalid.
-        delete cache[i];
-        cache[i] = nullptr;
-        null_entries++;
+    for (size_t i = 0; i < num_cached; i++)
+      if (compare_keys(key, cache_keys[i])) {
+        // Hit -- remove the entry, preserving the order of the others.
+        for (size_t j = i + 1; j < num_cached; j++) {
+          cache_keys[j - 1] = cache_keys[j];
+          cache_iters[j - 1] = cache_iters[j];
+        }
+        num_cached--;
         break;
       }
 
@@ -108,11 +124,20 @@ public:
     return the_map->erase(key);
   }
 
+  // The clear() method empties both the cache and the underlying map.
+  void clear (void) {
+    num_cached = 0;
+    the_map->clear();
+  }
+
   // operator[] uses find() to find or create a key:value pair.
   T& operator[] (const Key& key) {
     iterator iter = find(key);
     if (iter == end()) {
-      // Not found -- create a new value then try again.
+      // Not found -- create a new value then try again.  Flush the cache
+      // first if inserting a key may move other keys.
+      if (!map_has_stable_iterators<map_type>::value)
+        num_cached = 0;
       (void) (*the_map)[key];
       return (*this)[key];
     }
@@ -139,9 +164,10 @@ template<class Key,
          class T,
          class Hash = std::hash<Key>,
          class KeyEqual = std::equal_to<Key>,
-         class Allocator = std::allocator< std::pair<const Key, T> > >
+         class Allocator = std::allocator< std::pair<const Key, T> >,
+         size_t cache_size = 4>
 class CachedUnorderedMap : public CachedAnyMap<
-  unordered_map<Key, T, Hash, KeyEqual, Allocator>, Key, T, KeyEqual>
+  unordered_map<Key, T, Hash, KeyEqual, Allocator>, Key, T, KeyEqual, cache_size>
 {
 };
 
@@ -150,9 +176,27 @@ template<class Key,
          class T,
          class Compare = std::less<Key>,
          class Allocator = std::allocator< std::pair<const Key, T> >,
-         class KeyEqual = std::equal_to<Key> >
+         class KeyEqual = std::equal_to<Key>,
+         size_t cache_size = 4>
 class CachedOrderedMap : public CachedAnyMap<
-  map<Key, T, Compare, Allocator>, Key, T, KeyEqual>
+  map<Key, T, Compare, Allocator>, Key, T, KeyEqual, cache_size>
+{
+};
+
+// Specialize CachedAnyMap to a FlatHashMap.  For benchmarking purposes,
+// defining BF_STD_MAPS reverts CachedFlatMap to a CachedUnorderedMap.
+template<class Key,
+         class T,
+         class Hash = std::hash<Key>,
+         class KeyEqual = std::equal_to<Key>,
+         size_t cache_size = 4>
+class CachedFlatMap : public CachedAnyMap<
+#ifdef BF_STD_MAPS
+  unordered_map<Key, T, Hash, KeyEqual>,
+#else
+  FlatHashMap<Key, T, Hash, KeyEqual>,
+#endif
+  Key, T, KeyEqual, cache_size>
 {
 };
 
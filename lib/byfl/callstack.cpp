@@ -15,50 +15,80 @@ extern "C" {
 namespace bytesflops
 {
 
-    const char* CallStack::push_function (const char* funcname, KeyType_t key) {
-        // Push both the current function name and the combined name of the
-        // function and its call stack.
-        static char* combined_name = NULL;
-        static size_t len_combined_name = 0;
-        const char* unique_combined_name;      // Interned version of combined_name
-        size_t current_stack_depth = complete_call_stack.size();
-        if (current_stack_depth == 0) {
-          // First function on the call stack
-          len_combined_name = strlen(funcname) + 1;
-          combined_name = (char*) malloc(len_combined_name);
-          strcpy(combined_name, funcname);
-          max_depth = 1;
-        }
-        else {
-          // All other calls (the common case)
-          const char* ancestors_names = complete_call_stack.back().first;
-          size_t length_needed = strlen(funcname) + strlen(ancestors_names) + 2;
-          if (len_combined_name < length_needed) {
-            len_combined_name = length_needed*2;
-            combined_name = (char*) realloc(combined_name, len_combined_name);
-          }
-          sprintf(combined_name, "%s %s", funcname, ancestors_names);
-          current_stack_depth++;
-          if (current_stack_depth > max_depth)
-            max_depth = current_stack_depth;
+    // Combine a parent's context ID with a function key to produce a child's
+    // context ID.
+    static inline KeyType_t combine_context_id (KeyType_t parent_id, KeyType_t func_key) {
+        uint64_t id = (parent_id ^ func_key) + UINT64_C(0x9E3779B97F4A7C15) + (parent_id << 6) + (parent_id >> 2);
+        id = (id ^ (id >> 30))*UINT64_C(0xBF58476D1CE4E5B9);
+        id = (id ^ (id >> 27))*UINT64_C(0x94D049BB133111EB);
+        return id ^ (id >> 31);
+    }
+
+    const CallingContext* CallStack::push_function (const char* funcname, KeyType_t key,
+                                                    bool& is_new) {
+        // Find the calling context formed by the current context plus the
+        // new function.  Create the context if this is the first time
+        // we've seen it.  Constructing the context's name is deferred until
+        // someone needs it.
+        const CallingContext* parent =
+          complete_call_stack.empty() ? NULL : complete_call_stack.back();
+        ContextKey ckey = {parent == NULL ? 0 : parent->id, key};
+        CallingContext*& context = contexts[ckey];
+        is_new = context == NULL;
+        if (is_new) {
+          context = new CallingContext;
+          context->id = combine_context_id(ckey.parent_id, key);
+          context->func_key = key;
+          context->funcname = funcname;
+          context->parent = parent;
+          context->name = NULL;
         }
-        unique_combined_name = bf_string_to_symbol(combined_name);
-        complete_call_stack.push_back(std::make_pair(unique_combined_name, key));
-        return unique_combined_name;
+        complete_call_stack.push_back(context);
+        if (complete_call_stack.size() > max_depth)
+          max_depth = complete_call_stack.size();
+        return context;
     }
 
 
-          // Pop a function name from the call stack and return the new top of
-          // the call stack (function + ancestors).
-    CallStack::StackItem_t CallStack::pop_function (void) {
+    // Pop a function from the call stack and return the new top of the call
+    // stack (function + ancestors).
+    const CallingContext* CallStack::pop_function (void) {
         complete_call_stack.pop_back();
         if (complete_call_stack.size() > 0)
-        {
-          //std::string & nm = complete_call_stack.back();
           return complete_call_stack.back();
-        }
         else
-          return std::make_pair("[EMPTY]", 0);
-      }
+          return NULL;
+    }
+
+
+    const char* CallStack::current_name (void) const {
+        if (complete_call_stack.size() > 0)
+          return context_name(complete_call_stack.back());
+        else
+          return max_depth == 0 ? "-" : "[EMPTY]";
+    }
+
+
+    const char* CallStack::context_name (const CallingContext* context) {
+        // Names are immutable, so construct each only once.  Name each
+        // unnamed ancestor, outermost first, so every name is built by
+        // appending to its parent's.
+        if (context->name != NULL)
+          return context->name;
+        std::vector<const CallingContext*> unnamed;
+        for (const CallingContext* ctx = context; ctx != NULL && ctx->name == NULL; ctx = ctx->parent)
+          unnamed.push_back(ctx);
+        std::string combined_name;
+        for (auto iter = unnamed.rbegin(); iter != unnamed.rend(); iter++) {
+          const CallingContext* ctx = *iter;
+          combined_name = ctx->funcname;
+          if (ctx->parent != NULL) {
+            combined_name += ' ';
+            combined_name += ctx->parent->name;
+          }
+          ctx->name = bf_string_to_symbol(combined_name.c_str());
+        }
+        return context->name;
+    }
 
 } /* namespace bytesflops */
@@ -12,17 +12,28 @@
 #include <string>
 #include <cstring>
 #include <iostream>
+#include <unordered_map>
 
 #include "byfl-common.h"
 
 namespace bytesflops
 {
 
+    // Represent one node of a calling-context tree: a function plus the
+    // context from which it was called.  A context's ID depends only on
+    // its parent's ID and the function's key, so the same call stack
+    // receives the same ID in every thread.
+    struct CallingContext {
+      KeyType_t id;                   // Unique key for the function and its ancestors
+      KeyType_t func_key;             // Key of the function alone
+      const char* funcname;           // Name of the function alone
+      const CallingContext* parent;   // Calling context of the caller or NULL
+      mutable const char* name;       // Names of the function and its ancestors or NULL if not yet needed
+    };
+
     // Maintain a function call stack.
     class CallStack {
     public:
-      typedef std::pair<const char*, KeyType_t> StackItem_t;
-
       size_t max_depth;   // Maximum depth achieved by complete_call_stack
 
       CallStack() {
@@ -31,16 +42,45 @@ namespace bytesflops
 
       ~CallStack() {}
 
-      const char* push_function (const char* funcname, KeyType_t key);
-      StackItem_t pop_function (void);
+      // Push a function onto the call stack and return its calling
+      // context.  Set is_new to true if this is the first time the call
+      // stack has seen the context.
+      const CallingContext* push_function (const char* funcname, KeyType_t key,
+                                           bool& is_new);
+
+      // Pop a function from the call stack and return the new top of the
+      // call stack or NULL if the call stack is now empty.
+      const CallingContext* pop_function (void);
+
+      // Return the name of the function atop the call stack followed by
+      // the names of all of its ancestors.
+      const char* current_name (void) const;
+
+      // Return the name of a calling context's function followed by the
+      // names of all of its ancestors, constructing it if necessary.
+      static const char* context_name (const CallingContext* context);
 
       inline size_t depth() {return complete_call_stack.size();}
 
     private:
-        std::vector<StackItem_t> complete_call_stack;  // Stack of function and ancestor names
+      // Identify a calling context by its caller's context and its own
+      // function key.
+      struct ContextKey {
+        KeyType_t parent_id;
+        KeyType_t func_key;
 
-        //std::vector<std::string> complete_call_stack;  // Stack of function and ancestor names
+        bool operator==(const ContextKey& other) const {
+          return parent_id == other.parent_id && func_key == other.func_key;
+        }
+      };
+      struct ContextKeyHash {
+        size_t operator()(const ContextKey& ck) const {
+          return std::hash<KeyType_t>()(ck.parent_id*UINT64_C(0x9E3779B97F4A7C15) ^ ck.func_key);
+        }
+      };
 
+      std::vector<const CallingContext*> complete_call_stack;  // Stack of calling contexts
+      std::unordered_map<ContextKey, CallingContext*, ContextKeyHash> contexts;  // Every calling context this call stack has seen
     };
 
 } /* namespace bytesflops */
@@ -35,42 +35,22 @@ namespace bytesflops {
 extern BinaryOStream* bfbin;
 static bool output_ds_tags = false;  // true: user called bf_tag_data_region() at least once; false=no calls
 static uint64_t dstruct_time = 1;    // Current allocation "time"
+static uint64_t num_dstruct_counters = 0;  // Number of DataStructCounters ever created
 
-// Define an interval-tree type.
-template<typename T>
-class Interval
-{
-public:
-  T lower;    // Lower limit
-  T upper;    // Upper limit
-
-  Interval() { }
-
-  Interval(T ll, T ul) : lower(ll), upper(ul) {
-  }
-
-  bool operator<(const Interval<T>& other) const {
-    return upper < other.lower;
-  }
-
-  bool operator>(const Interval<T>& other) const {
-    return lower > other.upper;
-  }
-
-  // Equality is defined as not less than and not greater than.
-  bool operator==(const Interval<T>& other) const {
-    return !(*this < other) && !(*this > other);
-  }
+// When threads keep private counters, let loads and stores look up data
+// structures concurrently and require exclusive access only to allocate,
+// deallocate, or tag a data structure.
+static pthread_rwlock_t dstruct_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t dstruct_generation = 0;   // Number of times the lock was acquired for writing
 
-  friend ostream& operator<<(ostream& os, const Interval<T>& val) {
-    os << '[' << val.lower << ", " << val.upper << ']';
-    return os;
-  }
-};
+// Return the current allocation "time" then advance it.  The caller must
+// hold the mega-lock or, when threads keep private counters, the
+// data-structure lock for writing.
+static uint64_t advance_dstruct_time (void);
 
 // Define all of the counters and other information we keep track of
 // per data structure.
-class DataStructCounters
+class DataStructCounters : public ArenaAllocated
 {
 public:
   bf_symbol_info_t syminfo;   // Dynamic data structure source information
@@ -88,16 +68,19 @@ public:
   uint64_t access1_time = 0;  // First access "time" on a global counter
   uint64_t accessN_time = 0;  // Last access "time" on a global counter
   uint64_t free_time = 0;     // Deallocation "time" on a global counter
+  uint64_t index;             // Position of our access tallies in each thread's DataStructShard
 
   // The minimum we need to initialize are the data structure's initial size
   // (which can grow), symbol information, and whether the data structure comes
-  // from an explicit allocation or an access to an unknown address.
-  DataStructCounters(bf_symbol_info_t sinfo, uint64_t sz, bool alloc) :
+  // from an explicit allocation or an access to an unknown address.  Static
+  // data are always allocated at time 0.
+  DataStructCounters(bf_symbol_info_t sinfo, uint64_t sz, bool alloc, bool is_static=false) :
     syminfo(sinfo), current_size(sz), max_size(sz), allocation(alloc),
     bytes_alloced(sz), num_allocs(1), tag(""),
     access1_time(0), accessN_time(0), free_time(0)
   {
-    alloc_time = dstruct_time++;
+    alloc_time = is_static ? 0 : advance_dstruct_time();
+    index = num_dstruct_counters++;
   }
 
   // Generate a description of a data structure.
@@ -130,52 +113,326 @@ string DataStructCounters::generate_symbol_desc (void) const
   return locstr.str();
 }
 
+// Describe a contiguous range of addresses belonging to a data structure.
+struct DataStructRegion : public ArenaAllocated {
+  uint64_t lower;                 // First address in the range
+  uint64_t upper;                 // Last address in the range
+  DataStructCounters* counters;   // Counters for the data structure
+};
+
+// Keep track of the non-overlapping regions that overlap a single logical
+// page of memory.  Most pages are covered by a single region, which we
+// store directly; we resort to a vector sorted by address only for pages
+// on which multiple regions begin or end.
+class DataStructPage {
+private:
+  DataStructRegion* only = nullptr;    // The only region overlapping the page
+  vector<DataStructRegion*> many;      // All regions overlapping the page if more than one
+
+public:
+  DataStructPage(size_t) { }
+
+  // Return the region containing a given address or NULL if none does.
+  DataStructRegion* find (uint64_t address) const {
+    if (only != nullptr)
+      return only->lower <= address && address <= only->upper ? only : nullptr;
+    auto iter = upper_bound(many.begin(), many.end(), address,
+                            [](uint64_t addr, const DataStructRegion* r) {
+                              return addr < r->lower;
+                            });
+    if (iter == many.begin())
+      return nullptr;
+    --iter;
+    return address <= (*iter)->upper ? *iter : nullptr;
+  }
+
+  // Return a region overlapping a given address range or NULL if none does.
+  DataStructRegion* find_overlap (uint64_t lower, uint64_t upper) const {
+    if (only != nullptr)
+      return only->lower <= upper && lower <= only->upper ? only : nullptr;
+    for (auto iter = many.begin(); iter != many.end(); iter++)
+      if ((*iter)->lower <= upper && lower <= (*iter)->upper)
+        return *iter;
+    return nullptr;
+  }
+
+  // Add a region that doesn't overlap any other region on the page.
+  void insert (DataStructRegion* region) {
+    if (only == nullptr && many.empty()) {
+      only = region;
+      return;
+    }
+    if (only != nullptr) {
+      many.push_back(only);
+      only = nullptr;
+    }
+    auto iter = upper_bound(many.begin(), many.end(), region->lower,
+                            [](uint64_t addr, const DataStructRegion* r) {
+                              return addr < r->lower;
+                            });
+    many.insert(iter, region);
+  }
+
+  // Remove a region from the page.
+  void remove (DataStructRegion* region) {
+    if (only == region) {
+      only = nullptr;
+      return;
+    }
+    auto iter = find_if(many.begin(), many.end(),
+                        [region](const DataStructRegion* r) { return r == region; });
+    if (iter != many.end())
+      many.erase(iter);
+    if (many.size() == 1) {
+      only = many[0];
+      many.clear();
+    }
+  }
+};
+
+// Map each address to the region containing it using a shadow page table
+// with one entry per logical page.  Lookups cost a page-table walk (usually
+// elided by the page table's leaf cache) plus a search of the few regions
+// sharing the page.
+class DataStructMap {
+private:
+  PageTable<DataStructPage> shadow;    // Pages overlapped by any region
+  vector<DataStructRegion*> free_regions;   // Regions available for reuse
+
+public:
+  DataStructMap() : shadow(4096) { }
+
+  // Return the region containing a given address or NULL if none does.
+  DataStructRegion* find (uint64_t address) {
+    DataStructPage* page = shadow.find_page(address/shadow.page_size());
+    return page == nullptr ? nullptr : page->find(address);
+  }
+
+  // Do the same as find() but without modifying the map so that multiple
+  // threads can search it concurrently.
+  DataStructRegion* find_shared (uint64_t address) const {
+    DataStructPage* page = shadow.find_page_shared(address/shadow.page_size());
+    return page == nullptr ? nullptr : page->find(address);
+  }
+
+  // Return a region overlapping a given address range or NULL if none does.
+  DataStructRegion* find_overlap (uint64_t lower, uint64_t upper) {
+    size_t page_size = shadow.page_size();
+    for (uint64_t pagenum = lower/page_size; pagenum <= upper/page_size; pagenum++) {
+      DataStructPage* page = shadow.find_page(pagenum);
+      if (page == nullptr)
+        continue;
+      DataStructRegion* region = page->find_overlap(lower, upper);
+      if (region != nullptr)
+        return region;
+    }
+    return nullptr;
+  }
+
+  // Associate an address range that doesn't overlap any existing region
+  // with a set of counters.
+  DataStructRegion* insert (uint64_t lower, uint64_t upper, DataStructCounters* counters) {
+    DataStructRegion* region;
+    if (free_regions.empty())
+      region = new DataStructRegion;
+    else {
+      region = free_regions.back();
+      free_regions.pop_back();
+    }
+    region->lower = lower;
+    region->upper = upper;
+    region->counters = counters;
+    size_t page_size = shadow.page_size();
+    for (uint64_t pagenum = lower/page_size; pagenum <= upper/page_size; pagenum++)
+      shadow.get_page(pagenum)->insert(region);
+    return region;
+  }
+
+  // Remove a region from every page it overlaps.
+  void erase (DataStructRegion* region) {
+    size_t page_size = shadow.page_size();
+    for (uint64_t pagenum = region->lower/page_size; pagenum <= region->upper/page_size; pagenum++)
+      shadow.find_page(pagenum)->remove(region);
+    free_regions.push_back(region);
+  }
+};
+
 // Define this file's two main data structures.
-static CachedOrderedMap<Interval<uint64_t>, DataStructCounters*>* data_structs;  // Interval tree with information about each data structure
+static DataStructMap* data_structs;  // Map from an address to information about the data structure containing it
 static CachedUnorderedMap<ID_tag, DataStructCounters*>* id_tag_to_counters;  // Map from a symbol identifier to data-structure counters
 
-// Construct an interval tree of symbol addresses.
+// Construct a map from addresses to data structures.
 void initialize_data_structures (void)
 {
   if (data_structs != nullptr)
     return;    // Already initialized
-  data_structs = new CachedOrderedMap<Interval<uint64_t>, DataStructCounters*>;
+  data_structs = new DataStructMap;
   id_tag_to_counters = new CachedUnorderedMap<ID_tag, DataStructCounters*>;
 }
 
-// Disassociate a range of previously allocated addresses (given the address
-// at the beginning of the range) from the data structure to which it used to
-// belong.  Return the address to the right of the disassociated range.
-static void* disassoc_addresses_with_dstruct (void* baseptr)
+// Acquire the data-structure lock for reading (shared=true) or writing
+// (shared=false).  Do nothing unless threads keep private counters; the
+// mega-lock protects everything otherwise.
+static inline void lock_data_structs (bool shared)
 {
-  // Find the address interval and set of counters.
-  static Interval<uint64_t> search_addr(0, 0);
-  search_addr.lower = search_addr.upper = uint64_t(uintptr_t(baseptr));
-  auto iter = data_structs->find(search_addr);
-  if (iter == data_structs->end())
-    return (void*)((char*)baseptr + 1);  // Address was not previously allocated (or somehow snuck by us).
-  Interval<uint64_t> interval = iter->first;
-  DataStructCounters* counters = iter->second;
+  if (!bf_thread_shards)
+    return;
+  int retcode = shared ? pthread_rwlock_rdlock(&dstruct_lock) : pthread_rwlock_wrlock(&dstruct_lock);
+  if (retcode != 0) {
+    cerr << "Failed to acquire a read-write lock\n";
+    bf_abend();
+  }
+  if (!shared)
+    __atomic_add_fetch(&dstruct_generation, 1, __ATOMIC_RELEASE);
+}
 
+// Release the data-structure lock.
+static inline void unlock_data_structs (void)
+{
+  if (!bf_thread_shards)
+    return;
+  if (pthread_rwlock_unlock(&dstruct_lock) != 0) {
+    cerr << "Failed to release a read-write lock\n";
+    bf_abend();
+  }
+}
+
+// Tally one thread's accesses to a single data structure.
+struct DataStructAccesses {
+  DataStructCounters* counters = nullptr;  // Data structure being accessed
+  uint64_t bytes_loaded = 0;  // Number of bytes loaded
+  uint64_t bytes_stored = 0;  // Number of bytes stored
+  uint64_t load_ops = 0;      // Number of load operations
+  uint64_t store_ops = 0;     // Number of store operations
+  uint64_t access1_time = 0;  // First access "time" on the global counter
+  uint64_t accessN_time = 0;  // Last access "time" on the global counter
+};
+
+// Tally one thread's accesses to every data structure, indexed by
+// DataStructCounters::index.
+struct DataStructShard {
+  vector<DataStructAccesses> accesses;
+
+  // Timestamp accesses with a private clock so they need no cross-thread
+  // synchronization.  The clock is moved past dstruct_time whenever the
+  // thread acquires the data-structure lock, and allocations and frees
+  // move dstruct_time past every thread's clock.  Only the owning thread
+  // writes the clock.
+  uint64_t clock = 0;
+
+  // Remember the most recently accessed region so that repeated accesses
+  // to the same data structure need not even acquire the lock.  The cached
+  // region is valid only while dstruct_generation is unchanged.
+  uint64_t last_generation = ~(uint64_t)0;   // dstruct_generation when the region was cached
+  uint64_t last_lower = 1;                   // First address in the cached region
+  uint64_t last_upper = 0;                   // Last address in the cached region
+  DataStructCounters* last_counters = nullptr;   // Counters for the cached region
+};
+static __thread DataStructShard* thread_dstruct_accesses = nullptr;  // The calling thread's tallies
+static vector<DataStructShard*>* all_dstruct_shards = nullptr;     // Every thread's tallies, never freed
+
+// Move the global clock past every thread's private clock, and return
+// the current time then advance it.  When threads keep private counters,
+// allocations, frees, and the final report are the only operations that
+// read other threads' clocks.
+static uint64_t advance_dstruct_time (void)
+{
+  if (bf_thread_shards && all_dstruct_shards != nullptr)
+    for (auto iter = all_dstruct_shards->begin(); iter != all_dstruct_shards->end(); iter++) {
+      uint64_t thread_time = __atomic_load_n(&(*iter)->clock, __ATOMIC_RELAXED) + 1;
+      if (thread_time > dstruct_time)
+        dstruct_time = thread_time;
+    }
+  return dstruct_time++;
+}
+
+// Move the calling thread's private clock past the global clock.  The
+// caller must hold the data-structure lock for reading or writing.
+static inline void synchronize_thread_clock (DataStructShard* shard)
+{
+  if (shard->clock < dstruct_time)
+    __atomic_store_n(&shard->clock, dstruct_time, __ATOMIC_RELAXED);
+}
+
+// Merge a thread's data-structure access tallies into the global counters
+// then zero the thread's tallies.  The caller must hold the mega-lock.
+static void merge_data_struct_shard (void* shard_ptr)
+{
+  DataStructShard* shard = (DataStructShard*) shard_ptr;
+  for (auto iter = shard->accesses.begin(); iter != shard->accesses.end(); iter++) {
+    DataStructCounters* counters = iter->counters;
+    if (counters == nullptr || iter->access1_time == 0)
+      continue;
+    counters->bytes_loaded += iter->bytes_loaded;
+    counters->bytes_stored += iter->bytes_stored;
+    counters->load_ops += iter->load_ops;
+    counters->store_ops += iter->store_ops;
+    if (counters->access1_time == 0 || iter->access1_time < counters->access1_time)
+      counters->access1_time = iter->access1_time;
+    if (iter->accessN_time > counters->accessN_time)
+      counters->accessN_time = iter->accessN_time;
+    *iter = DataStructAccesses();
+  }
+}
+
+// Initialize the calling thread's data-structure access tallies at first use.
+void initialize_thread_data_structures (void)
+{
+  if (!bf_data_structs || !bf_thread_shards)
+    return;
+  thread_dstruct_accesses = new DataStructShard;
+  lock_data_structs(false);
+  if (all_dstruct_shards == nullptr)
+    all_dstruct_shards = new vector<DataStructShard*>;
+  all_dstruct_shards->push_back(thread_dstruct_accesses);
+  synchronize_thread_clock(thread_dstruct_accesses);
+  unlock_data_structs();
+  bf_register_thread_shard(merge_data_struct_shard, thread_dstruct_accesses);
+}
+
+// Disassociate a range of previously allocated addresses from the data
+// structure to which it used to belong.
+static void disassoc_region_with_dstruct (DataStructRegion* region)
+{
   // Reduce the size of the data structure by the size of the address range and
-  // break the link from the address interval to the counters.  Note that
+  // break the link from the address range to the counters.  Note that
   // id_tag_to_counters still points to the counters; we don't want to forget
   // that the data structure ever existed just because it was deallocated.
-  uint64_t interval_length = interval.upper - interval.lower + 1;
-  counters->current_size -= interval_length;
+  DataStructCounters* counters = region->counters;
+  uint64_t region_length = region->upper - region->lower + 1;
+  counters->current_size -= region_length;
+  uint64_t now = advance_dstruct_time();   // Deallocation is an event, even if we haven't freed the entire data structure.
   if (counters->current_size == 0)
-    counters->free_time = dstruct_time;
-  dstruct_time++;      // Deallocation is an event, even if we haven't freed the entire data structure.
-  data_structs->erase(interval);
-  return (void *)(interval.upper + 1);
+    counters->free_time = now;
+  data_structs->erase(region);
+}
+
+// Disassociate a range of previously allocated addresses (given the address
+// at the beginning of the range) from the data structure to which it used to
+// belong.
+static void disassoc_addresses_with_dstruct (void* baseptr)
+{
+  DataStructRegion* region = data_structs->find(uint64_t(uintptr_t(baseptr)));
+  if (region == nullptr)
+    return;  // Address was not previously allocated (or somehow snuck by us).
+  disassoc_region_with_dstruct(region);
 }
 
-// For access from user code, wrap disassoc_addresses_with_dstruct() and
-// discard the return value.
+// Disassociate every data structure that overlaps a given address range.
+static void disassoc_overlapping_dstructs (uint64_t first_addr, uint64_t last_addr)
+{
+  DataStructRegion* region;
+  while ((region = data_structs->find_overlap(first_addr, last_addr)) != nullptr)
+    disassoc_region_with_dstruct(region);
+}
+
+// For access from user code, wrap disassoc_addresses_with_dstruct().
 extern "C"
 void bf_disassoc_addresses_with_dstruct (void* baseptr)
 {
-  (void) disassoc_addresses_with_dstruct(baseptr);
+  lock_data_structs(false);
+  disassoc_addresses_with_dstruct(baseptr);
+  unlock_data_structs();
 }
 
 // Associate a range of addresses with a statically allocated data structure.
@@ -183,33 +440,45 @@ extern "C"
 void bf_assoc_addresses_with_sstruct (const bf_symbol_info_t* syminfo,
                                       void* baseptr, uint64_t numaddrs)
 {
+  OverheadTimer timer(BF_OVERHEAD_DATA_STRUCTS);
+
+  // Ignore this data structure if it consumes no space.
+  if (numaddrs == 0)
+    return;
+
   // Convert some of our arguments to slightly different forms.
   uint64_t first_addr = uint64_t(uintptr_t(baseptr));
   uint64_t last_addr = first_addr + numaddrs - 1;
   string symname(syminfo->symbol);
 
-  // Insert the symbol into the interval tree and into the mapping from
+  // Insert the symbol into the address map and into the mapping from
   // data-structure name to counters.
-  DataStructCounters* info = new DataStructCounters(*syminfo, numaddrs, true);
-  dstruct_time--;   // Undo the time increment when we're allocating statically.
-  info->alloc_time = 0;   // Static data are always allocated at time 0.
-  (*data_structs)[Interval<uint64_t>(first_addr, last_addr)] = info;
+  lock_data_structs(false);
+  disassoc_overlapping_dstructs(first_addr, last_addr);
+  DataStructCounters* info = new DataStructCounters(*syminfo, numaddrs, true, true);
+  data_structs->insert(first_addr, last_addr, info);
   (*id_tag_to_counters)[ID_tag(syminfo->ID)] = info;
+  unlock_data_structs();
 }
 
 // Associate a range of addresses with a dynamically allocated data structure.
-static void assoc_addresses_with_dstruct (const bf_symbol_info_t* syminfo,
-                                          void* old_baseptr, void* baseptr,
-                                          uint64_t numaddrs,
-                                          bool known_alloc)
+// Return the region representing the address range.
+static DataStructRegion* assoc_addresses_with_dstruct (const bf_symbol_info_t* syminfo,
+                                                       void* old_baseptr, void* baseptr,
+                                                       uint64_t numaddrs,
+                                                       bool known_alloc)
 {
   // Find an existing set of counters for the same source-code location.  If no
   // such counters exist, allocate a new set.
   DataStructCounters* counters;      // Counters associated with the data structure
+  uint64_t first_addr = uint64_t(uintptr_t(baseptr));
+  uint64_t last_addr = first_addr + numaddrs - 1;
   if (old_baseptr == nullptr) {
     // Common case -- we haven't seen the old base address before (because it's
     // presumably the same as the new address, and that's what was just
-    // allocated).
+    // allocated).  Any data structures that overlap the new address range
+    // must no longer exist.
+    disassoc_overlapping_dstructs(first_addr, last_addr);
     auto count_iter = id_tag_to_counters->find(ID_tag(syminfo->ID));
     if (count_iter == id_tag_to_counters->end()) {
       // Not found -- allocate new counters.
@@ -229,25 +498,21 @@ static void assoc_addresses_with_dstruct (const bf_symbol_info_t* syminfo,
   else {
     // Case of realloc -- reuse the old counters, but remove the old address
     // range, and subtract off the bytes previously allocated.
-    static Interval<uint64_t> search_addr(0, 0);
-    search_addr.lower = search_addr.upper = uint64_t(uintptr_t(old_baseptr));
-    auto old_iter = data_structs->find(search_addr);
-    counters = old_iter->second;
-    Interval<uint64_t> old_interval = old_iter->first;
-    counters->current_size -= old_interval.upper - old_interval.lower + 1;
+    DataStructRegion* old_region = data_structs->find(uint64_t(uintptr_t(old_baseptr)));
+    counters = old_region->counters;
+    counters->current_size -= old_region->upper - old_region->lower + 1;
     counters->current_size += numaddrs;
     if (counters->current_size > counters->max_size)
       counters->max_size = counters->current_size;
     counters->bytes_alloced += numaddrs;
     counters->num_allocs++;
-    data_structs->erase(old_interval);
+    data_structs->erase(old_region);
+    disassoc_overlapping_dstructs(first_addr, last_addr);
   }
 
   // Associate the new range of addresses with the old (or just created)
   // counters.
-  uint64_t baseaddr = uint64_t(uintptr_t(baseptr));
-  Interval<uint64_t> ival(baseaddr, baseaddr + numaddrs - 1);
-  (*data_structs)[ival] = counters;
+  return data_structs->insert(first_addr, last_addr, counters);
 }
 
 // Associate a range of addresses with a dynamically allocated data structure.
@@ -256,12 +521,16 @@ void bf_assoc_addresses_with_dstruct (const bf_symbol_info_t* syminfo,
                                       void* old_baseptr, void* baseptr,
                                       uint64_t numaddrs)
 {
+  OverheadTimer timer(BF_OVERHEAD_DATA_STRUCTS);
+
   // Ignore this data structure if it consumes no space.
   if (numaddrs == 0)
     return;
 
   // Associate the given addresses with the data structure.
+  lock_data_structs(false);
   assoc_addresses_with_dstruct(syminfo, old_baseptr, baseptr, numaddrs, true);
+  unlock_data_structs();
 }
 
 // Associate a range of addresses with a dynamically allocated data structure
@@ -271,6 +540,8 @@ void bf_assoc_addresses_with_dstruct_pm (const bf_symbol_info_t* syminfo,
                                          void* old_baseptr, void** baseptrptr,
                                          uint64_t numaddrs, int retcode)
 {
+  OverheadTimer timer(BF_OVERHEAD_DATA_STRUCTS);
+
   // Ignore this data structure if posix_memalign() failed.
   if (retcode != 0)
     return;
@@ -280,7 +551,9 @@ void bf_assoc_addresses_with_dstruct_pm (const bf_symbol_info_t* syminfo,
     return;
 
   // Associate the given addresses with the data structure.
+  lock_data_structs(false);
   assoc_addresses_with_dstruct(syminfo, old_baseptr, *baseptrptr, numaddrs, true);
+  unlock_data_structs();
 }
 
 // Associate a range of addresses with a dynamically allocated data structure
@@ -289,22 +562,46 @@ extern "C"
 void bf_assoc_addresses_with_dstruct_stack (const bf_symbol_info_t* syminfo,
                                             void* baseptr, uint64_t numaddrs)
 {
+  OverheadTimer timer(BF_OVERHEAD_DATA_STRUCTS);
+
   // Ignore this data structure if it consumes no space.
   if (numaddrs == 0)
     return;
 
-  // Disassociate all overlapping data structures.  For example if a function
-  // declares "int32_t x,y;" then returns, then another function delcares
-  // "int64_t foo;" and gets the same base address as x, we'll need to
-  // associate foo's address range with foo from now on, not with x and y.
-  void* lastaddr = (void*)((char*)baseptr + numaddrs);
-  for (void* addr = baseptr;
-       addr < lastaddr;
-       addr = disassoc_addresses_with_dstruct(addr))
-    ;
-
-  // Associate the given addresses with the data structure.
+  // Associate the given addresses with the data structure.  This first
+  // disassociates all overlapping data structures.  For example if a
+  // function declares "int32_t x,y;" then returns, then another function
+  // delcares "int64_t foo;" and gets the same base address as x, we'll need
+  // to associate foo's address range with foo from now on, not with x and y.
+  lock_data_structs(false);
   assoc_addresses_with_dstruct(syminfo, nullptr, baseptr, numaddrs, true);
+  unlock_data_structs();
+}
+
+// Increment the calling thread's private access counts for a data
+// structure.
+static void tally_thread_access (DataStructCounters* counters,
+                                 uint64_t numaddrs, uint8_t load0store1)
+{
+  DataStructShard* shard = thread_dstruct_accesses;
+  vector<DataStructAccesses>& accesses = shard->accesses;
+  if (counters->index >= accesses.size())
+    accesses.resize(counters->index + 1);
+  DataStructAccesses& tally = accesses[counters->index];
+  tally.counters = counters;
+  if (load0store1 == 0) {
+    tally.load_ops++;
+    tally.bytes_loaded += numaddrs;
+  }
+  else {
+    tally.store_ops++;
+    tally.bytes_stored += numaddrs;
+  }
+  uint64_t now = shard->clock + 1;
+  __atomic_store_n(&shard->clock, now, __ATOMIC_RELAXED);
+  if (tally.access1_time == 0)
+    tally.access1_time = now;
+  tally.accessN_time = now;
 }
 
 // Increment access counts for a data structure.
@@ -312,36 +609,66 @@ extern "C"
 void bf_access_data_struct (const bf_symbol_info_t* syminfo, uint64_t baseaddr,
                             uint64_t numaddrs, uint8_t load0store1)
 {
+  OverheadTimer timer(BF_OVERHEAD_DATA_STRUCTS);
+
   // Do nothing if counting is suppressed.
   if (bf_suppress_counting)
     return;
 
-  // Find the interval containing the base address.  Use a set of counts
-  // representing unknown data structures if we failed to find an interval.
-  static Interval<uint64_t> search_addr(0, 0);
-  search_addr.lower = search_addr.upper = baseaddr;
-  DataStructCounters* counters;
-  auto iter = data_structs->find(search_addr);
-  if (iter == data_structs->end()) {
+  // When threads keep private counters, find the region containing the base
+  // address while holding the data-structure lock only for reading, then
+  // update the calling thread's tallies.  Counters are never freed, so they
+  // remain valid after we release the lock.
+  if (bf_thread_shards) {
+    DataStructShard* shard = thread_dstruct_accesses;
+    uint64_t generation = __atomic_load_n(&dstruct_generation, __ATOMIC_ACQUIRE);
+    if (generation == shard->last_generation &&
+        shard->last_lower <= baseaddr && baseaddr <= shard->last_upper) {
+      tally_thread_access(shard->last_counters, numaddrs, load0store1);
+      return;
+    }
+    lock_data_structs(true);
+    generation = __atomic_load_n(&dstruct_generation, __ATOMIC_ACQUIRE);
+    synchronize_thread_clock(shard);
+    DataStructRegion* region = data_structs->find_shared(baseaddr);
+    DataStructCounters* counters = nullptr;
+    if (region != nullptr) {
+      counters = region->counters;
+      shard->last_generation = generation;
+      shard->last_lower = region->lower;
+      shard->last_upper = region->upper;
+      shard->last_counters = counters;
+    }
+    unlock_data_structs();
+    if (counters == nullptr) {
+      // The data structure wasn't found (see below).  Allocate it with
+      // exclusive access, unless another thread beat us to it.
+      lock_data_structs(false);
+      region = data_structs->find(baseaddr);
+      if (region == nullptr)
+        region = assoc_addresses_with_dstruct(syminfo, nullptr, (void*)uintptr_t(baseaddr),
+                                              numaddrs, false);
+      counters = region->counters;
+      synchronize_thread_clock(shard);
+      unlock_data_structs();
+    }
+    tally_thread_access(counters, numaddrs, load0store1);
+    return;
+  }
+
+  // Find the region containing the base address.  Use a set of counts
+  // representing unknown data structures if we failed to find a region.
+  DataStructRegion* region = data_structs->find(baseaddr);
+  if (region == nullptr)
     // The data structure wasn't found.  For example, it was allocated by a
     // non-Byfl-instrumented function (say, strdup(), for example).  "Allocate"
-    // it so it'll be found the next time.
-    void* lastaddr = (void*)(baseaddr + numaddrs);
-    for (void* addr = (void*)(uintptr_t(baseaddr));
-         addr < lastaddr;
-         addr = disassoc_addresses_with_dstruct(addr))
-      ;
-
-    // "Allocate" an unknown data structure.
-    assoc_addresses_with_dstruct(syminfo, nullptr, (void*)uintptr_t(baseaddr),
-                                 numaddrs, false);
-    iter = data_structs->find(search_addr);
-  }
-  counters = iter->second;
+    // it, replacing any data structures it overlaps, so it'll be found the
+    // next time.
+    region = assoc_addresses_with_dstruct(syminfo, nullptr, (void*)uintptr_t(baseaddr),
+                                          numaddrs, false);
+  DataStructCounters* counters = region->counters;
 
   // Increment the appropriate counters.
-  if (iter == data_structs->end())
-    abort();    // Internal error searching data_structs (bad interval?)
   if (load0store1 == 0) {
     counters->load_ops++;
     counters->bytes_loaded += numaddrs;
@@ -350,23 +677,21 @@ void bf_access_data_struct (const bf_symbol_info_t* syminfo, uint64_t baseaddr,
     counters->store_ops++;
     counters->bytes_stored += numaddrs;
   }
+  uint64_t now = advance_dstruct_time();
   if (counters->access1_time == 0)
-    counters->access1_time = dstruct_time;
-  counters->accessN_time = dstruct_time++;
+    counters->access1_time = now;
+  counters->accessN_time = now;
 }
 
 // Associate an arbitrary tag with a fragment of a data structure, given an
-// address within an interval.
-extern "C"
-void bf_tag_data_region (void* address, const char *tag)
+// address within a region.
+static void tag_data_region (void* address, const char *tag)
 {
   // Find the data structure associated with the given address.
-  static Interval<uint64_t> search_addr(0, 0);
-  search_addr.lower = search_addr.upper = uint64_t(uintptr_t(address));
-  auto diter = data_structs->find(search_addr);
-  if (diter == data_structs->end())
+  DataStructRegion* region = data_structs->find(uint64_t(uintptr_t(address)));
+  if (region == nullptr)
     return;
-  DataStructCounters* old_counters = diter->second;
+  DataStructCounters* old_counters = region->counters;
   uint64_t id = old_counters->syminfo.ID;
 
   // Find the set of counters associated with the symbol ID and tag.  If no
@@ -386,7 +711,7 @@ void bf_tag_data_region (void* address, const char *tag)
 
   // Transfer allocation values (but not load/store counters) from the old
   // counters to the new counters.
-  uint64_t numaddrs = diter->first.upper - diter->first.lower + 1;
+  uint64_t numaddrs = region->upper - region->lower + 1;
   old_counters->num_allocs--;
   new_counters->num_allocs++;
   old_counters->bytes_alloced -= numaddrs;
@@ -398,8 +723,17 @@ void bf_tag_data_region (void* address, const char *tag)
   if (new_counters->current_size > new_counters->max_size)
     new_counters->max_size = new_counters->current_size;
 
-  // Associate the original address interval with the new set of counters.
-  (*data_structs)[diter->first] = new_counters;
+  // Associate the original address range with the new set of counters.
+  region->counters = new_counters;
+}
+
+// For access from user code, wrap tag_data_region().
+extern "C"
+void bf_tag_data_region (void* address, const char *tag)
+{
+  lock_data_structs(false);
+  tag_data_region(address, tag);
+  unlock_data_structs();
 }
 
 // Compare two counters with the intention of sorted them in decreasing
@@ -425,7 +759,12 @@ static bool compare_counter_interest (const DataStructCounters* a,
 // Output load and store counters by data structure.
 void bf_report_data_struct_counts (void)
 {
-  // Sort all data structures in the interval tree by decreasing order
+  // Data structures that were never freed are reported as freed now.
+  lock_data_structs(false);
+  uint64_t end_time = advance_dstruct_time();
+  unlock_data_structs();
+
+  // Sort all data structures by decreasing order
   // of total bytes accessed.  Ignore any unaccessed data structures.
   vector<DataStructCounters*> interesting_data;
   for (auto iter = id_tag_to_counters->begin(); iter != id_tag_to_counters->end(); iter++) {
@@ -482,7 +821,7 @@ void bf_report_data_struct_counts (void)
            << counters->alloc_time
            << counters->access1_time
            << counters->accessN_time
-           << (counters->free_time == 0 ? dstruct_time : counters->free_time)
+           << (counters->free_time == 0 ? end_time : counters->free_time)
            << counters->bytes_loaded
            << counters->bytes_stored
            << counters->load_ops
@@ -0,0 +1,207 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (open-addressing hash-map class definitions)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#ifndef _FLATMAP_H_
+#define _FLATMAP_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <utility>
+
+// Define a hash map that stores all of its key:value pairs in a single array
+// and resolves collisions by linear probing.  Unlike an unordered_map, this
+// performs no memory allocation per insertion and usually finds a key with a
+// single cache miss.  The price is that inserting or erasing any key may
+// move other key:value pairs and therefore invalidates all iterators and
+// references into the map.  The interface is the subset of unordered_map's
+// that CachedAnyMap and its users require.
+template<class Key,
+         class T,
+         class Hash = std::hash<Key>,
+         class KeyEqual = std::equal_to<Key> >
+class FlatHashMap {
+public:
+  typedef std::pair<Key, T> value_type;
+
+private:
+  static const size_t min_capacity = 16;   // Smallest non-empty table
+  value_type* slots = nullptr;   // Storage for key:value pairs
+  uint8_t* occupied = nullptr;   // 1=slot holds a key:value pair; 0=empty
+  size_t mask = 0;               // Number of slots minus one
+  size_t num_elts = 0;           // Number of key:value pairs stored
+  Hash hash_key;                 // Functor for hashing a key
+  KeyEqual compare_keys;         // Functor for comparing two keys for equality
+
+  // Return the number of slots allocated.
+  size_t capacity() const { return slots == nullptr ? 0 : mask + 1; }
+
+  // Return the slot at which a key would ideally reside.  Scramble the
+  // hash value because std::hash is the identity function for integers,
+  // and addresses and page numbers collide badly in a power-of-two table.
+  size_t home_slot (const Key& key) const {
+    uint64_t h = uint64_t(hash_key(key));
+    h ^= h >> 33;
+    h *= UINT64_C(0xFF51AFD7ED558CCD);
+    h ^= h >> 33;
+    return size_t(h) & mask;
+  }
+
+  // Return the slot containing a key or the empty slot at which the key
+  // would be inserted.
+  size_t probe (const Key& key) const {
+    size_t slot = home_slot(key);
+    while (occupied[slot] && !compare_keys(slots[slot].first, key))
+      slot = (slot + 1) & mask;
+    return slot;
+  }
+
+  // Allocate a new, empty table with a given number of slots (a power of
+  // two) and move all existing key:value pairs into it.
+  void rehash (size_t new_capacity) {
+    value_type* old_slots = slots;
+    uint8_t* old_occupied = occupied;
+    size_t old_capacity = capacity();
+    slots = static_cast<value_type*>(::operator new(new_capacity*sizeof(value_type)));
+    occupied = static_cast<uint8_t*>(calloc(new_capacity, 1));
+    mask = new_capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++)
+      if (old_occupied[i]) {
+        size_t slot = probe(old_slots[i].first);
+        new (&slots[slot]) value_type(std::move(old_slots[i]));
+        occupied[slot] = 1;
+        old_slots[i].~value_type();
+      }
+    ::operator delete(old_slots);
+    free(old_occupied);
+  }
+
+  // Define an iterator that skips over empty slots.
+  template<typename map_ptr, typename elt_type>
+  class base_iterator {
+  private:
+    map_ptr the_map;     // Map being iterated over
+    size_t slot;         // Current slot
+
+    // Advance to the next occupied slot or to the end of the table.
+    void skip_empty (void) {
+      size_t num_slots = the_map->capacity();
+      while (slot < num_slots && !the_map->occupied[slot])
+        slot++;
+    }
+
+  public:
+    base_iterator() : the_map(nullptr), slot(0) { }
+    base_iterator(map_ptr m, size_t s) : the_map(m), slot(s) { skip_empty(); }
+    base_iterator(map_ptr m, size_t s, bool) : the_map(m), slot(s) { }   // Slot is known to be occupied or capacity()
+
+    // Allow conversion from a non-const to a const iterator.
+    template<typename other_map_ptr, typename other_elt_type>
+    base_iterator(const base_iterator<other_map_ptr, other_elt_type>& other) :
+      the_map(other.get_map()), slot(other.get_slot()) { }
+    map_ptr get_map() const { return the_map; }
+    size_t get_slot() const { return slot; }
+
+    elt_type& operator*() const { return the_map->slots[slot]; }
+    elt_type* operator->() const { return &the_map->slots[slot]; }
+    base_iterator& operator++() { slot++; skip_empty(); return *this; }
+    base_iterator operator++(int) { base_iterator prev(*this); ++*this; return prev; }
+    bool operator==(const base_iterator& other) const { return slot == other.slot; }
+    bool operator!=(const base_iterator& other) const { return slot != other.slot; }
+  };
+
+public:
+  typedef base_iterator<FlatHashMap*, value_type> iterator;
+  typedef base_iterator<const FlatHashMap*, const value_type> const_iterator;
+
+  FlatHashMap() { }
+
+  ~FlatHashMap() {
+    clear();
+    ::operator delete(slots);
+    free(occupied);
+  }
+
+  // The map owns its storage and therefore can't be copied.
+  FlatHashMap(const FlatHashMap&) = delete;
+  FlatHashMap& operator=(const FlatHashMap&) = delete;
+
+  iterator begin() { return iterator(this, 0); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  iterator end() { return iterator(this, capacity(), true); }
+  const_iterator end() const { return const_iterator(this, capacity(), true); }
+  size_t size() const { return num_elts; }
+  bool empty() const { return num_elts == 0; }
+
+  // Return an iterator to a key:value pair or end() if the key isn't found.
+  iterator find (const Key& key) {
+    if (num_elts == 0)
+      return end();
+    size_t slot = probe(key);
+    return occupied[slot] ? iterator(this, slot, true) : end();
+  }
+  const_iterator find (const Key& key) const {
+    if (num_elts == 0)
+      return end();
+    size_t slot = probe(key);
+    return occupied[slot] ? const_iterator(this, slot, true) : end();
+  }
+
+  // Return the value associated with a key, inserting a default-constructed
+  // value if the key isn't found.
+  T& operator[] (const Key& key) {
+    // Keep the table at most 3/4 full.
+    if (4*(num_elts + 1) > 3*capacity())
+      rehash(capacity() == 0 ? min_capacity : 2*capacity());
+    size_t slot = probe(key);
+    if (!occupied[slot]) {
+      new (&slots[slot]) value_type(key, T());
+      occupied[slot] = 1;
+      num_elts++;
+    }
+    return slots[slot].second;
+  }
+
+  // Remove a key:value pair and return the number of pairs removed (0 or 1).
+  // Shift subsequent pairs in the same probe sequence backwards so that no
+  // tombstones are needed.
+  size_t erase (const Key& key) {
+    if (num_elts == 0)
+      return 0;
+    size_t hole = probe(key);
+    if (!occupied[hole])
+      return 0;
+    for (size_t slot = (hole + 1) & mask; occupied[slot]; slot = (slot + 1) & mask) {
+      // Move the pair in slot into the hole unless its home slot lies
+      // cyclically within (hole, slot].
+      size_t home = home_slot(slots[slot].first);
+      bool stays = hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot);
+      if (stays)
+        continue;
+      slots[hole] = std::move(slots[slot]);
+      hole = slot;
+    }
+    slots[hole].~value_type();
+    occupied[hole] = 0;
+    num_elts--;
+    return 1;
+  }
+
+  // Remove all key:value pairs but retain the storage.
+  void clear (void) {
+    size_t num_slots = capacity();
+    for (size_t i = 0; i < num_slots; i++)
+      if (occupied[i]) {
+        slots[i].~value_type();
+        occupied[i] = 0;
+      }
+    num_elts = 0;
+  }
+};
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (HyperLogLog class definitions)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#ifndef _HYPERLOGLOG_H_
+#define _HYPERLOGLOG_H_
+
+#include "byfl.h"
+#include <cmath>
+
+using namespace std;
+
+namespace bytesflops {
+
+// Estimate the number of distinct 64-bit values in a stream using a fixed
+// amount of memory: one byte for each of 2^LOG2_REGISTERS registers.  This
+// is the HyperLogLog algorithm of Flajolet et al. with linear counting for
+// small cardinalities.  Because we use a 64-bit hash, no large-range
+// correction is needed.  The relative standard error is roughly
+// 1.04/sqrt(2^LOG2_REGISTERS).
+template<unsigned int LOG2_REGISTERS>
+class HyperLogLog : public ArenaAllocated {
+private:
+  static const size_t num_registers = size_t(1) << LOG2_REGISTERS;
+  uint8_t registers[num_registers];   // Maximum rank observed per register
+
+  // Mix a value's bits using the MurmurHash3 64-bit finalizer.
+  static uint64_t hash (uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+  }
+
+public:
+  HyperLogLog() {
+    clear();
+  }
+
+  // Forget all values observed so far.
+  void clear (void) {
+    memset(registers, 0, sizeof(registers));
+  }
+
+  // Observe a single value.  The high-order bits of the value's hash
+  // select a register, and the position of the first 1 bit among the
+  // remaining bits gives the rank.
+  void insert (uint64_t value) {
+    uint64_t h = hash(value);
+    size_t idx = size_t(h >> (64 - LOG2_REGISTERS));
+    uint64_t rest = (h << LOG2_REGISTERS) | (uint64_t(1) << (LOG2_REGISTERS - 1));
+    uint8_t rank = uint8_t(__builtin_clzll(rest) + 1);
+    if (rank > registers[idx])
+      registers[idx] = rank;
+  }
+
+  // Observe each value in a range.
+  void insert_range (uint64_t first, uint64_t num_values) {
+    for (uint64_t i = 0; i < num_values; i++)
+      insert(first + i);
+  }
+
+  // Fold another HyperLogLog's observations into ours.
+  void merge (const HyperLogLog& other) {
+    for (size_t i = 0; i < num_registers; i++)
+      if (other.registers[i] > registers[i])
+        registers[i] = other.registers[i];
+  }
+
+  // Return the estimated number of distinct values observed.
+  uint64_t estimate (void) const {
+    double m = double(num_registers);
+    double sum = 0.0;
+    size_t zeros = 0;
+    for (size_t i = 0; i < num_registers; i++) {
+      sum += ldexp(1.0, -int(registers[i]));
+      if (registers[i] == 0)
+        zeros++;
+    }
+    double alpha = 0.7213/(1.0 + 1.079/m);
+    double raw = alpha*m*m/sum;
+    if (raw <= 2.5*m && zeros > 0)
+      // Small range -- use linear counting instead.
+      raw = m*log(m/double(zeros));
+    return uint64_t(raw + 0.5);
+  }
+};
+
+} // namespace bytesflops
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (tracking instruction dependencies)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+
+namespace bytesflops {
+
+// Describe one module's instruction-dependency tallies.  Each thread has
+// its own copy of the tallies, which get_tallies() returns.
+struct InstDepsTable {
+  uint64_t num_tuples;             // Number of elements in the tallies
+  const bf_inst_deps_t* tuples;    // Opcodes corresponding to each tally
+  uint64_t* (*get_tallies)(void);  // Return the calling thread's tallies
+};
+
+// Keep track of each module's instruction-dependency tallies.
+static vector<InstDepsTable>* inst_deps_tables = nullptr;
+
+// Point to each module's copy of one thread's tallies.
+struct InstDepsShard {
+  vector<pair<size_t, uint64_t*>> tallies;  // Index into inst_deps_tables and the thread's tallies
+};
+static __thread InstDepsShard* thread_inst_deps = nullptr;  // The calling thread's tallies
+
+// Map an inst_deps_to_index() value to a tally across all modules and
+// threads.
+struct InstDepsTally {
+  bf_inst_deps_t tuple;   // Opcodes of an instruction and its operands
+  uint64_t tally;         // Number of dynamic executions observed
+};
+static unordered_map<uint64_t, InstDepsTally>* inst_deps_totals = nullptr;
+
+// Merge a thread's instruction-dependency tallies into the global tallies
+// then zero the thread's tallies.  The caller must hold the mega-lock.
+static void merge_inst_deps_shard (void* shard_ptr)
+{
+  InstDepsShard* shard = (InstDepsShard*) shard_ptr;
+  if (inst_deps_totals == nullptr)
+    inst_deps_totals = new unordered_map<uint64_t, InstDepsTally>;
+  for (auto iter = shard->tallies.begin(); iter != shard->tallies.end(); iter++) {
+    const InstDepsTable& table = (*inst_deps_tables)[iter->first];
+    uint64_t* tallies = iter->second;
+    for (uint64_t i = 0; i < table.num_tuples; i++) {
+      if (tallies[i] == 0)
+        continue;
+      const bf_inst_deps_t& tuple = table.tuples[i];
+      uint64_t idx = inst_deps_to_index(tuple.opcode, tuple.dep1, tuple.dep2, tuple.more);
+      auto total_iter = inst_deps_totals->find(idx);
+      if (total_iter == inst_deps_totals->end()) {
+        InstDepsTally& total = (*inst_deps_totals)[idx];
+        total.tuple = tuple;
+        total.tally = tallies[i];
+      }
+      else
+        total_iter->second.tally += tallies[i];
+      tallies[i] = 0;
+    }
+  }
+}
+
+// Initialize the calling thread's instruction-dependency tallies at first
+// use.
+void initialize_thread_inst_deps (void)
+{
+  if (!bf_tally_inst_deps)
+    return;
+  InstDepsShard* shard = new InstDepsShard;
+  if (inst_deps_tables != nullptr)
+    for (size_t i = 0; i < inst_deps_tables->size(); i++)
+      shard->tallies.push_back(make_pair(i, (*inst_deps_tables)[i].get_tallies()));
+  thread_inst_deps = shard;
+  bf_register_thread_shard(merge_inst_deps_shard, shard);
+}
+
+// Record a module's instruction-dependency tallies.  If the calling thread
+// was initialized before the module, associate the calling thread's copy
+// of the tallies with the thread.
+extern "C"
+void bf_record_inst_deps (uint64_t num_tuples, const bf_inst_deps_t* tuples,
+                          uint64_t* (*get_tallies)(void))
+{
+  if (inst_deps_tables == nullptr)
+    inst_deps_tables = new vector<InstDepsTable>;
+  InstDepsTable table;
+  table.num_tuples = num_tuples;
+  table.tuples = tuples;
+  table.get_tallies = get_tallies;
+  inst_deps_tables->push_back(table);
+  if (thread_inst_deps != nullptr)
+    thread_inst_deps->tallies.push_back(make_pair(inst_deps_tables->size() - 1, get_tallies()));
+}
+
+// Return the set of instruction-dependency tallies across all threads.
+// This is intended to be called at the end of the program, after all
+// threads' tallies have been merged.
+void bf_get_inst_deps (vector<pair<bf_inst_deps_t, uint64_t>>& histogram)
+{
+  histogram.clear();
+  if (inst_deps_totals == nullptr)
+    return;
+  for (auto iter = inst_deps_totals->begin(); iter != inst_deps_totals->end(); iter++)
+    histogram.push_back(make_pair(iter->second.tuple, iter->second.tally));
+}
+
+} // namespace bytesflops
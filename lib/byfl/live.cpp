@@ -0,0 +1,237 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (publication of live counters to shared memory)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+#include "bflive.h"
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+namespace bytesflops {
+
+// The run-time library checks this flag at each basic-block flush point
+// and invokes bf_publish_live_counters() when it's nonzero.  A background
+// thread sets it once every live_interval milliseconds.
+volatile uint8_t bf_live_due = 0;
+
+static uint64_t live_interval = 0;                  // Milliseconds between updates (0=none)
+static bf_live_segment_t* segment = nullptr;        // Shared-memory segment to which to publish
+static char segment_name[64];                       // Name of the above
+static chrono::steady_clock::time_point start_time; // Time at initialization
+
+// Represent the published subset of one function's counters.
+struct LiveFunction {
+  KeyType_t key;                             // Function key
+  uint64_t ops;                              // Operations performed, used for ranking
+  uint64_t counters[BF_LIVE_NUM_COUNTERS];   // Published counter values
+};
+
+// Extract the published subset of a set of counters.
+static void extract_live_counters (const ByteFlopCounters& counters, uint64_t* values)
+{
+  values[BF_LIVE_BBLOCKS] = counters.terminators[BF_END_BB_ANY];
+  values[BF_LIVE_LOAD_INS] = counters.load_ins;
+  values[BF_LIVE_STORE_INS] = counters.store_ins;
+  values[BF_LIVE_FLOPS] = counters.flops;
+  values[BF_LIVE_INT_OPS] = counters.ops - counters.flops - counters.load_ins - counters.store_ins - counters.terminators[BF_END_BB_ANY];
+  values[BF_LIVE_CALL_INS] = counters.call_ins;
+  values[BF_LIVE_LOADS] = counters.loads;
+  values[BF_LIVE_STORES] = counters.stores;
+  values[BF_LIVE_FP_BITS] = counters.fp_bits;
+  values[BF_LIVE_OP_BITS] = counters.op_bits;
+}
+
+// Copy a string into a fixed-size, NUL-terminated buffer, truncating it if
+// necessary.
+static void copy_name (char* dest, const string& src)
+{
+  size_t len = min(src.size(), size_t(BF_LIVE_NAME_LEN - 1));
+  memcpy(dest, src.data(), len);
+  dest[len] = '\0';
+}
+
+// Return a function's demangled name, caching the result.
+static string live_function_name (KeyType_t key)
+{
+  static unordered_map<KeyType_t, string>* key_to_name = new unordered_map<KeyType_t, string>;
+  auto iter = key_to_name->find(key);
+  if (iter != key_to_name->end())
+    return iter->second;
+  string name(bf_func_key_to_name(key));
+  if (name == "") {
+    // Call stacks are named only at the end of the run.
+    char keystr[48];
+    sprintf(keystr, "[call stack %016" PRIx64 "]", uint64_t(key));
+    return string(keystr);
+  }
+  return (*key_to_name)[key] = demangle_func_name(name);
+}
+
+// Remove the shared-memory segment when the program exits.
+static void remove_segment (void)
+{
+  shm_unlink(segment_name);
+}
+
+// Periodically request an update.  This runs in a background thread until
+// the program exits.
+static void live_timer (void)
+{
+  auto interval = chrono::milliseconds(live_interval);
+  auto next_time = chrono::steady_clock::now() + interval;
+  while (true) {
+    this_thread::sleep_until(next_time);
+    bf_live_due = 1;
+    next_time += interval;
+  }
+}
+
+// Read the update interval from the BF_LIVE environment variable (default:
+// don't publish live counters) and, if nonzero, create a shared-memory
+// segment to which to publish them.
+void initialize_live (void)
+{
+  const char* interval_str = getenv("BF_LIVE");
+  if (interval_str == nullptr || *interval_str == '\0')
+    return;
+  char* end;
+  unsigned long interval = strtoul(interval_str, &end, 10);
+  if (*end != '\0') {
+    cerr << "Failed to parse BF_LIVE=\"" << interval_str
+         << "\" as an update interval in milliseconds\n";
+    bf_abend();
+  }
+  if (interval == 0)
+    return;
+
+  // Create and map the segment.
+  sprintf(segment_name, BF_LIVE_SHM_FORMAT, (unsigned long) getpid());
+  int fd = shm_open(segment_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    cerr << "Failed to create shared-memory segment " << segment_name
+         << " (" << strerror(errno) << ")\n";
+    bf_abend();
+  }
+  if (ftruncate(fd, sizeof(bf_live_segment_t)) == -1) {
+    cerr << "Failed to size shared-memory segment " << segment_name
+         << " (" << strerror(errno) << ")\n";
+    shm_unlink(segment_name);
+    bf_abend();
+  }
+  void* addr = mmap(nullptr, sizeof(bf_live_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    cerr << "Failed to map shared-memory segment " << segment_name
+         << " (" << strerror(errno) << ")\n";
+    shm_unlink(segment_name);
+    bf_abend();
+  }
+  atexit(remove_segment);
+
+  // Fill in the fields that never change.  Write the magic number last so
+  // a reader never sees a partially initialized header.
+  segment = (bf_live_segment_t*) addr;
+  segment->version = BF_LIVE_VERSION;
+  segment->pid = uint64_t(getpid());
+  segment->start_time = uint64_t(time(nullptr));
+  vector<string> cmdline = parse_command_line();
+  copy_name(segment->program, cmdline.size() > 0 ? cmdline[0] : string("a.out"));
+  __atomic_store_n(&segment->magic, BF_LIVE_MAGIC, __ATOMIC_RELEASE);
+
+  // Start the timer.
+  start_time = chrono::steady_clock::now();
+  live_interval = interval;
+  thread(live_timer).detach();
+}
+
+// Publish a set of program totals and the per-function totals with the
+// most operations.  Readers spin rather than block while an update is in
+// progress.
+static void publish (const ByteFlopCounters& totals, bool finished)
+{
+  // Gather each function's totals, combining those tallied by key with
+  // those tallied by dense ID.  In thread-sharded mode, only the final
+  // update can see every thread's per-function tallies so we publish none
+  // until then rather than publish only the calling thread's.
+  static vector<LiveFunction>* functions = new vector<LiveFunction>;
+  static unordered_map<KeyType_t, size_t>* key_to_index = new unordered_map<KeyType_t, size_t>;
+  functions->clear();
+  key_to_index->clear();
+  if (finished || !bf_thread_shards)
+    bf_snapshot_func_totals([] (KeyType_t key, const ByteFlopCounters& counters) {
+        uint64_t values[BF_LIVE_NUM_COUNTERS];
+        extract_live_counters(counters, values);
+        auto iter = key_to_index->find(key);
+        if (iter == key_to_index->end()) {
+          (*key_to_index)[key] = functions->size();
+          LiveFunction func;
+          func.key = key;
+          func.ops = counters.ops;
+          memcpy(func.counters, values, sizeof(values));
+          functions->push_back(func);
+        }
+        else {
+          LiveFunction& func = (*functions)[iter->second];
+          func.ops += counters.ops;
+          for (int i = 0; i < BF_LIVE_NUM_COUNTERS; i++)
+            func.counters[i] += values[i];
+        }
+      });
+  size_t num_funcs = min(functions->size(), size_t(BF_LIVE_MAX_FUNCS));
+  partial_sort(functions->begin(), functions->begin() + num_funcs, functions->end(),
+               [] (const LiveFunction& one, const LiveFunction& two) {
+                 return one.ops > two.ops;
+               });
+
+  // Update the segment.  Increment the sequence number before and after
+  // the update so a reader can detect that it raced with us.
+  uint64_t seq = segment->sequence;
+  __atomic_store_n(&segment->sequence, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  auto elapsed = chrono::steady_clock::now() - start_time;
+  segment->elapsed_ns = uint64_t(chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+  segment->updates++;
+  segment->finished = finished ? 1 : 0;
+  extract_live_counters(totals, segment->totals);
+  for (size_t f = 0; f < num_funcs; f++) {
+    const LiveFunction& func = (*functions)[f];
+    copy_name(segment->funcs[f].name, live_function_name(func.key));
+    memcpy(segment->funcs[f].counters, func.counters, sizeof(func.counters));
+  }
+  segment->num_funcs = num_funcs;
+  __atomic_store_n(&segment->sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Publish the counters accumulated so far.  The run-time library invokes
+// this from a basic-block flush point when it sees bf_live_due set.  The
+// caller must hold the mega-lock if the program was compiled with
+// -bf-thread-safe.
+void bf_publish_live_counters (void)
+{
+  static ByteFlopCounters totals;
+  bf_live_due = 0;
+  if (segment == nullptr)
+    return;
+  bf_snapshot_totals(totals);
+  publish(totals, false);
+}
+
+// Publish the final counters and mark the program as finished.  This is
+// invoked at the end of the program, after global_totals is complete.
+void bf_finish_live (void)
+{
+  if (segment == nullptr)
+    return;
+  bf_acquire_mega_lock();
+  publish(global_totals, true);
+  bf_release_mega_lock();
+}
+
+} // namespace bytesflops
@@ -0,0 +1,176 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (measurement of the run-time library's own overhead)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+#include <chrono>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+using namespace std;
+
+namespace bytesflops {
+
+extern BinaryOStream* bfbin;
+
+uint64_t bf_overhead_period = 0;
+
+// Name each subsystem in the binary output.
+static const char* subsystem_names[BF_OVERHEAD_NUM_SUBSYSTEMS] = {
+  "Cache model",
+  "Reuse distance",
+  "Unique bytes",
+  "Memory footprint",
+  "Data structures",
+  "Strides",
+  "Basic-block flushes"
+};
+
+// Tally a single thread's calls to each subsystem.  Each thread updates
+// only its own tallies so no locking is needed on the fast path.
+class OverheadTallies : public ArenaAllocated {
+private:
+  uint64_t rng_state;    // State of a xorshift random-number generator
+
+public:
+  uint64_t calls[BF_OVERHEAD_NUM_SUBSYSTEMS];        // Calls to the subsystem
+  uint64_t timed_calls[BF_OVERHEAD_NUM_SUBSYSTEMS];  // Subset of the above that were timed
+  uint64_t ticks[BF_OVERHEAD_NUM_SUBSYSTEMS];        // Ticks consumed by the timed calls
+  uint64_t countdown[BF_OVERHEAD_NUM_SUBSYSTEMS];    // Calls remaining until the next timed call
+
+  OverheadTallies() : rng_state(uint64_t(uintptr_t(this)) | 1) {
+    memset(calls, 0, sizeof(calls));
+    memset(timed_calls, 0, sizeof(timed_calls));
+    memset(ticks, 0, sizeof(ticks));
+    for (int i = 0; i < BF_OVERHEAD_NUM_SUBSYSTEMS; i++)
+      countdown[i] = next_gap();
+  }
+
+  // Return the number of calls until the next timed call.  We randomize
+  // the gap (uniformly in [1, 2*bf_overhead_period-1]) so that periodic
+  // behavior in a subsystem can't alias with the sampling period.
+  uint64_t next_gap (void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return bf_overhead_period == 1 ? 1 : rng_state%(2*bf_overhead_period - 1) + 1;
+  }
+};
+
+static mutex tallies_lock;                          // Protect all_tallies
+static vector<OverheadTallies*>* all_tallies = nullptr;  // Every thread's tallies
+static __thread OverheadTallies* my_tallies = nullptr;   // The calling thread's tallies
+static uint64_t start_ticks;                        // Tick counter at initialization
+static chrono::steady_clock::time_point start_time; // Time at initialization
+
+// Read a fast, monotonically increasing tick counter: the time-stamp
+// counter where available and otherwise the steady clock in nanoseconds.
+static inline uint64_t read_ticks (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+// Read the sampling period from the BF_OVERHEAD environment variable
+// (default: no self-profiling).
+void initialize_overhead (void)
+{
+  const char* period_str = getenv("BF_OVERHEAD");
+  if (period_str == nullptr || *period_str == '\0')
+    return;
+  char* end;
+  unsigned long period = strtoul(period_str, &end, 10);
+  if (*end != '\0') {
+    cerr << "Failed to parse BF_OVERHEAD=\"" << period_str
+         << "\" as a sampling period\n";
+    bf_abend();
+  }
+  if (period == 0)
+    return;
+  all_tallies = new vector<OverheadTallies*>;
+  start_time = chrono::steady_clock::now();
+  start_ticks = read_ticks();
+  bf_overhead_period = period;
+}
+
+// Count a call to a subsystem and, if it's one of the calls we sample,
+// return the current tick count.
+uint64_t bf_overhead_begin (OverheadSubsystem subsystem)
+{
+  if (__builtin_expect(my_tallies == nullptr, 0)) {
+    my_tallies = new OverheadTallies;
+    lock_guard<mutex> guard(tallies_lock);
+    all_tallies->push_back(my_tallies);
+  }
+  my_tallies->calls[subsystem]++;
+  if (--my_tallies->countdown[subsystem] != 0)
+    return 0;
+  my_tallies->countdown[subsystem] = my_tallies->next_gap();
+  uint64_t now = read_ticks();
+  return now == 0 ? 1 : now;
+}
+
+// Charge the ticks elapsed since a sampled call began to its subsystem.
+void bf_overhead_end (OverheadSubsystem subsystem, uint64_t start)
+{
+  uint64_t now = read_ticks();
+  my_tallies->timed_calls[subsystem]++;
+  my_tallies->ticks[subsystem] += now - start;
+}
+
+// Output an estimate of the time spent in each subsystem -- only to the
+// binary output file, not the standard output device.  The time is
+// inclusive of any subsystem the entry point itself invokes.
+void bf_report_overhead (void)
+{
+  // Sum the tallies across all threads.
+  uint64_t calls[BF_OVERHEAD_NUM_SUBSYSTEMS] = {0};
+  uint64_t timed_calls[BF_OVERHEAD_NUM_SUBSYSTEMS] = {0};
+  uint64_t ticks[BF_OVERHEAD_NUM_SUBSYSTEMS] = {0};
+  {
+    lock_guard<mutex> guard(tallies_lock);
+    for (auto iter = all_tallies->cbegin(); iter != all_tallies->cend(); iter++)
+      for (int i = 0; i < BF_OVERHEAD_NUM_SUBSYSTEMS; i++) {
+        calls[i] += (*iter)->calls[i];
+        timed_calls[i] += (*iter)->timed_calls[i];
+        ticks[i] += (*iter)->ticks[i];
+      }
+  }
+
+  // Calibrate ticks against the steady clock over the entire run.
+  uint64_t total_ticks = read_ticks() - start_ticks;
+  auto elapsed = chrono::steady_clock::now() - start_time;
+  double total_ns = double(chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+  double ns_per_tick = total_ticks == 0 ? 0.0 : total_ns/double(total_ticks);
+
+  // Extrapolate the timed calls to all calls.
+  *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "Byfl overhead"
+         << uint8_t(BINOUT_COL_STRING) << "Subsystem"
+         << uint8_t(BINOUT_COL_UINT64) << "Calls"
+         << uint8_t(BINOUT_COL_UINT64) << "Timed calls"
+         << uint8_t(BINOUT_COL_UINT64) << "Timed ticks"
+         << uint8_t(BINOUT_COL_UINT64) << "Estimated total time (ns)"
+         << uint8_t(BINOUT_COL_UINT64) << "Program run time (ns)"
+         << uint8_t(BINOUT_COL_NONE);
+  for (int i = 0; i < BF_OVERHEAD_NUM_SUBSYSTEMS; i++) {
+    double est_ticks = timed_calls[i] == 0 ? 0.0 : double(ticks[i])*double(calls[i])/double(timed_calls[i]);
+    *bfbin << uint8_t(BINOUT_ROW_DATA)
+           << subsystem_names[i]
+           << calls[i]
+           << timed_calls[i]
+           << ticks[i]
+           << uint64_t(est_ticks*ns_per_tick + 0.5)
+           << uint64_t(total_ns + 0.5);
+  }
+  *bfbin << uint8_t(BINOUT_ROW_NONE);
+}
+
+} // namespace bytesflops
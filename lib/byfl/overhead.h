@@ -0,0 +1,56 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (self-profiling declarations)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#ifndef _OVERHEAD_H_
+#define _OVERHEAD_H_
+
+#include <cstdint>
+
+namespace bytesflops {
+
+// Enumerate the run-time-library subsystems whose cost we measure.
+typedef enum {
+  BF_OVERHEAD_CACHE,          // Cache model (bf_touch_cache())
+  BF_OVERHEAD_REUSE,          // Reuse distance (bf_reuse_dist_addrs_prog())
+  BF_OVERHEAD_UBYTES,         // Unique bytes (bf_assoc_addresses_with_{prog,func}())
+  BF_OVERHEAD_TALLYBYTES,     // Memory footprint (bf_assoc_addresses_with_{prog,func}_tb())
+  BF_OVERHEAD_DATA_STRUCTS,   // Data-structure tracking (bf_assoc_addresses_with_*struct*(), bf_access_data_struct())
+  BF_OVERHEAD_STRIDES,        // Stride tracking (bf_track_stride())
+  BF_OVERHEAD_BB_FLUSH,       // Basic-block flushes (bf_accumulate_bb_tallies(), bf_flush_bb_tallies())
+  BF_OVERHEAD_NUM_SUBSYSTEMS
+} OverheadSubsystem;
+
+// Time one out of every bf_overhead_period calls to each subsystem's entry
+// points (0=none).  This is set from the BF_OVERHEAD environment variable.
+extern uint64_t bf_overhead_period;
+
+// Begin and end timing a call.  bf_overhead_begin() returns zero if the
+// call is not to be timed.
+extern uint64_t bf_overhead_begin(OverheadSubsystem subsystem);
+extern void bf_overhead_end(OverheadSubsystem subsystem, uint64_t start);
+
+// Time the remainder of the enclosing scope if it's a sampled call.
+class OverheadTimer {
+private:
+  OverheadSubsystem subsystem;  // Subsystem to charge for the time
+  uint64_t start;               // Starting timestamp (0=not timed)
+
+public:
+  OverheadTimer (OverheadSubsystem which) : subsystem(which), start(0) {
+    if (__builtin_expect(bf_overhead_period != 0, 0))
+      start = bf_overhead_begin(subsystem);
+  }
+
+  ~OverheadTimer() {
+    if (__builtin_expect(start != 0, 0))
+      bf_overhead_end(subsystem, start);
+  }
+};
+
+} // namespace bytesflops
+
+#endif
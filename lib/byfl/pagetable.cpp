@@ -6,30 +6,278 @@
 */
 
 #include "byfl.h"
+#ifdef __x86_64__
+# include <immintrin.h>
+# define BF_X86_BIT_KERNELS
+#endif
 
 using namespace std;
 
 namespace bytesflops {
 
+// The following kernels operate on runs of whole bit-vector words and
+// return the number of bits that change from 0 to 1.  fill_words() sets
+// every bit in the run.  merge_words() ORs another run into the run.
+
+// Portable kernels.  Without a -m flag, __builtin_popcountll() compiles to
+// a library call on x86-64.
+static uint64_t fill_words_scalar (uint64_t* bits, size_t num_words)
+{
+  uint64_t new_bits = 0;
+  for (size_t w = 0; w < num_words; w++) {
+    new_bits += 64 - __builtin_popcountll(bits[w]);
+    bits[w] = ~0ULL;
+  }
+  return new_bits;
+}
+
+static uint64_t merge_words_scalar (uint64_t* __restrict__ bits,
+                                    const uint64_t* __restrict__ other_bits,
+                                    size_t num_words)
+{
+  uint64_t new_bits = 0;
+  for (size_t w = 0; w < num_words; w++) {
+    new_bits += __builtin_popcountll(other_bits[w] & ~bits[w]);
+    bits[w] |= other_bits[w];
+  }
+  return new_bits;
+}
+
+#ifdef BF_X86_BIT_KERNELS
+
+// The portable kernels but using the POPCNT instruction.
+__attribute__((target("popcnt")))
+static uint64_t fill_words_popcnt (uint64_t* bits, size_t num_words)
+{
+  uint64_t new_bits = 0;
+  for (size_t w = 0; w < num_words; w++) {
+    new_bits += 64 - _mm_popcnt_u64(bits[w]);
+    bits[w] = ~0ULL;
+  }
+  return new_bits;
+}
+
+__attribute__((target("popcnt")))
+static uint64_t merge_words_popcnt (uint64_t* __restrict__ bits,
+                                    const uint64_t* __restrict__ other_bits,
+                                    size_t num_words)
+{
+  uint64_t new_bits = 0;
+  for (size_t w = 0; w < num_words; w++) {
+    new_bits += _mm_popcnt_u64(other_bits[w] & ~bits[w]);
+    bits[w] |= other_bits[w];
+  }
+  return new_bits;
+}
+
+// Return the number of 1 bits in each 64-bit lane of a 256-bit vector.
+// AVX2 lacks a vector popcount so we look up each nibble's popcount with
+// a byte shuffle and sum the bytes of each lane.
+__attribute__((target("avx2")))
+static inline __m256i popcount_epi64_avx2 (__m256i vec)
+{
+  const __m256i nibble_counts =
+    _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_and_si256(vec, low_nibbles);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(vec, 4), low_nibbles);
+  __m256i byte_counts = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_counts, lo),
+                                        _mm256_shuffle_epi8(nibble_counts, hi));
+  return _mm256_sad_epu8(byte_counts, _mm256_setzero_si256());
+}
+
+// Sum the four 64-bit lanes of a 256-bit vector.
+__attribute__((target("avx2")))
+static inline uint64_t sum_epi64_avx2 (__m256i vec)
+{
+  __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(vec),
+                              _mm256_extracti128_si256(vec, 1));
+  return uint64_t(_mm_cvtsi128_si64(sum)) + uint64_t(_mm_extract_epi64(sum, 1));
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t fill_words_avx2 (uint64_t* bits, size_t num_words)
+{
+  const __m256i all_ones = _mm256_set1_epi64x(-1);
+  __m256i old_bits = _mm256_setzero_si256();
+  size_t w = 0;
+  for (; w + 4 <= num_words; w += 4) {
+    __m256i* vec = (__m256i*) &bits[w];
+    old_bits = _mm256_add_epi64(old_bits, popcount_epi64_avx2(_mm256_loadu_si256(vec)));
+    _mm256_storeu_si256(vec, all_ones);
+  }
+  uint64_t new_bits = 64*w - sum_epi64_avx2(old_bits);
+  for (; w < num_words; w++) {
+    new_bits += 64 - _mm_popcnt_u64(bits[w]);
+    bits[w] = ~0ULL;
+  }
+  return new_bits;
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t merge_words_avx2 (uint64_t* __restrict__ bits,
+                                  const uint64_t* __restrict__ other_bits,
+                                  size_t num_words)
+{
+  __m256i new_bits_vec = _mm256_setzero_si256();
+  size_t w = 0;
+  for (; w + 4 <= num_words; w += 4) {
+    __m256i* vec = (__m256i*) &bits[w];
+    __m256i mine = _mm256_loadu_si256(vec);
+    __m256i theirs = _mm256_loadu_si256((const __m256i*) &other_bits[w]);
+    new_bits_vec = _mm256_add_epi64(new_bits_vec,
+                                    popcount_epi64_avx2(_mm256_andnot_si256(mine, theirs)));
+    _mm256_storeu_si256(vec, _mm256_or_si256(mine, theirs));
+  }
+  uint64_t new_bits = sum_epi64_avx2(new_bits_vec);
+  for (; w < num_words; w++) {
+    new_bits += _mm_popcnt_u64(other_bits[w] & ~bits[w]);
+    bits[w] |= other_bits[w];
+  }
+  return new_bits;
+}
+
+// Sum the eight 64-bit lanes of a 512-bit vector.
+__attribute__((target("avx512f")))
+static inline uint64_t sum_epi64_avx512 (__m512i vec)
+{
+  uint64_t lanes[8];
+  _mm512_storeu_si512(lanes, vec);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+}
+
+// AVX-512 kernels, which use VPOPCNTQ and handle a partial final vector
+// with masked loads and stores.
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t fill_words_avx512 (uint64_t* bits, size_t num_words)
+{
+  const __m512i all_ones = _mm512_set1_epi64(-1);
+  __m512i old_bits = _mm512_setzero_si512();
+  for (size_t w = 0; w < num_words; w += 8) {
+    __mmask8 mask = num_words - w >= 8 ? 0xff : __mmask8((1U << (num_words - w)) - 1);
+    __m512i mine = _mm512_maskz_loadu_epi64(mask, &bits[w]);
+    old_bits = _mm512_add_epi64(old_bits, _mm512_popcnt_epi64(mine));
+    _mm512_mask_storeu_epi64(&bits[w], mask, all_ones);
+  }
+  return 64*num_words - sum_epi64_avx512(old_bits);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t merge_words_avx512 (uint64_t* __restrict__ bits,
+                                    const uint64_t* __restrict__ other_bits,
+                                    size_t num_words)
+{
+  __m512i new_bits = _mm512_setzero_si512();
+  for (size_t w = 0; w < num_words; w += 8) {
+    __mmask8 mask = num_words - w >= 8 ? 0xff : __mmask8((1U << (num_words - w)) - 1);
+    __m512i mine = _mm512_maskz_loadu_epi64(mask, &bits[w]);
+    __m512i merged = _mm512_or_si512(mine, _mm512_maskz_loadu_epi64(mask, &other_bits[w]));
+    new_bits = _mm512_add_epi64(new_bits,
+                                _mm512_popcnt_epi64(_mm512_xor_si512(merged, mine)));
+    _mm512_mask_storeu_epi64(&bits[w], mask, merged);
+  }
+  return sum_epi64_avx512(new_bits);
+}
+
+#endif
+
+// Define each set of kernels and the CPU feature it requires.
+struct BitKernels {
+  const char* name;                          // Name of the instruction-set extension
+  uint64_t (*fill_words)(uint64_t*, size_t);
+  uint64_t (*merge_words)(uint64_t* __restrict__, const uint64_t* __restrict__, size_t);
+  bool (*supported)(void);
+};
+
+static bool always_supported (void)
+{
+  return true;
+}
+
+#ifdef BF_X86_BIT_KERNELS
+static bool popcnt_supported (void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("popcnt");
+}
+
+static bool avx2_supported (void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+static bool avx512_supported (void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq");
+}
+#endif
+
+// List the kernels from most to least preferred.
+static const BitKernels bit_kernels[] = {
+#ifdef BF_X86_BIT_KERNELS
+  {"avx512", fill_words_avx512, merge_words_avx512, avx512_supported},
+  {"avx2", fill_words_avx2, merge_words_avx2, avx2_supported},
+  {"popcnt", fill_words_popcnt, merge_words_popcnt, popcnt_supported},
+#endif
+  {"scalar", fill_words_scalar, merge_words_scalar, always_supported}
+};
+
+// Point to the kernels in use.  These start out as the portable kernels so
+// page tables constructed during static initialization work.
+static uint64_t (*fill_words)(uint64_t*, size_t) = fill_words_scalar;
+static uint64_t (*merge_words)(uint64_t* __restrict__, const uint64_t* __restrict__, size_t) = merge_words_scalar;
+
+// Select the bit-vector kernels to use: the named set or, if name is
+// NULL, the most preferred set the CPU supports.  Return the name of the
+// selected set or NULL if the named set is unknown or unsupported.
+const char* bf_select_bit_kernels (const char* name)
+{
+  for (const BitKernels& kernels : bit_kernels) {
+    if (name != nullptr && strcmp(name, kernels.name) != 0)
+      continue;
+    if (!kernels.supported())
+      continue;
+    fill_words = kernels.fill_words;
+    merge_words = kernels.merge_words;
+    return kernels.name;
+  }
+  return nullptr;
+}
+static const char* initial_bit_kernels = bf_select_bit_kernels(nullptr);
+
 // Construct a page-table entry for bit-sized counters.
 BitPageTableEntry::BitPageTableEntry(size_t pg_size) : BasePageTableEntry(pg_size)
 {
   bytes_touched = 0;
-  bit_vector = new uint64_t[logical_page_size/64];
+  bit_vector = static_cast<uint64_t*>(bf_arena_alloc(sizeof(uint64_t)*logical_page_size/64));
   memset((void *)bit_vector, 0, sizeof(uint64_t)*logical_page_size/64);
 }
 
 // Copy an existing page-table entry.
 BitPageTableEntry::BitPageTableEntry(const BitPageTableEntry& other) : BasePageTableEntry(other)
 {
-  bit_vector = new uint64_t[logical_page_size/64];
+  if (other.bit_vector == nullptr) {
+    // The other page is full, so we don't need a bit vector either.
+    bit_vector = nullptr;
+    return;
+  }
+  bit_vector = static_cast<uint64_t*>(bf_arena_alloc(sizeof(uint64_t)*logical_page_size/64));
   memcpy((void *)bit_vector, other.bit_vector, sizeof(uint64_t)*logical_page_size/64);
 }
 
 // Destruct a bit-sized page-table entry.
 BitPageTableEntry::~BitPageTableEntry()
 {
-  delete[] bit_vector;
+  bf_arena_free(bit_vector, sizeof(uint64_t)*logical_page_size/64);
+}
+
+// Return a word with bits lo through hi, inclusive, set to 1.
+static inline uint64_t bit_range_mask(size_t lo, size_t hi)
+{
+  return (~0ULL >> (63 - (hi - lo))) << lo;
 }
 
 // Increment the tallies associated with a range of bytes, clamping each at 1.
@@ -45,33 +293,28 @@ void BitPageTableEntry::increment(size_t pos1, size_t pos2)
   if (word_ofs1 == word_ofs2) {
     // Fast case -- we have only one word to deal with.
     uint64_t word = bit_vector[word_ofs1]; // Vector of 64 bits
-    size_t bit_ofs1 = pos1%64;             // First bit to set
-    size_t bit_ofs2 = pos2%64;             // Last bit to set
-    uint64_t mask;                         // All 0s except for the bits to set
-    mask = ((2ULL<<(bit_ofs2 - bit_ofs1)) - 1ULL) << bit_ofs1;
-    uint64_t new_word = word | mask;       // Word with new bits set
-    bytes_touched += __builtin_popcountll(word ^ new_word);   // Tally the number of bits that changed.
-    bit_vector[word_ofs1] = new_word;
+    uint64_t mask = bit_range_mask(pos1%64, pos2%64);  // All 0s except for the bits to set
+    bytes_touched += __builtin_popcountll(mask & ~word);   // Tally the number of bits that change.
+    bit_vector[word_ofs1] = word | mask;
   }
   else {
-    // Slow case -- positions span multiple words.
-    for (size_t pos = pos1; pos <= pos2; pos++) {
-      size_t word_ofs = pos/64;             // Word containing the bit of interest
-      size_t bit_ofs = pos%64;              // Bit offset in the target word
-      uint64_t word = bit_vector[word_ofs]; // Vector of 64 bits
-      uint64_t mask = 1ULL<<bit_ofs;        // All 0s except for bitofs
-      if ((word&mask) == 0ULL) {
-        // Bit was previously 0.  Set it to 1.
-        bit_vector[word_ofs] |= mask;
-        bytes_touched++;
-      }
-    }
+    // Slow case -- positions span multiple words.  Set the tail of the
+    // first word, all of each intervening word, and the head of the last
+    // word, tallying the bits that were previously 0.
+    uint64_t mask = bit_range_mask(pos1%64, 63);
+    bytes_touched += __builtin_popcountll(mask & ~bit_vector[word_ofs1]);
+    bit_vector[word_ofs1] |= mask;
+    if (word_ofs2 - word_ofs1 > 1)
+      bytes_touched += fill_words(&bit_vector[word_ofs1 + 1], word_ofs2 - word_ofs1 - 1);
+    mask = bit_range_mask(0, pos2%64);
+    bytes_touched += __builtin_popcountll(mask & ~bit_vector[word_ofs2]);
+    bit_vector[word_ofs2] |= mask;
   }
 
   // If we filled the page, deallocate the memory used by the bit
   // vector, as we won't be setting any more bits.
   if (bytes_touched == logical_page_size) {
-    delete[] bit_vector;
+    bf_arena_free(bit_vector, sizeof(uint64_t)*logical_page_size/64);
     bit_vector = NULL;
   }
 }
@@ -83,98 +326,134 @@ void BitPageTableEntry::merge(BitPageTableEntry* other)
   if (!bit_vector)
     return;
 
-  // If the other PTE is full, set all of our bits to 1.
+  // If the other PTE is full, so is ours.
   if (other->bit_vector == nullptr) {
-    for (size_t w = 0; w < logical_page_size/64; w++) {
-      uint64_t word0 = bit_vector[w];
-      for (size_t b = 0; b < 64; b++) {
-        uint64_t bit0 = word0 & (1ULL<<b);
-        uint64_t bit1 = 1ULL<<b;
-        if (bit0 == 0ULL) {
-          word0 |= bit1;
-          bytes_touched++;
-        }
-      }
-      bit_vector[w] = word0;
-    }
+    bf_arena_free(bit_vector, sizeof(uint64_t)*logical_page_size/64);
+    bit_vector = nullptr;
+    bytes_touched = logical_page_size;
     return;
   }
 
-  // Merge bit-by-bit, incrementing bytes_touched on any transition
-  // from zero to one.
-  for (size_t w = 0; w < logical_page_size/64; w++) {
-    uint64_t word0 = bit_vector[w];
-    uint64_t word1 = other->bit_vector[w];
-    for (size_t b = 0; b < 64; b++) {
-      uint64_t bit0 = word0 & (1ULL<<b);
-      uint64_t bit1 = word1 & (1ULL<<b);
-      if (bit0 == 0ULL && bit1 != 0ULL) {
-        word0 |= bit1;
-        bytes_touched++;
-      }
-    }
-    bit_vector[w] = word0;
+  // OR the other PTE's bits into ours, tallying the number of bits that
+  // transition from zero to one.
+  bytes_touched += merge_words(bit_vector, other->bit_vector, logical_page_size/64);
+  if (bytes_touched == logical_page_size) {
+    bf_arena_free(bit_vector, sizeof(uint64_t)*logical_page_size/64);
+    bit_vector = nullptr;
   }
 }
 
-// Construct a page-table entry for word-sized counters.
+// Construct a page-table entry for word-sized counters.  Counters start out
+// as narrow as possible.
 WordPageTableEntry::WordPageTableEntry(size_t pg_size) : BasePageTableEntry(pg_size)
 {
   bytes_touched = 0;
-  byte_counter = new bytecount_t[logical_page_size];
-  memset((void *)byte_counter, 0, sizeof(bytecount_t)*logical_page_size);
+  counter_bytes = 1;
+  byte_counter = bf_arena_alloc(logical_page_size*counter_bytes);
+  memset(byte_counter, 0, logical_page_size*counter_bytes);
 }
 
 // Copy an existing page-table entry.
 WordPageTableEntry::WordPageTableEntry(const WordPageTableEntry& other) : BasePageTableEntry(other)
 {
-  byte_counter = new bytecount_t[logical_page_size];
-  memcpy((void *)byte_counter, other.byte_counter, sizeof(bytecount_t)*logical_page_size);
+  counter_bytes = other.counter_bytes;
+  byte_counter = bf_arena_alloc(logical_page_size*counter_bytes);
+  memcpy(byte_counter, other.byte_counter, logical_page_size*counter_bytes);
 }
 
 // Destruct a word-sized page-table entry.
 WordPageTableEntry::~WordPageTableEntry()
 {
-  delete[] byte_counter;
+  bf_arena_free(byte_counter, logical_page_size*counter_bytes);
 }
 
-// Increment the tallies associated with a range of bytes, clamping each at the
-// maximum word value.
-void WordPageTableEntry::increment(size_t pos1, size_t pos2)
+// Replace all of our counters with counters of the next larger width.
+void WordPageTableEntry::widen()
+{
+  size_t new_bytes = counter_bytes == 1 ? 2 : sizeof(bytecount_t);
+  void* new_counter = bf_arena_alloc(logical_page_size*new_bytes);
+  for (size_t pos = 0; pos < logical_page_size; pos++)
+    if (new_bytes == 2)
+      static_cast<uint16_t*>(new_counter)[pos] = static_cast<uint8_t*>(byte_counter)[pos];
+    else
+      static_cast<bytecount_t*>(new_counter)[pos] = get_count(pos);
+  bf_arena_free(byte_counter, logical_page_size*counter_bytes);
+  byte_counter = new_counter;
+  counter_bytes = new_bytes;
+}
+
+// Increment the tallies of a range of bytes using counters of a given width.
+// Return the first position that requires a wider counter or pos2+1 if all
+// counters were incremented.  Counters of the maximum width are clamped
+// instead of widened.
+template<typename T>
+size_t WordPageTableEntry::increment_as(size_t pos1, size_t pos2)
 {
+  T* counter = static_cast<T*>(byte_counter);
+  const T max_value = T(~T(0));
   for (size_t pos = pos1; pos <= pos2; pos++)
-    switch (byte_counter[pos]) {
-      case bf_max_bytecount:
-        // Maxed out our counter -- don't increment it further.
+    switch (counter[pos]) {
+      case max_value:
+        // Maxed out our counter -- widen it or don't increment it further.
+        if (sizeof(T) < sizeof(bytecount_t))
+          return pos;
         break;
 
       case 0:
         // First time a byte was touched
         bytes_touched++;
-        byte_counter[pos]++;
+        counter[pos]++;
         break;
 
       default:
         // Common case -- increment the counter.
-        byte_counter[pos]++;
+        counter[pos]++;
         break;
     }
+  return pos2 + 1;
+}
+
+// Increment the tallies associated with a range of bytes, clamping each at the
+// maximum word value.
+void WordPageTableEntry::increment(size_t pos1, size_t pos2)
+{
+  for (size_t pos = pos1; ; widen()) {
+    switch (counter_bytes) {
+      case 1:
+        pos = increment_as<uint8_t>(pos, pos2);
+        break;
+      case 2:
+        pos = increment_as<uint16_t>(pos, pos2);
+        break;
+      default:
+        pos = increment_as<bytecount_t>(pos, pos2);
+        break;
+    }
+    if (pos > pos2)
+      return;
+  }
 }
 
 // Merge the counts from another WordPageTableEntry into ours.
 void WordPageTableEntry::merge(WordPageTableEntry* other)
 {
+  while (counter_bytes < other->counter_bytes)
+    widen();
   for (size_t pos = 0; pos < logical_page_size; pos++) {
-    bytecount_t count0 = byte_counter[pos];
-    bytecount_t count1 = other->byte_counter[pos];
+    bytecount_t count0 = get_count(pos);
+    bytecount_t count1 = other->get_count(pos);
     if (count1 == 0)
       continue;
-    if (count0 != 0) {
-      byte_counter[pos] = count1;
+    bytecount_t sum;
+    if (count0 == 0) {
+      sum = count1;
       bytes_touched++;
     }
     else
-      byte_counter[pos] = (count1 > bf_max_bytecount - count0) ? bf_max_bytecount : count0 + count1;
+      sum = (count1 > bf_max_bytecount - count0) ? bf_max_bytecount : count0 + count1;
+    while (sum > max_count())
+      widen();
+    set_count(pos, sum);
   }
 }
 
@@ -14,6 +14,12 @@ using namespace std;
 
 namespace bytesflops {
 
+// Select the kernels that fill and merge BitPageTableEntry bit vectors:
+// "scalar", "popcnt", "avx2", "avx512", or NULL for the best the CPU
+// supports.  Return the name of the selected kernels or NULL if the
+// requested kernels are unavailable.
+extern const char* bf_select_bit_kernels(const char* name);
+
 // Define a mapping from a page-aligned memory address to a vector of counters,
 // one per byte.
 class BasePageTableEntry {
@@ -56,10 +62,50 @@ public:
   ~BitPageTableEntry();
 };
 
-// Specialize BasePageTableEntry for word-sized counters.
+// Specialize BasePageTableEntry for word-sized counters.  To save memory,
+// counters start out 8 bits wide, and all of a page's counters are widened
+// to 16 bits and then to the width of a bytecount_t as soon as any one of
+// them would overflow.
 class WordPageTableEntry : public BasePageTableEntry {
 private:
-  bytecount_t* byte_counter;      // One counter per byte on the page
+  void* byte_counter;             // One counter per byte on the page
+  uint8_t counter_bytes;          // Width in bytes of each counter
+
+  // Increment the tallies of a range of bytes using counters of a given
+  // width.  Return the first position that requires a wider counter or
+  // pos2+1 if all counters were incremented.
+  template<typename T>
+  size_t increment_as(size_t pos1, size_t pos2);
+
+  // Return the maximum value a counter can currently hold.
+  bytecount_t max_count() const {
+    switch (counter_bytes) {
+      case 1:
+        return UINT8_MAX;
+      case 2:
+        return UINT16_MAX;
+      default:
+        return ~(bytecount_t)0;
+    }
+  }
+
+  // Replace all of our counters with counters of the next larger width.
+  void widen();
+
+  // Assign a value to a given byte's counter.  The value must fit.
+  void set_count(size_t pos, bytecount_t value) {
+    switch (counter_bytes) {
+      case 1:
+        static_cast<uint8_t*>(byte_counter)[pos] = uint8_t(value);
+        break;
+      case 2:
+        static_cast<uint16_t*>(byte_counter)[pos] = uint16_t(value);
+        break;
+      default:
+        static_cast<bytecount_t*>(byte_counter)[pos] = value;
+        break;
+    }
+  }
 
 public:
   // Increment the tallies associated with a range of bytes, clamping each at
@@ -69,8 +115,17 @@ public:
   // Merge the counts from another WordPageTableEntry into ours.
   void merge(WordPageTableEntry* other);
 
-  // Expose the raw counts.
-  bytecount_t* raw_counts() { return byte_counter; }
+  // Return the count associated with a given byte.
+  bytecount_t get_count(size_t pos) const {
+    switch (counter_bytes) {
+      case 1:
+        return static_cast<const uint8_t*>(byte_counter)[pos];
+      case 2:
+        return static_cast<const uint16_t*>(byte_counter)[pos];
+      default:
+        return static_cast<const bytecount_t*>(byte_counter)[pos];
+    }
+  }
 
   // Define a constructor, copy constructor, and destructor.
   WordPageTableEntry(size_t pg_size);
@@ -78,100 +133,272 @@ public:
   ~WordPageTableEntry();
 };
 
+// Allocate page-table entries in blocks from Byfl's private arena to avoid
+// an allocation per page.
+template<typename PTE>
+class PTEArena {
+private:
+  static const size_t ptes_per_block = 64;  // Number of PTEs to allocate at once
+  vector<PTE*> blocks;                      // Raw storage for PTEs
+  size_t used_in_block = ptes_per_block;    // Number of PTEs constructed in the last block
+
+public:
+  // Construct a new PTE.
+  PTE* allocate (size_t pg_size) {
+    if (used_in_block == ptes_per_block) {
+      blocks.push_back(static_cast<PTE*>(bf_arena_alloc(sizeof(PTE)*ptes_per_block)));
+      used_in_block = 0;
+    }
+    return new (blocks.back() + used_in_block++) PTE(pg_size);
+  }
+
+  // Destruct all PTEs and release their storage.
+  void clear (void) {
+    for (size_t b = 0; b < blocks.size(); b++) {
+      size_t num_ptes = b == blocks.size() - 1 ? used_in_block : ptes_per_block;
+      for (size_t i = 0; i < num_ptes; i++)
+        blocks[b][i].~PTE();
+      bf_arena_free(blocks[b], sizeof(PTE)*ptes_per_block);
+    }
+    blocks.clear();
+    used_in_block = ptes_per_block;
+  }
+
+  ~PTEArena() { clear(); }
+};
+
 // Define a page table that associates a counter with each byte of program
-// memory.
+// memory.  Like a hardware page table, the page table is a radix tree
+// indexed by successive groups of page-number bits.  The tree starts as a
+// single leaf and grows taller only as needed to cover the pages accessed.
 template<typename PTE>
-class PageTable {
+class PageTable : public ArenaAllocated {
 private:
-  // Define an equality functors for use in constructing various hash tables.
-  struct eqaddr {
-    bool operator()(uintptr_t p1, uintptr_t p2) const { return p1 == p2; }
+  // Define a radix-tree node.  Leaves point to PTEs; all other nodes point
+  // to nodes one level down.
+  static const unsigned int radix_bits = 8;    // Page-number bits per level
+  static const uint64_t radix_size = 1ULL<<radix_bits;   // Children per node
+  struct RadixNode : public ArenaAllocated {
+    void* child[radix_size];
   };
 
-  // Define a mapping from a page number to the associated PageTableEntry.
-  typedef CachedUnorderedMap<uintptr_t, PTE*, hash<uintptr_t>, eqaddr> page_to_PTE_t;
-  page_to_PTE_t mapping;
+  typedef vector<pair<uint64_t, PTE*> > page_list_t;
+  page_list_t pages;            // Every {page number, PTE} in order of creation
+  PTEArena<PTE> arena;          // Storage for all of our PTEs
+  RadixNode* root = nullptr;    // Root of the radix tree
+  unsigned int height = 0;      // Number of levels in the radix tree
+  uint64_t root_base = 0;       // First page number covered by the root
+
+  // Cache recently used leaves so that interleaved accesses to a few
+  // regions of memory (e.g., heap and stack) rarely walk the tree.
+  static const unsigned int leaf_cache_bits = 3;
+  struct LeafCacheEntry {
+    uint64_t base = ~(uint64_t)0;   // First page number covered by leaf
+    RadixNode* leaf = nullptr;      // Leaf node
+  };
+  LeafCacheEntry leaf_cache[1<<leaf_cache_bits];
 
   // Logical page size in bytes represented
   size_t logical_page_size;
 
-  // Given a mapping of page numbers to counter vectors and a page number,
-  // return a counter vector, creating it if not found.
-  PTE* find_or_create_page (page_to_PTE_t& mapping, uint64_t pagenum) {
-    auto counters_iter = mapping.find(pagenum);
-    if (counters_iter == mapping.end()) {
+  // Return the number of page-number bits covered by a tree of a given
+  // height, capped at 64.
+  static unsigned int span_bits (unsigned int levels) {
+    return min(levels*radix_bits, 64U);
+  }
+
+  // Return true if a page number lies within the range covered by the root.
+  bool root_covers (uint64_t pagenum) const {
+    unsigned int span = span_bits(height);
+    return span == 64 || (pagenum >> span) == (root_base >> span);
+  }
+
+  // Free a radix tree node and all of its descendants.
+  static void free_node (RadixNode* node, unsigned int levels) {
+    if (levels > 1)
+      for (uint64_t i = 0; i < radix_size; i++)
+        if (node->child[i] != nullptr)
+          free_node(static_cast<RadixNode*>(node->child[i]), levels - 1);
+    delete node;
+  }
+
+  // Return the leaf-cache entry responsible for a given page number.
+  LeafCacheEntry& leaf_cache_slot (uint64_t pagenum) {
+    return leaf_cache[((pagenum >> radix_bits)*0x9E3779B97F4A7C15ULL) >> (64 - leaf_cache_bits)];
+  }
+
+  // Return the leaf covering a given page number or NULL if no such leaf
+  // exists.  This walks the tree without consulting the leaf cache.
+  RadixNode* find_leaf (uint64_t pagenum) const {
+    if (root == nullptr || !root_covers(pagenum))
+      return nullptr;
+    RadixNode* node = root;
+    for (unsigned int level = height - 1; level > 0; level--) {
+      node = static_cast<RadixNode*>(node->child[(pagenum >> (level*radix_bits)) & (radix_size - 1)]);
+      if (node == nullptr)
+        return nullptr;
+    }
+    return node;
+  }
+
+  // Return the leaf covering a given page number, creating it (and growing
+  // the tree) if necessary.
+  RadixNode* find_or_create_leaf (uint64_t pagenum) {
+    // Handle the common case of a page near one recently accessed.
+    uint64_t leaf_base = pagenum & ~(radix_size - 1);
+    LeafCacheEntry& cached = leaf_cache_slot(pagenum);
+    if (cached.base == leaf_base)
+      return cached.leaf;
+
+    // Grow the tree upwards until its root covers the page.
+    if (root == nullptr) {
+      root = new RadixNode();
+      height = 1;
+      root_base = leaf_base;
+    }
+    while (!root_covers(pagenum)) {
+      RadixNode* new_root = new RadixNode();
+      new_root->child[(root_base >> span_bits(height)) & (radix_size - 1)] = root;
+      root = new_root;
+      height++;
+      unsigned int span = span_bits(height);
+      root_base = span == 64 ? 0 : (root_base >> span) << span;
+    }
+
+    // Walk down the tree to the leaf, creating nodes as we go.
+    RadixNode* node = root;
+    for (unsigned int level = height - 1; level > 0; level--) {
+      void*& child = node->child[(pagenum >> (level*radix_bits)) & (radix_size - 1)];
+      if (child == nullptr)
+        child = new RadixNode();
+      node = static_cast<RadixNode*>(child);
+    }
+    cached.base = leaf_base;
+    cached.leaf = node;
+    return node;
+  }
+
+  // Given a page number, return a counter vector, creating it if not found.
+  PTE* find_or_create_page (uint64_t pagenum) {
+    void*& slot = find_or_create_leaf(pagenum)->child[pagenum & (radix_size - 1)];
+    if (slot == nullptr) {
       // This is the first byte we've touched on the page.
-      mapping[pagenum] = new PTE(logical_page_size);
-      return mapping[pagenum];
+      PTE* pte = arena.allocate(logical_page_size);
+      pages.push_back(make_pair(pagenum, pte));
+      slot = pte;
     }
-    else
-      // We've seen other bytes on this page.
-      return counters_iter->second;
+    return static_cast<PTE*>(slot);
   }
 
 public:
   // Store the logical page size.
   PageTable(size_t pg_size) : logical_page_size(pg_size) { }
 
-  // Expose iterators to our underlying address-to-PTE mapping.
-  typename page_to_PTE_t::iterator begin() { return mapping.begin(); }
-  typename page_to_PTE_t::iterator end() { return mapping.end(); }
+  // Free all of our memory when we're destroyed.
+  ~PageTable() { clear(); }
+
+  // Page tables own their PTEs and therefore can't be copied.
+  PageTable(const PageTable&) = delete;
+  PageTable& operator=(const PageTable&) = delete;
 
-  // Increment each counter in a given range.
-  void access (uint64_t baseaddr, uint64_t numaddrs) {
+  // Return the logical page size in bytes.
+  size_t page_size (void) const {
+    return logical_page_size;
+  }
+
+  // Given a page number, return its PTE, creating it if not found.
+  PTE* get_page (uint64_t pagenum) {
+    return find_or_create_page(pagenum);
+  }
+
+  // Given a page number, return its PTE or NULL if the page was never
+  // created.  Unlike get_page(), this never grows the tree.
+  PTE* find_page (uint64_t pagenum) {
+    uint64_t leaf_base = pagenum & ~(radix_size - 1);
+    LeafCacheEntry& cached = leaf_cache_slot(pagenum);
+    if (cached.base == leaf_base)
+      return static_cast<PTE*>(cached.leaf->child[pagenum & (radix_size - 1)]);
+    RadixNode* node = find_leaf(pagenum);
+    if (node == nullptr)
+      return nullptr;
+    cached.base = leaf_base;
+    cached.leaf = node;
+    return static_cast<PTE*>(node->child[pagenum & (radix_size - 1)]);
+  }
+
+  // Given a page number, return its PTE or NULL if the page was never
+  // created.  Unlike find_page(), this never touches the leaf cache, so
+  // multiple threads may call it concurrently as long as no thread is
+  // modifying the page table.
+  PTE* find_page_shared (uint64_t pagenum) const {
+    RadixNode* node = find_leaf(pagenum);
+    if (node == nullptr)
+      return nullptr;
+    return static_cast<PTE*>(node->child[pagenum & (radix_size - 1)]);
+  }
+
+  // Expose iterators to our {page number, PTE} pairs.
+  typename page_list_t::iterator begin() { return pages.begin(); }
+  typename page_list_t::iterator end() { return pages.end(); }
+
+  // Increment each counter in a given range, and return the number of
+  // addresses in the range that had never before been accessed.
+  uint64_t access (uint64_t baseaddr, uint64_t numaddrs) {
     uint64_t first_page = baseaddr / logical_page_size;
     uint64_t last_page = (baseaddr + numaddrs - 1) / logical_page_size;
+    uint64_t pagebase = baseaddr % logical_page_size;
     if (first_page == last_page) {
       // Common case (we hope) -- all addresses lie on the same logical page.
-      PTE* counters = find_or_create_page(mapping, first_page);
-      uint64_t pagebase = baseaddr % logical_page_size;
+      PTE* counters = find_or_create_page(first_page);
+      uint64_t old_count = counters->count();
       counters->increment(pagebase, pagebase + numaddrs - 1);
+      return counters->count() - old_count;
+    }
+
+    // Less common case -- addresses span logical pages.  Increment each
+    // page's portion of the range in a single operation.
+    uint64_t new_addrs = 0;
+    for (uint64_t pagenum = first_page; pagenum <= last_page; pagenum++) {
+      uint64_t lastbyte = pagenum == last_page
+        ? (baseaddr + numaddrs - 1) % logical_page_size
+        : logical_page_size - 1;
+      PTE* counters = find_or_create_page(pagenum);
+      uint64_t old_count = counters->count();
+      counters->increment(pagebase, lastbyte);
+      new_addrs += counters->count() - old_count;
+      pagebase = 0;
     }
-    else
-      // Less common case -- addresses may span logical pages.
-      for (uint64_t i = 0; i < numaddrs; i++) {
-        uint64_t address = baseaddr + i;
-        uint64_t pagenum = address / logical_page_size;
-        uint64_t byteoffset = address % logical_page_size;
-        PTE* counters = find_or_create_page(mapping, pagenum);
-        counters->increment(byteoffset, byteoffset);
-      }
+    return new_addrs;
   }
 
   // Merge another page table into ours.
   void merge (PageTable<PTE>* other) {
-    // Ensure we have a superset of the other page table's pages.
-    for (auto page_iter = other->mapping.begin();
-         page_iter != other->mapping.end();
-         page_iter++) {
-      uint64_t page_num = page_iter->first;
-      if (mapping.find(page_num) != mapping.end())
-        continue;
-      mapping[page_num] = new PTE(logical_page_size);
-    }
+    for (auto page_iter = other->pages.begin();
+         page_iter != other->pages.end();
+         page_iter++)
+      find_or_create_page(page_iter->first)->merge(page_iter->second);
+  }
 
-    // Merge page-by-page.
-    for (auto page_iter = mapping.begin();
-         page_iter != mapping.end();
-         page_iter++) {
-      uint64_t page_num = page_iter->first;
-      auto other_page_iter = other->mapping.find(page_num);
-      if (other_page_iter == other->mapping.end())
-        continue;
-      BitPageTableEntry* pte = other_page_iter->second;
-      page_iter->second->merge(pte);
-    }
+  // Discard all of our pages.
+  void clear (void) {
+    if (root != nullptr)
+      free_node(root, height);
+    root = nullptr;
+    height = 0;
+    root_base = 0;
+    for (auto& cached : leaf_cache)
+      cached = LeafCacheEntry();
+    pages.clear();
+    arena.clear();
   }
 
   // Return the number of unique addresses accessed.
   uint64_t tally_unique (void) {
     uint64_t unique_addrs = 0;
-    for (auto page_iter = mapping.begin();
-         page_iter != mapping.end();
-         page_iter++) {
-      const PTE* counters = page_iter->second;
-      unique_addrs += counters->count();
-    }
+    for (auto page_iter = pages.begin();
+         page_iter != pages.end();
+         page_iter++)
+      unique_addrs += page_iter->second->count();
     return unique_addrs;
   }
 };
@@ -0,0 +1,318 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (reduction of counters across the processes of a parallel job)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+
+using namespace std;
+
+namespace bytesflops {
+
+extern ostream* bfout;
+extern BinaryOStream* bfbin;
+
+// Define the subset of the counters we reduce for the program as a whole
+// and for each function.  The program-wide values are followed by the
+// instruction-mix histogram.
+enum {
+  REDUCE_BBLOCKS,          // Basic blocks executed
+  REDUCE_LOAD_INS,         // Load instructions executed
+  REDUCE_STORE_INS,        // Store instructions executed
+  REDUCE_FLOPS,            // Floating-point operations performed
+  REDUCE_INT_OPS,          // Integer operations performed
+  REDUCE_CALL_INS,         // Function calls executed
+  REDUCE_LOADS,            // Bytes loaded
+  REDUCE_STORES,           // Bytes stored
+  REDUCE_FP_BITS,          // Bits consumed or produced by floating-point operations
+  REDUCE_OP_BITS,          // Bits consumed or produced by all non-memory operations
+  NUM_REDUCED_COUNTERS
+};
+
+// Name each of the above in the textual and binary output, respectively.
+static const char* reduced_text_names[NUM_REDUCED_COUNTERS] = {
+  "basic blocks",
+  "loads",
+  "stores",
+  "flops",
+  "integer ops",
+  "function calls",
+  "bytes loaded",
+  "bytes stored",
+  "flop bits",
+  "op bits (excluding memory ops)"
+};
+static const char* reduced_binary_names[NUM_REDUCED_COUNTERS] = {
+  "Basic blocks",
+  "Load operations",
+  "Store operations",
+  "Floating-point operations",
+  "Integer operations",
+  "Function-call operations (non-exception-throwing)",
+  "Bytes loaded",
+  "Bytes stored",
+  "Floating-point operation bits",
+  "Integer operation bits"
+};
+
+static const size_t program_width = NUM_REDUCED_COUNTERS + NUM_LLVM_OPCODES;
+static const size_t function_width = NUM_REDUCED_COUNTERS;
+
+static uint64_t* local_program = nullptr;           // This process's program-wide values
+static map<KeyType_t, uint64_t*>* local_funcs = nullptr;  // This process's per-function values
+static bool silenced = false;                       // true=another process reports for us
+static bool shards_omitted = false;                 // true=live threads' shards weren't reduced
+
+// Store the reduced values for output at the end of the run.  These are
+// allocated dynamically so they're not destroyed before we output them.
+class ReducedValues {
+public:
+  string scope;                   // Set of processes reduced over
+  uint64_t procs;                 // Number of processes reduced over
+  vector<KeyType_t> keys;         // Function keys
+  vector<uint64_t> mins;          // Minimum of each value
+  vector<uint64_t> sums;          // Sum of each value
+  vector<uint64_t> maxes;         // Maximum of each value
+};
+static ReducedValues* reduced = nullptr;
+
+// Extract the counters we reduce from a set of ByteFlopCounters.
+static void extract_reduced_counters (const ByteFlopCounters& counters,
+                                      uint64_t* values)
+{
+  values[REDUCE_BBLOCKS] = counters.terminators[BF_END_BB_ANY];
+  values[REDUCE_LOAD_INS] = counters.load_ins;
+  values[REDUCE_STORE_INS] = counters.store_ins;
+  values[REDUCE_FLOPS] = counters.flops;
+  values[REDUCE_INT_OPS] = counters.ops - counters.flops - counters.load_ins - counters.store_ins - counters.terminators[BF_END_BB_ANY];
+  values[REDUCE_CALL_INS] = counters.call_ins;
+  values[REDUCE_LOADS] = counters.loads;
+  values[REDUCE_STORES] = counters.stores;
+  values[REDUCE_FP_BITS] = counters.fp_bits;
+  values[REDUCE_OP_BITS] = counters.op_bits;
+}
+
+// Tell the caller whether another process will report our counters.
+bool bf_reduce_silenced (void)
+{
+  return silenced;
+}
+
+// Output the reduced counters (minimum, mean, maximum, and imbalance) in
+// both textual and binary format.
+void bf_report_reduction (void)
+{
+  if (reduced == nullptr)
+    return;
+  const vector<uint64_t>& reduced_mins = reduced->mins;
+  const vector<uint64_t>& reduced_sums = reduced->sums;
+  const vector<uint64_t>& reduced_maxes = reduced->maxes;
+  const vector<KeyType_t>& reduced_keys = reduced->keys;
+  string tag(bf_output_prefix + "BYFL_MPI");
+  double nprocs = double(reduced->procs);
+
+  // Return the percentage by which a maximum exceeds a mean.
+  auto imbalance = [&](size_t i) -> double {
+    double mean = double(reduced_sums[i])/nprocs;
+    return mean == 0.0 ? 0.0 : (double(reduced_maxes[i])/mean - 1.0)*100.0;
+  };
+
+  // Output the program-wide counters in textual format.
+  *bfout << tag << ": " << setw(25) << reduced->procs
+         << " processes reduced (scope: " << reduced->scope << ")\n";
+  if (shards_omitted)
+    *bfout << "BYFL_WARNING: With -bf-thread-shards, the MPI reduction omits counts from threads still running\n"
+           << "BYFL_WARNING:     at MPI_Finalize and does not reduce per-function counters.\n";
+  *bfout << tag << ": " << setw(25) << "Minimum" << ' '
+         << setw(25) << "Mean" << ' '
+         << setw(25) << "Maximum" << ' '
+         << setw(10) << "Imbal. %" << " Counter\n";
+  for (size_t i = 0; i < NUM_REDUCED_COUNTERS; i++)
+    *bfout << tag << ": " << setw(25) << reduced_mins[i] << ' '
+           << setw(25) << fixed << setprecision(1) << double(reduced_sums[i])/nprocs << ' '
+           << setw(25) << reduced_maxes[i] << ' '
+           << setw(10) << imbalance(i) << ' '
+           << reduced_text_names[i] << '\n';
+  bfout->unsetf(ios_base::floatfield);
+
+  // Output the program-wide counters in binary format.  Binary output
+  // supports only integer columns so we round the mean and express the
+  // imbalance in hundredths of a percent.
+  *bfbin << uint8_t(BINOUT_TABLE_KEYVAL) << "MPI reduction"
+         << uint8_t(BINOUT_COL_UINT64) << "Processes" << reduced->procs
+         << uint8_t(BINOUT_COL_STRING) << "Scope" << reduced->scope
+         << uint8_t(BINOUT_COL_NONE);
+  *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "MPI summary"
+         << uint8_t(BINOUT_COL_STRING) << "Counter"
+         << uint8_t(BINOUT_COL_UINT64) << "Minimum"
+         << uint8_t(BINOUT_COL_UINT64) << "Mean"
+         << uint8_t(BINOUT_COL_UINT64) << "Maximum"
+         << uint8_t(BINOUT_COL_UINT64) << "Sum"
+         << uint8_t(BINOUT_COL_UINT64) << "Imbalance (hundredths of a percent)"
+         << uint8_t(BINOUT_COL_NONE);
+  for (size_t i = 0; i < NUM_REDUCED_COUNTERS; i++)
+    *bfbin << uint8_t(BINOUT_ROW_DATA)
+           << reduced_binary_names[i]
+           << reduced_mins[i]
+           << uint64_t(double(reduced_sums[i])/nprocs + 0.5)
+           << reduced_maxes[i]
+           << reduced_sums[i]
+           << uint64_t(imbalance(i)*100.0 + 0.5);
+  *bfbin << uint8_t(BINOUT_ROW_NONE);
+
+  // Output the instruction mix, omitting opcodes no process executed.
+  if (bf_tally_inst_mix) {
+    *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "MPI instruction mix"
+           << uint8_t(BINOUT_COL_STRING) << "Instruction"
+           << uint8_t(BINOUT_COL_UINT64) << "Minimum"
+           << uint8_t(BINOUT_COL_UINT64) << "Mean"
+           << uint8_t(BINOUT_COL_UINT64) << "Maximum"
+           << uint8_t(BINOUT_COL_UINT64) << "Sum"
+           << uint8_t(BINOUT_COL_NONE);
+    for (size_t op = 0; op < NUM_LLVM_OPCODES; op++) {
+      size_t i = NUM_REDUCED_COUNTERS + op;
+      if (reduced_sums[i] == 0)
+        continue;
+      *bfbin << uint8_t(BINOUT_ROW_DATA)
+             << opcode2name[op]
+             << reduced_mins[i]
+             << uint64_t(double(reduced_sums[i])/nprocs + 0.5)
+             << reduced_maxes[i]
+             << reduced_sums[i];
+    }
+    *bfbin << uint8_t(BINOUT_ROW_NONE);
+  }
+
+  // Output the per-function counters.
+  if (reduced_keys.empty())
+    return;
+  *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "MPI functions"
+         << uint8_t(BINOUT_COL_STRING) << "Demangled function name"
+         << uint8_t(BINOUT_COL_UINT64) << "Function key";
+  for (size_t c = 0; c < NUM_REDUCED_COUNTERS; c++)
+    *bfbin << uint8_t(BINOUT_COL_UINT64) << string(reduced_binary_names[c]) + " (minimum)"
+           << uint8_t(BINOUT_COL_UINT64) << string(reduced_binary_names[c]) + " (mean)"
+           << uint8_t(BINOUT_COL_UINT64) << string(reduced_binary_names[c]) + " (maximum)";
+  *bfbin << uint8_t(BINOUT_COL_NONE);
+  for (size_t f = 0; f < reduced_keys.size(); f++) {
+    string funcname(bf_func_key_to_name(reduced_keys[f]));
+    *bfbin << uint8_t(BINOUT_ROW_DATA)
+           << (funcname == "" ? string("[unknown]") : demangle_func_name(funcname))
+           << uint64_t(reduced_keys[f]);
+    for (size_t c = 0; c < NUM_REDUCED_COUNTERS; c++) {
+      size_t i = program_width + f*function_width + c;
+      *bfbin << reduced_mins[i]
+             << uint64_t(double(reduced_sums[i])/nprocs + 0.5)
+             << reduced_maxes[i];
+    }
+  }
+  *bfbin << uint8_t(BINOUT_ROW_NONE);
+}
+
+} // namespace bytesflops
+
+using namespace bytesflops;
+
+// Return the number of values reduced for the program as a whole.
+size_t bf_reduce_program_width (void)
+{
+  return program_width;
+}
+
+// Return the number of values reduced for each function.
+size_t bf_reduce_function_width (void)
+{
+  return function_width;
+}
+
+// Snapshot the calling process's counters, and return the number of
+// functions for which counters are available.  Per-function counters are
+// omitted when using -bf-call-stack because their keys are assigned at run
+// time and therefore differ across processes.  With -bf-thread-shards,
+// other live threads update their shards without the mega-lock, so those
+// shards can't safely be merged here.  The snapshot therefore covers only
+// the calling thread and threads that already exited, and we omit the
+// per-function counters (which would be even less complete) and warn.
+size_t bf_reduce_snapshot (void)
+{
+  bf_initialize_if_necessary();
+  if (local_program == nullptr) {
+    local_program = new uint64_t[program_width];
+    local_funcs = new map<KeyType_t, uint64_t*>;
+  }
+  bf_acquire_mega_lock();
+  static ByteFlopCounters totals;
+  bf_snapshot_totals(totals);
+  extract_reduced_counters(totals, local_program);
+  memcpy(&local_program[NUM_REDUCED_COUNTERS], totals.inst_mix_histo,
+         NUM_LLVM_OPCODES*sizeof(uint64_t));
+  shards_omitted = bf_thread_shards;
+  if (bf_per_func && !bf_call_stack && !bf_thread_shards)
+    bf_snapshot_func_totals([](KeyType_t key, const ByteFlopCounters& counters) {
+        // A function may be visited more than once so we accumulate.
+        uint64_t*& values = (*local_funcs)[key];
+        if (values == nullptr) {
+          values = new uint64_t[function_width];
+          memset(values, 0, function_width*sizeof(uint64_t));
+        }
+        uint64_t more_values[NUM_REDUCED_COUNTERS];
+        extract_reduced_counters(counters, more_values);
+        for (size_t i = 0; i < function_width; i++)
+          values[i] += more_values[i];
+      });
+  bf_release_mega_lock();
+  return local_funcs->size();
+}
+
+// Copy the program-wide values from the most recent snapshot.
+void bf_reduce_program_values (uint64_t* values)
+{
+  memcpy(values, local_program, program_width*sizeof(uint64_t));
+}
+
+// Copy the function keys from the most recent snapshot in sorted order.
+void bf_reduce_function_keys (uint64_t* keys)
+{
+  for (auto iter = local_funcs->cbegin(); iter != local_funcs->cend(); iter++)
+    *keys++ = iter->first;
+}
+
+// Copy the per-function values from the most recent snapshot for a given
+// list of functions.
+void bf_reduce_function_values (const uint64_t* keys, size_t num_keys,
+                                uint64_t* values)
+{
+  for (size_t f = 0; f < num_keys; f++, values += function_width) {
+    auto iter = local_funcs->find(keys[f]);
+    if (iter == local_funcs->end())
+      memset(values, 0, function_width*sizeof(uint64_t));
+    else
+      memcpy(values, iter->second, function_width*sizeof(uint64_t));
+  }
+}
+
+// Store the reduced values for bf_report_reduction() to output.
+void bf_reduce_results (const char* scope, uint64_t num_procs,
+                        size_t num_keys, const uint64_t* keys,
+                        const uint64_t* mins, const uint64_t* sums,
+                        const uint64_t* maxes)
+{
+  size_t num_values = program_width + num_keys*function_width;
+  if (reduced == nullptr)
+    reduced = new ReducedValues;
+  reduced->scope = scope;
+  reduced->procs = num_procs;
+  reduced->keys.assign(keys, keys + num_keys);
+  reduced->mins.assign(mins, mins + num_values);
+  reduced->sums.assign(sums, sums + num_values);
+  reduced->maxes.assign(maxes, maxes + num_values);
+}
+
+// Suppress the calling process's end-of-run output because another
+// process is reporting on its behalf.
+void bf_reduce_silence (void)
+{
+  silenced = true;
+}
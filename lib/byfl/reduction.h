@@ -0,0 +1,57 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (interface for reducing counters across processes)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#ifndef _REDUCTION_H_
+#define _REDUCTION_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// The following functions let a separate library (libbyfl-mpi) reduce
+// Byfl's counters across the processes of a parallel job without the
+// run-time library itself depending on any message-passing layer.  The
+// sequence is (1) bf_reduce_snapshot() on every process; (2) a reduction of
+// the values returned by bf_reduce_program_values() and
+// bf_reduce_function_values(); then (3) bf_reduce_results() on the process
+// that should report the reduced values and bf_reduce_silence() on all
+// others.
+extern "C" {
+  // Return the number of values reduced for the program as a whole and for
+  // each function.
+  size_t bf_reduce_program_width(void);
+  size_t bf_reduce_function_width(void);
+
+  // Snapshot the calling process's counters, and return the number of
+  // distinct functions for which counters are available.
+  size_t bf_reduce_snapshot(void);
+
+  // Copy bf_reduce_program_width() values into a given array.
+  void bf_reduce_program_values(uint64_t* values);
+
+  // Copy the (sorted) keys of the functions in the snapshot into a given
+  // array.
+  void bf_reduce_function_keys(uint64_t* keys);
+
+  // Copy bf_reduce_function_width() values for each of num_keys functions
+  // into a given array, using zeroes for functions absent from the snapshot.
+  void bf_reduce_function_values(const uint64_t* keys, size_t num_keys,
+                                 uint64_t* values);
+
+  // Store the reduced values for output at the end of the run.  scope
+  // describes the set of processes (e.g., "job" or "node").  mins, sums,
+  // and maxes each contain the program values followed by the values for
+  // each function in keys.
+  void bf_reduce_results(const char* scope, uint64_t num_procs,
+                         size_t num_keys, const uint64_t* keys,
+                         const uint64_t* mins, const uint64_t* sums,
+                         const uint64_t* maxes);
+
+  // Suppress the calling process's end-of-run output.
+  void bf_reduce_silence(void);
+}
+
+#endif
@@ -16,7 +16,7 @@ typedef CachedUnorderedMap<uint64_t, uint64_t> addr_to_time_t;
 addr_to_time_t last_access;   // Last access time of a given address
 
 // An RDnode is one node in a reuse-distance tree.
-class RDnode {
+class RDnode : public ArenaAllocated {
 private:
   RDnode* left;         // Left child
   RDnode* right;        // Right child
@@ -60,6 +60,9 @@ public:
 
   // Ensure that all nodes have a valid weight.
   void validate_weights();
+
+  // Free every node in a tree.
+  static void free_tree(RDnode* tree);
 };
 
 // fix_node_weight() sets the weight of a given node to the sum of its
@@ -313,6 +316,25 @@ void RDnode::validate_weights()
   }
 }
 
+// Free every node in a tree.  To avoid deep recursion on a degenerate
+// tree, we rotate left children to the right until none remain.
+void RDnode::free_tree(RDnode* tree)
+{
+  while (tree != nullptr)
+    if (tree->left == nullptr) {
+      RDnode* dead_node = tree;
+      tree = tree->right;
+      delete dead_node;
+    }
+    else {
+      RDnode* child = tree->left;
+      tree->left = child->right;
+      child->right = tree;
+      tree = child;
+    }
+}
+
+
 // Reinitialize an existing RDnode with a given address and timestamp.
 void RDnode::initialize(uint64_t new_address, uint64_t new_time)
 {
@@ -338,6 +360,139 @@ RDnode::RDnode(uint64_t address, uint64_t time)
 }
 
 
+// Define the minimum number of slots an RDfenwick allocates and the access
+// time it associates with an unoccupied slot.
+const uint64_t min_rdfenwick_slots = 1<<16;
+const uint64_t empty_slot = ~(uint64_t)0;
+
+// An RDfenwick is an alternative to a tree of RDnodes that stores each
+// access in an array slot ordered by access time and maintains a Fenwick
+// (binary indexed) tree of slot occupancy.  Counting the accesses more
+// recent than a given slot is then a prefix sum.  Slots are renumbered
+// compactly whenever the array fills up.  When an RDfenwick is in use,
+// last_access maps addresses to slots rather than to access times.
+class RDfenwick {
+private:
+  vector<uint64_t> tree;        // Fenwick tree of slot occupancy (1-based)
+  vector<uint64_t> addresses;   // Address stored in each slot
+  vector<uint64_t> times;       // Access time stored in each slot
+  uint64_t active;              // Number of occupied slots
+  uint64_t oldest;              // No occupied slot precedes this one
+  uint64_t next_slot;           // Slot to assign to the next access
+
+  // Add a value to a slot's entry in the Fenwick tree.
+  void tree_add(uint64_t slot, int64_t delta) {
+    uint64_t num_slots = times.size();
+    for (uint64_t i = slot + 1; i <= num_slots; i += i & -i)
+      tree[i] += delta;
+  }
+
+  // Return the number of occupied slots at or before a given slot.
+  uint64_t tree_prefix(uint64_t slot) {
+    uint64_t sum = 0;
+    for (uint64_t i = slot + 1; i > 0; i -= i & -i)
+      sum += tree[i];
+    return sum;
+  }
+
+  // Renumber all occupied slots to the front of a freshly sized array.
+  void compact(addr_to_time_t* slot_map);
+
+public:
+  RDfenwick() {
+    active = 0;
+    oldest = 0;
+    next_slot = 0;
+    tree.resize(min_rdfenwick_slots + 1, 0);
+    addresses.resize(min_rdfenwick_slots, 0);
+    times.resize(min_rdfenwick_slots, empty_slot);
+  }
+
+  // Return the number of occupied slots following a given slot.
+  uint64_t tree_dist(uint64_t slot) { return active - tree_prefix(slot); }
+
+  // Vacate a slot.
+  void remove(uint64_t slot) {
+    times[slot] = empty_slot;
+    tree_add(slot, -1);
+    active--;
+  }
+
+  // Store an address and its access time in a new slot, and return the
+  // slot number.
+  uint64_t insert(uint64_t address, uint64_t time, addr_to_time_t* slot_map);
+
+  // Remove all access times less than a given value from the array and
+  // from a given address-to-slot map.
+  void prune(uint64_t timestamp, addr_to_time_t* slot_map);
+};
+
+// Renumber all occupied slots to the front of an array large enough to
+// accommodate at least as many new accesses, and rebuild the Fenwick tree
+// in linear time.
+void RDfenwick::compact(addr_to_time_t* slot_map)
+{
+  // Slide all occupied slots to the front of the array.
+  uint64_t num_used = 0;
+  for (uint64_t slot = oldest; slot < next_slot; slot++)
+    if (times[slot] != empty_slot) {
+      addresses[num_used] = addresses[slot];
+      times[num_used] = times[slot];
+      (*slot_map)[addresses[num_used]] = num_used;
+      num_used++;
+    }
+
+  // Resize the array.
+  uint64_t num_slots = max(min_rdfenwick_slots, 2*num_used);
+  addresses.resize(num_slots);
+  times.resize(num_slots);
+  fill(times.begin() + num_used, times.end(), empty_slot);
+  oldest = 0;
+  next_slot = num_used;
+
+  // Rebuild the Fenwick tree.
+  tree.assign(num_slots + 1, 0);
+  for (uint64_t i = 1; i <= num_used; i++)
+    tree[i] = 1;
+  for (uint64_t i = 1; i <= num_slots; i++) {
+    uint64_t parent = i + (i & -i);
+    if (parent <= num_slots)
+      tree[parent] += tree[i];
+  }
+}
+
+// Store an address and its access time in a new slot, and return the slot
+// number.  Access times must be presented in increasing order.
+uint64_t RDfenwick::insert(uint64_t address, uint64_t time,
+                           addr_to_time_t* slot_map)
+{
+  if (__builtin_expect(next_slot == times.size(), 0))
+    compact(slot_map);
+  uint64_t slot = next_slot++;
+  addresses[slot] = address;
+  times[slot] = time;
+  tree_add(slot, 1);
+  active++;
+  return slot;
+}
+
+// Remove all access times less than a given value from the array and from
+// a given address-to-slot map.  Because slots are assigned in order of
+// access time we need only advance from the oldest slot.
+void RDfenwick::prune(uint64_t timestamp, addr_to_time_t* slot_map)
+{
+  for (; oldest < next_slot; oldest++) {
+    uint64_t time = times[oldest];
+    if (time == empty_slot)
+      continue;
+    if (time >= timestamp)
+      break;
+    slot_map->erase(addresses[oldest]);
+    remove(oldest);
+  }
+}
+
+
 // Define infinite distance.
 const uint64_t infinite_distance = ~(uint64_t)0;
 
@@ -350,17 +505,47 @@ private:
   vector<uint64_t> hist;    // Histogram of the number of times each reuse distance was observed
   uint64_t unique_entries;  // Number of unique addresses (infinite reuse distance)
   RDnode* dist_tree;        // Tree of reuse distances
+  RDfenwick* dist_array;    // Array of reuse distances (alternative to dist_tree)
+  uint64_t max_dist;        // Maximum reuse distance to consider
+
+  // Tally a reuse distance in the histogram.
+  void tally_distance(uint64_t distance);
+
+  // Incorporate a new address into the reuse-distance histogram using
+  // either a tree or an array.
+  void process_address_tree(uint64_t address);
+  void process_address_array(uint64_t address);
+
+  // Discard all previously seen addresses.
+  void forget_all();
+
+  // Incorporate a range of never-before-seen addresses into the
+  // reuse-distance histogram.
+  void process_unseen_range(uint64_t baseaddr, uint64_t numaddrs);
 
 public:
   // Initialize our various fields.
-  ReuseDistance() {
+  ReuseDistance(uint64_t max_distance) {
     clock = 0;
+    max_dist = max_distance;
     unique_entries = 0;
     dist_tree = nullptr;
+    dist_array = nullptr;
+    if (bf_reuse_engine == BF_RD_ENGINE_FENWICK)
+      dist_array = new RDfenwick();
   }
 
   // Incorporate a new address into the reuse-distance histogram.
-  void process_address(uint64_t address);
+  void process_address(uint64_t address) {
+    if (dist_array == nullptr)
+      process_address_tree(address);
+    else
+      process_address_array(address);
+  }
+
+  // Incorporate a range of addresses, accessed in increasing order, into
+  // the reuse-distance histogram.
+  void process_range(uint64_t baseaddr, uint64_t numaddrs);
 
   // Return a pointer to the reuse-distance histogram.
   vector<uint64_t>* get_histogram() { return &hist; }
@@ -373,19 +558,9 @@ public:
 };
 
 
-// Incorporate a new address into the reuse-distance histogram.
-void ReuseDistance::process_address(uint64_t address)
+// Tally a reuse distance in the histogram.
+void ReuseDistance::tally_distance(uint64_t distance)
 {
-  // Update the histogram.
-  uint64_t distance = infinite_distance;
-  addr_to_time_t::iterator prev_time_iter = last_access.find(address);
-  RDnode* new_node = nullptr;
-  if (prev_time_iter != last_access.end()) {
-    // We've previously seen this address.
-    uint64_t prev_time = prev_time_iter->second;
-    distance = dist_tree->tree_dist(prev_time);
-    dist_tree = dist_tree->remove(prev_time, &new_node);
-  }
   uint64_t hist_len = hist.size();
   if (distance < hist_len)
     // We've previously seen both this symbol and this reuse distance.
@@ -400,6 +575,24 @@ void ReuseDistance::process_address(uint64_t address)
       hist[distance]++;
     }
   }
+}
+
+
+// Incorporate a new address into the reuse-distance histogram using a
+// splay tree.
+void ReuseDistance::process_address_tree(uint64_t address)
+{
+  // Update the histogram.
+  uint64_t distance = infinite_distance;
+  addr_to_time_t::iterator prev_time_iter = last_access.find(address);
+  RDnode* new_node = nullptr;
+  if (prev_time_iter != last_access.end()) {
+    // We've previously seen this address.
+    uint64_t prev_time = prev_time_iter->second;
+    distance = dist_tree->tree_dist(prev_time);
+    dist_tree = dist_tree->remove(prev_time, &new_node);
+  }
+  tally_distance(distance);
 
   // Update the tree and the map.
   if (new_node == nullptr)
@@ -417,8 +610,103 @@ void ReuseDistance::process_address(uint64_t address)
 
   // If the tree and the map have grown too large, prune old addresses from
   // them.
-  if (last_access.size() > bf_max_reuse_distance)
-    dist_tree = dist_tree->prune_tree(clock - bf_max_reuse_distance, &last_access);
+  if (last_access.size() > max_dist)
+    dist_tree = dist_tree->prune_tree(clock - max_dist, &last_access);
+}
+
+
+// Incorporate a new address into the reuse-distance histogram using a
+// Fenwick tree.  This produces the same histogram as process_address_tree().
+void ReuseDistance::process_address_array(uint64_t address)
+{
+  // Update the histogram.
+  uint64_t distance = infinite_distance;
+  addr_to_time_t::iterator prev_slot_iter = last_access.find(address);
+  if (prev_slot_iter != last_access.end()) {
+    // We've previously seen this address.
+    uint64_t prev_slot = prev_slot_iter->second;
+    distance = dist_array->tree_dist(prev_slot);
+    dist_array->remove(prev_slot);
+  }
+  tally_distance(distance);
+
+  // Update the array and the map.
+  last_access[address] = dist_array->insert(address, clock, &last_access);
+  clock++;
+
+  // If the array and the map have grown too large, prune old addresses
+  // from them.
+  if (last_access.size() > max_dist)
+    dist_array->prune(clock - max_dist, &last_access);
+}
+
+
+// Discard all previously seen addresses without altering the histogram.
+void ReuseDistance::forget_all()
+{
+  if (dist_array == nullptr) {
+    RDnode::free_tree(dist_tree);
+    dist_tree = nullptr;
+  }
+  else {
+    delete dist_array;
+    dist_array = new RDfenwick();
+  }
+  last_access.clear();
+}
+
+
+// Incorporate a range of never-before-seen addresses into the
+// reuse-distance histogram.  All of them have infinite reuse distance.
+// If the range is longer than max_dist, pruning after each access would
+// leave only the last max_dist addresses of the range, so we can skip the
+// others entirely.
+void ReuseDistance::process_unseen_range(uint64_t baseaddr, uint64_t numaddrs)
+{
+  if (numaddrs > max_dist) {
+    uint64_t skipped = numaddrs - max_dist;
+    forget_all();
+    unique_entries += skipped;
+    clock += skipped;
+    baseaddr += skipped;
+    numaddrs = max_dist;
+  }
+  for (uint64_t ofs = 0; ofs < numaddrs; ofs++)
+    process_address(baseaddr + ofs);
+}
+
+
+// Incorporate a range of addresses, accessed in increasing order, into the
+// reuse-distance histogram.  This produces the same histogram as
+// processing each address individually.  When the range is larger than the
+// set of addresses we remember, we find the remembered addresses that lie
+// within the range by scanning the set and process the runs of addresses
+// between them in bulk.
+void ReuseDistance::process_range(uint64_t baseaddr, uint64_t numaddrs)
+{
+  // Handle the common case of a small range one address at a time.
+  if (numaddrs <= last_access.size()) {
+    for (uint64_t ofs = 0; ofs < numaddrs; ofs++)
+      process_address(baseaddr + ofs);
+    return;
+  }
+
+  // Find all previously seen addresses within the range.
+  vector<uint64_t> seen;
+  for (auto iter = last_access.begin(); iter != last_access.end(); iter++)
+    if (iter->first - baseaddr < numaddrs)
+      seen.push_back(iter->first);
+  sort(seen.begin(), seen.end());
+
+  // Alternate between runs of unseen addresses and individual seen
+  // addresses.
+  uint64_t address = baseaddr;
+  for (auto iter = seen.cbegin(); iter != seen.cend(); iter++) {
+    process_unseen_range(address, *iter - address);
+    process_address(*iter);
+    address = *iter + 1;
+  }
+  process_unseen_range(address, baseaddr + numaddrs - address);
 }
 
 
@@ -473,11 +761,40 @@ void ReuseDistance::compute_median(uint64_t* median_value, uint64_t* mad_value)
 // Keep track of the reuse distance of the program as a whole.
 static ReuseDistance* global_reuse_dist = nullptr;
 
+// When sampling, each sampled address stands for this many addresses.
+static double reuse_scale = 1.0;
+
+// Return true if an address should participate in the reuse-distance
+// calculation.  As in SHARDS, an address is sampled if a hash of it lies
+// below a fixed threshold so that either all or none of the accesses to a
+// given address are observed.  This is SHARDS's fixed-rate variant, not its
+// fixed-size variant: the threshold never drops, so the number of sampled
+// addresses we remember -- and hence our memory usage -- is bounded only by
+// bf_max_reuse_distance.
+static inline bool sample_address (uint64_t address)
+{
+  // Mix the address's bits using the MurmurHash3 64-bit finalizer.
+  address ^= address >> 33;
+  address *= 0xff51afd7ed558ccdULL;
+  address ^= address >> 33;
+  address *= 0xc4ceb9fe1a85ec53ULL;
+  address ^= address >> 33;
+  return address%BF_REUSE_SAMPLE_MODULUS < bf_reuse_sample_threshold;
+}
+
 
 // Initialize some of our variables at first use.
 void initialize_reuse (void)
 {
-  global_reuse_dist = new ReuseDistance();
+  reuse_scale = double(BF_REUSE_SAMPLE_MODULUS)/double(bf_reuse_sample_threshold);
+  uint64_t max_dist = bf_max_reuse_distance;
+  if (reuse_scale > 1.0) {
+    // Prune in terms of sampled rather than actual accesses.
+    max_dist = uint64_t(double(max_dist)/reuse_scale);
+    if (max_dist == 0)
+      max_dist = 1;
+  }
+  global_reuse_dist = new ReuseDistance(max_dist);
 }
 
 
@@ -486,19 +803,37 @@ void initialize_reuse (void)
 extern "C"
 void bf_reuse_dist_addrs_prog (uint64_t baseaddr, uint64_t numaddrs)
 {
-  if (bf_suppress_counting)
+  OverheadTimer timer(BF_OVERHEAD_REUSE);
+
+  if (bf_suppress_counting || numaddrs == 0)
     return;
-  for (uint64_t ofs = 0; ofs < numaddrs; ofs++)
-    global_reuse_dist->process_address(baseaddr + ofs);
+  if (bf_reuse_sample_threshold < BF_REUSE_SAMPLE_MODULUS) {
+    for (uint64_t ofs = 0; ofs < numaddrs; ofs++)
+      if (sample_address(baseaddr + ofs))
+        global_reuse_dist->process_address(baseaddr + ofs);
+  }
+  else
+    global_reuse_dist->process_range(baseaddr, numaddrs);
 }
 
 
 // Return the reuse distance histogram and count of unique bytes for
-// the program as a whole.
+// the program as a whole.  When sampling, the histogram's distances and
+// tallies must be multiplied by bf_get_reuse_distance_scale(), but the
+// count of unique bytes is already scaled.
 void bf_get_reuse_distance (vector<uint64_t>** hist, uint64_t* unique_addrs)
 {
   *hist = global_reuse_dist->get_histogram();
-  *unique_addrs = global_reuse_dist->get_unique_addrs();
+  *unique_addrs = uint64_t(global_reuse_dist->get_unique_addrs()*reuse_scale + 0.5);
+}
+
+
+// Return the factor by which to multiply sampled reuse distances and
+// tallies to estimate actual reuse distances and tallies (1.0 if all
+// addresses were considered).
+double bf_get_reuse_distance_scale (void)
+{
+  return reuse_scale;
 }
 
 
@@ -506,6 +841,10 @@ void bf_get_reuse_distance (vector<uint64_t>** hist, uint64_t* unique_addrs)
 void bf_get_median_reuse_distance (uint64_t* median_value, uint64_t* mad_value)
 {
   global_reuse_dist->compute_median(median_value, mad_value);
+  if (*median_value != infinite_distance) {
+    *median_value = uint64_t(*median_value*reuse_scale + 0.5);
+    *mad_value = uint64_t(*mad_value*reuse_scale + 0.5);
+  }
 }
 
 }
@@ -0,0 +1,229 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (burst sampling and extrapolation of the sampled counters)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+#include <cmath>
+#include <mutex>
+
+using namespace std;
+
+// Instrumented code decrements this on every call to an instrumented
+// function and invokes bf_sample_switch() instead once it reaches 1.  All
+// threads share the countdown, so every access uses relaxed atomics.
+extern "C" {
+  uint64_t bf_sample_countdown = 0;
+}
+
+namespace bytesflops {
+
+extern ostream* bfout;
+extern BinaryOStream* bfbin;
+
+// Define the subset of the counters we extrapolate.
+enum {
+  SAMPLE_BBLOCKS,          // Basic blocks executed
+  SAMPLE_LOAD_INS,         // Load instructions executed
+  SAMPLE_STORE_INS,        // Store instructions executed
+  SAMPLE_FLOPS,            // Floating-point operations performed
+  SAMPLE_INT_OPS,          // Integer operations performed
+  SAMPLE_CALL_INS,         // Function calls executed
+  SAMPLE_LOADS,            // Bytes loaded
+  SAMPLE_STORES,           // Bytes stored
+  SAMPLE_FP_BITS,          // Bits consumed or produced by floating-point operations
+  SAMPLE_OP_BITS,          // Bits consumed or produced by all non-memory operations
+  NUM_SAMPLED_COUNTERS
+};
+
+// Name each of the above in the textual and binary output, respectively.
+static const char* sampled_text_names[NUM_SAMPLED_COUNTERS] = {
+  "basic blocks",
+  "loads",
+  "stores",
+  "flops",
+  "integer ops",
+  "function calls",
+  "bytes loaded",
+  "bytes stored",
+  "flop bits",
+  "op bits (excluding memory ops)"
+};
+static const char* sampled_binary_names[NUM_SAMPLED_COUNTERS] = {
+  "Basic blocks",
+  "Load operations",
+  "Store operations",
+  "Floating-point operations",
+  "Integer operations",
+  "Function-call operations (non-exception-throwing)",
+  "Bytes loaded",
+  "Bytes stored",
+  "Floating-point operation bits",
+  "Integer operation bits"
+};
+
+static mutex switch_lock;            // Serialize phase switches
+static bool in_burst = false;        // true=counting; false=between bursts
+static uint64_t phase_length = 0;    // Function calls in the current phase
+static uint64_t completed_calls = 0; // Function calls in all completed phases
+static uint64_t num_bursts = 0;      // Number of completed bursts
+static ByteFlopCounters* burst_start = nullptr;  // Totals as of the beginning of the current burst
+static uint64_t burst_sums[NUM_SAMPLED_COUNTERS];  // Sum over all completed bursts
+static double burst_means[NUM_SAMPLED_COUNTERS];   // Running mean of each counter per burst
+static double burst_m2[NUM_SAMPLED_COUNTERS];      // Running sum of squared deviations from the mean
+
+// Extract the counters we extrapolate from a set of ByteFlopCounters.
+static void extract_sampled_counters (const ByteFlopCounters& counters,
+                                      uint64_t* values)
+{
+  values[SAMPLE_BBLOCKS] = counters.terminators[BF_END_BB_ANY];
+  values[SAMPLE_LOAD_INS] = counters.load_ins;
+  values[SAMPLE_STORE_INS] = counters.store_ins;
+  values[SAMPLE_FLOPS] = counters.flops;
+  values[SAMPLE_INT_OPS] = counters.ops - counters.flops - counters.load_ins - counters.store_ins - counters.terminators[BF_END_BB_ANY];
+  values[SAMPLE_CALL_INS] = counters.call_ins;
+  values[SAMPLE_LOADS] = counters.loads;
+  values[SAMPLE_STORES] = counters.stores;
+  values[SAMPLE_FP_BITS] = counters.fp_bits;
+  values[SAMPLE_OP_BITS] = counters.op_bits;
+}
+
+// Initialize some of our variables at first use.  We begin between bursts
+// so that program start-up doesn't dominate the samples.
+void initialize_sampling (void)
+{
+  if (bf_sample_period == 0)
+    return;
+  burst_start = new ByteFlopCounters;
+  phase_length = bf_sample_period - bf_sample_burst;
+  __atomic_store_n(&bf_sample_countdown, phase_length + 1, __ATOMIC_RELAXED);   // No call triggered this phase.
+  bf_sample_counting(false);
+}
+
+// Fold the counters accumulated during the burst that just ended into the
+// per-burst statistics.  The caller must hold the mega-lock.
+static void record_burst (void)
+{
+  static ByteFlopCounters totals;
+  static ByteFlopCounters deltas;
+  uint64_t values[NUM_SAMPLED_COUNTERS];
+  bf_snapshot_totals(totals);
+  (void) totals.difference(burst_start, &deltas);
+  extract_sampled_counters(deltas, values);
+  num_bursts++;
+  for (int i = 0; i < NUM_SAMPLED_COUNTERS; i++) {
+    // Use Welford's algorithm to maintain the mean and variance.
+    double delta = double(values[i]) - burst_means[i];
+    burst_means[i] += delta/double(num_bursts);
+    burst_m2[i] += delta*(double(values[i]) - burst_means[i]);
+    burst_sums[i] += values[i];
+  }
+}
+
+// Switch between counting and not counting.  The instrumented code
+// invokes this when bf_sample_countdown runs out.  The call that triggers
+// the switch is the first call of the new phase.
+extern "C"
+void bf_sample_switch (void)
+{
+  bf_initialize_if_necessary();
+  lock_guard<mutex> guard(switch_lock);
+  if (__atomic_load_n(&bf_sample_countdown, __ATOMIC_RELAXED) > 1)
+    // Another thread switched phases while we were waiting for the lock.
+    return;
+  completed_calls += phase_length;
+  if (in_burst) {
+    // End the current burst.
+    bf_flush_access_trace();
+    bf_acquire_mega_lock();
+    record_burst();
+    bf_release_mega_lock();
+    in_burst = false;
+    phase_length = bf_sample_period - bf_sample_burst;
+    bf_sample_counting(false);
+  }
+  else {
+    // Begin a new burst.
+    in_burst = true;
+    phase_length = bf_sample_burst;
+    bf_sample_counting(true);
+    bf_acquire_mega_lock();
+    bf_snapshot_totals(*burst_start);
+    bf_release_mega_lock();
+  }
+  __atomic_store_n(&bf_sample_countdown, phase_length, __ATOMIC_RELAXED);
+}
+
+// Report our estimates of what the counters would have been had we not
+// sampled.  This is invoked at the end of the program.  A partial final
+// burst contributes to the number of calls but not to the statistics.
+void bf_report_sampling (void)
+{
+  // Determine the total number of calls to instrumented functions.
+  uint64_t countdown = __atomic_load_n(&bf_sample_countdown, __ATOMIC_RELAXED);
+  uint64_t current_calls = phase_length + 1 - min(phase_length + 1, countdown);
+  uint64_t total_calls = completed_calls + current_calls;
+  uint64_t counted_calls = num_bursts*bf_sample_burst;
+  string tag(bf_output_prefix + "BYFL_SAMPLING");
+  if (num_bursts == 0) {
+    *bfout << bf_output_prefix
+           << "BYFL_WARNING: No sampling bursts completed in " << total_calls
+           << " function calls; consider reducing -bf-sample-period\n";
+    return;
+  }
+  if (num_bursts == 1)
+    *bfout << bf_output_prefix
+           << "BYFL_WARNING: Only one sampling burst completed; confidence intervals are unavailable\n";
+
+  // Scale the mean per-burst value of each counter by the number of
+  // bursts that would fit in the entire run.  The 95% confidence interval
+  // treats bursts as independent samples.
+  double scale = double(total_calls)/double(bf_sample_burst);
+  uint64_t estimate[NUM_SAMPLED_COUNTERS];
+  uint64_t half_width[NUM_SAMPLED_COUNTERS];
+  for (int i = 0; i < NUM_SAMPLED_COUNTERS; i++) {
+    estimate[i] = uint64_t(burst_means[i]*scale + 0.5);
+    if (num_bursts > 1) {
+      double std_err = sqrt(burst_m2[i]/double(num_bursts - 1)/double(num_bursts));
+      half_width[i] = uint64_t(1.96*std_err*scale + 0.5);
+    }
+    else
+      half_width[i] = 0;
+  }
+
+  // Output the estimates in textual format.
+  *bfout << tag << ": " << setw(25) << counted_calls << " of "
+         << total_calls << " function calls counted ("
+         << num_bursts << " bursts of " << bf_sample_burst << ")\n";
+  for (int i = 0; i < NUM_SAMPLED_COUNTERS; i++)
+    *bfout << tag << ": " << setw(25) << estimate[i] << " estimated "
+           << sampled_text_names[i] << " (+/- " << half_width[i] << ")\n";
+
+  // Output the estimates in binary format.
+  *bfbin << uint8_t(BINOUT_TABLE_KEYVAL) << "Sampling"
+         << uint8_t(BINOUT_COL_UINT64) << "Calls per burst" << bf_sample_burst
+         << uint8_t(BINOUT_COL_UINT64) << "Calls per period" << bf_sample_period
+         << uint8_t(BINOUT_COL_UINT64) << "Completed bursts" << num_bursts
+         << uint8_t(BINOUT_COL_UINT64) << "Counted calls" << counted_calls
+         << uint8_t(BINOUT_COL_UINT64) << "Total calls" << total_calls
+         << uint8_t(BINOUT_COL_NONE);
+  *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "Sampling estimates"
+         << uint8_t(BINOUT_COL_STRING) << "Counter"
+         << uint8_t(BINOUT_COL_UINT64) << "Counted in bursts"
+         << uint8_t(BINOUT_COL_UINT64) << "Estimated total"
+         << uint8_t(BINOUT_COL_UINT64) << "95% confidence interval (low)"
+         << uint8_t(BINOUT_COL_UINT64) << "95% confidence interval (high)"
+         << uint8_t(BINOUT_COL_NONE);
+  for (int i = 0; i < NUM_SAMPLED_COUNTERS; i++)
+    *bfbin << uint8_t(BINOUT_ROW_DATA)
+           << sampled_binary_names[i]
+           << burst_sums[i]
+           << estimate[i]
+           << estimate[i] - min(estimate[i], half_width[i])
+           << estimate[i] + half_width[i];
+  *bfbin << uint8_t(BINOUT_ROW_NONE);
+}
+
+} // namespace bytesflops
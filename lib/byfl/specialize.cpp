@@ -0,0 +1,46 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (verification of a run-time library specialized for a set of options)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+
+// Refer to the option values the instrumented code defines rather than to
+// the constants byfl.h substitutes for them.
+#ifdef BF_SPECIALIZED
+# undef bf_every_bb
+# undef bf_per_func
+# undef bf_call_stack
+# undef bf_unique_bytes
+# undef bf_cache_model
+# undef bf_types
+# undef bf_tally_inst_mix
+#endif
+
+namespace bytesflops {
+
+// Abort if the program was instrumented with different options from those
+// for which we were specialized.  Continuing would silently produce wrong
+// counts.
+void initialize_specialization (void)
+{
+#ifdef BF_SPECIALIZED
+  if (bool(bf_every_bb) != bool(BF_SPEC_EVERY_BB)
+      || bool(bf_per_func) != bool(BF_SPEC_PER_FUNC)
+      || bool(bf_call_stack) != bool(BF_SPEC_CALL_STACK)
+      || bool(bf_unique_bytes) != bool(BF_SPEC_UNIQUE_BYTES)
+      || bool(bf_cache_model) != bool(BF_SPEC_CACHE_MODEL)
+      || bool(bf_types) != bool(BF_SPEC_TYPES)
+      || bool(bf_tally_inst_mix) != bool(BF_SPEC_INST_MIX)) {
+    cerr << "This program was instrumented with different -bf-* options ("
+         << bf_option_string << ") from those for which the Byfl run-time"
+         << " library it was linked with was specialized.  Please relink"
+         << " it with -bf-specialize=no.\n";
+    bf_abend();
+  }
+#endif
+}
+
+} // namespace bytesflops
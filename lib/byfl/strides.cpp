@@ -20,10 +20,13 @@ namespace bytesflops {
 // Define a logical page size to use throughout this file.
 static const size_t logical_page_size = 1024;
 
-// Track a single call point's data-access pattern.
+// Track a single call point's data-access pattern.  All of a call point's
+// state lives in a fixed-size record so that the records for all call
+// points can be stored contiguously and indexed by stride-point ID.
 class AccessPattern {
 public:
-  bf_symbol_info_t syminfo;             // Call-point source information
+  const bf_symbol_info_t* syminfo;      // Call-point source information
+  uint64_t first_addr;                  // First data address
   uint64_t prev_addr;                   // Previous data address
   uint64_t num_bytes;                   // Bytes per access (i.e., word size)
   uint64_t stride_tally[NUM_STRIDES];   // Tally by word stride
@@ -31,24 +34,16 @@ public:
   uint64_t total_strides;               // Sum across stride_tally[]
   bool is_store;                        // true=store; false=load
   bool is_const;                        // true=provably constant address at compile time; false=may vary
-  BitPageTable* touched_data;           // Flags for every byte of memory accessed
+  bool executed;                        // true=accessed memory at least once
+  bool multi_target;                    // true=observed at least one nonzero stride
+  HyperLogLog<8> touched_data;          // Estimate of the number of unique bytes accessed
 
   // Initialize an AccessPattern with all zero tallies.
-  AccessPattern(bf_symbol_info_t sinfo, uint64_t addr, uint64_t nbytes,
-                bool st, bool cons) :
-    syminfo(sinfo), prev_addr(addr), num_bytes(nbytes),  backward_strides(0),
-    total_strides(0), is_store(st), is_const(cons), touched_data(nullptr) {
+  AccessPattern(const bf_stride_point_t& point) :
+    syminfo(point.syminfo), first_addr(0), prev_addr(0), num_bytes(0),
+    backward_strides(0), total_strides(0), is_store(point.is_store != 0),
+    is_const(point.is_const != 0), executed(false), multi_target(false) {
     memset(stride_tally, 0, NUM_STRIDES*sizeof(uint64_t));
-    if (bf_unique_bytes || bf_mem_footprint) {
-      touched_data = new BitPageTable(logical_page_size);
-      touched_data->access(addr, nbytes);
-    }
-  }
-
-  // Free any memory we allocated.
-  ~AccessPattern() {
-    if (touched_data != nullptr)
-      delete touched_data;
   }
 
   // Given an address, increment the appropriate stride tally.
@@ -93,39 +88,90 @@ public:
   }
 };
 
-// Define this file's main data structure.
-static CachedOrderedMap<uint64_t, AccessPattern*>* stride_data;  // Map from a location ID to stride information.
+// Define this file's main data structure, a flat array of access patterns
+// indexed by stride-point ID.
+static vector<AccessPattern, ArenaAllocator<AccessPattern> >* stride_data = nullptr;
+
+// Flag every byte of memory accessed by a call point that has accessed
+// more than one address (a multi-targeted instruction).  A call point that
+// has always accessed the same address (a uni-targeted instruction)
+// touches only the num_bytes bytes at its first_addr.
+static BitPageTable* mti_touched_data = nullptr;
 
 // Gain access to our binary output stream.
 extern BinaryOStream* bfbin;
 
-// Initialize our internal data structure.
+// Initialize our internal data structures.
 void initialize_strides (void)
 {
   if (stride_data == nullptr)
-    stride_data = new CachedOrderedMap<uint64_t, AccessPattern*>;
+    stride_data = new vector<AccessPattern, ArenaAllocator<AccessPattern> >;
+  if (mti_touched_data == nullptr && bf_strides && (bf_unique_bytes || bf_mem_footprint))
+    mti_touched_data = new BitPageTable(logical_page_size);
+}
+
+// Record a module's table of call points whose strides are tracked and
+// assign them consecutive IDs.  This is invoked from each module's
+// constructor, possibly before bf_initialize_if_necessary().
+extern "C"
+void bf_record_stride_points (uint64_t num_points,
+                              const bf_stride_point_t* points,
+                              uint64_t* base_id)
+{
+  if (stride_data == nullptr)
+    stride_data = new vector<AccessPattern, ArenaAllocator<AccessPattern> >;
+  *base_id = stride_data->size();
+  stride_data->reserve(stride_data->size() + num_points);
+  for (uint64_t i = 0; i < num_points; i++)
+    stride_data->emplace_back(points[i]);
 }
 
 // Track a call point's strided access pattern.
 extern "C"
-void bf_track_stride (bf_symbol_info_t* syminfo, uint64_t baseaddr,
-                      uint64_t numaddrs, uint8_t load0store1, uint8_t is_const)
+void bf_track_stride (uint64_t point_id, uint64_t baseaddr, uint64_t numaddrs)
 {
-  // Determine if we've previously seen this call point.
-  auto iter = stride_data->find(syminfo->ID);
-  if (iter == stride_data->end()) {
-    // First access from this call point: Create a new tally entry.
-    (*stride_data)[syminfo->ID] = new AccessPattern(*syminfo, baseaddr, numaddrs, bool(load0store1), bool(is_const));
+  OverheadTimer timer(BF_OVERHEAD_STRIDES);
+
+  // Ignore call points from modules whose constructor hasn't yet run.
+  if (stride_data == nullptr || point_id >= stride_data->size())
+    return;
+  AccessPattern* info = &(*stride_data)[point_id];
+  if (!info->executed) {
+    // First access from this call point.
+    info->executed = true;
+    info->first_addr = baseaddr;
+    info->prev_addr = baseaddr;
+    info->num_bytes = numaddrs;
     return;
   }
 
   // We've seen this call point before.  Determine the new stride and update
   // our information accordingly.
-  AccessPattern* info = iter->second;
   info->increment_tally(baseaddr);
   info->prev_addr = baseaddr;
-  if (info->touched_data != nullptr)
-    info->touched_data->access(baseaddr, numaddrs);
+  if (mti_touched_data == nullptr)
+    return;
+  if (!info->multi_target) {
+    if (baseaddr == info->first_addr)
+      return;
+    // This is the call point's first nonzero stride.  Account for the
+    // address it previously accessed.
+    info->multi_target = true;
+    mti_touched_data->access(info->first_addr, info->num_bytes);
+    info->touched_data.insert_range(info->first_addr, info->num_bytes);
+  }
+  mti_touched_data->access(baseaddr, numaddrs);
+  info->touched_data.insert_range(baseaddr, numaddrs);
+}
+
+// Return the number of unique bytes a call point accessed.  This is exact
+// for uni-targeted instructions and an estimate for multi-targeted
+// instructions.
+static uint64_t tally_unique_bytes (const AccessPattern* info)
+{
+  if (info->multi_target)
+    return info->touched_data.estimate();
+  return info->num_bytes;
 }
 
 // Compute the number of unique memory addresses accessed by loads/stores
@@ -134,25 +180,11 @@ void bf_track_stride (bf_symbol_info_t* syminfo, uint64_t baseaddr,
 void bf_partition_unique_addresses (uint64_t* uti, uint64_t *mti)
 {
   BitPageTable uti_pt(logical_page_size);
-  BitPageTable mti_pt(logical_page_size);
-  for (auto iter = stride_data->begin(); iter != stride_data->end(); iter++) {
-    // Determine if this is a uni-targeted instruction (UTI) or a
-    // multi-targeted instruction (MTI).
-    AccessPattern* info = iter->second;
-    uint64_t nonzero_strides = 0;
-    for (size_t i = 0; i <= MAX_POW2_STRIDE; i++)
-      nonzero_strides += info->stride_tally[i];
-    nonzero_strides += info->stride_tally[OTHER_STRIDE];
-
-    // Merge the current pattern's page table into either the UTI or MTI page
-    // table.
-    if (nonzero_strides == 0)
-      uti_pt.merge(info->touched_data);
-    else
-      mti_pt.merge(info->touched_data);
-  }
+  for (auto iter = stride_data->begin(); iter != stride_data->end(); iter++)
+    if (iter->executed && !iter->multi_target)
+      uti_pt.access(iter->first_addr, iter->num_bytes);
   *uti = uti_pt.tally_unique();
-  *mti = mti_pt.tally_unique();
+  *mti = mti_touched_data->tally_unique();
 }
 
 // This function is used by sort() to sort stride information in decreasing
@@ -164,12 +196,12 @@ static bool compare_total_strides (const AccessPattern* one,
 {
   if (two->total_strides != one->total_strides)
     return two->total_strides < one->total_strides;
-  int fname_diff = strcmp(one->syminfo.file, two->syminfo.file);
+  int fname_diff = strcmp(one->syminfo->file, two->syminfo->file);
   if (fname_diff != 0)
     return fname_diff < 0;
-  if (one->syminfo.line != two->syminfo.line)
-    return one->syminfo.line < two->syminfo.line;
-  return strcmp(one->syminfo.origin, two->syminfo.origin) < 0;
+  if (one->syminfo->line != two->syminfo->line)
+    return one->syminfo->line < two->syminfo->line;
+  return strcmp(one->syminfo->origin, two->syminfo->origin) < 0;
 }
 
 // Output strides by call point.
@@ -198,15 +230,16 @@ void bf_report_strides_by_call_point (void)
   *bfbin << uint8_t(BINOUT_COL_NONE);
 
   // Sort the stride information in decreasing order of invocation count.
-  vector<AccessPattern*> access_pats;
+  vector<const AccessPattern*> access_pats;
   for (auto iter = stride_data->begin(); iter != stride_data->end(); iter++)
-    access_pats.push_back(iter->second);
+    if (iter->executed)
+      access_pats.push_back(&*iter);
   sort(access_pats.begin(), access_pats.end(), compare_total_strides);
 
   // Output all the information we have.
   for (auto iter = access_pats.begin(); iter != access_pats.end(); iter++) {
-    AccessPattern* info = *iter;
-    bf_symbol_info_t* syminfo = &info->syminfo;
+    const AccessPattern* info = *iter;
+    const bf_symbol_info_t* syminfo = info->syminfo;
     string reference(demangle_func_name(syminfo->origin));
     size_t refpos = reference.find(" referencing ");
     if (refpos == string::npos)
@@ -229,7 +262,7 @@ void bf_report_strides_by_call_point (void)
     *bfbin << info->stride_tally[OTHER_STRIDE]
            << info->backward_strides;
     if (bf_unique_bytes || bf_mem_footprint)
-      *bfbin << info->touched_data->tally_unique();
+      *bfbin << tally_unique_bytes(info);
   }
   *bfbin << uint8_t(BINOUT_ROW_NONE);
 }
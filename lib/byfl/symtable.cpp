@@ -9,26 +9,120 @@
 
 using namespace std;
 
-// Say whether one string is strictly less than another.
-struct str_less_than
-{
-  bool operator()(const char* s1, const char* s2) const {
-    if (s1 == s2)
-      return false;
-    return strcmp(s1, s2) < 0;
+namespace bytesflops {
+
+// Store a symbol's hash value and length alongside its characters.  Symbols
+// are never modified or freed once created.
+struct Symbol {
+  uint64_t hash;      // Hash of the symbol's characters
+  size_t length;      // Number of characters, excluding the NUL
+  char name[1];       // NUL-terminated characters (allocated to length)
+};
+
+// Allocate symbols contiguously from large chunks of memory instead of
+// calling strdup() for each one.  Storage is never returned.
+class SymbolArena {
+private:
+  static const size_t chunk_size = 65536;   // Bytes to allocate at once
+  char* next = nullptr;      // Next free byte in the current chunk
+  size_t remaining = 0;      // Free bytes left in the current chunk
+
+public:
+  // Allocate a new, uninitialized symbol able to hold a string of a given
+  // length.
+  Symbol* allocate (size_t length) {
+    size_t bytes = (offsetof(Symbol, name) + length + 1 + alignof(Symbol) - 1) & ~(alignof(Symbol) - 1);
+    if (bytes > chunk_size/4)
+      // Give large symbols their own allocation.
+      return static_cast<Symbol*>(::operator new(bytes));
+    if (bytes > remaining) {
+      next = static_cast<char*>(::operator new(chunk_size));
+      remaining = chunk_size;
+    }
+    Symbol* sym = reinterpret_cast<Symbol*>(next);
+    next += bytes;
+    remaining -= bytes;
+    return sym;
   }
 };
 
-namespace bytesflops {
+// Define an open-addressed, append-only hash table of symbols.  Readers
+// never lock: each slot is written exactly once, from NULL to a fully
+// constructed symbol, and a full table is replaced by a larger copy rather
+// than modified in place.  Writers serialize on a mutex.  Superseded tables
+// are never freed because a reader may still be probing one.
+struct SymbolTable {
+  size_t mask;           // Number of slots minus one (a power of two minus one)
+  size_t used;           // Number of occupied slots (protected by symbol_table_lock)
+  Symbol** slots;        // Pointers to symbols or NULL for empty slots
 
-// Define a map from equal strings to equivalent strings.
-typedef map<const char*, const char*, str_less_than> symbol_table_t;
-static symbol_table_t* symbol_table = NULL;
+  SymbolTable(size_t num_slots) : mask(num_slots - 1), used(0) {
+    slots = new Symbol*[num_slots]();
+  }
+};
+static SymbolTable* symbol_table = nullptr;   // Current table (read atomically)
+static SymbolArena* symbol_storage = nullptr; // Storage for all symbols (protected by symbol_table_lock)
+static pthread_mutex_t symbol_table_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 // Initialize some of our variables at first use.
 void initialize_symtable (void) {
-  symbol_table = new symbol_table_t();
+  pthread_mutex_lock(&symbol_table_lock);
+  if (symbol_table == nullptr) {
+    symbol_storage = new SymbolArena();
+    __atomic_store_n(&symbol_table, new SymbolTable(4096), __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&symbol_table_lock);
+}
+
+
+// Hash a string using 64-bit FNV-1a.  Also return the string's length.
+static inline uint64_t hash_string (const char* str, size_t& length)
+{
+  uint64_t hash = UINT64_C(14695981039346656037);
+  const char* s;
+  for (s = str; *s != '\0'; s++)
+    hash = (hash ^ uint8_t(*s))*UINT64_C(1099511628211);
+  length = s - str;
+  return hash;
+}
+
+
+// Search a table for a string, returning either its symbol or NULL if not
+// found.  In the latter case, also return the empty slot at which the
+// search ended.
+static inline Symbol* find_symbol (SymbolTable* table, const char* str,
+                                   size_t length, uint64_t hash, size_t& slot)
+{
+  for (slot = hash & table->mask; ; slot = (slot + 1) & table->mask) {
+    Symbol* sym = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+    if (sym == nullptr)
+      return nullptr;
+    if (sym->hash == hash && sym->length == length && memcmp(sym->name, str, length) == 0)
+      return sym;
+  }
+}
+
+
+// Replace a table with one twice as large.  The caller must hold
+// symbol_table_lock.
+static SymbolTable* grow_symbol_table (SymbolTable* old_table)
+{
+  SymbolTable* new_table = new SymbolTable(2*(old_table->mask + 1));
+  for (size_t i = 0; i <= old_table->mask; i++) {
+    Symbol* sym = old_table->slots[i];
+    if (sym == nullptr)
+      continue;
+    size_t slot;
+    for (slot = sym->hash & new_table->mask;
+         new_table->slots[slot] != nullptr;
+         slot = (slot + 1) & new_table->mask)
+      ;
+    new_table->slots[slot] = sym;
+  }
+  new_table->used = old_table->used;
+  __atomic_store_n(&symbol_table, new_table, __ATOMIC_RELEASE);
+  return new_table;
 }
 
 
@@ -38,16 +132,40 @@ const char* bf_string_to_symbol (const char* nonunique)
 {
   if (nonunique == NULL)
     return NULL;
-  symbol_table_t::iterator sym_iter = symbol_table->find(nonunique);
-  if (sym_iter == symbol_table->end()) {
-    // New entry for the symbol table -- create a unique symbol and return it.
-    const char* unique = strdup(nonunique);
-    (*symbol_table)[unique] = unique;
-    return unique;
+
+  // Common case -- the symbol already exists.  Search without locking.
+  size_t length;
+  uint64_t hash = hash_string(nonunique, length);
+  size_t slot;
+  SymbolTable* table = __atomic_load_n(&symbol_table, __ATOMIC_ACQUIRE);
+  if (table == nullptr) {
+    initialize_symtable();
+    table = __atomic_load_n(&symbol_table, __ATOMIC_ACQUIRE);
+  }
+  Symbol* sym = find_symbol(table, nonunique, length, hash, slot);
+  if (sym != nullptr)
+    return sym->name;
+
+  // New symbol -- repeat the search while holding the lock in case another
+  // thread inserted the symbol or replaced the table in the meantime.
+  pthread_mutex_lock(&symbol_table_lock);
+  table = symbol_table;
+  sym = find_symbol(table, nonunique, length, hash, slot);
+  if (sym == nullptr) {
+    // Keep the table at most half full.
+    if (2*(table->used + 1) > table->mask + 1) {
+      table = grow_symbol_table(table);
+      find_symbol(table, nonunique, length, hash, slot);
+    }
+    sym = symbol_storage->allocate(length);
+    sym->hash = hash;
+    sym->length = length;
+    memcpy(sym->name, nonunique, length + 1);
+    table->used++;
+    __atomic_store_n(&table->slots[slot], sym, __ATOMIC_RELEASE);
   }
-  else
-    // Existing entry in the symbol table -- return it.
-    return sym_iter->second;
+  pthread_mutex_unlock(&symbol_table_lock);
+  return sym->name;
 }
 
 } // namespace bytesflops
@@ -18,6 +18,16 @@ typedef CachedUnorderedMap<const char*, WordPageTable*> func_to_page_t;
 static WordPageTable* global_unique_bytes = nullptr;
 static func_to_page_t* function_unique_bytes = nullptr;
 
+// In thread-sharded mode, each thread records its accesses in private copies
+// of the above, which are merged into the global copies when the thread
+// exits or the program ends.
+struct UniqueBytesShard {
+  WordPageTable* global_unique_bytes;
+  func_to_page_t* function_unique_bytes;
+};
+static __thread WordPageTable* thread_global_unique_bytes = nullptr;
+static __thread func_to_page_t* thread_function_unique_bytes = nullptr;
+
 // Define a logical page size to use throughout this file.
 static const size_t logical_page_size = 8192;
 
@@ -28,6 +38,38 @@ void initialize_tallybytes (void)
   function_unique_bytes = new func_to_page_t();
 }
 
+// Merge a thread's private page tables into the global page tables.  The
+// caller must hold the mega-lock.
+static void merge_unique_bytes_shard (void* shard_ptr)
+{
+  UniqueBytesShard* shard = (UniqueBytesShard*) shard_ptr;
+  global_unique_bytes->merge(shard->global_unique_bytes);
+  shard->global_unique_bytes->clear();
+  for (auto map_iter = shard->function_unique_bytes->begin();
+       map_iter != shard->function_unique_bytes->end();
+       map_iter++) {
+    auto gmap_iter = function_unique_bytes->find(map_iter->first);
+    if (gmap_iter == function_unique_bytes->end())
+      (*function_unique_bytes)[map_iter->first] = map_iter->second;
+    else {
+      gmap_iter->second->merge(map_iter->second);
+      delete map_iter->second;
+    }
+  }
+  shard->function_unique_bytes->clear();
+}
+
+// Initialize the calling thread's variables at first use.
+void initialize_thread_tallybytes (void)
+{
+  if (!bf_thread_shards)
+    return;
+  UniqueBytesShard* shard = new UniqueBytesShard;
+  shard->global_unique_bytes = thread_global_unique_bytes = new WordPageTable(logical_page_size);
+  shard->function_unique_bytes = thread_function_unique_bytes = new func_to_page_t();
+  bf_register_thread_shard(merge_unique_bytes_shard, shard);
+}
+
 // Return the number of unique addresses referenced by a given function.
 uint64_t bf_tally_unique_addresses_tb (const char* funcname)
 {
@@ -51,10 +93,11 @@ static WordPageTable* assoc_addresses_with_func (const char* funcname,
                                                  uint64_t numaddrs)
 {
   WordPageTable* unique_bytes;
-  func_to_page_t::iterator map_iter = function_unique_bytes->find(funcname);
-  if (map_iter == function_unique_bytes->end())
+  func_to_page_t* func_map = bf_thread_shards ? thread_function_unique_bytes : function_unique_bytes;
+  func_to_page_t::iterator map_iter = func_map->find(funcname);
+  if (map_iter == func_map->end())
     // This is the first time we've seen this function.
-    (*function_unique_bytes)[funcname] = unique_bytes = new WordPageTable(logical_page_size);
+    (*func_map)[funcname] = unique_bytes = new WordPageTable(logical_page_size);
   else
     // We've seen this function before.
     unique_bytes = map_iter->second;
@@ -67,13 +110,16 @@ static WordPageTable* assoc_addresses_with_func (const char* funcname,
 extern "C"
 void bf_assoc_addresses_with_func_tb (const char* funcname, uint64_t baseaddr, uint64_t numaddrs)
 {
-  // Do nothing if counting is suppressed.
-  if (bf_suppress_counting)
+  OverheadTimer timer(BF_OVERHEAD_TALLYBYTES);
+
+  // Do nothing if counting is suppressed or the range is empty (e.g., from
+  // a zero-length memset()).
+  if (bf_suppress_counting || numaddrs == 0)
     return;
 
   // Find the given function's mapping from page number to bit list.
   if (bf_call_stack)
-    funcname = bf_func_and_parents;
+    funcname = bf_func_and_parents();
   else
     funcname = bf_string_to_symbol(funcname);
 
@@ -85,9 +131,14 @@ void bf_assoc_addresses_with_func_tb (const char* funcname, uint64_t baseaddr, u
 extern "C"
 void bf_assoc_addresses_with_prog_tb (uint64_t baseaddr, uint64_t numaddrs)
 {
-  if (bf_suppress_counting)
+  OverheadTimer timer(BF_OVERHEAD_TALLYBYTES);
+
+  if (bf_suppress_counting || numaddrs == 0)
     return;
-  global_unique_bytes->access(baseaddr, numaddrs);
+  if (bf_thread_shards)
+    thread_global_unique_bytes->access(baseaddr, numaddrs);
+  else
+    global_unique_bytes->access(baseaddr, numaddrs);
 }
 
 // Return true if one {count, multiplier} pair has a greater
@@ -110,10 +161,11 @@ static void get_address_tally_hist (WordPageTable& mapping, vector<bf_addr_tally
     counts_iter++;
 
     // Increment the multiplier for each count.
-    const bytecount_t* byte_counter = pte->raw_counts();
-    for (size_t i = 0; i < logical_page_size; i++)
-      if (byte_counter[i] > 0)
-        count2mult[byte_counter[i]]++;
+    for (size_t i = 0; i < logical_page_size; i++) {
+      bytecount_t count = pte->get_count(i);
+      if (count > 0)
+        count2mult[count]++;
+    }
   }
 
   // Convert count2mult from a map to a vector.
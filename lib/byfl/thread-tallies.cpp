@@ -0,0 +1,350 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (attribution of counters to threads and OpenMP parallel regions)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+#include <dlfcn.h>
+#include <sstream>
+#ifdef HAVE_OMP_TOOLS_H
+# include <omp-tools.h>
+#endif
+
+using namespace std;
+
+namespace bytesflops {
+
+extern ostream* bfout;
+extern BinaryOStream* bfbin;
+
+// Define the subset of the counters we attribute to parallel regions.
+enum {
+  THREAD_BBLOCKS,          // Basic blocks executed
+  THREAD_LOAD_INS,         // Load instructions executed
+  THREAD_STORE_INS,        // Store instructions executed
+  THREAD_FLOPS,            // Floating-point operations performed
+  THREAD_INT_OPS,          // Integer operations performed
+  THREAD_CALL_INS,         // Function calls executed
+  THREAD_LOADS,            // Bytes loaded
+  THREAD_STORES,           // Bytes stored
+  THREAD_FP_BITS,          // Bits consumed or produced by floating-point operations
+  THREAD_OP_BITS,          // Bits consumed or produced by all non-memory operations
+  NUM_THREAD_COUNTERS
+};
+
+// Name each of the above in the binary output.
+static const char* thread_binary_names[NUM_THREAD_COUNTERS] = {
+  "Basic blocks",
+  "Load operations",
+  "Store operations",
+  "Floating-point operations",
+  "Integer operations",
+  "Function-call operations (non-exception-throwing)",
+  "Bytes loaded",
+  "Bytes stored",
+  "Floating-point operation bits",
+  "Integer operation bits"
+};
+
+// Tally the counters a thread accumulated within one parallel region.
+struct RegionTallies {
+  uint64_t instances;                      // Number of times the thread entered the region
+  uint64_t values[NUM_THREAD_COUNTERS];    // Counters accumulated within the region
+
+  RegionTallies() : instances(0) {
+    memset(values, 0, sizeof(values));
+  }
+};
+
+// Tally all of a thread's counters and their breakdown by parallel region.
+// A region is identified by the address of the code that launched it;
+// nullptr represents code outside of any parallel region.
+class ThreadTallies : public ArenaAllocated {
+public:
+  uint64_t thread_num;                     // Thread number in order of first use
+  ByteFlopCounters totals;                 // Counters the thread has flushed so far
+  vector<const void*> region_stack;        // Parallel regions the thread is in (innermost last)
+  uint64_t region_start[NUM_THREAD_COUNTERS];  // Counter values on entry to the innermost region
+  map<const void*, RegionTallies> regions; // Counters in each parallel region
+
+  ThreadTallies (uint64_t num) : thread_num(num) {
+    memset(region_start, 0, sizeof(region_start));
+  }
+};
+
+static vector<ThreadTallies*>* all_thread_tallies = nullptr;  // Every thread's tallies
+static __thread ThreadTallies* my_thread_tallies = nullptr;   // The calling thread's tallies
+static bool saw_parallel_region = false;   // true=the OpenMP runtime reported at least one region
+
+// Extract the counters we attribute to regions from a set of ByteFlopCounters.
+static void extract_thread_counters (const ByteFlopCounters& counters,
+                                     uint64_t* values)
+{
+  values[THREAD_BBLOCKS] = counters.terminators[BF_END_BB_ANY];
+  values[THREAD_LOAD_INS] = counters.load_ins;
+  values[THREAD_STORE_INS] = counters.store_ins;
+  values[THREAD_FLOPS] = counters.flops;
+  values[THREAD_INT_OPS] = counters.ops - counters.flops - counters.load_ins - counters.store_ins - counters.terminators[BF_END_BB_ANY];
+  values[THREAD_CALL_INS] = counters.call_ins;
+  values[THREAD_LOADS] = counters.loads;
+  values[THREAD_STORES] = counters.stores;
+  values[THREAD_FP_BITS] = counters.fp_bits;
+  values[THREAD_OP_BITS] = counters.op_bits;
+}
+
+// Return the calling thread's counter values so far, including those not
+// yet flushed from its counter variables.
+static void current_thread_counters (uint64_t* values)
+{
+  extract_thread_counters(my_thread_tallies->totals, values);
+  uint64_t bblocks = bf_terminator_count == nullptr ? 0 : bf_terminator_count[BF_END_BB_ANY];
+  values[THREAD_BBLOCKS] += bblocks;
+  values[THREAD_LOAD_INS] += bf_load_ins_count;
+  values[THREAD_STORE_INS] += bf_store_ins_count;
+  values[THREAD_FLOPS] += bf_flop_count;
+  values[THREAD_INT_OPS] += bf_op_count - bf_flop_count - bf_load_ins_count - bf_store_ins_count - bblocks;
+  values[THREAD_CALL_INS] += bf_call_ins_count;
+  values[THREAD_LOADS] += bf_load_count;
+  values[THREAD_STORES] += bf_store_count;
+  values[THREAD_FP_BITS] += bf_fp_bits_count;
+  values[THREAD_OP_BITS] += bf_op_bits_count;
+}
+
+// Charge the counters accumulated since the innermost region was entered
+// (or resumed) to that region, and restart the region's tally from a given
+// set of counter values.
+static void charge_current_region (ThreadTallies* tallies, const uint64_t* now)
+{
+  const void* region = tallies->region_stack.empty() ? nullptr : tallies->region_stack.back();
+  RegionTallies& region_tallies = tallies->regions[region];
+  for (int i = 0; i < NUM_THREAD_COUNTERS; i++) {
+    region_tallies.values[i] += now[i] - tallies->region_start[i];
+    tallies->region_start[i] = now[i];
+  }
+}
+
+// Allocate a set of per-thread tallies for the calling thread and return
+// the counters into which the caller should flush the thread's counter
+// variables.  This is invoked only in thread-sharded mode.
+ByteFlopCounters* bf_new_thread_tallies (void)
+{
+  bf_acquire_mega_lock();
+  if (all_thread_tallies == nullptr)
+    all_thread_tallies = new vector<ThreadTallies*>;
+  my_thread_tallies = new ThreadTallies(all_thread_tallies->size());
+  all_thread_tallies->push_back(my_thread_tallies);
+  bf_release_mega_lock();
+  return &my_thread_tallies->totals;
+}
+
+// Note that the calling thread is beginning to execute a parallel region.
+void bf_enter_parallel_region (const void* region)
+{
+  bf_initialize_if_necessary();
+  if (my_thread_tallies == nullptr)
+    return;
+  uint64_t now[NUM_THREAD_COUNTERS];
+  current_thread_counters(now);
+  charge_current_region(my_thread_tallies, now);
+  my_thread_tallies->region_stack.push_back(region);
+  my_thread_tallies->regions[region].instances++;
+  saw_parallel_region = true;
+}
+
+// Note that the calling thread has finished executing a parallel region.
+void bf_leave_parallel_region (void)
+{
+  if (my_thread_tallies == nullptr || my_thread_tallies->region_stack.empty())
+    return;
+  uint64_t now[NUM_THREAD_COUNTERS];
+  current_thread_counters(now);
+  charge_current_region(my_thread_tallies, now);
+  my_thread_tallies->region_stack.pop_back();
+}
+
+#ifdef HAVE_OMP_TOOLS_H
+// Remember the code address that launched each parallel region.
+static void on_parallel_begin (ompt_data_t* encountering_task_data,
+                               const ompt_frame_t* encountering_task_frame,
+                               ompt_data_t* parallel_data,
+                               unsigned int requested_parallelism,
+                               int flags,
+                               const void* codeptr_ra)
+{
+  parallel_data->ptr = const_cast<void*>(codeptr_ra);
+}
+
+// Attribute each thread's counters to the parallel region it's executing.
+static void on_implicit_task (ompt_scope_endpoint_t endpoint,
+                              ompt_data_t* parallel_data,
+                              ompt_data_t* task_data,
+                              unsigned int actual_parallelism,
+                              unsigned int index,
+                              int flags)
+{
+  if (flags & ompt_task_initial)
+    return;
+  if (endpoint == ompt_scope_begin)
+    bf_enter_parallel_region(parallel_data == nullptr ? nullptr : parallel_data->ptr);
+  else
+    bf_leave_parallel_region();
+}
+
+// Register our callbacks with the OpenMP runtime.
+static int initialize_ompt (ompt_function_lookup_t lookup,
+                            int initial_device_num,
+                            ompt_data_t* tool_data)
+{
+  ompt_set_callback_t set_callback = (ompt_set_callback_t) lookup("ompt_set_callback");
+  if (set_callback == nullptr)
+    return 0;
+  set_callback(ompt_callback_parallel_begin, (ompt_callback_t) on_parallel_begin);
+  set_callback(ompt_callback_implicit_task, (ompt_callback_t) on_implicit_task);
+  return 1;
+}
+
+// Do nothing when the OpenMP runtime shuts down.  We report our data at
+// the end of the program.
+static void finalize_ompt (ompt_data_t* tool_data)
+{
+}
+
+#endif
+
+// Return a human-readable name for a parallel region: the enclosing
+// function if its symbol is exported or else an offset into the executable
+// or library, which addr2line can map to a source line.
+static string region_name (const void* region)
+{
+  if (region == nullptr)
+    return "[outside parallel regions]";
+  stringstream name;
+  Dl_info info;
+  if (dladdr(region, &info) == 0)
+    name << "0x" << hex << uintptr_t(region);
+  else if (info.dli_sname != nullptr)
+    name << demangle_func_name(info.dli_sname)
+         << "+0x" << hex << (uintptr_t(region) - uintptr_t(info.dli_saddr));
+  else {
+    const char* slash = strrchr(info.dli_fname, '/');
+    name << (slash == nullptr ? info.dli_fname : slash + 1)
+         << "+0x" << hex << (uintptr_t(region) - uintptr_t(info.dli_fbase));
+  }
+  return name.str();
+}
+
+// Report each thread's counters and, if the OpenMP runtime told us about
+// any parallel regions, each thread's counters within each region.  This
+// must be called after all thread shards have been merged.
+void bf_report_thread_counters (void)
+{
+  if (all_thread_tallies == nullptr)
+    return;
+  size_t num_threads = all_thread_tallies->size();
+
+  // Compute the mean operation count across threads so we can express
+  // each thread's load balance relative to it.
+  double mean_ops = 0.0;
+  for (auto iter = all_thread_tallies->cbegin(); iter != all_thread_tallies->cend(); iter++)
+    mean_ops += double((*iter)->totals.ops);
+  mean_ops /= double(num_threads);
+
+  // Output a summary of each thread in textual format.
+  string tag(bf_output_prefix + "BYFL_THREAD");
+  *bfout << tag << ": " << setw(8) << "Thread" << ' '
+         << setw(20) << "Bytes" << ' '
+         << setw(20) << "Flops" << ' '
+         << setw(20) << "Ops" << ' '
+         << setw(12) << "Bytes/flop" << ' '
+         << setw(12) << "Ops/mean" << '\n';
+  for (auto iter = all_thread_tallies->cbegin(); iter != all_thread_tallies->cend(); iter++) {
+    const ByteFlopCounters& totals = (*iter)->totals;
+    uint64_t bytes = totals.loads + totals.stores;
+    *bfout << tag << ": " << setw(8) << (*iter)->thread_num << ' '
+           << setw(20) << bytes << ' '
+           << setw(20) << totals.flops << ' '
+           << setw(20) << totals.ops << ' '
+           << setw(12) << fixed << setprecision(4)
+           << (totals.flops == 0 ? 0.0 : double(bytes)/double(totals.flops)) << ' '
+           << setw(12) << (mean_ops == 0.0 ? 0.0 : double(totals.ops)/mean_ops) << '\n';
+    bfout->unsetf(ios_base::floatfield);
+  }
+
+  // Output each thread's counters in binary format.  Binary output
+  // supports only integer columns so we express the ratios in parts per
+  // thousand.
+  *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "Threads"
+         << uint8_t(BINOUT_COL_UINT64) << "Thread";
+  for (int i = 0; i < NUM_THREAD_COUNTERS; i++)
+    *bfbin << uint8_t(BINOUT_COL_UINT64) << thread_binary_names[i];
+  *bfbin << uint8_t(BINOUT_COL_UINT64) << "Operations"
+         << uint8_t(BINOUT_COL_UINT64) << "Bytes per flop (thousandths)"
+         << uint8_t(BINOUT_COL_UINT64) << "Operations relative to the mean (thousandths)"
+         << uint8_t(BINOUT_COL_NONE);
+  for (auto iter = all_thread_tallies->cbegin(); iter != all_thread_tallies->cend(); iter++) {
+    const ByteFlopCounters& totals = (*iter)->totals;
+    uint64_t values[NUM_THREAD_COUNTERS];
+    extract_thread_counters(totals, values);
+    uint64_t bytes = totals.loads + totals.stores;
+    *bfbin << uint8_t(BINOUT_ROW_DATA) << (*iter)->thread_num;
+    for (int i = 0; i < NUM_THREAD_COUNTERS; i++)
+      *bfbin << values[i];
+    *bfbin << totals.ops
+           << uint64_t(totals.flops == 0 ? 0.0 : double(bytes)*1000.0/double(totals.flops) + 0.5)
+           << uint64_t(mean_ops == 0.0 ? 0.0 : double(totals.ops)*1000.0/mean_ops + 0.5);
+  }
+  *bfbin << uint8_t(BINOUT_ROW_NONE);
+
+  // Output each thread's counters within each parallel region.
+  if (!saw_parallel_region)
+    return;
+  *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "Parallel regions"
+         << uint8_t(BINOUT_COL_STRING) << "Region"
+         << uint8_t(BINOUT_COL_UINT64) << "Thread"
+         << uint8_t(BINOUT_COL_UINT64) << "Instances";
+  for (int i = 0; i < NUM_THREAD_COUNTERS; i++)
+    *bfbin << uint8_t(BINOUT_COL_UINT64) << thread_binary_names[i];
+  *bfbin << uint8_t(BINOUT_COL_NONE);
+  for (auto iter = all_thread_tallies->begin(); iter != all_thread_tallies->end(); iter++) {
+    // Charge whatever the thread did since its last region boundary to the
+    // region it was in at the time.
+    ThreadTallies* tallies = *iter;
+    uint64_t now[NUM_THREAD_COUNTERS];
+    extract_thread_counters(tallies->totals, now);
+    charge_current_region(tallies, now);
+    for (auto riter = tallies->regions.cbegin(); riter != tallies->regions.cend(); riter++) {
+      if (riter->second.instances == 0 &&
+          all_of(riter->second.values, riter->second.values + NUM_THREAD_COUNTERS,
+                 [](uint64_t v) { return v == 0; }))
+        continue;    // Thread did nothing outside of parallel regions.
+      *bfbin << uint8_t(BINOUT_ROW_DATA)
+             << region_name(riter->first)
+             << tallies->thread_num
+             << riter->second.instances;
+      for (int i = 0; i < NUM_THREAD_COUNTERS; i++)
+        *bfbin << riter->second.values[i];
+    }
+  }
+  *bfbin << uint8_t(BINOUT_ROW_NONE);
+}
+
+} // namespace bytesflops
+
+#ifdef HAVE_OMP_TOOLS_H
+// Announce ourself to an OMPT-capable OpenMP runtime.  We register our
+// callbacks only in thread-sharded mode, which is when per-thread tallies
+// exist.
+extern "C"
+ompt_start_tool_result_t* ompt_start_tool (unsigned int omp_version,
+                                           const char* runtime_version)
+{
+  static ompt_start_tool_result_t result = {
+    bytesflops::initialize_ompt,
+    bytesflops::finalize_ompt,
+    {0}
+  };
+  return bf_thread_shards ? &result : nullptr;
+}
+#endif
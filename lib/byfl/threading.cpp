@@ -13,8 +13,67 @@ static pthread_mutex_t megalock = PTHREAD_MUTEX_INITIALIZER;    // Lock protecti
 
 namespace bytesflops {
 
+// Each thread maintains a list of shards (thread-private data) and the
+// functions that merge them into the corresponding global data.
+typedef vector<pair<shard_merger_t, void*> > shard_list_t;
+static vector<shard_list_t*>* all_shards = nullptr;  // Shard lists of every registered thread
+static __thread shard_list_t* my_shards = nullptr;   // The calling thread's shard list
+static pthread_key_t thread_exit_key;   // Key whose destructor runs when a thread exits
+
+// Merge each shard in a list into the global data then empty the list.
+static void merge_shard_list (shard_list_t* shards)
+{
+  for (auto iter = shards->begin(); iter != shards->end(); iter++)
+    (iter->first)(iter->second);
+  shards->clear();
+}
+
+// Merge an exiting thread's shards into the global data.
+static void merge_exiting_thread (void* shards_ptr)
+{
+  shard_list_t* shards = (shard_list_t*) shards_ptr;
+  bf_acquire_mega_lock();
+  merge_shard_list(shards);
+  all_shards->erase(find(all_shards->begin(), all_shards->end(), shards));
+  bf_release_mega_lock();
+  delete shards;
+}
+
 // Initialize some of our variables at first use.
 void initialize_threading (void) {
+  all_shards = new vector<shard_list_t*>;
+  if (pthread_key_create(&thread_exit_key, merge_exiting_thread) != 0) {
+    cerr << "Failed to create a thread-specific data key\n";
+    bf_abend();
+  }
+}
+
+// Register a piece of the calling thread's private data and a function
+// that merges it into the global data.  The function is invoked, with the
+// mega-lock held, either when the thread exits or at the end of the program.
+void bf_register_thread_shard (shard_merger_t merger, void* shard)
+{
+  if (my_shards == nullptr) {
+    my_shards = new shard_list_t;
+    bf_acquire_mega_lock();
+    all_shards->push_back(my_shards);
+    bf_release_mega_lock();
+    if (pthread_setspecific(thread_exit_key, my_shards) != 0) {
+      cerr << "Failed to set thread-specific data\n";
+      bf_abend();
+    }
+  }
+  my_shards->push_back(make_pair(merger, shard));
+}
+
+// Merge all remaining threads' shards into the global data.  This is
+// intended to be called once, at the end of the program.
+void bf_merge_thread_shards (void)
+{
+  bf_acquire_mega_lock();
+  for (auto iter = all_shards->begin(); iter != all_shards->end(); iter++)
+    merge_shard_list(*iter);
+  bf_release_mega_lock();
 }
 
 // Take the mega-lock.
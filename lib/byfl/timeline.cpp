@@ -0,0 +1,162 @@
+/*
+ * Helper library for computing bytes:flops ratios
+ * (periodic snapshots of the global counters)
+ *
+ * By Scott Pakin <pakin@lanl.gov>
+ */
+
+#include "byfl.h"
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+// Instrumented code checks this flag at the end of every basic block and
+// invokes bf_take_timeline_snapshot() when it's nonzero.  A background
+// thread sets it once every bf_timeline_interval milliseconds.
+extern "C" {
+  volatile uint8_t bf_timeline_due = 0;
+}
+
+namespace bytesflops {
+
+extern BinaryOStream* bfbin;
+
+// Define the subset of the counters we record in each snapshot.
+struct TimelineEntry {
+  uint64_t begin_ns;     // Time at which the interval began
+  uint64_t end_ns;       // Time at which the interval ended
+  uint64_t bblocks;      // Basic blocks executed
+  uint64_t load_ins;     // Load instructions executed
+  uint64_t store_ins;    // Store instructions executed
+  uint64_t flops;        // Floating-point operations performed
+  uint64_t int_ops;      // Integer operations performed
+  uint64_t call_ins;     // Function calls executed
+  uint64_t loads;        // Bytes loaded
+  uint64_t stores;       // Bytes stored
+  uint64_t fp_bits;      // Bits consumed or produced by floating-point operations
+  uint64_t op_bits;      // Bits consumed or produced by all non-memory operations
+};
+
+static vector<TimelineEntry>* timeline = nullptr;   // All snapshots taken so far
+static ByteFlopCounters* prev_totals = nullptr;     // Totals as of the previous snapshot
+static chrono::steady_clock::time_point start_time; // Time at which the first interval began
+static uint64_t prev_ns = 0;                        // Time at which the current interval began
+
+// Return the number of nanoseconds since start_time.
+static uint64_t elapsed_ns (void)
+{
+  auto elapsed = chrono::steady_clock::now() - start_time;
+  return uint64_t(chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+}
+
+// Periodically request a snapshot.  This runs in a background thread
+// until the program exits.
+static void timeline_timer (void)
+{
+  auto interval = chrono::milliseconds(bf_timeline_interval);
+  auto next_time = chrono::steady_clock::now() + interval;
+  while (true) {
+    this_thread::sleep_until(next_time);
+    bf_timeline_due = 1;
+    next_time += interval;
+  }
+}
+
+// Initialize some of our variables at first use.
+void initialize_timeline (void)
+{
+  if (bf_timeline_interval == 0)
+    return;
+  timeline = new vector<TimelineEntry>;
+  prev_totals = new ByteFlopCounters;
+  start_time = chrono::steady_clock::now();
+  thread(timeline_timer).detach();
+}
+
+// Append to the timeline the difference between the current totals and
+// those at the previous snapshot.  The caller must hold the mega-lock.
+static void record_snapshot (ByteFlopCounters& totals)
+{
+  static ByteFlopCounters deltas;
+  (void) totals.difference(prev_totals, &deltas);
+  TimelineEntry entry;
+  entry.begin_ns = prev_ns;
+  entry.end_ns = prev_ns = elapsed_ns();
+  entry.bblocks = deltas.terminators[BF_END_BB_ANY];
+  entry.load_ins = deltas.load_ins;
+  entry.store_ins = deltas.store_ins;
+  entry.flops = deltas.flops;
+  entry.int_ops = deltas.ops - deltas.flops - deltas.load_ins - deltas.store_ins - deltas.terminators[BF_END_BB_ANY];
+  entry.call_ins = deltas.call_ins;
+  entry.loads = deltas.loads;
+  entry.stores = deltas.stores;
+  entry.fp_bits = deltas.fp_bits;
+  entry.op_bits = deltas.op_bits;
+  timeline->push_back(entry);
+  *prev_totals = totals;
+}
+
+// Record the counters accumulated since the previous snapshot.  The
+// instrumented code invokes this when it sees bf_timeline_due set.
+extern "C"
+void bf_take_timeline_snapshot (void)
+{
+  static ByteFlopCounters totals;
+  bf_acquire_mega_lock();
+  if (bf_timeline_due) {
+    // Another thread may have taken the snapshot while we were waiting
+    // for the lock.
+    bf_timeline_due = 0;
+    bf_snapshot_totals(totals);
+    record_snapshot(totals);
+  }
+  if (bf_live_due)
+    bf_publish_live_counters();
+  bf_release_mega_lock();
+}
+
+// Output the timeline.  This is invoked at the end of the program, after
+// global_totals is complete, so the final interval accounts for all
+// remaining counts.
+void bf_report_timeline (void)
+{
+  // Record the final interval.
+  bf_acquire_mega_lock();
+  record_snapshot(global_totals);
+  bf_release_mega_lock();
+
+  // Output the timeline -- only to the binary output file, not the
+  // standard output device.
+  *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "Timeline"
+         << uint8_t(BINOUT_COL_UINT64) << "Beginning time (ns)"
+         << uint8_t(BINOUT_COL_UINT64) << "Ending time (ns)"
+         << uint8_t(BINOUT_COL_UINT64) << "Basic blocks"
+         << uint8_t(BINOUT_COL_UINT64) << "Load operations"
+         << uint8_t(BINOUT_COL_UINT64) << "Store operations"
+         << uint8_t(BINOUT_COL_UINT64) << "Floating-point operations"
+         << uint8_t(BINOUT_COL_UINT64) << "Integer operations"
+         << uint8_t(BINOUT_COL_UINT64) << "Function-call operations (non-exception-throwing)"
+         << uint8_t(BINOUT_COL_UINT64) << "Bytes loaded"
+         << uint8_t(BINOUT_COL_UINT64) << "Bytes stored"
+         << uint8_t(BINOUT_COL_UINT64) << "Floating-point operation bits"
+         << uint8_t(BINOUT_COL_UINT64) << "Integer operation bits"
+         << uint8_t(BINOUT_COL_NONE);
+  for (auto iter = timeline->cbegin(); iter != timeline->cend(); iter++)
+    *bfbin << uint8_t(BINOUT_ROW_DATA)
+           << iter->begin_ns
+           << iter->end_ns
+           << iter->bblocks
+           << iter->load_ins
+           << iter->store_ins
+           << iter->flops
+           << iter->int_ops
+           << iter->call_ins
+           << iter->loads
+           << iter->stores
+           << iter->fp_bits
+           << iter->op_bits;
+  *bfbin << uint8_t(BINOUT_ROW_NONE);
+}
+
+} // namespace bytesflops
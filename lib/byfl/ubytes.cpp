@@ -12,22 +12,124 @@ using namespace std;
 
 namespace bytesflops {
 
+// Define a logical page size to use throughout this file.
+static const size_t logical_page_size = 8192;
+
+// Define the number of registers (log base 2) in each HyperLogLog sketch
+// used by -bf-unique-bytes=approx.  2^12 one-byte registers give a
+// relative standard error of about 1.6%.
+static const unsigned int log2_sketch_registers = 12;
+typedef HyperLogLog<log2_sketch_registers> UniqueBytesSketch;
+
+// Record the unique bytes touched by a function or by the program as a
+// whole, either exactly, with one bit per byte, or approximately, with a
+// HyperLogLog sketch whose size is independent of the memory footprint.
+class UniqueBytes : public ArenaAllocated {
+private:
+  BitPageTable* exact;          // Exact set of bytes touched
+  UniqueBytesSketch* approx;    // Estimate of the number of bytes touched
+
+public:
+  UniqueBytes() : exact(nullptr), approx(nullptr) {
+    if (bf_unique_bytes_approx)
+      approx = new UniqueBytesSketch();
+    else
+      exact = new BitPageTable(logical_page_size);
+  }
+
+  ~UniqueBytes() {
+    delete exact;
+    delete approx;
+  }
+
+  // Record an access to a range of bytes.
+  void access (uint64_t baseaddr, uint64_t numaddrs) {
+    if (approx == nullptr)
+      exact->access(baseaddr, numaddrs);
+    else
+      approx->insert_range(baseaddr, numaddrs);
+  }
+
+  // Merge another set of unique bytes into ours.
+  void merge (UniqueBytes* other) {
+    if (approx == nullptr)
+      exact->merge(other->exact);
+    else
+      approx->merge(*other->approx);
+  }
+
+  // Forget all bytes touched so far.
+  void clear (void) {
+    if (approx == nullptr)
+      exact->clear();
+    else
+      approx->clear();
+  }
+
+  // Return the (possibly estimated) number of unique bytes touched.
+  uint64_t tally_unique (void) {
+    if (approx == nullptr)
+      return exact->tally_unique();
+    else
+      return approx->estimate();
+  }
+};
+
 // Keep track of the unique bytes touched by each function and by the program
 // as a whole.
-typedef CachedUnorderedMap<const char*, BitPageTable*> func_to_page_t;
-static BitPageTable* global_unique_bytes = nullptr;
+typedef CachedUnorderedMap<const char*, UniqueBytes*> func_to_page_t;
+static UniqueBytes* global_unique_bytes = nullptr;
 static func_to_page_t* function_unique_bytes = nullptr;
 
-// Define a logical page size to use throughout this file.
-static const size_t logical_page_size = 8192;
+// In thread-sharded mode, each thread records its accesses in private copies
+// of the above, which are merged into the global copies when the thread
+// exits or the program ends.
+struct UniqueBytesShard {
+  UniqueBytes* global_unique_bytes;
+  func_to_page_t* function_unique_bytes;
+};
+static __thread UniqueBytes* thread_global_unique_bytes = nullptr;
+static __thread func_to_page_t* thread_function_unique_bytes = nullptr;
 
 // Initialize some of our variables at first use.
 void initialize_ubytes (void)
 {
-  global_unique_bytes = new BitPageTable(logical_page_size);
+  global_unique_bytes = new UniqueBytes();
   function_unique_bytes = new func_to_page_t();
 }
 
+// Merge a thread's private page tables into the global page tables.  The
+// caller must hold the mega-lock.
+static void merge_unique_bytes_shard (void* shard_ptr)
+{
+  UniqueBytesShard* shard = (UniqueBytesShard*) shard_ptr;
+  global_unique_bytes->merge(shard->global_unique_bytes);
+  shard->global_unique_bytes->clear();
+  for (auto map_iter = shard->function_unique_bytes->begin();
+       map_iter != shard->function_unique_bytes->end();
+       map_iter++) {
+    auto gmap_iter = function_unique_bytes->find(map_iter->first);
+    if (gmap_iter == function_unique_bytes->end())
+      (*function_unique_bytes)[map_iter->first] = map_iter->second;
+    else {
+      gmap_iter->second->merge(map_iter->second);
+      delete map_iter->second;
+    }
+  }
+  shard->function_unique_bytes->clear();
+}
+
+// Initialize the calling thread's variables at first use.
+void initialize_thread_ubytes (void)
+{
+  if (!bf_thread_shards)
+    return;
+  UniqueBytesShard* shard = new UniqueBytesShard;
+  shard->global_unique_bytes = thread_global_unique_bytes = new UniqueBytes();
+  shard->function_unique_bytes = thread_function_unique_bytes = new func_to_page_t();
+  bf_register_thread_shard(merge_unique_bytes_shard, shard);
+}
+
 // Return the number of unique addresses referenced by a given function.
 uint64_t bf_tally_unique_addresses (const char* funcname)
 {
@@ -44,17 +146,29 @@ uint64_t bf_tally_unique_addresses (void)
   return global_unique_bytes->tally_unique();
 }
 
+// Return the half-width of a 95% confidence interval around a count of
+// unique addresses returned by bf_tally_unique_addresses(), or 0 if the
+// count is exact.
+uint64_t bf_unique_addresses_error (uint64_t tally)
+{
+  if (!bf_unique_bytes_approx)
+    return 0;
+  double rel_std_err = 1.04/sqrt(double(1 << log2_sketch_registers));
+  return uint64_t(1.96*rel_std_err*double(tally) + 0.5);
+}
+
 // Associate a set of memory locations with a given function.  Return
-// the page-to-bit-vector mapping for the given function.
-static BitPageTable* assoc_addresses_with_func (const char* funcname,
+// the set of unique bytes for the given function.
+static UniqueBytes* assoc_addresses_with_func (const char* funcname,
                                                 uint64_t baseaddr,
                                                 uint64_t numaddrs)
 {
-  BitPageTable* unique_bytes;
-  func_to_page_t::iterator map_iter = function_unique_bytes->find(funcname);
-  if (map_iter == function_unique_bytes->end())
+  UniqueBytes* unique_bytes;
+  func_to_page_t* func_map = bf_thread_shards ? thread_function_unique_bytes : function_unique_bytes;
+  func_to_page_t::iterator map_iter = func_map->find(funcname);
+  if (map_iter == func_map->end())
     // This is the first time we've seen this function.
-    (*function_unique_bytes)[funcname] = unique_bytes = new BitPageTable(logical_page_size);
+    (*func_map)[funcname] = unique_bytes = new UniqueBytes();
   else
     // We've seen this function before.
     unique_bytes = map_iter->second;
@@ -66,13 +180,16 @@ static BitPageTable* assoc_addresses_with_func (const char* funcname,
 extern "C"
 void bf_assoc_addresses_with_func (const char* funcname, uint64_t baseaddr, uint64_t numaddrs)
 {
-  // Do nothing if counting is suppressed.
-  if (bf_suppress_counting)
+  OverheadTimer timer(BF_OVERHEAD_UBYTES);
+
+  // Do nothing if counting is suppressed or the range is empty (e.g., from
+  // a zero-length memset()).
+  if (bf_suppress_counting || numaddrs == 0)
     return;
 
   // Find the given function's mapping from page number to bit list.
   if (bf_call_stack)
-    funcname = bf_func_and_parents;
+    funcname = bf_func_and_parents();
   else
     funcname = bf_string_to_symbol(funcname);
 
@@ -84,9 +201,14 @@ void bf_assoc_addresses_with_func (const char* funcname, uint64_t baseaddr, uint
 extern "C"
 void bf_assoc_addresses_with_prog (uint64_t baseaddr, uint64_t numaddrs)
 {
-  if (bf_suppress_counting)
+  OverheadTimer timer(BF_OVERHEAD_UBYTES);
+
+  if (bf_suppress_counting || numaddrs == 0)
     return;
-  global_unique_bytes->access(baseaddr, numaddrs);
+  if (bf_thread_shards)
+    thread_global_unique_bytes->access(baseaddr, numaddrs);
+  else
+    global_unique_bytes->access(baseaddr, numaddrs);
 }
 
 } // namespace bytesflops
@@ -71,6 +71,13 @@ typedef CachedUnorderedMap<const char*, vector_to_tally_t*> name_to_vector_t;
 static name_to_vector_t* function_vector_usage = NULL;
 static name_to_vector_t* user_defined_vector_usage = NULL;
 
+// Keep track of every kind of vector operation performed by every function
+// in every registered module, indexed by dense ID, plus the number of
+// times each was performed since it was last folded into
+// function_vector_usage.
+static vector<const bf_vector_op_t*>* vector_ops = NULL;
+static vector<uint64_t>* vector_op_tallies = NULL;
+
 
 namespace bytesflops {
 
@@ -83,10 +90,12 @@ void initialize_vectors (void)
   user_defined_vector_usage = new name_to_vector_t();
 }
 
-// Associate a vector operation with a given name.
+// Associate a number of executions of a vector operation with a given
+// name.
 static void tally_vector_operation (name_to_vector_t* vector_usage,
                                     const char *tag, uint64_t num_elements,
-                                    uint64_t element_bits, bool is_flop)
+                                    uint64_t element_bits, bool is_flop,
+                                    uint64_t tally=1)
 {
   // Find or create the associated vector-to-tally mapping.
   name_to_vector_t::iterator vectally_iter = vector_usage->find(tag);
@@ -94,7 +103,7 @@ static void tally_vector_operation (name_to_vector_t* vector_usage,
     // This is the first time we've seen this tag.  Give it a fresh
     // map and return.
     vector_to_tally_t* newvectally = new vector_to_tally_t();
-    (*newvectally)[new VectorOperation(num_elements, element_bits, is_flop)] = 1;
+    (*newvectally)[new VectorOperation(num_elements, element_bits, is_flop)] = tally;
     (*vector_usage)[tag] = newvectally;
     return;
   }
@@ -107,30 +116,75 @@ static void tally_vector_operation (name_to_vector_t* vector_usage,
   if (tally_iter == vectally->end()) {
     // This is the first time we've seen this vector type in the
     // current tag.  Create an initial tally and return.
-    (*vectally)[search_vector] = 1;
+    (*vectally)[search_vector] = tally;
     search_vector = new VectorOperation();
     return;
   }
-  tally_iter->second++;
+  tally_iter->second += tally;
 }
 
+// Record a module's table of vector operations.  Assign the operations
+// consecutive IDs, and tell the module the first of these.
 extern "C"
-void bf_tally_vector_operation (const char *funcname, uint64_t num_elements,
-                                uint64_t element_bits, bool is_flop)
+void bf_record_vector_ops (uint64_t num_ops, const bf_vector_op_t* ops,
+                           uint64_t* base_id)
+{
+  if (vector_ops == NULL) {
+    vector_ops = new vector<const bf_vector_op_t*>;
+    vector_op_tallies = new vector<uint64_t>;
+  }
+  *base_id = vector_ops->size();
+  for (uint64_t i = 0; i < num_ops; i++) {
+    vector_ops->push_back(&ops[i]);
+    vector_op_tallies->push_back(0);
+  }
+}
+
+// Fold the tallies of registered vector operations into
+// function_vector_usage, and reset them.
+static void fold_vector_op_tallies (void)
+{
+  if (vector_ops == NULL)
+    return;
+  for (size_t i = 0; i < vector_ops->size(); i++) {
+    uint64_t tally = (*vector_op_tallies)[i];
+    if (tally == 0)
+      continue;
+    const bf_vector_op_t* op = (*vector_ops)[i];
+    const char* funcname = bf_per_func ? bf_string_to_symbol(op->funcname) : "";
+    tally_vector_operation(function_vector_usage, funcname, op->num_elements,
+                           op->element_bits, op->is_flop != 0, tally);
+    (*vector_op_tallies)[i] = 0;
+  }
+}
+
+// Tally a vector operation.  A registered operation's ID indexes a flat
+// array of tallies directly.  We fall back to looking up the operation's
+// properties if we're tracking call stacks, which are known only at run
+// time, or if the operation's module has not yet registered its vector
+// operations.
+extern "C"
+void bf_tally_vector_operation (uint64_t op_id, const char *funcname,
+                                uint64_t num_elements, uint64_t element_bits,
+                                bool is_flop)
 {
   // Do nothing if counting is suppressed.
   if (bf_suppress_counting)
     return;
 
   // Find the given function's mapping from vector to tally and increment that.
-  if (bf_per_func)
-    if (bf_call_stack)
-      funcname = bf_func_and_parents;
+  if (!bf_call_stack && vector_ops != NULL && op_id < vector_ops->size())
+    (*vector_op_tallies)[op_id]++;
+  else {
+    if (bf_per_func)
+      if (bf_call_stack)
+        funcname = bf_func_and_parents();
+      else
+        funcname = bf_string_to_symbol(funcname);
     else
-      funcname = bf_string_to_symbol(funcname);
-  else
-    funcname = "";
-  tally_vector_operation(function_vector_usage, funcname, num_elements, element_bits, is_flop);
+      funcname = "";
+    tally_vector_operation(function_vector_usage, funcname, num_elements, element_bits, is_flop);
+  }
 
   // Also tally according to the user's specified data-partitioning scheme.
   const char* partition = bf_string_to_symbol(bf_categorize_counters());
@@ -141,6 +195,7 @@ void bf_tally_vector_operation (const char *funcname, uint64_t num_elements,
 // Acquire statistics on all vector operations encountered.
 void bf_get_vector_statistics(uint64_t* num_ops, uint64_t* total_elts, uint64_t* total_bits) {
   *num_ops = *total_elts = *total_bits = 0;
+  fold_vector_op_tallies();
   for (name_to_vector_t::iterator vectally_iter = function_vector_usage->begin();
        vectally_iter != function_vector_usage->end();
        vectally_iter++) {
@@ -179,6 +234,8 @@ void bf_get_vector_statistics(const char* tag, uint64_t* num_ops, uint64_t* tota
 // Output a histogram of all vector operations encountered.
 void bf_report_vector_operations (void)
 {
+  fold_vector_op_tallies();
+
   // Output a binary table header.
   *bfbin << uint8_t(BINOUT_TABLE_BASIC) << "Vector operations";
   *bfbin << uint8_t(BINOUT_COL_UINT64) << "Elements per vector"
@@ -28,9 +28,12 @@ namespace bytesflops_pass {
                  cl::desc("Additionally output the name of each function's parent"));
 
   // Define a command-line option for keeping track of unique bytes
-  cl::opt<bool>
-  TrackUniqueBytes("bf-unique-bytes", cl::init(false), cl::NotHidden,
-                   cl::desc("Tally unique bytes accessed"));
+  cl::opt<UniqueBytesType>
+  TrackUniqueBytes("bf-unique-bytes", cl::init(UB_NONE), cl::NotHidden, cl::ValueOptional,
+                   cl::desc("Tally unique bytes accessed"),
+                   cl::values(clEnumValN(UB_EXACT,  "exact",  "Count unique bytes exactly"),
+                              clEnumValN(UB_APPROX, "approx", "Estimate unique bytes using constant memory per function"),
+                              clEnumValN(UB_EXACT,  "",       "Count unique bytes exactly")));
 
   // Define a command-line option for keeping track of unique bytes
   cl::opt<bool>
@@ -86,6 +89,12 @@ namespace bytesflops_pass {
   ThreadSafety("bf-thread-safe", cl::init(false), cl::NotHidden,
                cl::desc("Generate slower but thread-safe instrumentation"));
 
+  // Define a command-line option for giving each thread its own counters
+  // rather than serializing all threads on a single lock.
+  cl::opt<bool>
+  ThreadShards("bf-thread-shards", cl::init(false), cl::NotHidden,
+               cl::desc("Give each thread private counters, merged at exit (implies -bf-thread-safe)"));
+
   // Define a command-line option for tallying vector operations.
   cl::opt<bool>
   TallyVectors("bf-vectors", cl::init(false), cl::NotHidden,
@@ -107,6 +116,21 @@ namespace bytesflops_pass {
                cl::desc("Treat addresses not touched after this many accesses as untouched"),
                cl::value_desc("accesses"));
 
+  // Define a command-line option for selecting the reuse-distance
+  // algorithm.
+  cl::opt<ReuseEngineType>
+  ReuseEngine("bf-reuse-engine", cl::init(RD_ENGINE_SPLAY), cl::NotHidden,
+              cl::desc("Data structure used to compute reuse distance"),
+              cl::values(clEnumValN(RD_ENGINE_SPLAY,   "splay",   "Splay tree (smaller memory footprint)"),
+                         clEnumValN(RD_ENGINE_FENWICK, "fenwick", "Fenwick tree (faster)")));
+
+  // Define a command-line option for estimating reuse distance from a
+  // spatially hashed sample of addresses.
+  cl::opt<double>
+  ReuseSample("bf-reuse-sample", cl::init(1.0), cl::NotHidden,
+              cl::desc("Estimate reuse distance from this fraction of all addresses"),
+              cl::value_desc("rate"));
+
   // Define a command-line option for turning on the cache model.
   // Doing so will create private-cache.dump,
   // remote-shared-cache.dump, and shared-cache.dump files on each
@@ -128,6 +152,62 @@ namespace bytesflops_pass {
                cl::desc("Log base 2 of the maximum number of sets modeled at the same time."),
                cl::value_desc("bits"));
 
+  // Define a command-line option to specify the maximum associativity.
+  cl::opt<unsigned long long>
+  CacheMaxWays("bf-max-ways", cl::init(64), cl::NotHidden,
+               cl::desc("Maximum number of lines per set modeled by the simple cache model."),
+               cl::value_desc("ways"));
+
+  // Define a command-line option for modeling a specific cache hierarchy
+  // (in addition to the simple cache model, which is implied).
+  cl::opt<string>
+  CacheConfig("bf-cache-config", cl::init(""), cl::NotHidden,
+              cl::desc("Model a cache hierarchy, listed from the level closest to the processor"),
+              cl::value_desc("name:capacity:ways:line_size,..."));
+
+  // Define a command-line option for the cache hierarchy's inclusion policy.
+  cl::opt<CachePolicyType>
+  CachePolicy("bf-cache-policy", cl::init(CACHE_INCLUSIVE), cl::NotHidden,
+              cl::desc("Inclusion policy of the modeled cache hierarchy"),
+              cl::values(clEnumValN(CACHE_INCLUSIVE, "inclusive", "Each level holds a copy of all data in the levels above it"),
+                         clEnumValN(CACHE_EXCLUSIVE, "exclusive", "Each line resides in at most one level")));
+
+  // Define a command-line option for buffering memory accesses and
+  // passing them to the run-time library in bulk.
+  cl::opt<bool>
+  BatchAccesses("bf-batch-accesses", cl::init(false), cl::NotHidden,
+                cl::desc("Buffer memory accesses per thread and analyze them in batches"));
+
+  // Define a command-line option for periodically snapshotting the
+  // counters to show how they evolve over time.
+  cl::opt<unsigned long long>
+  TimelineInterval("bf-timeline", cl::init(0), cl::NotHidden,
+                   cl::desc("Snapshot the counters every N milliseconds (0=never)"),
+                   cl::value_desc("ms"));
+
+  // Define a command-line option for giving each function an
+  // uninstrumented clone to run while counting is disabled.
+  cl::opt<bool>
+  CloneFunctions("bf-clone-functions", cl::init(false), cl::NotHidden,
+                 cl::desc("Run uninstrumented copies of functions while counting is disabled"));
+
+  // Define a command-line option for updating the counters once per
+  // countable loop rather than once per iteration.
+  cl::opt<bool>
+  HoistLoopCounters("bf-hoist-counters", cl::init(true), cl::NotHidden,
+                    cl::desc("Update counters once after each countable loop instead of in every iteration"));
+
+  // Define a pair of command-line options for counting only during
+  // periodic bursts of function calls.
+  cl::opt<unsigned long long>
+  SampleBurst("bf-sample-burst", cl::init(1000), cl::NotHidden,
+              cl::desc("Count N function calls per sampling period"),
+              cl::value_desc("N"));
+  cl::opt<unsigned long long>
+  SamplePeriod("bf-sample-period", cl::init(0), cl::NotHidden,
+               cl::desc("Count only one burst out of every N function calls (0=count everything)"),
+               cl::value_desc("N"));
+
   static RegisterPass<BytesFlops> H("bytesflops", "Bytes:flops instrumentation");
 
   // Define a command-line option for tracking load/store strides.
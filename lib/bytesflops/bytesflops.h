@@ -12,11 +12,13 @@
 
 #include "llvm/ADT/StringMap.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instruction.h"
@@ -35,6 +37,8 @@
 #include <vector>
 #include <memory>
 #include <set>
+#include <map>
+#include <tuple>
 #include <iomanip>
 #include <unordered_map>
 #include <time.h>
@@ -62,7 +66,8 @@ namespace bytesflops_pass {
   extern cl::opt<bool> TrackCallStack;
 
   // Define a command-line option for keeping track of unique bytes.
-  extern cl::opt<bool> TrackUniqueBytes;
+  typedef enum {UB_NONE, UB_EXACT, UB_APPROX} UniqueBytesType;
+  extern cl::opt<UniqueBytesType> TrackUniqueBytes;
 
   // Define a command-line option for helping find a program's
   // working-set size.
@@ -100,6 +105,10 @@ namespace bytesflops_pass {
   // cost of increasing execution time).
   extern cl::opt<bool> ThreadSafety;
 
+  // Define a command-line option for giving each thread its own counters
+  // rather than serializing all threads on a single lock.
+  extern cl::opt<bool> ThreadShards;
+
   // Define a command-line option for tallying vector operations.
   extern cl::opt<bool> TallyVectors;
 
@@ -111,18 +120,62 @@ namespace bytesflops_pass {
   // Define a command-line option for pruning reuse distance.
   extern cl::opt<unsigned long long> MaxReuseDist;
 
+  // Define a command-line option for selecting the reuse-distance algorithm.
+  typedef enum {
+    RD_ENGINE_SPLAY = BF_RD_ENGINE_SPLAY,
+    RD_ENGINE_FENWICK = BF_RD_ENGINE_FENWICK
+  } ReuseEngineType;
+  extern cl::opt<ReuseEngineType> ReuseEngine;
+
+  // Define a command-line option for sampling addresses for reuse distance.
+  extern cl::opt<double> ReuseSample;
+
   // Define a command-line option for turning on the cache model.
   extern cl::opt<bool> CacheModel;
 
+  // Define a command-line option for buffering memory accesses and passing
+  // them to the run-time library in bulk.
+  extern cl::opt<bool> BatchAccesses;
+
+  // Define a command-line option for periodically snapshotting the
+  // counters.
+  extern cl::opt<unsigned long long> TimelineInterval;
+
+  // Define a command-line option for giving each function an
+  // uninstrumented clone to run while counting is disabled.
+  extern cl::opt<bool> CloneFunctions;
+
+  // Define a command-line option for updating the counters once per
+  // countable loop rather than once per iteration.
+  extern cl::opt<bool> HoistLoopCounters;
+
+  // Define a pair of command-line options for counting only during
+  // periodic bursts of function calls.
+  extern cl::opt<unsigned long long> SampleBurst;
+  extern cl::opt<unsigned long long> SamplePeriod;
+
   // Define a command-line option for cache line size in bytes.
   extern cl::opt<unsigned long long> CacheLineBytes;
 
   // Define a command-line option for log2 of the maximum number of sets to model.
   extern cl::opt<unsigned long long> CacheMaxSetBits;
 
+  // Define a command-line option to specify the maximum associativity.
+  extern cl::opt<unsigned long long> CacheMaxWays;
+
   // Define a command-line option for tracking load/store strides.
   extern cl::opt<bool> TrackStrides;
 
+  // Define a command-line option for modeling a cache hierarchy.
+  extern cl::opt<string> CacheConfig;
+
+  // Define a command-line option for the cache hierarchy's inclusion policy.
+  typedef enum {
+    CACHE_INCLUSIVE = BF_CACHE_INCLUSIVE,
+    CACHE_EXCLUSIVE = BF_CACHE_EXCLUSIVE
+  } CachePolicyType;
+  extern cl::opt<CachePolicyType> CachePolicy;
+
   // Destructively remove all instances of a given character from a string.
   extern void remove_all_instances(string& some_string, char some_char);
 
@@ -206,7 +259,9 @@ namespace bytesflops_pass {
     GlobalVariable* store_inst_var;             // Global reference to bf_store_ins_count, a 64-bit store-instruction counter
     GlobalVariable* mem_insts_var;              // Global reference to bf_mem_insts, a set of 64-bit memory instruction counters
     GlobalVariable* inst_mix_histo_var;         // Global reference to bf_inst_mix_histo, an array representing a histogram of specific instruction counts.
-    GlobalVariable* inst_deps_histo_var;        // Global reference to bf_inst_deps_histo, an array representing histogram of instruction dependencies.
+    GlobalVariable* inst_deps_histo_var;        // Placeholder for bf_inst_deps_tallies, the module's per-thread instruction-dependency tallies
+    map<uint64_t, uint64_t> inst_deps_ids;      // Map from an instruction-dependency index to an element of bf_inst_deps_tallies
+    vector<Constant*> inst_deps_tuples;         // bf_inst_deps_t for each element of bf_inst_deps_tallies, flattened
     GlobalVariable* terminator_var;             // Global reference to bf_terminator_count, an array of terminator tallies
     GlobalVariable* mem_intrinsics_var;         // Global reference to bf_mem_intrin_count, tallies of memory intrinsics
     GlobalVariable* flop_var;  // Global reference to bf_flop_count, a 64-bit flop counter
@@ -214,6 +269,10 @@ namespace bytesflops_pass {
     GlobalVariable* op_var;    // Global reference to bf_op_count, a 64-bit operation counter
     GlobalVariable* op_bits_var;   // Global reference to bf_op_bits_count, a 64-bit operation-bit counter
     GlobalVariable* call_inst_var;              // Global reference to bf_call_ins_count, a 64-bit call-instruction counter
+    GlobalVariable* access_trace_var;           // Global reference to bf_access_trace, a thread's buffer of memory accesses
+    GlobalVariable* access_trace_len_var;       // Global reference to bf_access_trace_len, the number of entries in bf_access_trace
+    GlobalVariable* bb_pending_var;             // Global reference to bf_bb_pending_count, the number of basic blocks not yet flushed
+    GlobalVariable* bb_flush_threshold_var;     // Global reference to bf_bb_flush_threshold, the number of basic blocks per flush
     uint64_t static_loads;   // Number of static load instructions
     uint64_t static_stores;  // Number of static store instructions
     uint64_t static_flops;   // Number of static floating-point instructions
@@ -225,6 +284,23 @@ namespace bytesflops_pass {
     Function* accum_bb_tallies;   // Pointer to bf_accumulate_bb_tallies()
     Function* report_bb_tallies;  // Pointer to bf_report_bb_tallies()
     Function* reset_bb_tallies;   // Pointer to bf_reset_bb_tallies()
+    Function* flush_bb_tallies;   // Pointer to bf_flush_bb_tallies()
+    Function* record_bb_tallies;  // Pointer to bf_record_bb_tallies()
+    Function* record_inst_deps;   // Pointer to bf_record_inst_deps()
+    bool defer_bb_tallies;        // true=let counters accumulate across basic blocks until the next flush
+    StructType* bb_record_type;   // bf_bb_record_t struct type
+    vector<Constant*> bb_records; // bf_bb_record_t for every basic block instrumented so far
+    bool static_bb_tallies;       // true=count flops, ops, and the instruction mix per basic block at compile time
+
+    // Describe the operations a basic block performs each time it executes.
+    typedef struct {
+      uint64_t flops;      // Number of floating-point operations
+      uint64_t fp_bits;    // Number of bits used by all FP operations
+      uint64_t ops;        // Number of operations of any type
+      uint64_t op_bits;    // Number of bits used by all operations except loads/stores
+      map<unsigned int, uint64_t> inst_mix;  // Number of instructions of each opcode
+    } StaticBBCounts;
+    StaticBBCounts bb_counts;     // Static counts for the current basic block
     Function* assoc_counts_with_func;    // Pointer to bf_assoc_counters_with_func()
     Function* assoc_addrs_with_func;    // Pointer to bf_assoc_addresses_with_func()
     Function* assoc_addrs_with_prog;    // Pointer to bf_assoc_addresses_with_prog()
@@ -233,7 +309,15 @@ namespace bytesflops_pass {
     Function* tally_function;      // Pointer to bf_incr_func_tally()
     Function* take_mega_lock;      // Pointer to bf_acquire_mega_lock()
     Function* release_mega_lock;   // Pointer to bf_release_mega_lock()
+    bool lock_every_bb;            // true=hold the mega-lock while updating each basic block's counters
+    bool lock_shared_calls;        // true=hold the mega-lock only around calls that update shared state
+    bool lock_dstruct_accesses;    // true=hold the mega-lock around each bf_access_data_struct() call
     Function* tally_vector;        // Pointer to bf_tally_vector_operation()
+    Function* record_vector_ops;   // Pointer to bf_record_vector_ops()
+    StructType* vector_op_type;    // bf_vector_op_t struct type
+    vector<Constant*> vector_ops;  // bf_vector_op_t for every kind of vector operation in every function
+    std::map<std::tuple<std::string, uint64_t, uint64_t, bool>, uint64_t> vector_op_index;  // Index into vector_ops of each function/operation combination
+    GlobalVariable* vector_base_var;  // ID the run-time library assigns to the module's first vector operation
     Function* access_data_struct;  // Pointer to bf_access_data_struct()
     Function* assoc_addrs_with_sstruct;     // Pointer to bf_assoc_addresses_with_sstruct()
     Function* assoc_addrs_with_dstruct;     // Pointer to bf_assoc_addresses_with_dstruct
@@ -245,7 +329,45 @@ namespace bytesflops_pass {
     Function* access_cache;      // Pointer to bf_touch_cache()
     Function* tally_bb_exec;     // Pointer to bf_tally_bb_execution()
     Function* track_stride;      // Pointer to bf_track_stride()
+    Function* record_stride_points;  // Pointer to bf_record_stride_points()
+    StructType* stride_point_type;   // bf_stride_point_t struct type
+    vector<Constant*> stride_points; // bf_stride_point_t for every load and store whose strides are tracked
+    GlobalVariable* stride_base_var; // ID the run-time library assigns to the module's first stride point
+    Function* drain_access_trace;  // Pointer to bf_drain_access_trace()
+    Function* take_timeline_snapshot;  // Pointer to bf_take_timeline_snapshot()
+    GlobalVariable* timeline_due_var;  // Global reference to bf_timeline_due, nonzero when a snapshot is due
+    GlobalVariable* counting_enabled_var;  // Global reference to bf_counting_enabled, zero while counting is disabled
+    GlobalVariable* sample_countdown_var;  // Global reference to bf_sample_countdown, function calls remaining in the current sampling phase
+    Function* sample_switch;     // Pointer to bf_sample_switch()
+
+    // Describe a memory access not yet appended to the access trace.
+    typedef struct {
+      Value* pointer;        // Pointer to the first byte accessed
+      Value* num_bytes;      // Number of bytes accessed (an integer of any width)
+      uint64_t analyses;     // Bit mask of BF_TRACE_* values
+      Constant* funcname;    // Name of the accessing function or NULL
+    } PendingAccess;
+    vector<PendingAccess> pending_accesses;   // Accesses in the current basic block
     StringMap<Constant*> func_name_to_arg;   // Map from a function name to an IR function argument
+
+    // Describe a counter update that a countable loop performs once per
+    // iteration.
+    typedef struct {
+      Constant* global_var;  // Counter variable or array
+      ConstantInt* idx;      // Index into the array or nullptr for a variable
+      uint64_t increment;    // Amount to add per iteration
+    } HoistedIncrement;
+
+    // Describe a countable loop whose counter updates we perform once, in
+    // the loop's exit block, instead of once per iteration.
+    typedef struct {
+      BasicBlock* exit_bb;   // The loop's sole exit block
+      Value* trip_count;     // Number of iterations (a 64-bit integer)
+      vector<HoistedIncrement> increments;   // Updates to perform on exit
+    } CountableLoop;
+    vector<CountableLoop> countable_loops;   // Countable loops in the current function
+    map<BasicBlock*, size_t> bb_to_countable_loop;   // Map from a basic block to its index in countable_loops
+    CountableLoop* hoist_target;   // Countable loop containing the basic block being instrumented, if any
     set<string>* instrument_only;   // Set of functions to instrument; NULL=all
     set<string>* dont_instrument;   // Set of functions not to instrument; NULL=none
     ConstantInt* not_end_of_bb;     // 0, not at the end of a basic block
@@ -283,6 +405,8 @@ namespace bytesflops_pass {
     Function* func_map_ctor;  // static constructor for the function keys
     std::unique_ptr<FunctionKeyGen>    m_keygen;
     std::map<std::string, KeyType_t>   func_key_map;
+    std::map<KeyType_t, uint64_t>      func_key_index;  // Position of each key in the module's table of functions
+    GlobalVariable* func_base_var;   // ID the run-time library assigns to the module's first function
     std::vector<KeyType_t>             recorded;
 
     GlobalVariable * byfl_fmap_cnt;
@@ -303,15 +427,21 @@ namespace bytesflops_pass {
                                 Value* idx,
                                 Value* increment);
 
-    // Insert before a given instruction some code to increment an element of a
-    // global 4-D array.
-    void increment_global_4D_array(BasicBlock::iterator& insert_before,
-                                   GlobalVariable* global_var,
-                                   Value* idx1,
-                                   Value* idx2,
-                                   Value* idx3,
-                                   Value* idx4,
-                                   Value* increment);
+    // Return true if counter updates may be hoisted out of countable
+    // loops.
+    bool can_hoist_counters(void) const;
+
+    // Find the current function's countable loops and compute their trip
+    // counts in their preheaders.
+    void find_countable_loops(Function& function);
+
+    // Add a constant counter increment to hoist_target's hoisted
+    // increments.  Return false if the increment can't be hoisted.
+    bool hoist_increment(Constant* global_var, Value* idx, Value* increment);
+
+    // Insert code into each countable loop's exit block to perform the
+    // loop's hoisted counter updates.
+    void insert_hoisted_increments(Module* module);
 
     // Mark a variable as "used" (not eligible for dead-code elimination).
     void mark_as_used(Module& module, Constant* protected_var);
@@ -370,7 +500,8 @@ namespace bytesflops_pass {
 
     // Declare an external variable.
     GlobalVariable* declare_global_var(Module& module, Type* var_type,
-                                       StringRef var_name, bool is_const=false);
+                                       StringRef var_name, bool is_const=false,
+                                       bool is_thread_local=false);
 
     GlobalVariable* create_global_var(Module& module,
                                       Type* var_type,
@@ -387,6 +518,34 @@ namespace bytesflops_pass {
     void insert_end_bb_code (Module* module, KeyType_t funcKey, uint64_t num_insts,
                              int& must_clear, BasicBlock::iterator& insert_before);
 
+    // Insert code to convert a pointer and a length to 64-bit integers.
+    void range_to_i64 (Module* module, Value* mem_ptr, Value* length,
+                       Instruction* insert_before,
+                       Value*& mem_addr, Value*& num_bytes);
+
+    // Insert code to append a list of pending memory accesses to the access
+    // trace and to drain the trace when it fills.  This splits the basic
+    // block.
+    void insert_access_trace_code (Module* module,
+                                   vector<PendingAccess>& accesses,
+                                   BasicBlock::iterator& insert_before,
+                                   bool lock_held);
+
+    // Insert code to take a timeline snapshot if one is due.  This
+    // splits the basic block.
+    void insert_timeline_code (Module* module,
+                               BasicBlock::iterator& insert_before);
+
+    // Create an uninstrumented copy of a function to run while counting
+    // is disabled.  Return nullptr if the function can't forward its
+    // arguments to a copy of itself.
+    Function* create_uninstrumented_clone (Function& function);
+
+    // Insert code at the beginning of a function to forward the call to
+    // the function's uninstrumented clone while counting is disabled.
+    void insert_clone_guard (Module* module, Function& function,
+                             Function* clone);
+
     // Wrap CallInst::Create() with code to acquire and release the
     // mega-lock when instrumenting in thread-safe mode.
     void callinst_create(Value* function, ArrayRef<Value*> args,
@@ -402,6 +561,15 @@ namespace bytesflops_pass {
     void callinst_create(Value* function, ArrayRef<Value*> args,
                          BasicBlock* insert_before);
 
+    // Wrap callinst_create() with code to acquire and release the
+    // mega-lock when instrumenting in thread-sharded mode.  This is used
+    // for run-time functions that update state shared by all threads.
+    void callinst_create_shared(Value* function, ArrayRef<Value*> args,
+                                Instruction* insert_before);
+
+    // Ditto the above but for parameterless functions.
+    void callinst_create_shared(Value* function, Instruction* insert_before);
+
     // Given a Call instruction, return true if we can safely ignore it.
     bool ignorable_call (const Instruction* inst);
 
@@ -413,6 +581,14 @@ namespace bytesflops_pass {
     void map_instructions_to_strings(Function& function);
     string inst_to_string(Instruction* inst);
 
+    // Analyze a range of addresses read or written.
+    void instrument_access_range(Module* module,
+                                 StringRef function_name,
+                                 Value* mem_ptr,
+                                 Value* length,
+                                 bool is_store,
+                                 BasicBlock::iterator& insert_before);
+
     // Instrument Load and Store instructions.
     void instrument_load_store(Module* module,
                                StringRef function_name,
@@ -423,6 +599,7 @@ namespace bytesflops_pass {
 
     // Instrument Call instructions.
     void instrument_call(Module* module,
+                         StringRef function_name,
                          BasicBlock::iterator& iter,
                          BasicBlock::iterator& insert_before,
                          int& must_clear);
@@ -497,6 +674,25 @@ namespace bytesflops_pass {
     // Track all global variable declarations.
     void track_global_variables(Module* module);
 
+    // Create a module constructor that passes the run-time library our
+    // table of basic blocks.
+    void create_bb_records_ctor(Module* module);
+
+    // Define the module's per-thread instruction-dependency tallies and a
+    // constructor that passes them to the run-time library.
+    void create_inst_deps_ctor(Module* module);
+
+    // Create a module constructor that passes the run-time library our
+    // table of loads and stores whose strides are tracked.
+    void create_stride_points_ctor(Module* module);
+
+    // Create a module constructor that passes the run-time library our
+    // table of vector operations.
+    void create_vector_ops_ctor(Module* module);
+
+    // Create a constant bf_symbol_info_t based on a given InternalSymbolInfo.
+    GlobalVariable* create_syminfo_constant(Module& module, InternalSymbolInfo& syminfo);
+
     // Read the metadata associated with a value and generate code to construct
     // a bf_symbol_info_t representing where the value came from.
     AllocaInst* find_value_provenance(Module& module, Value* value,
@@ -538,6 +734,9 @@ namespace bytesflops_pass {
 
     virtual bool runOnModule(Module & module) override;
 
+    // Declare the analyses we use to find countable loops.
+    virtual void getAnalysisUsage(AnalysisUsage& usage) const override;
+
     // Insert code for incrementing our byte, flop, etc. counters.
     virtual bool doFinalization(Module& module) override;
 
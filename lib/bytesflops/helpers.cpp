@@ -11,6 +11,14 @@
 #include <iostream>
 
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#if LLVM_VERSION_MAJOR >= 11
+# include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#else
+# include "llvm/Analysis/ScalarEvolutionExpander.h"
+#endif
 
 #include "llvm/CodeGen/ValueTypes.h"
 
@@ -141,6 +149,10 @@ void BytesFlops::increment_global_variable(BasicBlock::iterator& insert_before,
                                            Constant* global_var,
                                            Value* increment)
 {
+  // Defer the update to the end of the loop if we can.
+  if (hoist_increment(global_var, nullptr, increment))
+    return;
+
   // %0 = load i64* @<global_var>, align 8
 #if LLVM_VERSION_MAJOR >= 11
   LoadInst* load_var = new LoadInst(cast<PointerType>(global_var->getType())->getElementType(), global_var, "gvar", false, &*insert_before);
@@ -167,6 +179,9 @@ void BytesFlops::increment_global_array(BasicBlock::iterator& insert_before,
                                         Value* idx,
                                         Value* increment)
 {
+  // Defer the update to the end of the loop if we can.
+  if (hoist_increment(global_var, idx, increment))
+    return;
 
   // %1 = load i64** @<global_var>, align 8
 #if LLVM_VERSION_MAJOR >= 11
@@ -208,53 +223,6 @@ void BytesFlops::increment_global_array(BasicBlock::iterator& insert_before,
   mark_as_byfl(store_inst);
 }
 
-// Insert before a given instruction some code to increment an element of a
-// global 4-D array.
-void BytesFlops::increment_global_4D_array(BasicBlock::iterator& insert_before,
-                                           GlobalVariable* array4d_var,
-                                           Value* idx1,
-                                           Value* idx2,
-                                           Value* idx3,
-                                           Value* idx4,
-                                           Value* increment)
-{
-  // %1 = getelementptr inbounds [<D1> x [<D1> x [<D3> x [<D4> x i64]]]]* @<global_var>, i64 0, i64 <idx1>, i64 <idx2>, i64 <idx3>, i64 <idx4>
-  std::vector<Value*> gep_indices;
-  gep_indices.push_back(zero);
-  gep_indices.push_back(idx1);
-  gep_indices.push_back(idx2);
-  gep_indices.push_back(idx3);
-  gep_indices.push_back(idx4);
-  GetElementPtrInst* gep_inst =
-    GetElementPtrInst::Create(nullptr, array4d_var, gep_indices, "idx4_ptr", &*insert_before);
-  mark_as_byfl(gep_inst);
-
-  // %2 = load i64* %1, align 8
-#if LLVM_VERSION_MAJOR >= 11
-  LoadInst* load_inst = new LoadInst(cast<PointerType>(gep_inst->getType())->getElementType(), gep_inst, "idx4_val", false, (Align)8, &*insert_before);
-#elif LLVM_VERSION_MAJOR >= 10
-  LoadInst* load_inst = new LoadInst(cast<PointerType>(gep_inst->getType())->getElementType(), gep_inst, "idx4_val", false, (MaybeAlign)8, &*insert_before);
-#else
-  LoadInst* load_inst = new LoadInst(gep_inst, "idx4_val", false, 8, &*insert_before);
-#endif
-  mark_as_byfl(load_inst);
-
-  // %3 = add i64 %2, <increment>
-  BinaryOperator* add_inst =
-    BinaryOperator::Create(Instruction::Add, load_inst, increment, "new_val", &*insert_before);
-  mark_as_byfl(add_inst);
-
-  // store i64 %3, i64* %1, align 8
-#if LLVM_VERSION_MAJOR >= 11
-  StoreInst* store_inst = new StoreInst(add_inst, gep_inst, false, (Align)8, &*insert_before);
-#elif LLVM_VERSION_MAJOR >= 10
-  StoreInst* store_inst = new StoreInst(add_inst, gep_inst, false, (MaybeAlign)8, &*insert_before);
-#else
-  StoreInst* store_inst = new StoreInst(add_inst, gep_inst, false, 8, &*insert_before);
-#endif
-  mark_as_byfl(store_inst);
-}
-
 void BytesFlops::mark_as_used(Module& module, Constant* protected_var)
 {
   LLVMContext& globctx = module.getContext();
@@ -334,6 +302,30 @@ GlobalVariable* BytesFlops::create_global_constant(Module& module,
   return new_constant;
 }
 
+// Create a private array of characters in the instrumented code and return
+// a pointer to its first character.
+static Constant* create_private_string(Module& module, const char* name,
+                                       const char* value)
+{
+  LLVMContext& globctx = module.getContext();
+  size_t num_bytes = strlen(value) + 1;   // Number of characters including the trailing '\0'
+  ArrayType* array_type = ArrayType::get(Type::getInt8Ty(globctx), num_bytes);
+  Constant *local_string = ConstantDataArray::getString(globctx, value, true);
+  GlobalVariable* string_contents =
+    new GlobalVariable(module, array_type, true, GlobalValue::PrivateLinkage,
+                       local_string, string(name)+string(".data"));
+#if LLVM_VERSION_MAJOR >= 10
+  string_contents->setAlignment(MaybeAlign(8));
+#else
+  string_contents->setAlignment(8);
+#endif
+  ConstantInt* zero = ConstantInt::get(globctx, APInt(64, 0));
+  std::vector<Constant*> getelementptr_indexes;
+  getelementptr_indexes.push_back(zero);
+  getelementptr_indexes.push_back(zero);
+  return ConstantExpr::getGetElementPtr(array_type, string_contents, getelementptr_indexes);
+}
+
 // Create and initialize a global char* constant in the instrumented code.
 Constant* BytesFlops::create_global_constant(Module& module,
                                              const char* name,
@@ -355,23 +347,9 @@ Constant* BytesFlops::create_global_constant(Module& module,
       return old_value;
   }
   LLVMContext& globctx = module.getContext();
-  size_t num_bytes = strlen(value) + 1;   // Number of characters including the trailing '\0'
-  ArrayType* array_type = ArrayType::get(Type::getInt8Ty(globctx), num_bytes);
-  Constant *local_string = ConstantDataArray::getString(globctx, value, true);
-  GlobalVariable* string_contents =
-    new GlobalVariable(module, array_type, true, GlobalValue::PrivateLinkage,
-                       local_string, string(name)+string(".data"));
-#if LLVM_VERSION_MAJOR >= 10
-  string_contents->setAlignment(MaybeAlign(8));
-#else
-  string_contents->setAlignment(8);
-#endif
+  Constant* array_pointer = create_private_string(module, name, value);
+
   // Next, create a global pointer to the local array of characters.
-  std::vector<Constant*> getelementptr_indexes;
-  getelementptr_indexes.push_back(zero);
-  getelementptr_indexes.push_back(zero);
-  Constant* array_pointer =
-    ConstantExpr::getGetElementPtr(nullptr, string_contents, getelementptr_indexes);
   PointerType* pointer_type = PointerType::get(IntegerType::get(globctx, 8), 0);
   GlobalVariable* new_constant =
     new GlobalVariable(module, pointer_type, true,
@@ -563,7 +541,8 @@ Constant* BytesFlops::map_func_name_to_arg (Module* module, StringRef funcname)
 GlobalVariable* BytesFlops::declare_global_var(Module& module,
                                                Type* var_type,
                                                StringRef var_name,
-                                               bool is_const)
+                                               bool is_const,
+                                               bool is_thread_local)
 {
   // Don't declare the same variable twice in a single module.
   GlobalVariable* oldvar = module.getGlobalVariable(var_name);
@@ -572,7 +551,10 @@ GlobalVariable* BytesFlops::declare_global_var(Module& module,
   else
     return new GlobalVariable(module, var_type, is_const,
                               GlobalVariable::ExternalLinkage, 0,
-                              var_name, 0, GlobalVariable::NotThreadLocal);
+                              var_name, 0,
+                              is_thread_local
+                              ? GlobalVariable::InitialExecTLSModel
+                              : GlobalVariable::NotThreadLocal);
 }
 
 // Insert code to set every element of a given array to zero.
@@ -694,10 +676,115 @@ void BytesFlops::insert_end_bb_code (Module* module, KeyType_t funcKey,
                          ConstantInt::get(globctx, APInt(64, BF_END_BB_ANY)),
                          one);
 
-  // If we're instrumenting every basic block, insert calls to
-  // bf_tally_bb_execution(), bf_accumulate_bb_tallies(), and
-  // bf_report_bb_tallies().
-  if (InstrumentEveryBB) {
+  // If we're deferring tallies or counting the basic block's operations at
+  // compile time, increment a counter private to the basic block, and
+  // record the counter in the module's table of basic blocks along with
+  // the basic block's static counts.
+  GlobalVariable* bb_syminfo = nullptr;
+  if (defer_bb_tallies || static_bb_tallies) {
+    IntegerType* i64type = Type::getInt64Ty(globctx);
+    PointerType* i64ptr = Type::getInt64PtrTy(globctx);
+    uint64_t bb_id = 0;
+    if (defer_bb_tallies) {
+      static MersenneTwister bb_rng(module->getModuleIdentifier());
+      bb_id = uint64_t(bb_rng.next());
+      InternalSymbolInfo syminfo(&inst, inst_to_string(&inst));
+      bb_syminfo = create_syminfo_constant(*module, syminfo);
+    }
+    GlobalVariable* bb_tally =
+      new GlobalVariable(*module, i64type, false,
+                         GlobalValue::PrivateLinkage, zero, "bf_bb_tally");
+    if (ThreadSafety && !lock_every_bb) {
+#if LLVM_VERSION_MAJOR >= 13
+      mark_as_byfl(new AtomicRMWInst(AtomicRMWInst::Add, bb_tally, one, (Align)8,
+                                     AtomicOrdering::Monotonic, SyncScope::System,
+                                     &*insert_before));
+#else
+      mark_as_byfl(new AtomicRMWInst(AtomicRMWInst::Add, bb_tally, one,
+                                     AtomicOrdering::Monotonic, SyncScope::System,
+                                     &*insert_before));
+#endif
+    }
+    else
+      increment_global_variable(insert_before, bb_tally, one);
+
+    // Represent the instruction mix as a constant array of {opcode, tally}
+    // pairs.
+    Constant* inst_mix = ConstantPointerNull::get(i64ptr);
+    if (!bb_counts.inst_mix.empty()) {
+      vector<Constant*> inst_mix_elts;
+      for (auto iter = bb_counts.inst_mix.begin(); iter != bb_counts.inst_mix.end(); iter++) {
+        inst_mix_elts.push_back(ConstantInt::get(globctx, APInt(64, iter->first)));
+        inst_mix_elts.push_back(ConstantInt::get(globctx, APInt(64, iter->second)));
+      }
+      ArrayType* inst_mix_type = ArrayType::get(i64type, inst_mix_elts.size());
+      GlobalVariable* inst_mix_var =
+        new GlobalVariable(*module, inst_mix_type, true, GlobalValue::PrivateLinkage,
+                           ConstantArray::get(inst_mix_type, inst_mix_elts),
+                           "bf_bb_inst_mix");
+      vector<Constant*> getelementptr_indexes;
+      getelementptr_indexes.push_back(zero);
+      getelementptr_indexes.push_back(zero);
+      inst_mix = ConstantExpr::getGetElementPtr(inst_mix_type, inst_mix_var,
+                                                getelementptr_indexes);
+    }
+    vector<Constant*> record_fields;
+    record_fields.push_back(ConstantInt::get(globctx, APInt(64, bb_id)));
+    if (bb_syminfo == nullptr)
+      record_fields.push_back(null_syminfo_pointer);
+    else
+      record_fields.push_back(bb_syminfo);
+    record_fields.push_back(ConstantInt::get(globctx, APInt(64, num_insts)));
+    record_fields.push_back(bb_tally);
+    record_fields.push_back(ConstantInt::get(globctx, APInt(64, bb_counts.flops)));
+    record_fields.push_back(ConstantInt::get(globctx, APInt(64, bb_counts.fp_bits)));
+    record_fields.push_back(ConstantInt::get(globctx, APInt(64, bb_counts.ops)));
+    record_fields.push_back(ConstantInt::get(globctx, APInt(64, bb_counts.op_bits)));
+    record_fields.push_back(ConstantInt::get(globctx, APInt(64, bb_counts.inst_mix.size())));
+    record_fields.push_back(inst_mix);
+    bb_records.push_back(ConstantStruct::get(bb_record_type, record_fields));
+  }
+
+  // If we're instrumenting every basic block and deferring tallies, count
+  // the basic block's execution towards the next flush.  Only once every
+  // bf_bb_flush_threshold basic blocks do we insert a call to
+  // bf_flush_bb_tallies() to accumulate and report the counters, which
+  // we've left to aggregate all of the intervening basic blocks.
+  if (defer_bb_tallies) {
+    // Flush the counters if enough basic blocks have executed since the
+    // previous flush.
+#if LLVM_VERSION_MAJOR >= 11
+    LoadInst* pending = new LoadInst(Type::getInt64Ty(globctx), bb_pending_var, "bb_pending", false, &*insert_before);
+    LoadInst* threshold = new LoadInst(Type::getInt64Ty(globctx), bb_flush_threshold_var, "bb_threshold", false, &*insert_before);
+#else
+    LoadInst* pending = new LoadInst(bb_pending_var, "bb_pending", false, &*insert_before);
+    LoadInst* threshold = new LoadInst(bb_flush_threshold_var, "bb_threshold", false, &*insert_before);
+#endif
+    mark_as_byfl(pending);
+    mark_as_byfl(threshold);
+    BinaryOperator* new_pending =
+      BinaryOperator::Create(Instruction::Add, pending, one,
+                             "new_bb_pending", &*insert_before);
+    mark_as_byfl(new_pending);
+    mark_as_byfl(new StoreInst(new_pending, bb_pending_var, false, &*insert_before));
+    ICmpInst* must_flush =
+      new ICmpInst(&*insert_before, ICmpInst::ICMP_UGE, new_pending, threshold,
+                   "must_flush");
+    mark_as_byfl(must_flush);
+    Instruction* flush_term =
+      SplitBlockAndInsertIfThen(must_flush, &*insert_before, false,
+                                MDBuilder(globctx).createBranchWeights(1, uint32_t(min(BBMergeCount.getValue(), (unsigned long long)UINT32_MAX))));
+    flush_term->getParent()->setName("bf_flush");
+    insert_before->getParent()->setName("bf_tail");
+    vector<Value*> arg_list;
+    arg_list.push_back(bb_syminfo);
+    callinst_create_shared(flush_bb_tallies, arg_list, flush_term);
+  }
+
+  // If we're instrumenting every basic block without deferring tallies,
+  // insert calls to bf_tally_bb_execution(), bf_accumulate_bb_tallies(),
+  // and bf_report_bb_tallies().
+  if (InstrumentEveryBB && !defer_bb_tallies) {
     static MersenneTwister bb_rng(module->getModuleIdentifier());
     vector<Value*> arg_list;
     uint64_t randnum = uint64_t(bb_rng.next());
@@ -713,17 +800,32 @@ void BytesFlops::insert_end_bb_code (Module* module, KeyType_t funcKey,
   }
 
   // If we're instrumenting by function, insert a call to
-  // bf_assoc_counters_with_func() at the end of the basic block.
+  // bf_assoc_counters_with_func() at the end of the basic block.  Pass it
+  // both the function's dense ID (the module's base ID plus the function's
+  // position in the module) and, as a fallback, the function's key.
   if (TallyByFunction) {
     vector<Value*> arg_list;
+#if LLVM_VERSION_MAJOR >= 11
+    LoadInst* func_base = new LoadInst(cast<PointerType>(func_base_var->getType())->getElementType(), func_base_var, "func_base", false, &*insert_before);
+#else
+    LoadInst* func_base = new LoadInst(func_base_var, "func_base", false, &*insert_before);
+#endif
+    mark_as_byfl(func_base);
+    BinaryOperator* func_id =
+      BinaryOperator::Create(Instruction::Add, func_base,
+                             ConstantInt::get(globctx, APInt(64, func_key_index[funcKey])),
+                             "func_id", &*insert_before);
+    mark_as_byfl(func_id);
+    arg_list.push_back(func_id);
     ConstantInt * key = ConstantInt::get(IntegerType::get(globctx, 8*sizeof(FunctionKeyGen::KeyID)),
                                          funcKey);
     arg_list.push_back(key);
     callinst_create(assoc_counts_with_func, arg_list, &*insert_before);
   }
 
-  // Reset all of our counter variables.
-  if (InstrumentEveryBB || TallyByFunction) {
+  // Reset all of our counter variables unless bf_flush_bb_tallies() will
+  // do so.
+  if ((InstrumentEveryBB && !defer_bb_tallies) || TallyByFunction) {
     if (must_clear & CLEAR_LOADS) {
       mark_as_byfl(new StoreInst(zero, load_var, false, &*insert_before));
       mark_as_byfl(new StoreInst(zero, load_inst_var, false, &*insert_before));
@@ -819,9 +921,9 @@ void BytesFlops::insert_end_bb_code (Module* module, KeyType_t funcKey,
     must_clear = 0;
   }
 
-  // If we're instrumenting every basic block, insert a call to
-  // bf_reset_bb_tallies().
-  if (InstrumentEveryBB)
+  // If we're instrumenting every basic block without deferring tallies,
+  // insert a call to bf_reset_bb_tallies().
+  if (InstrumentEveryBB && !defer_bb_tallies)
     callinst_create(reset_bb_tallies, &*insert_before);
 
   // If we're instrumenting by call stack, insert a call to bf_pop_function()
@@ -830,6 +932,438 @@ void BytesFlops::insert_end_bb_code (Module* module, KeyType_t funcKey,
     callinst_create(pop_function, &*insert_before);
 }
 
+// Insert code to convert a pointer and a length, which can be an integer of
+// any width, to the pair of 64-bit integers the run-time library expects.
+void BytesFlops::range_to_i64 (Module* module, Value* mem_ptr, Value* length,
+                               Instruction* insert_before,
+                               Value*& mem_addr, Value*& num_bytes)
+{
+  IntegerType* i64type = Type::getInt64Ty(module->getContext());
+  CastInst* addr_inst = new PtrToIntInst(mem_ptr, i64type, "", insert_before);
+  mark_as_byfl(addr_inst);
+  mem_addr = addr_inst;
+  num_bytes = length;
+  if (length->getType() != i64type) {
+    CastInst* length_inst = new ZExtInst(length, i64type, "", insert_before);
+    mark_as_byfl(length_inst);
+    num_bytes = length_inst;
+  }
+}
+
+// Append a list of pending memory accesses to the calling thread's access
+// trace.  After every BF_TRACE_LEN - BF_TRACE_DRAIN_THRESHOLD accesses,
+// conditionally invoke bf_drain_access_trace() to hand the trace to the
+// run-time library's analyses.  Each conditional call splits the basic
+// block; the split-off blocks are named bf_drain* and bf_tail* so we don't
+// instrument them.  lock_held indicates that the code is inserted where the
+// basic block holds the mega-lock.
+void BytesFlops::insert_access_trace_code (Module* module,
+                                           vector<PendingAccess>& accesses,
+                                           BasicBlock::iterator& insert_before,
+                                           bool lock_held)
+{
+  LLVMContext& globctx = module->getContext();
+  IntegerType* i64type = Type::getInt64Ty(globctx);
+#if LLVM_VERSION_MAJOR >= 11
+  PointerType* i64ptrtype = Type::getInt64PtrTy(globctx);
+#endif
+  const size_t fields = sizeof(bf_trace_entry_t)/sizeof(uint64_t);
+  const size_t max_appends = BF_TRACE_LEN - BF_TRACE_DRAIN_THRESHOLD;
+  for (size_t first = 0; first < accesses.size(); first += max_appends) {
+    size_t last = min(first + max_appends, accesses.size());
+
+    // Find the first free word in the trace.
+#if LLVM_VERSION_MAJOR >= 11
+    LoadInst* trace = new LoadInst(i64ptrtype, access_trace_var, "trace", false, &*insert_before);
+    LoadInst* trace_len = new LoadInst(i64type, access_trace_len_var, "trace_len", false, &*insert_before);
+#else
+    LoadInst* trace = new LoadInst(access_trace_var, "trace", false, &*insert_before);
+    LoadInst* trace_len = new LoadInst(access_trace_len_var, "trace_len", false, &*insert_before);
+#endif
+    mark_as_byfl(trace);
+    mark_as_byfl(trace_len);
+    BinaryOperator* trace_ofs =
+      BinaryOperator::Create(Instruction::Mul, trace_len,
+                             ConstantInt::get(globctx, APInt(64, fields)),
+                             "trace_ofs", &*insert_before);
+    mark_as_byfl(trace_ofs);
+
+    // Store each access as a bf_trace_entry_t.
+    for (size_t i = first; i < last; i++) {
+      PendingAccess& access = accesses[i];
+      Value* mem_addr;
+      Value* num_bytes;
+      range_to_i64(module, access.pointer, access.num_bytes, &*insert_before,
+                   mem_addr, num_bytes);
+      Value* field_values[fields] = {
+        mem_addr,
+        num_bytes,
+        ConstantInt::get(globctx, APInt(64, access.analyses)),
+        access.funcname == nullptr
+        ? (Constant*)zero
+        : ConstantExpr::getPtrToInt(access.funcname, i64type)
+      };
+      for (size_t f = 0; f < fields; f++) {
+        BinaryOperator* word_ofs =
+          BinaryOperator::Create(Instruction::Add, trace_ofs,
+                                 ConstantInt::get(globctx, APInt(64, (i - first)*fields + f)),
+                                 "word_ofs", &*insert_before);
+        mark_as_byfl(word_ofs);
+        GetElementPtrInst* word_ptr =
+          GetElementPtrInst::Create(i64type, trace, word_ofs, "word_ptr", &*insert_before);
+        mark_as_byfl(word_ptr);
+        mark_as_byfl(new StoreInst(field_values[f], word_ptr, false, &*insert_before));
+      }
+    }
+
+    // Update the trace length.
+    BinaryOperator* new_trace_len =
+      BinaryOperator::Create(Instruction::Add, trace_len,
+                             ConstantInt::get(globctx, APInt(64, last - first)),
+                             "new_trace_len", &*insert_before);
+    mark_as_byfl(new_trace_len);
+    mark_as_byfl(new StoreInst(new_trace_len, access_trace_len_var, false, &*insert_before));
+
+    // Drain the trace if it's nearly full.  Ask bf_drain_access_trace() to
+    // acquire the mega-lock around shared state unless we already hold it.
+    // If the basic block holds the mega-lock only around its final
+    // updates, and we're not there, acquire it around the drain as a whole.
+    ICmpInst* trace_full =
+      new ICmpInst(&*insert_before, ICmpInst::ICMP_UGE, new_trace_len,
+                   ConstantInt::get(globctx, APInt(64, BF_TRACE_DRAIN_THRESHOLD)),
+                   "trace_full");
+    mark_as_byfl(trace_full);
+    Instruction* drain_term =
+      SplitBlockAndInsertIfThen(trace_full, &*insert_before, false,
+                                MDBuilder(globctx).createBranchWeights(1, max_appends));
+    drain_term->getParent()->setName("bf_drain");
+    insert_before->getParent()->setName("bf_tail");
+    bool take_lock = lock_every_bb && !lock_held;
+    if (take_lock)
+      callinst_create(take_mega_lock, drain_term);
+    vector<Value*> arg_list;
+    arg_list.push_back(ConstantInt::get(globctx, APInt(8, lock_shared_calls ? 1 : 0)));
+    callinst_create(drain_access_trace, arg_list, drain_term);
+    if (take_lock)
+      callinst_create(release_mega_lock, drain_term);
+  }
+  accesses.clear();
+}
+
+// Check if the run-time library's timer has requested a timeline snapshot
+// and, if so, invoke bf_take_timeline_snapshot().  The flag is written by
+// another thread so we load it as volatile to keep it from being hoisted
+// out of loops.  The check splits the basic block; the split-off blocks
+// are named bf_snapshot* and bf_tail* so we don't instrument them.
+void BytesFlops::insert_timeline_code (Module* module,
+                                       BasicBlock::iterator& insert_before)
+{
+  LLVMContext& globctx = module->getContext();
+  IntegerType* i8type = Type::getInt8Ty(globctx);
+#if LLVM_VERSION_MAJOR >= 11
+  LoadInst* due = new LoadInst(i8type, timeline_due_var, "timeline_due", true, &*insert_before);
+#else
+  LoadInst* due = new LoadInst(timeline_due_var, "timeline_due", true, &*insert_before);
+#endif
+  mark_as_byfl(due);
+  ICmpInst* must_snapshot =
+    new ICmpInst(&*insert_before, ICmpInst::ICMP_NE, due,
+                 ConstantInt::get(i8type, 0), "must_snapshot");
+  mark_as_byfl(must_snapshot);
+  Instruction* snapshot_term =
+    SplitBlockAndInsertIfThen(must_snapshot, &*insert_before, false,
+                              MDBuilder(globctx).createBranchWeights(1, UINT32_MAX));
+  snapshot_term->getParent()->setName("bf_snapshot");
+  insert_before->getParent()->setName("bf_tail");
+  callinst_create(take_timeline_snapshot, snapshot_term);
+}
+
+// Create an uninstrumented copy of a function.  The copy is private to the
+// module and named bf_uninstrumented.<name> so we don't instrument it.
+// Functions that can't simply pass their arguments along to another
+// function -- variadic functions, naked functions, and functions taking
+// inalloca or swifterror arguments -- aren't copied.
+Function* BytesFlops::create_uninstrumented_clone (Function& function)
+{
+  if (function.isVarArg() || function.hasFnAttribute(Attribute::Naked))
+    return nullptr;
+  for (auto arg_iter = function.arg_begin(); arg_iter != function.arg_end(); arg_iter++)
+    if (arg_iter->hasInAllocaAttr() || arg_iter->hasSwiftErrorAttr())
+      return nullptr;
+  ValueToValueMapTy vmap;
+  Function* clone = CloneFunction(&function, vmap);
+  clone->setName("bf_uninstrumented." + function.getName());
+  clone->setLinkage(GlobalValue::InternalLinkage);
+  clone->setVisibility(GlobalValue::DefaultVisibility);
+  clone->setDLLStorageClass(GlobalValue::DefaultStorageClass);
+  clone->setComdat(nullptr);
+  return clone;
+}
+
+// Turn a 64-bit load or store into a relaxed (monotonic) atomic one.
+template<typename MemInst>
+static void make_relaxed_atomic (MemInst* inst)
+{
+#if LLVM_VERSION_MAJOR >= 11
+  inst->setAlignment((Align)8);
+#elif LLVM_VERSION_MAJOR >= 10
+  inst->setAlignment((MaybeAlign)8);
+#else
+  inst->setAlignment(8);
+#endif
+  inst->setAtomic(AtomicOrdering::Monotonic);
+}
+
+// Insert a new entry block into an instrumented function that tail-calls
+// the function's uninstrumented clone when bf_counting_enabled is zero.
+// The guard precedes even bf_initialize_if_necessary() because counting
+// can be disabled only after the run-time library has been initialized.
+// With -bf-sample-period, the guard also counts down to the next switch
+// between counting and not counting.
+void BytesFlops::insert_clone_guard (Module* module, Function& function,
+                                     Function* clone)
+{
+  LLVMContext& globctx = module->getContext();
+  IntegerType* i8type = Type::getInt8Ty(globctx);
+  BasicBlock& old_entry = function.front();
+  BasicBlock* guard_bb =
+    BasicBlock::Create(globctx, "bf_guard", &function, &old_entry);
+  BasicBlock* forward_bb =
+    BasicBlock::Create(globctx, "bf_forward", &function, &old_entry);
+
+  // With -bf-sample-period, every call counts down to the next switch
+  // between counting and not counting.  All threads share the countdown
+  // so we load and store it with relaxed atomics.  A race between threads
+  // can lose a decrement, which merely lengthens the phase slightly.  We
+  // never decrement below 1 so that such a race can't wrap the countdown
+  // around.
+  if (sample_countdown_var != nullptr) {
+    IntegerType* i64type = Type::getInt64Ty(globctx);
+    BasicBlock* entry_bb = guard_bb;
+    BasicBlock* decr_bb =
+      BasicBlock::Create(globctx, "bf_countdown", &function, forward_bb);
+    BasicBlock* switch_bb =
+      BasicBlock::Create(globctx, "bf_sample", &function, forward_bb);
+    guard_bb = BasicBlock::Create(globctx, "bf_check", &function, forward_bb);
+#if LLVM_VERSION_MAJOR >= 11
+    LoadInst* remaining = new LoadInst(i64type, sample_countdown_var, "remaining", entry_bb);
+#else
+    LoadInst* remaining = new LoadInst(sample_countdown_var, "remaining", entry_bb);
+#endif
+    make_relaxed_atomic(remaining);
+    mark_as_byfl(remaining);
+    ICmpInst* expired =
+      new ICmpInst(*entry_bb, ICmpInst::ICMP_ULE, remaining,
+                   ConstantInt::get(i64type, 1), "phase_expired");
+    mark_as_byfl(expired);
+    BranchInst* branch = BranchInst::Create(switch_bb, decr_bb, expired, entry_bb);
+    branch->setMetadata(LLVMContext::MD_prof,
+                        MDBuilder(globctx).createBranchWeights(1, UINT32_MAX));
+    mark_as_byfl(branch);
+    BinaryOperator* decremented =
+      BinaryOperator::Create(Instruction::Sub, remaining,
+                             ConstantInt::get(i64type, 1), "remaining", decr_bb);
+    mark_as_byfl(decremented);
+    StoreInst* store_remaining = new StoreInst(decremented, sample_countdown_var, decr_bb);
+    make_relaxed_atomic(store_remaining);
+    mark_as_byfl(store_remaining);
+    mark_as_byfl(BranchInst::Create(guard_bb, decr_bb));
+    callinst_create(sample_switch, switch_bb);
+    mark_as_byfl(BranchInst::Create(guard_bb, switch_bb));
+  }
+
+  // Branch to the clone if counting is disabled.
+#if LLVM_VERSION_MAJOR >= 11
+  LoadInst* enabled = new LoadInst(i8type, counting_enabled_var, "counting_enabled", guard_bb);
+#else
+  LoadInst* enabled = new LoadInst(counting_enabled_var, "counting_enabled", guard_bb);
+#endif
+  mark_as_byfl(enabled);
+  ICmpInst* disabled =
+    new ICmpInst(*guard_bb, ICmpInst::ICMP_EQ, enabled,
+                 ConstantInt::get(i8type, 0), "counting_disabled");
+  mark_as_byfl(disabled);
+  mark_as_byfl(BranchInst::Create(forward_bb, &old_entry, disabled, guard_bb));
+
+  // Pass all of our arguments to the clone and return whatever it returns.
+  // The clone is a candidate for inlining so the call needs a debug
+  // location if the function has debug information.
+  vector<Value*> args;
+  for (auto arg_iter = function.arg_begin(); arg_iter != function.arg_end(); arg_iter++)
+    args.push_back(&*arg_iter);
+  CallInst* call = CallInst::Create(clone, args, "", forward_bb);
+  call->setCallingConv(clone->getCallingConv());
+  call->setTailCall();
+  if (DISubprogram* subprog = function.getSubprogram())
+    call->setDebugLoc(DILocation::get(globctx, subprog->getLine(), 0, subprog));
+  mark_as_byfl(call);
+  if (function.getReturnType()->isVoidTy())
+    mark_as_byfl(ReturnInst::Create(globctx, forward_bb));
+  else
+    mark_as_byfl(ReturnInst::Create(globctx, call, forward_bb));
+}
+
+// Return true if counter updates may be hoisted out of countable loops.
+// They can't be if the counters must be up to date at the end of every
+// basic block.
+bool BytesFlops::can_hoist_counters (void) const
+{
+  return HoistLoopCounters && !InstrumentEveryBB && !TallyByFunction;
+}
+
+// Find the current function's countable loops: innermost loops whose trip
+// count ScalarEvolution can compute, that execute every one of their basic
+// blocks exactly once per iteration, that exit only from the latch to a
+// block with no other predecessors, and that make no function calls.  For
+// each such loop, compute the trip count in the preheader.  Code that
+// increments a counter by a constant in such a loop can instead add the
+// product of the trip count and the increment when the loop exits.
+void BytesFlops::find_countable_loops (Function& function)
+{
+  countable_loops.clear();
+  bb_to_countable_loop.clear();
+  hoist_target = nullptr;
+  if (!can_hoist_counters())
+    return;
+
+  // Because we're a module pass, each getAnalysis() call reruns all of the
+  // function's analyses.  That recomputes the dominator tree and loop
+  // information in place but replaces the ScalarEvolution object, so we
+  // must acquire ScalarEvolution last.
+  DominatorTree& dom_tree = getAnalysis<DominatorTreeWrapperPass>(function).getDomTree();
+  LoopInfo& loop_info = getAnalysis<LoopInfoWrapperPass>(function).getLoopInfo();
+  ScalarEvolution& scev = getAnalysis<ScalarEvolutionWrapperPass>(function).getSE();
+  IntegerType* i64type = Type::getInt64Ty(function.getContext());
+
+  // Remember which instructions already exist so we can mark the ones
+  // that compute trip counts as our own.
+  set<Instruction*> original_insts;
+  for (inst_iterator iter = inst_begin(function); iter != inst_end(function); iter++)
+    original_insts.insert(&*iter);
+
+  // Consider each innermost loop in turn.
+  SCEVExpander expander(scev, function.getParent()->getDataLayout(), "bf_trip");
+  for (Loop* loop : loop_info.getLoopsInPreorder()) {
+    if (!loop->getSubLoops().empty())
+      continue;
+    BasicBlock* preheader = loop->getLoopPreheader();
+    BasicBlock* latch = loop->getLoopLatch();
+    BasicBlock* exit_bb = loop->getUniqueExitBlock();
+    if (preheader == nullptr || latch == nullptr || exit_bb == nullptr
+        || loop->getExitingBlock() != latch
+        || exit_bb->getSinglePredecessor() != latch
+        || exit_bb->isEHPad())
+      continue;
+    bool straight_line = true;
+    for (BasicBlock* bb : loop->blocks()) {
+      if (!dom_tree.dominates(bb, latch))
+        straight_line = false;
+      for (Instruction& inst : *bb)
+        if (isa<CallBase>(inst) && !ignorable_call(&inst))
+          straight_line = false;
+      if (!straight_line)
+        break;
+    }
+    if (!straight_line)
+      continue;
+
+    // Compute the trip count as one more than the backedge-taken count.
+    const SCEV* taken = scev.getBackedgeTakenCount(loop);
+    if (isa<SCEVCouldNotCompute>(taken)
+        || !taken->getType()->isIntegerTy()
+        || taken->getType()->getIntegerBitWidth() > 64)
+      continue;
+    const SCEV* trips = scev.getAddExpr(scev.getZeroExtendExpr(taken, i64type),
+                                        scev.getOne(i64type));
+#if LLVM_VERSION_MAJOR >= 15
+    if (!expander.isSafeToExpand(trips))
+      continue;
+#else
+    if (!isSafeToExpand(trips, scev))
+      continue;
+#endif
+    CountableLoop countable;
+    countable.exit_bb = exit_bb;
+    countable.trip_count = expander.expandCodeFor(trips, i64type, preheader->getTerminator());
+    for (BasicBlock* bb : loop->blocks())
+      bb_to_countable_loop[bb] = countable_loops.size();
+    countable_loops.push_back(countable);
+  }
+
+  // Don't count the trip-count computations as program operations.
+  for (inst_iterator iter = inst_begin(function); iter != inst_end(function); iter++)
+    if (original_insts.find(&*iter) == original_insts.end())
+      mark_as_byfl(&*iter);
+}
+
+// Add a constant counter increment to hoist_target's hoisted increments.
+// Return false if we're not in a countable loop or if the increment or
+// array index varies from iteration to iteration.
+bool BytesFlops::hoist_increment (Constant* global_var, Value* idx,
+                                  Value* increment)
+{
+  if (hoist_target == nullptr)
+    return false;
+  ConstantInt* const_incr = dyn_cast<ConstantInt>(increment);
+  if (const_incr == nullptr)
+    return false;
+  ConstantInt* const_idx = nullptr;
+  if (idx != nullptr) {
+    const_idx = dyn_cast<ConstantInt>(idx);
+    if (const_idx == nullptr)
+      return false;
+  }
+  vector<HoistedIncrement>& increments = hoist_target->increments;
+  for (auto iter = increments.begin(); iter != increments.end(); iter++)
+    if (iter->global_var == global_var && iter->idx == const_idx) {
+      iter->increment += const_incr->getZExtValue();
+      return true;
+    }
+  HoistedIncrement hoisted;
+  hoisted.global_var = global_var;
+  hoisted.idx = const_idx;
+  hoisted.increment = const_incr->getZExtValue();
+  increments.push_back(hoisted);
+  return true;
+}
+
+// Insert code at the beginning of each countable loop's exit block to add
+// the trip count times each hoisted increment to the corresponding
+// counter.
+void BytesFlops::insert_hoisted_increments (Module* module)
+{
+  hoist_target = nullptr;
+  LLVMContext& globctx = module->getContext();
+  for (auto loop_iter = countable_loops.begin(); loop_iter != countable_loops.end(); loop_iter++) {
+    if (loop_iter->increments.empty())
+      continue;
+    BasicBlock::iterator insert_before = loop_iter->exit_bb->getFirstInsertionPt();
+    if (lock_every_bb)
+      callinst_create(take_mega_lock, &*insert_before);
+    for (auto incr_iter = loop_iter->increments.begin();
+         incr_iter != loop_iter->increments.end();
+         incr_iter++) {
+      Value* total = loop_iter->trip_count;
+      if (incr_iter->increment != 1) {
+        BinaryOperator* product =
+          BinaryOperator::Create(Instruction::Mul, loop_iter->trip_count,
+                                 ConstantInt::get(globctx, APInt(64, incr_iter->increment)),
+                                 "loop_incr", &*insert_before);
+        mark_as_byfl(product);
+        total = product;
+      }
+      if (incr_iter->idx == nullptr)
+        increment_global_variable(insert_before, incr_iter->global_var, total);
+      else
+        increment_global_array(insert_before, incr_iter->global_var, incr_iter->idx, total);
+    }
+    if (lock_every_bb)
+      callinst_create(release_mega_lock, &*insert_before);
+  }
+  countable_loops.clear();
+  bb_to_countable_loop.clear();
+}
+
 // Wrap CallInst::Create() with a more convenient interface.
 void BytesFlops::callinst_create(Value* function, ArrayRef<Value*> args,
                                  Instruction* insert_before)
@@ -880,6 +1414,29 @@ void BytesFlops::callinst_create(Value* function, Instruction* insert_before)
   mark_as_byfl(cinst);
 }
 
+// Wrap callinst_create() with code to acquire and release the mega-lock in
+// thread-sharded mode.
+void BytesFlops::callinst_create_shared(Value* function, ArrayRef<Value*> args,
+                                        Instruction* insert_before)
+{
+  if (lock_shared_calls)
+    callinst_create(take_mega_lock, insert_before);
+  callinst_create(function, args, insert_before);
+  if (lock_shared_calls)
+    callinst_create(release_mega_lock, insert_before);
+}
+
+// Ditto the above but for parameterless functions.
+void BytesFlops::callinst_create_shared(Value* function,
+                                        Instruction* insert_before)
+{
+  if (lock_shared_calls)
+    callinst_create(take_mega_lock, insert_before);
+  callinst_create(function, insert_before);
+  if (lock_shared_calls)
+    callinst_create(release_mega_lock, insert_before);
+}
+
 // Given a Call instruction, return true if we can safely ignore it.
 bool BytesFlops::ignorable_call (const Instruction* inst)
 {
@@ -1140,6 +1697,24 @@ AllocaInst* BytesFlops::find_value_provenance(Module& module,
   return syminfo_struct;
 }
 
+// Create a constant bf_symbol_info_t in the generated code based on a given
+// InternalSymbolInfo.  Unlike find_value_provenance(), this generates no
+// code that executes at run time.
+GlobalVariable* BytesFlops::create_syminfo_constant(Module& module,
+                                                    InternalSymbolInfo& syminfo)
+{
+  LLVMContext& globctx = module.getContext();
+  vector<Constant*> fields;
+  fields.push_back(ConstantInt::get(globctx, APInt(64, syminfo.ID)));
+  fields.push_back(create_private_string(module, "bf_syminfo.origin", syminfo.origin.c_str()));
+  fields.push_back(create_private_string(module, "bf_syminfo.symbol", syminfo.symbol.c_str()));
+  fields.push_back(create_private_string(module, "bf_syminfo.function", syminfo.function.c_str()));
+  fields.push_back(create_private_string(module, "bf_syminfo.file", syminfo.file.c_str()));
+  fields.push_back(ConstantInt::get(globctx, APInt(32, syminfo.line)));
+  return new GlobalVariable(module, syminfo_type, true, GlobalValue::PrivateLinkage,
+                            ConstantStruct::get(syminfo_type, fields), "bf_syminfo");
+}
+
 
 // Read the metadata associated with a value and generate code to construct a
 // bf_symbol_info_t representing where the value came from.
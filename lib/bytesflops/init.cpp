@@ -161,6 +161,226 @@ namespace bytesflops_pass {
     }
   }
 
+  /*
+   * Define a constructor called bf_bb_records_ctor() with the following
+   * form, passing the run-time library a table of every basic block
+   * instrumented in the module:
+   *
+   * __attribute__((constructor))
+   * static void bf_bb_records_ctor (void)
+   * {
+   *   bf_record_bb_tallies(num_records, bf_bb_records);
+   * }
+   */
+  void BytesFlops::create_bb_records_ctor (Module* module) {
+    if (bb_records.empty())
+      return;
+
+    // Define a constant array of bf_bb_record_t structs.
+    LLVMContext& globctx = module->getContext();
+    ArrayType* records_type = ArrayType::get(bb_record_type, bb_records.size());
+    GlobalVariable* records =
+      new GlobalVariable(*module, records_type, true, GlobalValue::PrivateLinkage,
+                         ConstantArray::get(records_type, bb_records), "bf_bb_records");
+    vector<Constant*> getelementptr_indexes;
+    getelementptr_indexes.push_back(zero);
+    getelementptr_indexes.push_back(zero);
+    Constant* records_pointer =
+      ConstantExpr::getGetElementPtr(records_type, records, getelementptr_indexes);
+
+    // Declare the bf_bb_records_ctor() function.
+    Function* func = declare_thunk(module, "bf_bb_records_ctor");
+    func->setLinkage(GlobalValue::InternalLinkage);
+    prepend_to_ctor_list(module, func);
+
+    // Add a single basic block to bf_bb_records_ctor() that calls
+    // bf_record_bb_tallies().
+    BasicBlock* bblock = BasicBlock::Create(globctx, "entry", func);
+    ReturnInst* ret_inst = ReturnInst::Create(globctx, bblock);
+    vector<Value*> arg_list;
+    arg_list.push_back(ConstantInt::get(globctx, APInt(64, bb_records.size())));
+    arg_list.push_back(records_pointer);
+    callinst_create(record_bb_tallies, arg_list, ret_inst);
+    bb_records.clear();
+  }
+
+  /*
+   * Replace the placeholder for the module's per-thread array of
+   * instruction-dependency tallies with the array itself and define a
+   * constructor called bf_inst_deps_ctor() with the following form,
+   * passing the run-time library the opcodes corresponding to each
+   * element of the array:
+   *
+   * static __thread uint64_t bf_inst_deps_tallies[num_tuples];
+   *
+   * static uint64_t* bf_get_inst_deps_tallies (void)
+   * {
+   *   return bf_inst_deps_tallies;
+   * }
+   *
+   * __attribute__((constructor))
+   * static void bf_inst_deps_ctor (void)
+   * {
+   *   bf_record_inst_deps(num_tuples, bf_inst_deps_tuples, bf_get_inst_deps_tallies);
+   * }
+   */
+  void BytesFlops::create_inst_deps_ctor (Module* module) {
+    if (inst_deps_histo_var == nullptr)
+      return;
+    GlobalVariable* placeholder = inst_deps_histo_var;
+    inst_deps_histo_var = nullptr;
+    size_t num_tuples = inst_deps_ids.size();
+    if (num_tuples == 0) {
+      placeholder->eraseFromParent();
+      return;
+    }
+
+    // Define the per-thread array of tallies.
+    LLVMContext& globctx = module->getContext();
+    IntegerType* i64type = Type::getInt64Ty(globctx);
+    PointerType* i64ptrtype = Type::getInt64PtrTy(globctx);
+    ArrayType* tallies_type = ArrayType::get(i64type, num_tuples);
+    GlobalVariable* tallies =
+      new GlobalVariable(*module, tallies_type, false, GlobalValue::PrivateLinkage,
+                         ConstantAggregateZero::get(tallies_type), "",
+                         nullptr, GlobalVariable::GeneralDynamicTLSModel);
+    tallies->takeName(placeholder);
+    Constant* tallies_pointer = ConstantExpr::getBitCast(tallies, i64ptrtype);
+    placeholder->replaceAllUsesWith(tallies_pointer);
+    placeholder->eraseFromParent();
+
+    // Define a constant array of bf_inst_deps_t structs, flattened to an
+    // array of integers.
+    ArrayType* tuples_type = ArrayType::get(i64type, inst_deps_tuples.size());
+    GlobalVariable* tuples =
+      new GlobalVariable(*module, tuples_type, true, GlobalValue::PrivateLinkage,
+                         ConstantArray::get(tuples_type, inst_deps_tuples),
+                         "bf_inst_deps_tuples");
+    vector<Constant*> getelementptr_indexes;
+    getelementptr_indexes.push_back(zero);
+    getelementptr_indexes.push_back(zero);
+    Constant* tuples_pointer =
+      ConstantExpr::getGetElementPtr(tuples_type, tuples, getelementptr_indexes);
+    inst_deps_tuples.clear();
+    inst_deps_ids.clear();
+
+    // Define a function that returns the calling thread's array of
+    // tallies.
+    FunctionType* getter_type = FunctionType::get(i64ptrtype, false);
+    Function* getter =
+      Function::Create(getter_type, GlobalValue::InternalLinkage,
+                       "bf_get_inst_deps_tallies", module);
+    BasicBlock* bblock = BasicBlock::Create(globctx, "entry", getter);
+    ReturnInst::Create(globctx, tallies_pointer, bblock);
+
+    // Declare the bf_inst_deps_ctor() function.
+    Function* func = declare_thunk(module, "bf_inst_deps_ctor");
+    func->setLinkage(GlobalValue::InternalLinkage);
+    prepend_to_ctor_list(module, func);
+
+    // Add a single basic block to bf_inst_deps_ctor() that calls
+    // bf_record_inst_deps().
+    bblock = BasicBlock::Create(globctx, "entry", func);
+    ReturnInst* ret_inst = ReturnInst::Create(globctx, bblock);
+    vector<Value*> arg_list;
+    arg_list.push_back(ConstantInt::get(globctx, APInt(64, num_tuples)));
+    arg_list.push_back(tuples_pointer);
+    arg_list.push_back(getter);
+    callinst_create(record_inst_deps, arg_list, ret_inst);
+  }
+
+  /*
+   * Define a constructor called bf_stride_points_ctor() with the following
+   * form, passing the run-time library a table of every load and store
+   * whose strides the module tracks:
+   *
+   * static uint64_t bf_stride_base = BF_STRIDE_UNREGISTERED;
+   *
+   * __attribute__((constructor))
+   * static void bf_stride_points_ctor (void)
+   * {
+   *   bf_record_stride_points(num_points, bf_stride_points, &bf_stride_base);
+   * }
+   *
+   * Each call to bf_track_stride() passes bf_stride_base plus the index of
+   * its load or store in bf_stride_points[].
+   */
+  void BytesFlops::create_stride_points_ctor (Module* module) {
+    if (stride_points.empty())
+      return;
+
+    // Define a constant array of bf_stride_point_t structs.
+    LLVMContext& globctx = module->getContext();
+    ArrayType* points_type = ArrayType::get(stride_point_type, stride_points.size());
+    GlobalVariable* points =
+      new GlobalVariable(*module, points_type, true, GlobalValue::PrivateLinkage,
+                         ConstantArray::get(points_type, stride_points), "bf_stride_points");
+    vector<Constant*> getelementptr_indexes;
+    getelementptr_indexes.push_back(zero);
+    getelementptr_indexes.push_back(zero);
+    Constant* points_pointer =
+      ConstantExpr::getGetElementPtr(points_type, points, getelementptr_indexes);
+
+    // Declare the bf_stride_points_ctor() function.
+    Function* func = declare_thunk(module, "bf_stride_points_ctor");
+    func->setLinkage(GlobalValue::InternalLinkage);
+    prepend_to_ctor_list(module, func);
+
+    // Add a single basic block to bf_stride_points_ctor() that calls
+    // bf_record_stride_points().
+    BasicBlock* bblock = BasicBlock::Create(globctx, "entry", func);
+    ReturnInst* ret_inst = ReturnInst::Create(globctx, bblock);
+    vector<Value*> arg_list;
+    arg_list.push_back(ConstantInt::get(globctx, APInt(64, stride_points.size())));
+    arg_list.push_back(points_pointer);
+    arg_list.push_back(stride_base_var);
+    callinst_create(record_stride_points, arg_list, ret_inst);
+    stride_points.clear();
+  }
+
+  /*
+   * Define a constructor called bf_vector_ops_ctor() with the following
+   * form:
+   *
+   * static void bf_vector_ops_ctor (void)
+   * {
+   *   bf_record_vector_ops(num_ops, bf_vector_ops, &bf_vector_base);
+   * }
+   */
+  void BytesFlops::create_vector_ops_ctor (Module* module) {
+    if (vector_ops.empty())
+      return;
+
+    // Define a constant array of bf_vector_op_t structs.
+    LLVMContext& globctx = module->getContext();
+    ArrayType* ops_type = ArrayType::get(vector_op_type, vector_ops.size());
+    GlobalVariable* ops =
+      new GlobalVariable(*module, ops_type, true, GlobalValue::PrivateLinkage,
+                         ConstantArray::get(ops_type, vector_ops), "bf_vector_ops");
+    vector<Constant*> getelementptr_indexes;
+    getelementptr_indexes.push_back(zero);
+    getelementptr_indexes.push_back(zero);
+    Constant* ops_pointer =
+      ConstantExpr::getGetElementPtr(ops_type, ops, getelementptr_indexes);
+
+    // Declare the bf_vector_ops_ctor() function.
+    Function* func = declare_thunk(module, "bf_vector_ops_ctor");
+    func->setLinkage(GlobalValue::InternalLinkage);
+    prepend_to_ctor_list(module, func);
+
+    // Add a single basic block to bf_vector_ops_ctor() that calls
+    // bf_record_vector_ops().
+    BasicBlock* bblock = BasicBlock::Create(globctx, "entry", func);
+    ReturnInst* ret_inst = ReturnInst::Create(globctx, bblock);
+    vector<Value*> arg_list;
+    arg_list.push_back(ConstantInt::get(globctx, APInt(64, vector_ops.size())));
+    arg_list.push_back(ops_pointer);
+    arg_list.push_back(vector_base_var);
+    callinst_create(record_vector_ops, arg_list, ret_inst);
+    vector_ops.clear();
+    vector_op_index.clear();
+  }
+
   // Initialize the BytesFlops pass.
   bool BytesFlops::doInitialization(Module& module) {
     // Prevent the plugin from being unloaded.  Doing so prevents LLVM's
@@ -178,27 +398,39 @@ namespace bytesflops_pass {
     IntegerType* i32type = Type::getInt32Ty(globctx);
     IntegerType* i64type = Type::getInt64Ty(globctx);
     PointerType* i64ptrtype = Type::getInt64PtrTy(globctx);
-    mem_insts_var       = declare_global_var(module, i64ptrtype, "bf_mem_insts_count", true);
-    inst_mix_histo_var  = declare_global_var(module, i64ptrtype, "bf_inst_mix_histo", true);
-    terminator_var      = declare_global_var(module, i64ptrtype, "bf_terminator_count", true);
-    mem_intrinsics_var  = declare_global_var(module, i64ptrtype, "bf_mem_intrin_count", true);
-    load_var        = declare_global_var(module, i64type, "bf_load_count");
-    store_var       = declare_global_var(module, i64type, "bf_store_count");
-    load_inst_var   = declare_global_var(module, i64type, "bf_load_ins_count");
-    store_inst_var  = declare_global_var(module, i64type, "bf_store_ins_count");
-    flop_var        = declare_global_var(module, i64type, "bf_flop_count");
-    fp_bits_var     = declare_global_var(module, i64type, "bf_fp_bits_count");
-
-    op_var          = declare_global_var(module, i64type, "bf_op_count");
-    op_bits_var     = declare_global_var(module, i64type, "bf_op_bits_count");
-    call_inst_var   = declare_global_var(module, i64type, "bf_call_ins_count");
-
-    // bf_inst_deps_histo is a bit tricky because it's a 3D array.
-    ArrayType* i64array1Dtype = ArrayType::get(i64type, 2);
-    ArrayType* i64array2Dtype = ArrayType::get(i64array1Dtype, NUM_LLVM_OPCODES_POW2);
-    ArrayType* i64array3Dtype = ArrayType::get(i64array2Dtype, NUM_LLVM_OPCODES_POW2);
-    ArrayType* i64array4Dtype = ArrayType::get(i64array3Dtype, NUM_LLVM_OPCODES_POW2);
-    inst_deps_histo_var = declare_global_var(module, i64array4Dtype, "bf_inst_deps_histo", false);
+    // The per-basic-block counters are thread-local; the run-time library
+    // merges all threads' values at the end of the run.
+    mem_insts_var       = declare_global_var(module, i64ptrtype, "bf_mem_insts_count", true, true);
+    inst_mix_histo_var  = declare_global_var(module, i64ptrtype, "bf_inst_mix_histo", true, true);
+    terminator_var      = declare_global_var(module, i64ptrtype, "bf_terminator_count", true, true);
+    mem_intrinsics_var  = declare_global_var(module, i64ptrtype, "bf_mem_intrin_count", true, true);
+    load_var        = declare_global_var(module, i64type, "bf_load_count", false, true);
+    store_var       = declare_global_var(module, i64type, "bf_store_count", false, true);
+    load_inst_var   = declare_global_var(module, i64type, "bf_load_ins_count", false, true);
+    store_inst_var  = declare_global_var(module, i64type, "bf_store_ins_count", false, true);
+    flop_var        = declare_global_var(module, i64type, "bf_flop_count", false, true);
+    fp_bits_var     = declare_global_var(module, i64type, "bf_fp_bits_count", false, true);
+
+    op_var          = declare_global_var(module, i64type, "bf_op_count", false, true);
+    op_bits_var     = declare_global_var(module, i64type, "bf_op_bits_count", false, true);
+    call_inst_var   = declare_global_var(module, i64type, "bf_call_ins_count", false, true);
+    access_trace_var     = declare_global_var(module, i64ptrtype, "bf_access_trace", true, true);
+    access_trace_len_var = declare_global_var(module, i64type, "bf_access_trace_len", false, true);
+    bb_pending_var  = declare_global_var(module, i64type, "bf_bb_pending_count", false, true);
+    bb_flush_threshold_var = declare_global_var(module, i64type, "bf_bb_flush_threshold");
+
+    // Each module tallies instruction dependencies in a private, per-thread
+    // array with one element per combination of opcodes that appears in
+    // the module.  We don't know the array's size until we've seen the
+    // entire module so we refer to a placeholder until doFinalization().
+    inst_deps_ids.clear();
+    inst_deps_tuples.clear();
+    inst_deps_histo_var = nullptr;
+    if (TallyInstDeps)
+      inst_deps_histo_var =
+        new GlobalVariable(module, i64type, false, GlobalValue::PrivateLinkage,
+                           ConstantInt::get(i64type, 0), "bf_inst_deps_tallies",
+                           nullptr, GlobalVariable::GeneralDynamicTLSModel);
 
     // Declare a few argument types we intend to use in multiple declarations.
     IntegerType* uint8_arg = IntegerType::get(globctx, 8);
@@ -267,7 +499,13 @@ namespace bytesflops_pass {
     create_global_constant(module, "bf_mem_footprint", bool(FindMemFootprint));
 
     // Assign a value to bf_unique_bytes.
-    create_global_constant(module, "bf_unique_bytes", bool(TrackUniqueBytes) || bool(FindMemFootprint));
+    create_global_constant(module, "bf_unique_bytes", TrackUniqueBytes != UB_NONE || bool(FindMemFootprint));
+
+    // Assign a value to bf_unique_bytes_approx.  -bf-mem-footprint needs
+    // exact per-byte access counts so it can't be approximated.
+    if (TrackUniqueBytes == UB_APPROX && FindMemFootprint)
+      report_fatal_error("-bf-unique-bytes=approx is incompatible with -bf-mem-footprint");
+    create_global_constant(module, "bf_unique_bytes_approx", TrackUniqueBytes == UB_APPROX);
 
     // Assign a value to bf_vectors.
     create_global_constant(module, "bf_vectors", bool(TallyVectors));
@@ -281,15 +519,36 @@ namespace bytesflops_pass {
     // Assign a value to bf_max_reuse_dist.
     create_global_constant(module, "bf_max_reuse_distance", uint64_t(MaxReuseDist));
 
-    // Assign a value to bf_cache_model.
+    // Assign a value to bf_reuse_engine.
+    create_global_constant(module, "bf_reuse_engine", uint64_t(ReuseEngine));
+
+    // Assign a value to bf_reuse_sample_threshold.
+    uint64_t sample_threshold = uint64_t(ReuseSample*BF_REUSE_SAMPLE_MODULUS);
+    if (!(ReuseSample <= 1.0) || sample_threshold == 0)
+      report_fatal_error("-bf-reuse-sample requires a rate in (0, 1]");
+    create_global_constant(module, "bf_reuse_sample_threshold", sample_threshold);
+
+    // Assign a value to bf_cache_model.  Modeling a cache hierarchy
+    // implies using the cache model.
+    if (CacheConfig != "")
+      CacheModel = true;
     create_global_constant(module, "bf_cache_model", bool(CacheModel));
 
+    // Assign values to bf_cache_config and bf_cache_policy.
+    create_global_constant(module, "bf_cache_config", CacheConfig.c_str());
+    create_global_constant(module, "bf_cache_policy", uint64_t(CachePolicy));
+
     // Assign a value to bf_line_size.
     create_global_constant(module, "bf_line_size", uint64_t(CacheLineBytes));
 
     // Assign a value to bf_max_sets.
     create_global_constant(module, "bf_max_set_bits", uint64_t(CacheMaxSetBits));
 
+    // Assign a value to bf_max_ways.
+    if (CacheMaxWays == 0)
+      report_fatal_error("-bf-max-ways must be at least 1");
+    create_global_constant(module, "bf_max_ways", uint64_t(CacheMaxWays));
+
     // Create a global string that stores all of our command-line options.
     vector<string> command_line = parse_command_line();   // All command-line arguments
     string bf_cmdline;   // Reconstructed command line with -bf-* options only
@@ -308,24 +567,49 @@ namespace bytesflops_pass {
      * unique integer with each function and use that as the key.  We maintain
      * the association of the function names to their integer keys at compile
      * time, then create a constructor to record the map via a call to
-     * bf_record_funcs2keys. */
+     * bf_record_funcs2keys.  That call also assigns the module's functions
+     * consecutive dense IDs, which the run-time library can use as array
+     * indexes. */
     vector<Type*> func_arg;
     func_arg.push_back(IntegerType::get(globctx, 8*sizeof(uint32_t)));
     func_arg.push_back(PointerType::get(IntegerType::get(globctx, 8*sizeof(uint64_t)),0));
     PointerType* char_ptr_ptr = PointerType::get(ptr_to_char_arg, 0);
     func_arg.push_back(char_ptr_ptr);
+    func_arg.push_back(PointerType::get(IntegerType::get(globctx, 8*sizeof(uint64_t)),0));
     FunctionType* void_int_func_result =
       FunctionType::get(Type::getVoidTy(globctx), func_arg, false);
     record_funcs2keys = declare_extern_c(void_int_func_result,
                                          "bf_record_funcs2keys",
                                          &module);
 
+    // Define the module's base function ID.  Until the module's
+    // constructor runs, this lies outside the range of valid IDs.
+    func_base_var =
+      new GlobalVariable(module, IntegerType::get(globctx, 64), false,
+                         GlobalValue::PrivateLinkage,
+                         ConstantInt::get(IntegerType::get(globctx, 64), BF_FUNC_UNREGISTERED),
+                         "bf_func_base");
+
     // Inject an external declarations for bf_initialize_if_necessary().
     init_if_necessary = declare_thunk(&module, "bf_initialize_if_necessary");
 
     // Inject external declarations for bf_accumulate_bb_tallies(),
-    // bf_reset_bb_tallies(), bf_report_bb_tallies(), and
-    // bf_tally_bb_execution().
+    // bf_reset_bb_tallies(), bf_report_bb_tallies(),
+    // bf_tally_bb_execution(), bf_flush_bb_tallies(), and
+    // bf_record_bb_tallies().  Unless we also need to reset the counters
+    // at the end of every basic block for -bf-by-func, we let them
+    // accumulate across basic blocks and invoke only
+    // bf_flush_bb_tallies(), and only periodically.
+    defer_bb_tallies = InstrumentEveryBB && !TallyByFunction;
+    bb_records.clear();
+
+    // When counters are reported only in aggregate, count each basic
+    // block's flops, ops, and instruction mix at compile time and tally
+    // only the basic block's executions at run time.  The tally is shared
+    // by all threads, so we don't do this if threads otherwise keep their
+    // counters private and don't hold the mega-lock around every basic
+    // block.
+    static_bb_tallies = !InstrumentEveryBB && !TallyByFunction && !ThreadShards;
     if (InstrumentEveryBB) {
       // Declare the zero-argument functions first.
       accum_bb_tallies = declare_thunk(&module, "bf_accumulate_bb_tallies");
@@ -348,6 +632,59 @@ namespace bytesflops_pass {
         FunctionType::get(Type::getVoidTy(globctx), func_args, false);
       tally_bb_exec =
         declare_extern_c(void_func_result, "bf_tally_bb_execution", &module);
+
+      // Declare bf_flush_bb_tallies().
+      func_args.clear();
+      func_args.push_back(ptr_to_syminfo_arg);
+      void_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), func_args, false);
+      flush_bb_tallies =
+        declare_extern_c(void_func_result, "bf_flush_bb_tallies", &module);
+    }
+    if (InstrumentEveryBB || static_bb_tallies) {
+      // Declare a bf_bb_record_t struct type.
+#if LLVM_VERSION_MAJOR >= 12
+      bb_record_type = StructType::getTypeByName(globctx, "struct.bf_bb_record_t");
+#else
+      bb_record_type = module.getTypeByName("struct.bf_bb_record_t");
+#endif
+      if (bb_record_type == nullptr) {
+        bb_record_type = StructType::create(globctx, "struct.bf_bb_record_t");
+        std::vector<Type*> record_fields;
+        record_fields.push_back(i64type);
+        record_fields.push_back(ptr_to_syminfo_arg);
+        record_fields.push_back(i64type);
+        record_fields.push_back(i64ptrtype);
+        record_fields.push_back(i64type);
+        record_fields.push_back(i64type);
+        record_fields.push_back(i64type);
+        record_fields.push_back(i64type);
+        record_fields.push_back(i64type);
+        record_fields.push_back(i64ptrtype);
+        bb_record_type->setBody(record_fields, false);
+      }
+
+      // Declare bf_record_bb_tallies().
+      vector<Type*> func_args;
+      func_args.push_back(uint64_arg);
+      func_args.push_back(PointerType::get(bb_record_type, 0));
+      FunctionType* void_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), func_args, false);
+      record_bb_tallies =
+        declare_extern_c(void_func_result, "bf_record_bb_tallies", &module);
+    }
+
+    // Inject an external declaration for bf_record_inst_deps().
+    record_inst_deps = nullptr;
+    if (TallyInstDeps) {
+      vector<Type*> func_args;
+      func_args.push_back(uint64_arg);
+      func_args.push_back(i64ptrtype);
+      func_args.push_back(PointerType::get(FunctionType::get(i64ptrtype, false), 0));
+      FunctionType* void_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), func_args, false);
+      record_inst_deps =
+        declare_extern_c(void_func_result, "bf_record_inst_deps", &module);
     }
 
     // Inject an external declarations for bf_increment_func_tally().
@@ -360,6 +697,7 @@ namespace bytesflops_pass {
       // bf_assoc_counters_with_func
       vector<Type*> func_arg;
       IntegerType* keyid_arg = IntegerType::get(globctx, 8*sizeof(FunctionKeyGen::KeyID));
+      func_arg.push_back(IntegerType::get(globctx, 64));
       func_arg.push_back(keyid_arg);
       FunctionType* void_func_result =
         FunctionType::get(Type::getVoidTy(globctx), func_arg, false);
@@ -396,10 +734,17 @@ namespace bytesflops_pass {
       }
     }
 
-    // Declare bf_tally_vector_operation() only if we were asked
-    // to track vector operations.
+    // Declare bf_tally_vector_operation() and bf_record_vector_ops() only
+    // if we were asked to track vector operations.  Each kind of vector
+    // operation a function performs is identified by a dense index into
+    // the module's table of vector operations, offset by a base the
+    // run-time library assigns to the module.
+    vector_ops.clear();
+    vector_op_index.clear();
+    vector_base_var = nullptr;
     if (TallyVectors) {
       vector<Type*> all_function_args;
+      all_function_args.push_back(uint64_arg);
       all_function_args.push_back(ptr_to_char_arg);
       all_function_args.push_back(uint64_arg);
       all_function_args.push_back(uint64_arg);
@@ -410,11 +755,44 @@ namespace bytesflops_pass {
         declare_extern_c(void_func_result,
                          "bf_tally_vector_operation",
                          &module);
+
+      // Declare a bf_vector_op_t struct type.
+#if LLVM_VERSION_MAJOR >= 12
+      vector_op_type = StructType::getTypeByName(globctx, "struct.bf_vector_op_t");
+#else
+      vector_op_type = module.getTypeByName("struct.bf_vector_op_t");
+#endif
+      if (vector_op_type == nullptr) {
+        vector_op_type = StructType::create(globctx, "struct.bf_vector_op_t");
+        std::vector<Type*> op_fields;
+        op_fields.push_back(ptr_to_char_arg);
+        op_fields.push_back(uint64_arg);
+        op_fields.push_back(uint64_arg);
+        op_fields.push_back(uint64_arg);
+        vector_op_type->setBody(op_fields, false);
+      }
+
+      // Declare bf_record_vector_ops().
+      all_function_args.clear();
+      all_function_args.push_back(uint64_arg);
+      all_function_args.push_back(PointerType::get(vector_op_type, 0));
+      all_function_args.push_back(PointerType::get(uint64_arg, 0));
+      void_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
+      record_vector_ops =
+        declare_extern_c(void_func_result, "bf_record_vector_ops", &module);
+
+      // Define the module's base vector-operation ID.  Until the module's
+      // constructor runs, this lies outside the range of valid IDs.
+      vector_base_var =
+        new GlobalVariable(module, uint64_arg, false, GlobalValue::PrivateLinkage,
+                           ConstantInt::get(uint64_arg, BF_VECTOR_UNREGISTERED),
+                           "bf_vector_base");
     }
 
     // Inject external declarations for bf_assoc_addresses_with_prog()
     // and bf_assoc_addresses_with_func().
-    if (TrackUniqueBytes || FindMemFootprint) {
+    if (TrackUniqueBytes != UB_NONE || FindMemFootprint) {
       // Declare bf_assoc_addresses_with_prog() any time we need to
       // track unique bytes.
       vector<Type*> all_function_args;
@@ -543,19 +921,54 @@ namespace bytesflops_pass {
                          &module);
     }
 
-    // Declare bf_track_stride() only if we were asked to track access strides.
+    // Declare bf_track_stride() and bf_record_stride_points() only if we
+    // were asked to track access strides.  Each load or store we track is
+    // identified by a dense index into the module's table of stride
+    // points, offset by a base the run-time library assigns to the module.
+    stride_points.clear();
+    stride_base_var = nullptr;
     if (TrackStrides) {
       vector<Type*> all_function_args;
       FunctionType* void_func_result;
       all_function_args.clear();
-      all_function_args.push_back(ptr_to_syminfo_arg);
       all_function_args.push_back(uint64_arg);
       all_function_args.push_back(uint64_arg);
-      all_function_args.push_back(uint8_arg);
-      all_function_args.push_back(uint8_arg);
+      all_function_args.push_back(uint64_arg);
       void_func_result =
         FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
       track_stride = declare_extern_c(void_func_result, "bf_track_stride", &module);
+
+      // Declare a bf_stride_point_t struct type.
+#if LLVM_VERSION_MAJOR >= 12
+      stride_point_type = StructType::getTypeByName(globctx, "struct.bf_stride_point_t");
+#else
+      stride_point_type = module.getTypeByName("struct.bf_stride_point_t");
+#endif
+      if (stride_point_type == nullptr) {
+        stride_point_type = StructType::create(globctx, "struct.bf_stride_point_t");
+        std::vector<Type*> point_fields;
+        point_fields.push_back(ptr_to_syminfo_arg);
+        point_fields.push_back(uint64_arg);
+        point_fields.push_back(uint64_arg);
+        stride_point_type->setBody(point_fields, false);
+      }
+
+      // Declare bf_record_stride_points().
+      all_function_args.clear();
+      all_function_args.push_back(uint64_arg);
+      all_function_args.push_back(PointerType::get(stride_point_type, 0));
+      all_function_args.push_back(PointerType::get(uint64_arg, 0));
+      void_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
+      record_stride_points =
+        declare_extern_c(void_func_result, "bf_record_stride_points", &module);
+
+      // Define the module's base stride-point ID.  Until the module's
+      // constructor runs, this lies outside the range of valid IDs.
+      stride_base_var =
+        new GlobalVariable(module, uint64_arg, false, GlobalValue::PrivateLinkage,
+                           ConstantInt::get(uint64_arg, BF_STRIDE_UNREGISTERED),
+                           "bf_stride_base");
     }
 
     // Inject an external declaration for llvm.memset.p0i8.i64().
@@ -595,6 +1008,77 @@ namespace bytesflops_pass {
                          &module);
     }
 
+    // Assign a value to bf_batch_accesses.
+    create_global_constant(module, "bf_batch_accesses", bool(BatchAccesses));
+
+    // Inject an external declaration for bf_drain_access_trace().
+    drain_access_trace = nullptr;
+    if (BatchAccesses) {
+      vector<Type*> all_function_args;
+      all_function_args.push_back(uint8_arg);
+      FunctionType* void_func_result =
+        FunctionType::get(Type::getVoidTy(globctx), all_function_args, false);
+      drain_access_trace =
+        declare_extern_c(void_func_result,
+                         "bf_drain_access_trace",
+                         &module);
+    }
+
+    // Assign a value to bf_timeline_interval.
+    create_global_constant(module, "bf_timeline_interval", uint64_t(TimelineInterval));
+
+    // Inject external declarations for bf_timeline_due and
+    // bf_take_timeline_snapshot().
+    take_timeline_snapshot = nullptr;
+    timeline_due_var = nullptr;
+    if (TimelineInterval > 0) {
+      timeline_due_var = declare_global_var(module, Type::getInt8Ty(globctx), "bf_timeline_due");
+      take_timeline_snapshot = declare_thunk(&module, "bf_take_timeline_snapshot");
+    }
+
+    // Assign values to bf_sample_burst and bf_sample_period.  Burst
+    // sampling relies on switching between instrumented functions and
+    // their uninstrumented clones.
+    if (SamplePeriod > 0) {
+      if (SampleBurst == 0 || SampleBurst >= SamplePeriod)
+        report_fatal_error("-bf-sample-burst must be at least 1 and less than -bf-sample-period");
+      CloneFunctions = true;
+    }
+    create_global_constant(module, "bf_sample_burst", uint64_t(SampleBurst));
+    create_global_constant(module, "bf_sample_period", uint64_t(SamplePeriod));
+
+    // Inject an external declaration for bf_counting_enabled and, if
+    // we're sampling, bf_sample_countdown and bf_sample_switch().
+    counting_enabled_var = nullptr;
+    sample_countdown_var = nullptr;
+    sample_switch = nullptr;
+    if (CloneFunctions)
+      counting_enabled_var = declare_global_var(module, Type::getInt8Ty(globctx), "bf_counting_enabled");
+    if (SamplePeriod > 0) {
+      sample_countdown_var = declare_global_var(module, Type::getInt64Ty(globctx), "bf_sample_countdown");
+      sample_switch = declare_thunk(&module, "bf_sample_switch");
+    }
+
+    // We haven't yet found any loops whose counter updates we can hoist.
+    hoist_target = nullptr;
+
+    // Assign a value to bf_thread_shards.  Sharding implies thread safety.
+    // We still hold the mega-lock for each basic block when the basic
+    // block updates a global structure directly or writes per-basic-block
+    // output on every basic block.  Otherwise, we hold it only around the
+    // few run-time calls that update state shared by all threads.
+    if (ThreadShards)
+      ThreadSafety = true;
+    create_global_constant(module, "bf_thread_shards", bool(ThreadShards));
+    lock_every_bb = ThreadSafety &&
+      (!ThreadShards || (InstrumentEveryBB && !defer_bb_tallies));
+    lock_shared_calls = ThreadShards && !lock_every_bb;
+
+    // When threads keep private counters, bf_access_data_struct() tallies
+    // accesses privately and synchronizes only with allocations and
+    // deallocations, so it needs no mega-lock.
+    lock_dstruct_accesses = ThreadSafety && !ThreadShards;
+
     // Inject external declarations for bf_acquire_mega_lock() and
     // bf_release_mega_lock().
     if (ThreadSafety) {
@@ -648,7 +1132,12 @@ namespace bytesflops_pass {
       // Avoid the endless recursion that would be caused if we were to
       // instrument bf_categorize_counters() using bf_categorize_counters().
       return false;
-    if (function_name == "bf_func_key_map_ctor" || function_name == "bf_track_global_vars_ctor")
+    if (function_name == "bf_func_key_map_ctor" || function_name == "bf_track_global_vars_ctor" ||
+        function_name == "bf_bb_records_ctor" ||
+        function_name == "bf_inst_deps_ctor" ||
+        function_name == "bf_stride_points_ctor" ||
+        function_name == "bf_vector_ops_ctor" ||
+        function_name == "bf_get_inst_deps_tallies")
       // Ignore other Byfl-defined functions, too.
       return false;
     if (function_name == "_Znwm" || function_name == "_ZdlPv" || function_name == "_ZdaPv")
@@ -662,9 +1151,18 @@ namespace bytesflops_pass {
       // instrument various string-related functions from the C++ STL that we
       // invoke from the run-time library.
       return false;
+    if (function_name.startswith("bf_uninstrumented."))
+      // Don't instrument the clones we created for use while counting is
+      // disabled.
+      return false;
     if (function.empty())
       return false;
 
+    // With -bf-clone-functions, copy the function before we instrument it.
+    Function* clone = nullptr;
+    if (CloneFunctions)
+      clone = create_uninstrumented_clone(function);
+
     // Reset all of our static counters.
     static_loads = 0;
     static_stores = 0;
@@ -680,6 +1178,8 @@ namespace bytesflops_pass {
     // Instrument "interesting" instructions in every basic block.
     Module* module = function.getParent();
     instrument_entire_function(module, function, function_name);
+    if (clone != nullptr)
+      insert_clone_guard(module, function, clone);
 
     // Return, indicating that we modified this function.
     return true;
@@ -694,6 +1194,16 @@ namespace bytesflops_pass {
     return true;
   }
 
+  // Declare the analyses we use to find countable loops.  We use them
+  // only if we hoist counter updates out of loops.
+  void BytesFlops::getAnalysisUsage(AnalysisUsage& usage) const {
+    if (!can_hoist_counters())
+      return;
+    usage.addRequired<DominatorTreeWrapperPass>();
+    usage.addRequired<LoopInfoWrapperPass>();
+    usage.addRequired<ScalarEvolutionWrapperPass>();
+  }
+
   // Output what we instrumented.
   void BytesFlops::print(raw_ostream &outfile, const Module *module) const {
     outfile << module->getModuleIdentifier() << ": "
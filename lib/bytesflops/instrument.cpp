@@ -54,11 +54,14 @@ namespace bytesflops_pass {
      * 1) the number of keys
      * 2) the function keys
      * 3) the function names
-     * that is, the key of function fnames[i] is keys[i].
+     * 4) where to store the dense ID of the first function
+     * that is, the key of function fnames[i] is keys[i], and its dense
+     * ID is *base + i.
      */
     args.push_back(const_nkeys);
     args.push_back(keys);
     args.push_back(fnames);
+    args.push_back(func_base_var);
     CallInst* void_12 = CallInst::Create(record_funcs2keys, args, "", ctor_bb);
     void_12->setCallingConv(CallingConv::C);
     void_12->setTailCall(false);
@@ -149,6 +152,93 @@ namespace bytesflops_pass {
     increment_global_array(iter, mem_insts_var, idxVal, one);
   }
 
+  // Insert code to associate a range of addresses read or written with the
+  // program and the current function, to pass it to the cache model, and to
+  // compute its reuse distance, as requested by the user.  The range is
+  // either the target of a load or store or the source or destination of a
+  // memory intrinsic.  length can be an integer of any width and need not be
+  // a constant.
+  void BytesFlops::instrument_access_range(Module* module,
+                                           StringRef function_name,
+                                           Value* mem_ptr,
+                                           Value* length,
+                                           bool is_store,
+                                           BasicBlock::iterator& insert_before) {
+    // Determine which analyses apply to the range.
+    uint64_t analyses = 0;
+    if (TrackUniqueBytes != UB_NONE || FindMemFootprint) {
+      analyses |= BF_TRACE_UNIQUE;
+      if (TallyByFunction)
+        analyses |= BF_TRACE_FUNC;
+    }
+    if (CacheModel)
+      analyses |= BF_TRACE_CACHE;
+    if ((rd_bits&(1<<(is_store ? RD_STORES : RD_LOADS))) != 0)
+      analyses |= BF_TRACE_REUSE;
+    if (analyses == 0)
+      return;
+
+    // If requested by the user, defer the analyses to the access trace
+    // rather than calling each one individually.  Per-function unique bytes
+    // with -bf-call-stack depend on the call stack at the time of the access
+    // so they can't be deferred.  The trace records the pointer and length
+    // themselves, not values computed from them here, so that the access
+    // can be appended to the trace anywhere after it in the basic block.
+    uint64_t deferred = 0;
+    if (BatchAccesses) {
+      deferred = analyses;
+      if (TrackCallStack)
+        deferred &= ~uint64_t(BF_TRACE_FUNC);
+      PendingAccess access;
+      access.pointer = mem_ptr;
+      access.num_bytes = length;
+      access.analyses = deferred;
+      access.funcname = nullptr;
+      if ((deferred&BF_TRACE_FUNC) != 0)
+        access.funcname = map_func_name_to_arg(module, function_name);
+      pending_accesses.push_back(access);
+    }
+    uint64_t direct = analyses & ~deferred;
+    if (direct == 0)
+      return;
+    Value* mem_addr;
+    Value* num_bytes;
+    range_to_i64(module, mem_ptr, length, &*insert_before, mem_addr, num_bytes);
+
+    // If requested by the user, insert a call to
+    // bf_assoc_addresses_with_func() and/or bf_assoc_addresses_with_prog().
+    if ((direct&BF_TRACE_FUNC) != 0) {
+      vector<Value*> arg_list;
+      arg_list.push_back(map_func_name_to_arg(module, function_name));
+      arg_list.push_back(mem_addr);
+      arg_list.push_back(num_bytes);
+      callinst_create(assoc_addrs_with_func, arg_list, &*insert_before);
+    }
+    if ((direct&BF_TRACE_UNIQUE) != 0) {
+      vector<Value*> arg_list;
+      arg_list.push_back(mem_addr);
+      arg_list.push_back(num_bytes);
+      callinst_create(assoc_addrs_with_prog, arg_list, &*insert_before);
+    }
+
+    // If requested by the user, insert a call to bf_touch_cache().
+    if ((direct&BF_TRACE_CACHE) != 0) {
+      vector<Value*> arg_list;
+      arg_list.push_back(mem_addr);
+      arg_list.push_back(num_bytes);
+      callinst_create(access_cache, arg_list, &*insert_before);
+    }
+
+    // If requested by the user, also insert a call to
+    // bf_reuse_dist_addrs_prog().
+    if ((direct&BF_TRACE_REUSE) != 0) {
+      vector<Value*> arg_list;
+      arg_list.push_back(mem_addr);
+      arg_list.push_back(num_bytes);
+      callinst_create_shared(reuse_dist_prog, arg_list, &*insert_before);
+    }
+  }
+
   // Instrument Load and Store instructions.
   void BytesFlops::instrument_load_store(Module* module,
                                          StringRef function_name,
@@ -189,71 +279,49 @@ namespace bytesflops_pass {
         static_stores++;
       }
 
-    // Determine the memory address that was loaded or stored.
-    CastInst* mem_addr = nullptr;
-    Value* mem_ptr = nullptr;
-    if (TrackUniqueBytes || FindMemFootprint || rd_bits > 0 ||
-        TallyByDataStruct || TrackStrides || CacheModel) {
-      mem_ptr =
-        opcode == Instruction::Load
-        ? cast<LoadInst>(inst).getPointerOperand()
-        : cast<StoreInst>(inst).getPointerOperand();
-      mem_addr = new PtrToIntInst(mem_ptr, IntegerType::get(bbctx, 64),
-                                  "", &*insert_before);
-      mark_as_byfl(mem_addr);
-    }
-
-    // If requested by the user, also insert a call to
-    // bf_assoc_addresses_with_prog() and perhaps
-    // bf_assoc_addresses_with_func().
-    if (TrackUniqueBytes || FindMemFootprint) {
-      // Conditionally insert a call to bf_assoc_addresses_with_func().
-      if (TallyByFunction) {
-        vector<Value*> arg_list;
-        arg_list.push_back(map_func_name_to_arg(module, function_name));
-        arg_list.push_back(mem_addr);
-        arg_list.push_back(num_bytes);
-        callinst_create(assoc_addrs_with_func, arg_list, &*insert_before);
-      }
-
-      // Unconditionally insert a call to bf_assoc_addresses_with_prog().
-      vector<Value*> arg_list;
-      arg_list.push_back(mem_addr);
-      arg_list.push_back(num_bytes);
-      callinst_create(assoc_addrs_with_prog, arg_list, &*insert_before);
-    }
-
-    // If requested by the user, insert a call to bf_touch_cache().
-    if (CacheModel) {
-      vector<Value*> arg_list;
-      arg_list.push_back(mem_addr);
-      arg_list.push_back(num_bytes);
-      callinst_create(access_cache, arg_list, &*insert_before);
-    }
-
-    // If requested by the user, also insert a call to
-    // bf_reuse_dist_addrs_prog().
-    if ((opcode == Instruction::Load && (rd_bits&(1<<RD_LOADS)) != 0)
-        || (opcode == Instruction::Store && (rd_bits&(1<<RD_STORES)) != 0)) {
-      vector<Value*> arg_list;
-      arg_list.push_back(mem_addr);
-      arg_list.push_back(num_bytes);
-      callinst_create(reuse_dist_prog, arg_list, &*insert_before);
-    }
+    // Analyze the range of addresses that was loaded or stored.
+    Value* mem_ptr =
+      opcode == Instruction::Load
+      ? cast<LoadInst>(inst).getPointerOperand()
+      : cast<StoreInst>(inst).getPointerOperand();
+    instrument_access_range(module, function_name, mem_ptr, num_bytes,
+                            opcode == Instruction::Store, insert_before);
 
     // If requested by the user, also insert a call to bf_track_stride().
+    // The load or store's static properties go in the module's table of
+    // stride points; at run time we pass only the table entry's ID.
     if (TrackStrides) {
+      CastInst* mem_addr = new PtrToIntInst(mem_ptr, IntegerType::get(bbctx, 64),
+                                            "", &*insert_before);
+      mark_as_byfl(mem_addr);
+      InternalSymbolInfo syminfo(&inst, inst_to_string(&inst));
+      vector<Constant*> point_fields;
+      point_fields.push_back(create_syminfo_constant(*module, syminfo));
+      point_fields.push_back(ConstantInt::get(bbctx, APInt(64, opcode == Instruction::Load ? 0 : 1)));
+      point_fields.push_back(ConstantInt::get(bbctx, APInt(64, all_constant_refs(&inst))));
+      uint64_t point_idx = stride_points.size();
+      stride_points.push_back(ConstantStruct::get(stride_point_type, point_fields));
+
+      // %0 = load i64* @bf_stride_base, align 8
+#if LLVM_VERSION_MAJOR >= 11
+      LoadInst* stride_base = new LoadInst(cast<PointerType>(stride_base_var->getType())->getElementType(), stride_base_var, "stride_base", false, &*insert_before);
+#else
+      LoadInst* stride_base = new LoadInst(stride_base_var, "stride_base", false, &*insert_before);
+#endif
+      mark_as_byfl(stride_base);
+
+      // %1 = add i64 %0, <index>
+      BinaryOperator* point_id =
+        BinaryOperator::Create(Instruction::Add, stride_base,
+                               ConstantInt::get(bbctx, APInt(64, point_idx)),
+                               "stride_id", &*insert_before);
+      mark_as_byfl(point_id);
+
       vector<Value*> arg_list;
-      func_syminfo =
-        find_value_provenance(*module, &inst, inst_to_string(&inst), insert_before, func_syminfo);
-      uint8_t load0store1 = opcode == Instruction::Load ? 0 : 1;
-      uint8_t is_const = all_constant_refs(&inst);
-      arg_list.push_back(func_syminfo);
+      arg_list.push_back(point_id);
       arg_list.push_back(mem_addr);
       arg_list.push_back(num_bytes);
-      arg_list.push_back(ConstantInt::get(bbctx, APInt(8, load0store1)));
-      arg_list.push_back(ConstantInt::get(bbctx, APInt(8, is_const)));
-      callinst_create(track_stride, arg_list, &*insert_before);
+      callinst_create_shared(track_stride, arg_list, &*insert_before);
     }
 
     // If requested by the user, insert a call to bf_access_data_struct().
@@ -264,7 +332,7 @@ namespace bytesflops_pass {
       insert_post_ls++;
 
       // Acquire the mega-lock before inserting any instrumentation code.
-      if (ThreadSafety)
+      if (lock_dstruct_accesses)
         callinst_create(take_mega_lock, &*insert_post_ls);
 
       // Instrument the load or store.
@@ -282,7 +350,7 @@ namespace bytesflops_pass {
       callinst_create(access_data_struct, arg_list, &*insert_post_ls);
 
       // Release the mega-lock.
-      if (ThreadSafety)
+      if (lock_dstruct_accesses)
         callinst_create(release_mega_lock, &*insert_post_ls);
 
       // Advance the iterator to the last piece of code we inserted.  The
@@ -308,6 +376,8 @@ namespace bytesflops_pass {
       if (cit == func_key_map.end()) {
         keyval = m_keygen->nextRandomKey();
         func_key_map[fname] = keyval;
+        uint64_t idx = func_key_index.size();   // Assign before inserting.
+        func_key_index[keyval] = idx;
       }
       else
         keyval = cit->second;
@@ -318,6 +388,7 @@ namespace bytesflops_pass {
   // Instrument Call instructions.  Note that we've already skipped
   // over calls to llvm.dbg.*.
   void BytesFlops::instrument_call(Module* module,
+                                   StringRef function_name,
                                    BasicBlock::iterator& iter,
                                    BasicBlock::iterator& insert_before,
                                    int& must_clear) {
@@ -338,6 +409,10 @@ namespace bytesflops_pass {
         increment_global_array(insert_before, mem_intrinsics_var, callVal, one);
         ConstantInt* byteVal = ConstantInt::get(globctx, APInt(64, BF_MEMSET_BYTES));
         increment_global_array(insert_before, mem_intrinsics_var, byteVal, memsetfunc->getLength());
+
+        // Analyze the entire range of addresses as a single store.
+        instrument_access_range(module, function_name, memsetfunc->getDest(),
+                                memsetfunc->getLength(), true, insert_before);
         if (TallyByDataStruct) {
           // We can't delay instrumentation to the end of the basic block.  We
           // have to do it now in case the data are about to be deallocated.
@@ -345,7 +420,7 @@ namespace bytesflops_pass {
           insert_post_mem++;
 
           // Acquire the mega-lock before inserting any instrumentation code.
-          if (ThreadSafety)
+          if (lock_dstruct_accesses)
             callinst_create(take_mega_lock, &*insert_post_mem);
 
           // A memory set is treated as a store.
@@ -364,7 +439,7 @@ namespace bytesflops_pass {
           callinst_create(access_data_struct, arg_list, &*insert_post_mem);
 
           // Release the mega-lock.
-          if (ThreadSafety)
+          if (lock_dstruct_accesses)
             callinst_create(release_mega_lock, &*insert_post_mem);
 
           // Advance the iterator to the last piece of code we inserted.  The
@@ -380,6 +455,13 @@ namespace bytesflops_pass {
         increment_global_array(insert_before, mem_intrinsics_var, callVal, one);
         ConstantInt* byteVal = ConstantInt::get(globctx, APInt(64, BF_MEMXFER_BYTES));
         increment_global_array(insert_before, mem_intrinsics_var, byteVal, memxferfunc->getLength());
+
+        // Analyze the entire source range as a single load and the entire
+        // destination range as a single store.
+        instrument_access_range(module, function_name, memxferfunc->getSource(),
+                                memxferfunc->getLength(), false, insert_before);
+        instrument_access_range(module, function_name, memxferfunc->getDest(),
+                                memxferfunc->getLength(), true, insert_before);
         if (TallyByDataStruct) {
           // We can't delay instrumentation to the end of the basic block.  We
           // have to do it now in case the data are about to be deallocated.
@@ -387,7 +469,7 @@ namespace bytesflops_pass {
           insert_post_mem++;
 
           // Acquire the mega-lock before inserting any instrumentation code.
-          if (ThreadSafety)
+          if (lock_dstruct_accesses)
             callinst_create(take_mega_lock, &*insert_post_mem);
 
           // A memory transfer is treated as a load...
@@ -419,7 +501,7 @@ namespace bytesflops_pass {
           callinst_create(access_data_struct, arg_list, &*insert_post_mem);
 
           // Release the mega-lock.
-          if (ThreadSafety)
+          if (lock_dstruct_accesses)
             callinst_create(release_mega_lock, &*insert_post_mem);
 
           // Advance the iterator to the last piece of code we inserted.  The
@@ -711,12 +793,18 @@ namespace bytesflops_pass {
             break;
         }
       }
-      increment_global_variable(insert_before, op_var,
-                                ConstantInt::get(bbctx, APInt(64, arg_ops)));
-      must_clear |= CLEAR_OPS;
-      increment_global_variable(insert_before, op_bits_var,
-                                ConstantInt::get(bbctx, APInt(64, arg_op_bits)));
-      must_clear |= CLEAR_OP_BITS;
+      if (static_bb_tallies) {
+        bb_counts.ops += arg_ops;
+        bb_counts.op_bits += arg_op_bits;
+      }
+      else {
+        increment_global_variable(insert_before, op_var,
+                                  ConstantInt::get(bbctx, APInt(64, arg_ops)));
+        must_clear |= CLEAR_OPS;
+        increment_global_variable(insert_before, op_bits_var,
+                                  ConstantInt::get(bbctx, APInt(64, arg_op_bits)));
+        must_clear |= CLEAR_OP_BITS;
+      }
       static_ops += arg_ops;
     }
     else {
@@ -729,14 +817,22 @@ namespace bytesflops_pass {
       num_bits = ConstantInt::get(bbctx, APInt(64, instruction_operand_bits(inst)));
 
       // Increment the operation counter and the operation bit counter.
-      increment_global_variable(insert_before, op_var, num_elts);
-      must_clear |= CLEAR_OPS;
-      if (!isa<LoadInst>(inst) && !isa<StoreInst>(inst)) {
-        // Count loads and stores as zero op bits to clarify reports
-        // of bits per op bit: we don't want memory bits contributing
-        // to both the numerator and the denominator.
-        increment_global_variable(insert_before, op_bits_var, num_bits);
-        must_clear |= CLEAR_OP_BITS;
+      // Count loads and stores as zero op bits to clarify reports of bits
+      // per op bit: we don't want memory bits contributing to both the
+      // numerator and the denominator.
+      bool tally_op_bits = !isa<LoadInst>(inst) && !isa<StoreInst>(inst);
+      if (static_bb_tallies) {
+        bb_counts.ops += num_elts->getZExtValue();
+        if (tally_op_bits)
+          bb_counts.op_bits += num_bits->getZExtValue();
+      }
+      else {
+        increment_global_variable(insert_before, op_var, num_elts);
+        must_clear |= CLEAR_OPS;
+        if (tally_op_bits) {
+          increment_global_variable(insert_before, op_bits_var, num_bits);
+          must_clear |= CLEAR_OP_BITS;
+        }
       }
 #if LLVM_VERSION_MAJOR >= 12
       static_ops += instType->isVectorTy() ? dyn_cast<FixedVectorType>(instType)->getNumElements() : 1;
@@ -765,10 +861,16 @@ namespace bytesflops_pass {
 
       num_elts = get_vector_length(bbctx, instType, one);
       num_bits = ConstantInt::get(bbctx, APInt(64, instruction_operand_bits(inst)));
-      increment_global_variable(insert_before, flop_var, num_elts);
-      must_clear |= CLEAR_FLOPS;
-      increment_global_variable(insert_before, fp_bits_var, num_bits);
-      must_clear |= CLEAR_FP_BITS;
+      if (static_bb_tallies) {
+        bb_counts.flops += num_elts->getZExtValue();
+        bb_counts.fp_bits += num_bits->getZExtValue();
+      }
+      else {
+        increment_global_variable(insert_before, flop_var, num_elts);
+        must_clear |= CLEAR_FLOPS;
+        increment_global_variable(insert_before, fp_bits_var, num_bits);
+        must_clear |= CLEAR_FP_BITS;
+      }
       static_flops++;
     }
 
@@ -789,19 +891,55 @@ namespace bytesflops_pass {
           // Ignore mixed scalar/vector operations.
           break;
 
-        // Tally this vector operation.
-        vector<Value*> arg_list;
+        // Find or create this function's entry in the module's table of
+        // vector operations.
 #if LLVM_VERSION_MAJOR >= 12
         uint64_t elt_count = dyn_cast<FixedVectorType>(vt)->getNumElements();
 #else	
 	uint64_t elt_count = vt->getNumElements();
 #endif
 	uint64_t total_bits = instType->getPrimitiveSizeInBits();
-        arg_list.push_back(map_func_name_to_arg(module, function_name));
+        Constant* funcname_arg = map_func_name_to_arg(module, function_name);
+        auto op_key = std::make_tuple(function_name.str(), elt_count, total_bits/elt_count, true);
+        auto op_iter = vector_op_index.find(op_key);
+        uint64_t op_idx;
+        if (op_iter == vector_op_index.end()) {
+          vector<Constant*> op_fields;
+          op_fields.push_back(funcname_arg);
+          op_fields.push_back(ConstantInt::get(bbctx, APInt(64, elt_count)));
+          op_fields.push_back(ConstantInt::get(bbctx, APInt(64, total_bits/elt_count)));
+          op_fields.push_back(ConstantInt::get(bbctx, APInt(64, 1)));
+          op_idx = vector_ops.size();
+          vector_ops.push_back(ConstantStruct::get(vector_op_type, op_fields));
+          vector_op_index[op_key] = op_idx;
+        }
+        else
+          op_idx = op_iter->second;
+
+        // %0 = load i64* @bf_vector_base, align 8
+#if LLVM_VERSION_MAJOR >= 11
+        LoadInst* vector_base = new LoadInst(cast<PointerType>(vector_base_var->getType())->getElementType(), vector_base_var, "vector_base", false, &*insert_before);
+#else
+        LoadInst* vector_base = new LoadInst(vector_base_var, "vector_base", false, &*insert_before);
+#endif
+        mark_as_byfl(vector_base);
+
+        // %1 = add i64 %0, <index>
+        BinaryOperator* op_id =
+          BinaryOperator::Create(Instruction::Add, vector_base,
+                                 ConstantInt::get(bbctx, APInt(64, op_idx)),
+                                 "vector_id", &*insert_before);
+        mark_as_byfl(op_id);
+
+        // Tally this vector operation.  The run-time library needs the
+        // operation's properties only if the module is not yet registered.
+        vector<Value*> arg_list;
+        arg_list.push_back(op_id);
+        arg_list.push_back(funcname_arg);
         arg_list.push_back(get_vector_length(bbctx, vt, one));
         arg_list.push_back(ConstantInt::get(bbctx, APInt(64, total_bits/elt_count)));
         arg_list.push_back(ConstantInt::get(bbctx, APInt(8, 1)));
-        callinst_create(tally_vector, arg_list, &*insert_before);
+        callinst_create_shared(tally_vector, arg_list, &*insert_before);
       }
       while (0);
   }
@@ -815,6 +953,10 @@ namespace bytesflops_pass {
     // Tally the number of basic blocks that the function contains.
     static_bblocks += function.size();
 
+    // Find the loops whose counter updates we can hoist.  Do this before
+    // we modify the function.
+    find_countable_loops(function);
+
     // Generate a unique key for the function and insert a call to record it.
     FunctionKeyGen::KeyID keyval = record_func(function_name.str());
 
@@ -861,13 +1003,22 @@ namespace bytesflops_pass {
          func_iter++) {
       // Perform per-basic-block variable initialization.
       BasicBlock& bb = *func_iter;
-      if (bb.getName() == "bf_entry")
-        continue;  // Don't instrument the basic block we just added.
+      if (bb.getName().startswith("bf_"))
+        continue;  // Don't instrument the basic blocks we added.
+      auto loop_iter = bb_to_countable_loop.find(&bb);
+      if (loop_iter == bb_to_countable_loop.end())
+        hoist_target = nullptr;
+      else
+        hoist_target = &countable_loops[loop_iter->second];
       LLVMContext& bbctx = bb.getContext();
       BasicBlock::iterator terminator_inst = bb.end();
       terminator_inst--;
       int must_clear = 0;   // Keep track of which counters we need to clear.
+      vector<pair<Instruction*, vector<PendingAccess> > > call_flushes;  // Accesses to trace before each call
       uint64_t num_insts = bb.size();
+      bb_counts.flops = bb_counts.fp_bits = 0;
+      bb_counts.ops = bb_counts.op_bits = 0;
+      bb_counts.inst_mix.clear();
 
       // Insert an "unreachable" instruction as a sentinel before the real
       // terminator instruction.  New code is inserted before the real
@@ -875,7 +1026,7 @@ namespace bytesflops_pass {
       Instruction* unreachable = new UnreachableInst(bbctx, &*terminator_inst);
 
       // Acquire the mega-lock before inserting any instrumentation code.
-      if (ThreadSafety)
+      if (lock_every_bb)
         callinst_create(take_mega_lock, &*terminator_inst);
 
       // Iterate over the basic block's instructions one-by-one until
@@ -897,7 +1048,9 @@ namespace bytesflops_pass {
         unsigned int opcode = iter->getOpcode();
 
         // Maintain a histogram of instructions executed.
-        if (TallyInstMix) {
+        if (TallyInstMix && static_bb_tallies)
+          bb_counts.inst_mix[opcode]++;
+        else if (TallyInstMix) {
           ConstantInt* opCodeIdx = ConstantInt::get(bbctx,  APInt(64, int64_t(opcode)));
           increment_global_array(terminator_inst, inst_mix_histo_var, opCodeIdx, one);
         }
@@ -923,14 +1076,26 @@ namespace bytesflops_pass {
               opcodes[o] = oinst->getOpcode();
           }
 
-          // Increment the appropriate 4-D array value.
-          increment_global_4D_array(terminator_inst,
-                                    inst_deps_histo_var,
-                                    ConstantInt::get(bbctx, APInt(64, opcodes[0])),
-                                    ConstantInt::get(bbctx, APInt(64, opcodes[1])),
-                                    ConstantInt::get(bbctx, APInt(64, opcodes[2])),
-                                    inst.getNumOperands() > 2 ? one : zero,
-                                    one);
+          // Assign the combination of opcodes an element of the module's
+          // array of tallies if it doesn't already have one, and
+          // increment that element.
+          uint64_t more = inst.getNumOperands() > 2 ? 1 : 0;
+          uint64_t deps_idx = inst_deps_to_index(opcodes[0], opcodes[1], opcodes[2], more);
+          auto id_iter = inst_deps_ids.find(deps_idx);
+          uint64_t deps_id;
+          if (id_iter == inst_deps_ids.end()) {
+            deps_id = inst_deps_ids.size();
+            inst_deps_ids[deps_idx] = deps_id;
+            for (o = 0; o < 3; o++)
+              inst_deps_tuples.push_back(ConstantInt::get(bbctx, APInt(64, opcodes[o])));
+            inst_deps_tuples.push_back(ConstantInt::get(bbctx, APInt(64, more)));
+          }
+          else
+            deps_id = id_iter->second;
+          Constant* tally_ptr =
+            ConstantExpr::getGetElementPtr(Type::getInt64Ty(bbctx), inst_deps_histo_var,
+                                           ConstantInt::get(bbctx, APInt(64, deps_id)));
+          increment_global_variable(terminator_inst, tally_ptr, one);
         }
 
         // Process the current instruction.
@@ -942,7 +1107,16 @@ namespace bytesflops_pass {
             break;
 
           case Instruction::Call:
-            instrument_call(module, iter, terminator_inst, must_clear);
+            // The callee may append its own accesses to the access trace or
+            // may never return (e.g., exit(), longjmp(), or a C++ throw), so
+            // the accesses that precede the call must be appended to the
+            // trace before the call.  Intrinsics don't run instrumented
+            // code.
+            if (!pending_accesses.empty() && !isa<IntrinsicInst>(inst)) {
+              call_flushes.push_back(make_pair(&inst, vector<PendingAccess>()));
+              call_flushes.back().second.swap(pending_accesses);
+            }
+            instrument_call(module, function_name, iter, terminator_inst, must_clear);
             break;
 
           case Instruction::Alloca:
@@ -956,13 +1130,27 @@ namespace bytesflops_pass {
         instrument_all(inst, bbctx, terminator_inst, must_clear);
       }
 
+      // Append the accesses that precede each call to the access trace
+      // immediately before the call.
+      for (auto flush_iter = call_flushes.begin(); flush_iter != call_flushes.end(); flush_iter++) {
+        BasicBlock::iterator call_iter = flush_iter->first->getIterator();
+        insert_access_trace_code(module, flush_iter->second, call_iter, false);
+      }
+
       // Add one last bit of code then release the mega-lock and elide
       // the sentinel terminator.
       insert_end_bb_code(module, keyval, num_insts, must_clear, terminator_inst);
-      if (ThreadSafety)
-        callinst_create(release_mega_lock, &*terminator_inst);
       unreachable->eraseFromParent();
+      if (!pending_accesses.empty())
+        insert_access_trace_code(module, pending_accesses, terminator_inst, lock_every_bb);
+      if (lock_every_bb)
+        callinst_create(release_mega_lock, &*terminator_inst);
+      if (TimelineInterval > 0)
+        insert_timeline_code(module, terminator_inst);
     }  // Ends the loop over basic blocks within the function
+
+    // Update the counters for all iterations of each countable loop.
+    insert_hoisted_increments(module);
   }
 
   bool BytesFlops::doFinalization(Module& module)
@@ -990,13 +1178,17 @@ namespace bytesflops_pass {
       ConstantInt *
       const_int32 = ConstantInt::get(ctx, APInt(32, StringRef("0"), 10));
 
-      std::vector<Constant*> const_key_elems;
-      std::vector<Constant*> const_fname_elems;
+      // Order the functions by their position in the module's table so
+      // that the run-time library's dense IDs match those used by
+      // insert_end_bb_code().
+      std::vector<Constant*> const_key_elems(func_key_map.size());
+      std::vector<Constant*> const_fname_elems(func_key_map.size());
 
       int i = 0;
       for (auto it = func_key_map.begin(); it != func_key_map.end(); it++) {
         const std::string & name = it->first;
         auto key = it->second;
+        uint64_t idx = func_key_index[key];
 
         // name.size() + 1 for NULL char.
         ArrayType *
@@ -1004,7 +1196,7 @@ namespace bytesflops_pass {
 
         // Record the key.
         ConstantInt* const_int64 = ConstantInt::get(ctx, APInt(64, key));
-        const_key_elems.push_back(const_int64);
+        const_key_elems[idx] = const_int64;
 
         // Record the name.
         std::string gv_name = ".str" + std::to_string(i++);
@@ -1029,7 +1221,7 @@ namespace bytesflops_pass {
           const_ptr_indices.push_back(const_int32);
           Constant *
             const_ptr = ConstantExpr::getGetElementPtr(nullptr, gvar_array_str, const_ptr_indices);
-          const_fname_elems.push_back(const_ptr);
+          const_fname_elems[idx] = const_ptr;
           gvar_array_str->setInitializer(const_fname);
       }
 
@@ -1102,6 +1294,13 @@ namespace bytesflops_pass {
       create_func_map_ctor(module, (uint32_t)func_key_map.size(),
                            array_key_pointer, array_fnames_pointer);
 
+      // Pass the run-time library our table of basic blocks and our
+      // instruction-dependency tallies, if any.
+      create_bb_records_ctor(&module);
+      create_inst_deps_ctor(&module);
+      create_stride_points_ctor(&module);
+      create_vector_ops_ctor(&module);
+
       return true;
   }
 
@@ -0,0 +1,32 @@
+/***********************************
+ * Benchmark: huge memory copies   *
+ * By Scott Pakin <pakin@lanl.gov> *
+ ***********************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Copy and clear large buffers to stress Byfl's handling of memory
+ * intrinsics. */
+int main (int argc, char *argv[])
+{
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  size_t bytes = 64UL<<20;
+  long reps = 10*scale;
+  char *src = malloc(bytes);
+  char *dst = malloc(bytes);
+  long sum = 0;
+  long r;
+
+  memset(src, 1, bytes);
+  for (r = 0; r < reps; r++) {
+    memcpy(dst, src, bytes);
+    memset(src, (int) r, bytes/2);
+    sum += dst[r*4096 % bytes];
+  }
+  printf("Checksum is %ld\n", sum);
+  free(src);
+  free(dst);
+  return 0;
+}
@@ -0,0 +1,194 @@
+/*****************************************
+ * Time the run-time library's hot paths *
+ * By Scott Pakin <pakin@lanl.gov>       *
+ *****************************************/
+
+#include "byfl.h"
+#include <chrono>
+#include <functional>
+
+using namespace std;
+using namespace bytesflops;
+
+// Stand in for the constants the bytesflops pass normally defines in
+// instrumented code.  The microbenchmarks enable only the subsystems they
+// exercise.
+const char* bf_foofoo = "";
+uint64_t* testkey = nullptr;
+uint64_t* bf_keys = nullptr;
+uint64_t bf_bb_merge = 1;
+uint8_t bf_call_stack = 0;
+uint8_t bf_every_bb = 0;
+uint64_t bf_max_reuse_distance = ~uint64_t(0);
+uint64_t bf_reuse_engine = BF_RD_ENGINE_SPLAY;
+uint64_t bf_reuse_sample_threshold = BF_REUSE_SAMPLE_MODULUS;
+const char* bf_option_string = "[microbenchmark]";
+uint8_t bf_per_func = 0;
+uint8_t bf_mem_footprint = 0;
+uint8_t bf_tally_inst_mix = 0;
+uint8_t bf_tally_inst_deps = 0;
+uint8_t bf_types = 0;
+uint8_t bf_unique_bytes = 0;
+uint8_t bf_unique_bytes_approx = 0;
+uint8_t bf_vectors = 0;
+uint8_t bf_cache_model = 1;
+uint8_t bf_data_structs = 0;
+uint8_t bf_strides = 0;
+uint64_t bf_line_size = 64;
+uint64_t bf_max_set_bits = 12;
+uint64_t bf_max_ways = 16;
+const char* bf_cache_config = "";
+uint64_t bf_cache_policy = BF_CACHE_INCLUSIVE;
+uint8_t bf_thread_shards = 0;
+uint8_t bf_batch_accesses = 0;
+uint64_t bf_timeline_interval = 0;
+uint64_t bf_sample_burst = 0;
+uint64_t bf_sample_period = 0;
+uint64_t bf_fmap_cnt = 0;
+
+// Generate a reproducible stream of pseudorandom addresses.
+class AddressStream {
+private:
+  uint64_t state;
+
+public:
+  AddressStream() : state(88172645463325252ULL) { }
+
+  uint64_t next (uint64_t range) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state % range;
+  }
+};
+
+// Run a benchmark, and output the time per operation.
+static void run_benchmark (const char* name, uint64_t num_ops,
+                           function<void(uint64_t)> body)
+{
+  auto start = chrono::steady_clock::now();
+  body(num_ops);
+  auto elapsed = chrono::steady_clock::now() - start;
+  double ns = double(chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+  printf("%-40s %12" PRIu64 " ops %10.2f ns/op\n", name, num_ops, ns/double(num_ops));
+  fflush(stdout);
+}
+
+int main (int argc, char* argv[])
+{
+  const char* scale_str = argc > 1 ? argv[1] : getenv("BF_BENCH_SCALE");
+  uint64_t scale = scale_str == nullptr ? 1 : strtoull(scale_str, nullptr, 10);
+  if (scale == 0)
+    scale = 1;
+  uint64_t num_ops = 1000000*scale;
+  const uint64_t footprint = 1ULL<<26;   // Bytes spanned by random addresses
+  bf_initialize_if_necessary();
+
+  // Page tables
+  run_benchmark("BitPageTable (sequential 8-byte)", num_ops, [](uint64_t n) {
+      BitPageTable table(8192);
+      for (uint64_t i = 0; i < n; i++)
+        table.access(0x10000000 + i*8, 8);
+    });
+  run_benchmark("BitPageTable (random 8-byte)", num_ops, [&](uint64_t n) {
+      BitPageTable table(8192);
+      AddressStream addrs;
+      for (uint64_t i = 0; i < n; i++)
+        table.access(0x10000000 + addrs.next(footprint), 8);
+    });
+  run_benchmark("WordPageTable (random 8-byte)", num_ops, [&](uint64_t n) {
+      WordPageTable table(8192);
+      AddressStream addrs;
+      for (uint64_t i = 0; i < n; i++)
+        table.access(0x10000000 + addrs.next(footprint), 8);
+    });
+
+  // Bit-vector kernels.  Fill long ranges and merge page tables with each
+  // set of kernels the CPU supports, and check that every set tallies the
+  // same number of unique bytes as the portable kernels.
+  BitPageTable merge_source(8192);
+  AddressStream source_addrs;
+  for (uint64_t i = 0; i < 65536; i++)
+    merge_source.access(0x10000000 + source_addrs.next(footprint), 8);
+  uint64_t num_pages = 0;
+  for (auto page_iter = merge_source.begin(); page_iter != merge_source.end(); page_iter++)
+    num_pages++;
+  uint64_t expected_fill = 0;
+  uint64_t expected_merge = 0;
+  for (const char* kernels : {"scalar", "popcnt", "avx2", "avx512"}) {
+    if (bf_select_bit_kernels(kernels) == nullptr)
+      continue;
+    uint64_t unique_bytes = 0;
+    string name = string("BitPageTable (random 1KB, ") + kernels + ")";
+    run_benchmark(name.c_str(), num_ops/10, [&](uint64_t n) {
+        BitPageTable table(8192);
+        AddressStream addrs;
+        for (uint64_t i = 0; i < n; i++)
+          table.access(0x10000000 + addrs.next(footprint*4), 1024);
+        unique_bytes = table.tally_unique();
+      });
+    if (expected_fill == 0)
+      expected_fill = unique_bytes;
+    else if (unique_bytes != expected_fill)
+      printf("    *** Expected %" PRIu64 " unique bytes but saw %" PRIu64 " ***\n",
+             expected_fill, unique_bytes);
+    name = string("BitPageTable merge (") + kernels + ")";
+    run_benchmark(name.c_str(), num_pages*(num_ops/10000), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i += num_pages) {
+          BitPageTable table(8192);
+          table.merge(&merge_source);
+          unique_bytes = table.tally_unique();
+        }
+      });
+    if (expected_merge == 0)
+      expected_merge = unique_bytes;
+    else if (unique_bytes != expected_merge)
+      printf("    *** Expected %" PRIu64 " unique bytes but saw %" PRIu64 " ***\n",
+             expected_merge, unique_bytes);
+  }
+  bf_select_bit_kernels(nullptr);
+
+  // Reuse distance (splay tree of RDnodes)
+  run_benchmark("Reuse distance (sequential 8-byte)", num_ops/10, [](uint64_t n) {
+      for (uint64_t i = 0; i < n; i++)
+        bf_reuse_dist_addrs_prog(0x20000000 + (i*8)%(1<<20), 8);
+    });
+  run_benchmark("Reuse distance (random 8-byte)", num_ops/10, [&](uint64_t n) {
+      AddressStream addrs;
+      for (uint64_t i = 0; i < n; i++)
+        bf_reuse_dist_addrs_prog(0x30000000 + addrs.next(footprint), 8);
+    });
+
+  // Cache model
+  run_benchmark("Cache model (sequential 8-byte)", num_ops, [](uint64_t n) {
+      for (uint64_t i = 0; i < n; i++)
+        bf_touch_cache(0x40000000 + i*8, 8);
+    });
+  run_benchmark("Cache model (random 8-byte)", num_ops, [&](uint64_t n) {
+      AddressStream addrs;
+      for (uint64_t i = 0; i < n; i++)
+        bf_touch_cache(0x50000000 + addrs.next(footprint), 8);
+    });
+
+  // Cached maps
+  run_benchmark("CachedFlatMap (repeated keys)", num_ops, [&](uint64_t n) {
+      CachedFlatMap<uint64_t, uint64_t> map;
+      for (uint64_t i = 0; i < n; i++)
+        map[i%4]++;
+    });
+  run_benchmark("CachedFlatMap (random keys)", num_ops, [&](uint64_t n) {
+      CachedFlatMap<uint64_t, uint64_t> map;
+      AddressStream keys;
+      for (uint64_t i = 0; i < n; i++)
+        map[keys.next(65536)]++;
+    });
+  run_benchmark("CachedUnorderedMap (random keys)", num_ops, [&](uint64_t n) {
+      CachedUnorderedMap<uint64_t, uint64_t> map;
+      AddressStream keys;
+      for (uint64_t i = 0; i < n; i++)
+        map[keys.next(65536)]++;
+    });
+
+  // Skip Byfl's end-of-run report, which is meaningless here.
+  _exit(0);
+}
@@ -0,0 +1,37 @@
+/***********************************
+ * Benchmark: multithreading       *
+ * By Scott Pakin <pakin@lanl.gov> *
+ ***********************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Perform a multithreaded dot product and an array update so that all
+ * threads contend for Byfl's shared state. */
+int main (int argc, char *argv[])
+{
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  long n = 1L<<21;
+  long reps = 10*scale;
+  double *x = malloc(n*sizeof(double));
+  double *y = malloc(n*sizeof(double));
+  double sum = 0.0;
+  long i, r;
+
+#pragma omp parallel for
+  for (i = 0; i < n; i++) {
+    x[i] = (double) i;
+    y[i] = 1.0/(double) (i + 1);
+  }
+  for (r = 0; r < reps; r++) {
+#pragma omp parallel for reduction(+:sum)
+    for (i = 0; i < n; i++) {
+      sum += x[i]*y[i];
+      y[i] += 1.0e-6;
+    }
+  }
+  printf("Checksum is %g\n", sum);
+  free(x);
+  free(y);
+  return 0;
+}
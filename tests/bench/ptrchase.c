@@ -0,0 +1,52 @@
+/***********************************
+ * Benchmark: pointer chasing      *
+ * By Scott Pakin <pakin@lanl.gov> *
+ ***********************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Traverse a linked list whose nodes are scattered randomly through
+ * memory so that every load depends on the previous one. */
+typedef struct node {
+  struct node *next;
+  long value;
+} node_t;
+
+int main (int argc, char *argv[])
+{
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  long n = 1L<<20;
+  long steps = 2*n*scale;
+  node_t *nodes = malloc(n*sizeof(node_t));
+  long *order = malloc(n*sizeof(long));
+  node_t *p;
+  long sum = 0;
+  long i;
+
+  /* Link the nodes in a random cyclic order. */
+  for (i = 0; i < n; i++)
+    order[i] = i;
+  srand(12345);
+  for (i = n - 1; i > 0; i--) {
+    long j = rand() % (i + 1);
+    long t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  for (i = 0; i < n; i++) {
+    nodes[order[i]].next = &nodes[order[(i + 1) % n]];
+    nodes[order[i]].value = i;
+  }
+
+  /* Chase the pointers. */
+  p = &nodes[order[0]];
+  for (i = 0; i < steps; i++) {
+    sum += p->value;
+    p = p->next;
+  }
+  printf("Checksum is %ld\n", sum);
+  free(order);
+  free(nodes);
+  return 0;
+}
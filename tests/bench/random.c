@@ -0,0 +1,35 @@
+/***********************************
+ * Benchmark: random access        *
+ * By Scott Pakin <pakin@lanl.gov> *
+ ***********************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Perform GUPS-style read-modify-write updates to random locations in a
+ * large table. */
+int main (int argc, char *argv[])
+{
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  long n = 1L<<22;
+  long updates = 4*n*scale;
+  uint64_t *table = malloc(n*sizeof(uint64_t));
+  uint64_t x = 88172645463325252ULL;
+  uint64_t sum = 0;
+  long i;
+
+  for (i = 0; i < n; i++)
+    table[i] = i;
+  for (i = 0; i < updates; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    table[x & (n - 1)] ^= x;
+  }
+  for (i = 0; i < n; i++)
+    sum += table[i];
+  printf("Checksum is %llu\n", (unsigned long long) sum);
+  free(table);
+  return 0;
+}
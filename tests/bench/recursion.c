@@ -0,0 +1,37 @@
+/***********************************
+ * Benchmark: deep recursion       *
+ * By Scott Pakin <pakin@lanl.gov> *
+ ***********************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Recurse deeply to stress per-function and call-stack tracking. */
+static long descend (long depth, long value)
+{
+  volatile long local[4];
+  local[depth & 3] = value;
+  if (depth == 0)
+    return local[0] + value;
+  return descend(depth - 1, value*3 + depth) + local[depth & 3];
+}
+
+/* Compute Fibonacci numbers the slow way to make many short calls. */
+static long fib (long n)
+{
+  return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+int main (int argc, char *argv[])
+{
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  long reps = 100*scale;
+  long sum = 0;
+  long r;
+
+  for (r = 0; r < reps; r++)
+    sum += descend(10000, r);
+  sum += fib(24 + (scale > 1 ? 2 : 0));
+  printf("Checksum is %ld\n", sum);
+  return 0;
+}
@@ -0,0 +1,38 @@
+/***********************************
+ * Benchmark: stencil computation  *
+ * By Scott Pakin <pakin@lanl.gov> *
+ ***********************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Perform Jacobi iterations of a 5-point stencil on a 2-D grid. */
+int main (int argc, char *argv[])
+{
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  long n = 1024;
+  long iters = 20*scale;
+  double *grid = calloc(n*n, sizeof(double));
+  double *next = calloc(n*n, sizeof(double));
+  double *tmp;
+  double sum = 0.0;
+  long i, j, t;
+
+  for (i = 0; i < n; i++)
+    grid[i] = grid[i*n] = 1.0;
+  for (t = 0; t < iters; t++) {
+    for (i = 1; i < n - 1; i++)
+      for (j = 1; j < n - 1; j++)
+        next[i*n + j] = 0.25*(grid[(i - 1)*n + j] + grid[(i + 1)*n + j] +
+                              grid[i*n + j - 1] + grid[i*n + j + 1]);
+    tmp = grid;
+    grid = next;
+    next = tmp;
+  }
+  for (i = 0; i < n*n; i++)
+    sum += grid[i];
+  printf("Checksum is %g\n", sum);
+  free(grid);
+  free(next);
+  return 0;
+}
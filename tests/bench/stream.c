@@ -0,0 +1,35 @@
+/***********************************
+ * Benchmark: streaming access     *
+ * By Scott Pakin <pakin@lanl.gov> *
+ ***********************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Perform STREAM-style triads over arrays too large to fit in cache. */
+int main (int argc, char *argv[])
+{
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  long n = 1L<<21;
+  long reps = 10*scale;
+  double *a = malloc(n*sizeof(double));
+  double *b = malloc(n*sizeof(double));
+  double *c = malloc(n*sizeof(double));
+  double sum = 0.0;
+  long i, r;
+
+  for (i = 0; i < n; i++) {
+    b[i] = (double) i;
+    c[i] = (double) (n - i);
+  }
+  for (r = 0; r < reps; r++)
+    for (i = 0; i < n; i++)
+      a[i] = b[i] + 3.0*c[i];
+  for (i = 0; i < n; i++)
+    sum += a[i];
+  printf("Checksum is %g\n", sum);
+  free(a);
+  free(b);
+  free(c);
+  return 0;
+}
@@ -0,0 +1,190 @@
+/**************************************************************
+ * Check that the run-time library analyzes a long address    *
+ * range the same as it analyzes the range's bytes one by one *
+ * By Scott Pakin <pakin@lanl.gov>                            *
+ **************************************************************/
+
+#include "byfl.h"
+#include <sys/wait.h>
+
+using namespace std;
+using namespace bytesflops;
+
+// Define the memory the test accesses.
+static const uint64_t region_base = 0x10000000;
+static const uint64_t region_size = 1<<20;
+
+// Generate a reproducible stream of pseudorandom numbers.
+class RandomStream {
+private:
+  uint64_t state;
+
+public:
+  RandomStream() : state(88172645463325252ULL) { }
+
+  uint64_t next (uint64_t range) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state % range;
+  }
+};
+
+// Access a range of addresses either all at once or a byte (a cache line
+// for the cache model) at a time.
+static void access_range (uint64_t baseaddr, uint64_t numaddrs, bool bulk)
+{
+  if (bulk) {
+    bf_assoc_addresses_with_prog(baseaddr, numaddrs);
+    bf_touch_cache(baseaddr, numaddrs);
+    bf_reuse_dist_addrs_prog(baseaddr, numaddrs);
+    return;
+  }
+  for (uint64_t ofs = 0; ofs < numaddrs; ofs++) {
+    bf_assoc_addresses_with_prog(baseaddr + ofs, 1);
+    bf_reuse_dist_addrs_prog(baseaddr + ofs, 1);
+  }
+  uint64_t endaddr = baseaddr + numaddrs;
+  for (uint64_t addr = baseaddr; addr < endaddr; ) {
+    uint64_t line_end = min((addr/bf_line_size + 1)*bf_line_size, endaddr);
+    bf_touch_cache(addr, line_end - addr);
+    addr = line_end;
+  }
+}
+
+// Append a set of cache hits to a summary of results.
+static void summarize_hits (vector<uint64_t>& summary,
+                            const vector<unordered_map<uint64_t,uint64_t> >& hits)
+{
+  for (size_t set_bits = 0; set_bits < hits.size(); set_bits++) {
+    map<uint64_t, uint64_t> sorted_hits(hits[set_bits].begin(), hits[set_bits].end());
+    for (auto iter = sorted_hits.begin(); iter != sorted_hits.end(); iter++) {
+      summary.push_back(set_bits);
+      summary.push_back(iter->first);
+      summary.push_back(iter->second);
+    }
+  }
+}
+
+// Perform a mix of small and large accesses, and return a summary of
+// the results.
+static vector<uint64_t> run_accesses (bool bulk)
+{
+  bf_initialize_if_necessary();
+  RandomStream rng;
+  for (int i = 0; i < 400; i++) {
+    uint64_t numaddrs;
+    switch (rng.next(4)) {
+      case 0:
+        numaddrs = rng.next(16) + 1;     // Scalar load or store
+        break;
+      case 1:
+        numaddrs = rng.next(512) + 1;    // A few cache lines
+        break;
+      case 2:
+        numaddrs = rng.next(8192) + 1;   // Up to a logical page
+        break;
+      default:
+        numaddrs = rng.next(65536) + 1;  // Several logical pages
+        break;
+    }
+    access_range(region_base + rng.next(region_size - numaddrs), numaddrs, bulk);
+  }
+
+  vector<uint64_t> summary;
+  summary.push_back(bf_tally_unique_addresses());
+  vector<uint64_t>* hist;
+  uint64_t unique_addrs;
+  bf_get_reuse_distance(&hist, &unique_addrs);
+  summary.push_back(unique_addrs);
+  summary.push_back(hist->size());
+  summary.insert(summary.end(), hist->begin(), hist->end());
+  summary.push_back(bf_get_private_cache_accesses());
+  summary.push_back(bf_get_private_cold_misses());
+  summarize_hits(summary, bf_get_private_cache_hits());
+  summary.push_back(bf_get_shared_cache_accesses());
+  summary.push_back(bf_get_shared_cold_misses());
+  summarize_hits(summary, bf_get_shared_cache_hits());
+  return summary;
+}
+
+// Run the accesses in a child process, which starts with pristine
+// run-time-library state, and return the child's summary of the results.
+static vector<uint64_t> run_in_child (bool bulk)
+{
+  int fds[2];
+  if (pipe(fds) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    // Child -- send the summary to the parent and exit without producing
+    // an end-of-program report.
+    close(fds[0]);
+    vector<uint64_t> summary = run_accesses(bulk);
+    uint64_t len = summary.size();
+    if (write(fds[1], &len, sizeof(len)) != sizeof(len) ||
+        write(fds[1], summary.data(), len*sizeof(uint64_t)) != ssize_t(len*sizeof(uint64_t)))
+      _exit(1);
+    _exit(0);
+  }
+
+  // Parent -- receive the summary from the child.
+  close(fds[1]);
+  FILE* child = fdopen(fds[0], "r");
+  uint64_t len = 0;
+  vector<uint64_t> summary;
+  if (fread(&len, sizeof(len), 1, child) == 1) {
+    summary.resize(len);
+    if (fread(summary.data(), sizeof(uint64_t), len, child) != len)
+      summary.clear();
+  }
+  fclose(child);
+  int status;
+  if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0
+      || summary.empty()) {
+    fprintf(stderr, "The %s child process failed\n", bulk ? "bulk" : "per-byte");
+    exit(1);
+  }
+  return summary;
+}
+
+int main (void)
+{
+  // Enable only unique bytes, the cache model, and reuse distance.  The
+  // remaining constants the bytesflops pass normally defines are linked in
+  // as zeroes and empty strings.
+  bf_option_string = "[bulk-range test]";
+  bf_bb_merge = 1;
+  bf_reuse_engine = BF_RD_ENGINE_SPLAY;
+  bf_reuse_sample_threshold = BF_REUSE_SAMPLE_MODULUS;
+  bf_unique_bytes = 1;
+  bf_cache_model = 1;
+  bf_line_size = 64;
+  bf_max_set_bits = 6;
+  bf_max_ways = 4;
+  bf_cache_policy = BF_CACHE_INCLUSIVE;
+
+  // Compare bulk and per-byte results with and without a maximum reuse
+  // distance.
+  int status = 0;
+  for (uint64_t max_dist : {~uint64_t(0), uint64_t(1000)}) {
+    bf_max_reuse_distance = max_dist;
+    vector<uint64_t> bulk = run_in_child(true);
+    vector<uint64_t> bytes = run_in_child(false);
+    bool match = bulk == bytes;
+    printf("Maximum reuse distance %-20" PRIu64 " %s (%zu values)\n",
+           max_dist, match ? "match" : "MISMATCH", bulk.size());
+    if (!match)
+      status = 1;
+  }
+
+  // Skip the run-time library's end-of-program report.
+  fflush(stdout);
+  _exit(status);
+}
@@ -0,0 +1,239 @@
+/************************************************
+ * Display live counters published by a running *
+ * Byfl-instrumented program                    *
+ * By Scott Pakin <pakin@lanl.gov>              *
+ ***********************************************/
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "bflive.h"
+
+using namespace std;
+
+// Define the name of the current executable.
+static string progname;
+
+// Abort the program.  This is expected to be used at the end of a
+// stream write.
+static ostream& die (ostream& os)
+{
+  os.flush();
+  exit(1);
+  return os;
+}
+
+// Output a usage message.
+static void show_usage (ostream& os)
+{
+  os << "Usage: " << progname << " [-d <seconds>] [-n <functions>] [-1] <pid>\n\n"
+     << "  -d <seconds>    Refresh the display every <seconds> seconds (default: 2)\n"
+     << "  -n <functions>  Show at most <functions> functions (default: 20)\n"
+     << "  -1              Output a single snapshot and exit\n";
+}
+
+// Copy a consistent snapshot of the segment, never blocking the writer.
+// Return false if the writer is updating the segment too frequently for us
+// to get a consistent copy.
+static bool read_segment (const bf_live_segment_t* shm, bf_live_segment_t& copy)
+{
+  for (int tries = 0; tries < 10000; tries++) {
+    uint64_t seq1 = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+    if ((seq1&1) != 0) {
+      // The writer is in the middle of an update.
+      sched_yield();
+      continue;
+    }
+    memcpy(&copy, shm, sizeof(bf_live_segment_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t seq2 = __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+    if (seq1 == seq2)
+      return true;
+  }
+  return false;
+}
+
+// Format a number with a metric suffix.
+static string metric (double value)
+{
+  static const char* suffixes[] = {"", "K", "M", "G", "T", "P", "E"};
+  size_t s = 0;
+  while (value >= 1000.0 && s < sizeof(suffixes)/sizeof(suffixes[0]) - 1) {
+    value /= 1000.0;
+    s++;
+  }
+  ostringstream oss;
+  oss << fixed << setprecision(s == 0 ? 0 : 1) << value << suffixes[s];
+  return oss.str();
+}
+
+// Format a ratio, or a dash if the denominator is zero.
+static string ratio (double num, double den)
+{
+  if (den == 0.0)
+    return "-";
+  ostringstream oss;
+  oss << fixed << setprecision(4) << num/den;
+  return oss.str();
+}
+
+// Output a snapshot of the counters.  Rates are computed relative to the
+// previous snapshot, if any.
+static void show_snapshot (ostream& os, const bf_live_segment_t& cur,
+                           const bf_live_segment_t* prev, size_t max_funcs)
+{
+  static const char* counter_names[BF_LIVE_NUM_COUNTERS] = {
+    "Basic blocks",
+    "Load operations",
+    "Store operations",
+    "Floating-point operations",
+    "Integer operations",
+    "Function-call operations",
+    "Bytes loaded",
+    "Bytes stored",
+    "Floating-point operation bits",
+    "Integer operation bits"
+  };
+
+  // Output a header.
+  double elapsed = double(cur.elapsed_ns)/1e9;
+  os << cur.program << " (PID " << cur.pid << "): "
+     << (cur.finished ? "finished" : "running") << " after "
+     << fixed << setprecision(1) << elapsed << " s, "
+     << cur.updates << " updates\n\n";
+
+  // Output the program totals and their rates of change.
+  double interval = 0.0;
+  if (prev != nullptr && cur.elapsed_ns > prev->elapsed_ns)
+    interval = double(cur.elapsed_ns - prev->elapsed_ns)/1e9;
+  os << left << setw(32) << "Counter" << right << setw(12) << "Total"
+     << setw(14) << "Per second" << '\n';
+  for (int c = 0; c < BF_LIVE_NUM_COUNTERS; c++) {
+    os << left << setw(32) << counter_names[c] << right << setw(12) << metric(double(cur.totals[c]));
+    if (interval > 0.0)
+      os << setw(14) << metric(double(cur.totals[c] - prev->totals[c])/interval);
+    os << '\n';
+  }
+  double bytes = double(cur.totals[BF_LIVE_LOADS] + cur.totals[BF_LIVE_STORES]);
+  double flops = double(cur.totals[BF_LIVE_FLOPS]);
+  os << '\n' << left << setw(32) << "Bytes per flop" << right << setw(12) << ratio(bytes, flops);
+  if (interval > 0.0) {
+    double dbytes = bytes - double(prev->totals[BF_LIVE_LOADS] + prev->totals[BF_LIVE_STORES]);
+    double dflops = flops - double(prev->totals[BF_LIVE_FLOPS]);
+    os << setw(14) << ratio(dbytes, dflops) << '\n'
+       << left << setw(32) << "Bandwidth (bytes/s)" << right << setw(12) << ""
+       << setw(14) << metric(dbytes/interval);
+  }
+  os << "\n\n";
+
+  // Output the functions with the most operations.
+  size_t num_funcs = min(size_t(cur.num_funcs), max_funcs);
+  if (num_funcs == 0)
+    return;
+  os << right << setw(12) << "Flops" << setw(12) << "Int ops"
+     << setw(12) << "Bytes" << setw(10) << "B/F" << "  " << "Function\n";
+  for (size_t f = 0; f < num_funcs; f++) {
+    const bf_live_func_t& func = cur.funcs[f];
+    double fbytes = double(func.counters[BF_LIVE_LOADS] + func.counters[BF_LIVE_STORES]);
+    double fflops = double(func.counters[BF_LIVE_FLOPS]);
+    os << right << setw(12) << metric(fflops)
+       << setw(12) << metric(double(func.counters[BF_LIVE_INT_OPS]))
+       << setw(12) << metric(fbytes)
+       << setw(10) << ratio(fbytes, fflops) << "  "
+       << func.name << '\n';
+  }
+}
+
+int main (int argc, char* argv[])
+{
+  // Parse the command line.
+  progname = argv[0];
+  size_t slash = progname.rfind('/');
+  if (slash != string::npos)
+    progname = progname.substr(slash + 1);
+  double delay = 2.0;
+  size_t max_funcs = 20;
+  bool once = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:n:1h")) != -1)
+    switch (opt) {
+      case 'd':
+        delay = atof(optarg);
+        if (delay <= 0.0)
+          cerr << progname << ": The refresh delay must be positive\n" << die;
+        break;
+      case 'n':
+        max_funcs = size_t(strtoul(optarg, nullptr, 10));
+        break;
+      case '1':
+        once = true;
+        break;
+      case 'h':
+        show_usage(cout);
+        exit(0);
+        break;
+      default:
+        show_usage(cerr);
+        exit(1);
+        break;
+    }
+  if (optind != argc - 1) {
+    show_usage(cerr);
+    exit(1);
+  }
+  char* end;
+  unsigned long pid = strtoul(argv[optind], &end, 10);
+  if (*end != '\0')
+    cerr << progname << ": Failed to parse \"" << argv[optind] << "\" as a process ID\n" << die;
+
+  // Map the program's segment read-only.
+  char shm_name[64];
+  sprintf(shm_name, BF_LIVE_SHM_FORMAT, pid);
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd == -1)
+    cerr << progname << ": Failed to open " << shm_name << " (" << strerror(errno)
+         << "); was process " << pid << " run with BF_LIVE set?\n" << die;
+  void* addr = mmap(nullptr, sizeof(bf_live_segment_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    cerr << progname << ": Failed to map " << shm_name << " (" << strerror(errno) << ")\n" << die;
+  const bf_live_segment_t* shm = (const bf_live_segment_t*) addr;
+  if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != BF_LIVE_MAGIC || shm->version != BF_LIVE_VERSION)
+    cerr << progname << ": " << shm_name << " is not a version "
+         << BF_LIVE_VERSION << " Byfl live-counter segment\n" << die;
+
+  // Repeatedly display the counters until the program finishes.
+  bool clear_screen = !once && isatty(STDOUT_FILENO);
+  bf_live_segment_t* cur = new bf_live_segment_t;
+  bf_live_segment_t* prev = nullptr;
+  while (true) {
+    if (!read_segment(shm, *cur))
+      cerr << progname << ": Failed to read a consistent snapshot from " << shm_name << '\n' << die;
+    if (clear_screen)
+      cout << "\033[H\033[2J";
+    show_snapshot(cout, *cur, prev, max_funcs);
+    cout.flush();
+    if (once || cur->finished)
+      break;
+    if (kill(pid_t(pid), 0) == -1 && errno == ESRCH) {
+      cout << "\nProcess " << pid << " exited without publishing its final counters\n";
+      break;
+    }
+    if (prev == nullptr)
+      prev = new bf_live_segment_t;
+    swap(cur, prev);
+    usleep(useconds_t(delay*1e6));
+  }
+  munmap(addr, sizeof(bf_live_segment_t));
+  return 0;
+}
@@ -0,0 +1,632 @@
+/***********************************************************
+ * Merge multiple Byfl binary output files (e.g., one per  *
+ * MPI rank) into a single Byfl binary output file         *
+ * By Scott Pakin <pakin@lanl.gov>                         *
+ ***********************************************************/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include "bfbin.h"
+#include "binarytagdefs.h"
+
+using namespace std;
+
+// Define the name of the current executable.
+string progname;
+
+// Abort the program.  This is expected to be used at the end of a
+// stream write.
+static ostream& die (ostream& os)
+{
+  os.flush();
+  exit(1);
+  return os;
+}
+
+// Define the set of integer columns that by default identify a row rather
+// than count something and therefore are matched rather than reduced.
+static const char* default_key_columns[] = {
+  "Line number",
+  "Basic block number",
+  "Beginning basic block number",
+  "Ending basic block number",
+  "Word size",
+  "Elements per vector",
+  "Bits per element",
+  "Capacity in bytes",
+  "Distance in bytes",
+  "Set size",
+  "LRU search distance",
+  "Thread",
+  "Capacity (bytes)",
+  "Associativity",
+  "Line size (bytes)",
+  "Sets",
+  nullptr
+};
+
+// Define a type for our command-line options.
+class Options {
+private:
+  void show_usage (ostream& os);
+
+public:
+  vector<string> infilenames;          // Names of the input files
+  string outfilename;                  // Name of the output file
+  unordered_set<string> key_columns;   // Integer columns to match instead of reduce
+  size_t num_threads;                  // Number of files to read concurrently
+  bool per_rank;                       // true=also output every input row, tagged with its rank
+
+  Options (int argc, char* argv[]);
+};
+
+// Output a usage string.
+void Options::show_usage (ostream& os)
+{
+  os << "Usage: " << progname
+     << " --output=<filename.byfl>"
+     << " [--key=<column_name>]"
+     << " [--threads=<number>]"
+     << " [--per-rank]"
+     << " <filename.byfl>...\n";
+}
+
+// Parse the command line into an Options.
+Options::Options (int argc, char* argv[])
+{
+  // Initialize the options.
+  outfilename = "";
+  for (size_t i = 0; default_key_columns[i] != nullptr; i++)
+    key_columns.emplace(default_key_columns[i]);
+  num_threads = thread::hardware_concurrency();
+  if (num_threads == 0)
+    num_threads = 1;
+  per_rank = false;
+
+  // Walk the command line and process each option we encounter.
+  static struct option cmd_line_options[] = {
+    { "help",     no_argument,       NULL, 'h' },
+    { "output",   required_argument, NULL, 'o' },
+    { "key",      required_argument, NULL, 'k' },
+    { "threads",  required_argument, NULL, 't' },
+    { "per-rank", no_argument,       NULL, 'p' },
+    { NULL,       0,                 NULL, 0 }
+  };
+  int opt_index = 0;
+  while (true) {
+    int c = getopt_long(argc, argv, "ho:k:t:p", cmd_line_options, &opt_index);
+    if (c == -1)
+      break;
+    switch (c) {
+      case 'h':
+        show_usage(cout);
+        exit(0);
+        break;
+
+      case 'o':
+        outfilename = string(optarg);
+        break;
+
+      case 'k':
+        key_columns.emplace(optarg);
+        break;
+
+      case 't':
+        {
+          char* endptr;
+          long n = strtol(optarg, &endptr, 10);
+          if (*endptr != '\0' || n < 1)
+            cerr << progname << ": --threads requires a positive integer\n" << die;
+          num_threads = size_t(n);
+        }
+        break;
+
+      case 'p':
+        per_rank = true;
+        break;
+
+      case 0:
+        cerr << progname << ": Internal error in " << __FILE__
+             << ", line " << __LINE__ << '\n' << die;
+        break;
+
+      default:
+        show_usage(cout);
+        exit(1);
+        break;
+    }
+  }
+
+  // Store the remaining arguments as input file names.
+  for (int i = optind; i < argc; i++)
+    infilenames.push_back(string(argv[i]));
+  if (infilenames.empty())
+    cerr << progname << ": The name of at least one Byfl binary file must be specified\n" << die;
+  if (outfilename == "")
+    cerr << progname << ": An output file must be specified with --output (-o)\n" << die;
+  if (num_threads > infilenames.size())
+    num_threads = infilenames.size();
+}
+
+// Represent a single datum of any type.
+struct Datum {
+  uint64_t ival;      // Integer or Boolean value
+  string sval;        // String value
+};
+
+// Describe what the merge does with a column.
+enum ColumnRole {
+  ROLE_KEY,           // Match rows on this column
+  ROLE_FIRST,         // Keep the first file's value (key:value tables only)
+  ROLE_REDUCE         // Compute the sum, minimum, and maximum across files
+};
+
+// Represent a column header.
+struct Column {
+  BINOUT_COL_T type;  // Data type
+  string name;        // Column name
+  ColumnRole role;    // What to do with the column's data
+
+  bool operator== (const Column& other) const {
+    return type == other.type && name == other.name;
+  }
+};
+
+// Represent one row of a merged table.
+struct MergedRow {
+  vector<Datum> values;       // Values of key and first-value columns (others are unused)
+  vector<uint64_t> sums;      // Sum of each column to reduce
+  vector<uint64_t> mins;      // Minimum of each column to reduce
+  vector<uint64_t> maxes;     // Maximum of each column to reduce
+  uint64_t num_rows;          // Number of input rows merged into this row
+};
+
+// Represent one row of an input table, tagged with its rank.
+struct RankRow {
+  size_t rank;                // Position of the file on the command line
+  vector<Datum> values;       // Value of every column
+};
+
+// Represent a table merged from one or more files.
+struct MergedTable {
+  string name;                               // Table name
+  bool keyval;                               // true=key:value table; false=basic table
+  vector<Column> columns;                    // Column headers
+  size_t num_reduced;                        // Number of columns with ROLE_REDUCE
+  unordered_map<string, size_t> row_index;   // Map from a row key to an index into rows
+  vector<MergedRow> rows;                    // Merged rows in order of first appearance
+  vector<RankRow> rank_rows;                 // Unmerged rows (if --per-rank was specified)
+};
+
+// Represent all of the tables merged from a set of files.
+struct MergedFiles {
+  vector<MergedTable> tables;                   // Tables in order of first appearance
+  unordered_map<string, size_t> table_index;    // Map from a table name to an index into tables
+};
+
+// Define the state needed while parsing a single file.
+struct FileState {
+  const Options* options;     // Command-line options
+  MergedFiles* merged;        // Tables into which to merge the file's contents
+  string filename;            // Name of the file being parsed
+  size_t rank;                // Position of the file on the command line
+  string tablename;           // Name of the current table
+  bool keyval;                // true=current table is a key:value table
+  vector<Column> columns;     // Column headers of the current table
+  MergedTable* table;         // Merged table corresponding to the current table
+};
+
+// Construct a hash key from a row's key columns.
+static string row_key (const vector<Column>& columns, const vector<Datum>& values)
+{
+  string key;
+  for (size_t i = 0; i < columns.size(); i++) {
+    if (columns[i].role != ROLE_KEY)
+      continue;
+    if (columns[i].type == BINOUT_COL_STRING) {
+      key += values[i].sval;
+      key += '\0';
+    }
+    else
+      key.append((const char*)&values[i].ival, sizeof(uint64_t));
+  }
+  return key;
+}
+
+// Find or create a merged table with a given name and columns.  Abort if
+// the columns don't match those seen previously.
+static MergedTable& find_table (MergedFiles& merged, const string& name, bool keyval,
+                                const vector<Column>& columns, const string& filename)
+{
+  auto iter = merged.table_index.find(name);
+  if (iter != merged.table_index.end()) {
+    MergedTable& table = merged.tables[iter->second];
+    if (table.keyval != keyval || table.columns != columns)
+      cerr << progname << ": Table \"" << name << "\" in " << filename
+           << " has different columns from the same table in other files\n" << die;
+    return table;
+  }
+  merged.table_index[name] = merged.tables.size();
+  merged.tables.push_back(MergedTable());
+  MergedTable& table = merged.tables.back();
+  table.name = name;
+  table.keyval = keyval;
+  table.columns = columns;
+  table.num_reduced = 0;
+  for (auto citer = columns.cbegin(); citer != columns.cend(); citer++)
+    if (citer->role == ROLE_REDUCE)
+      table.num_reduced++;
+  return table;
+}
+
+// Merge one row into a table.
+static void merge_row (MergedTable& table, MergedRow&& row)
+{
+  auto result = table.row_index.emplace(row_key(table.columns, row.values), table.rows.size());
+  if (result.second) {
+    table.rows.push_back(move(row));
+    return;
+  }
+  auto iter = result.first;
+  MergedRow& old_row = table.rows[iter->second];
+  for (size_t i = 0; i < table.num_reduced; i++) {
+    old_row.sums[i] += row.sums[i];
+    old_row.mins[i] = min(old_row.mins[i], row.mins[i]);
+    old_row.maxes[i] = max(old_row.maxes[i], row.maxes[i]);
+  }
+  old_row.num_rows += row.num_rows;
+}
+
+// Report a parse error and abort.
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void error_callback (void* state, const char* message)
+{
+  cerr << progname << ": " << message << endl << die;
+}
+
+// Begin a basic table.
+static void begin_basic_table (void* state, const char* tablename)
+{
+  FileState* fstate = (FileState*) state;
+  fstate->tablename = tablename;
+  fstate->keyval = false;
+  fstate->columns.clear();
+}
+
+// Begin a key:value table.
+static void begin_keyval_table (void* state, const char* tablename)
+{
+  FileState* fstate = (FileState*) state;
+  fstate->tablename = tablename;
+  fstate->keyval = true;
+  fstate->columns.clear();
+}
+
+// Store a column header.  Strings and Booleans are always keys in a basic
+// table.  Integers are keys only if named on the command line (or by
+// default).  In a key:value table, which contains only one row, nothing is
+// a key.
+static void add_column (FileState* fstate, BINOUT_COL_T type, const char* name)
+{
+  Column col;
+  col.type = type;
+  col.name = name;
+  if (type != BINOUT_COL_UINT64)
+    col.role = fstate->keyval ? ROLE_FIRST : ROLE_KEY;
+  else if (!fstate->keyval && fstate->options->key_columns.find(col.name) != fstate->options->key_columns.cend())
+    col.role = ROLE_KEY;
+  else
+    col.role = ROLE_REDUCE;
+  fstate->columns.push_back(col);
+}
+
+// Store an integer column header.
+static void uint64_column (void* state, const char* name)
+{
+  add_column((FileState*) state, BINOUT_COL_UINT64, name);
+}
+
+// Store a string column header.
+static void string_column (void* state, const char* name)
+{
+  add_column((FileState*) state, BINOUT_COL_STRING, name);
+}
+
+// Store a Boolean column header.
+static void bool_column (void* state, const char* name)
+{
+  add_column((FileState*) state, BINOUT_COL_BOOL, name);
+}
+
+// Find the merged table that corresponds to the current table.
+static void end_columns (void* state)
+{
+  FileState* fstate = (FileState*) state;
+  fstate->table = &find_table(*fstate->merged, fstate->tablename, fstate->keyval,
+                              fstate->columns, fstate->filename);
+}
+
+// Merge an entire row of data into the current table.
+static void merge_data_row (void* state, const bfbin_value_t* data, size_t num_data)
+{
+  FileState* fstate = (FileState*) state;
+  MergedTable& table = *fstate->table;
+  MergedRow row;
+  row.values.resize(num_data);
+  row.sums.reserve(table.num_reduced);
+  for (size_t i = 0; i < num_data; i++) {
+    const Column& col = table.columns[i];
+    Datum& datum = row.values[i];
+    switch (col.type) {
+      case BINOUT_COL_UINT64:
+        datum.ival = data[i].uint64_value;
+        break;
+
+      case BINOUT_COL_STRING:
+        datum.sval = data[i].string_value;
+        break;
+
+      case BINOUT_COL_BOOL:
+        datum.ival = data[i].bool_value;
+        break;
+
+      default:
+        cerr << progname << ": Internal error in " << __FILE__
+             << ", line " << __LINE__ << '\n' << die;
+        break;
+    }
+    if (col.role == ROLE_REDUCE)
+      row.sums.push_back(datum.ival);
+  }
+  row.mins = row.sums;
+  row.maxes = row.sums;
+  row.num_rows = 1;
+
+  // Retain the unmerged row if requested.
+  if (fstate->options->per_rank) {
+    RankRow rrow;
+    rrow.rank = fstate->rank;
+    rrow.values = row.values;
+    table.rank_rows.push_back(move(rrow));
+  }
+  merge_row(table, move(row));
+}
+
+// Merge a contiguous range of input files.  This function is the body of
+// each worker thread.
+static void merge_files (const Options* options, size_t first, size_t last,
+                         MergedFiles* merged)
+{
+  bfbin_callback_t callbacks;
+  memset(&callbacks, 0, sizeof(bfbin_callback_t));
+  callbacks.error_cb = error_callback;
+  callbacks.table_begin_basic_cb = begin_basic_table;
+  callbacks.table_begin_keyval_cb = begin_keyval_table;
+  callbacks.column_uint64_cb = uint64_column;
+  callbacks.column_string_cb = string_column;
+  callbacks.column_bool_cb = bool_column;
+  callbacks.column_end_cb = end_columns;
+  callbacks.row_data_cb = merge_data_row;
+  for (size_t i = first; i < last; i++) {
+    FileState fstate;
+    fstate.options = options;
+    fstate.merged = merged;
+    fstate.filename = options->infilenames[i];
+    fstate.rank = i;
+    fstate.keyval = false;
+    fstate.table = nullptr;
+    bf_process_byfl_file(fstate.filename.c_str(), &callbacks, &fstate, 0);
+  }
+}
+
+// Merge one set of merged tables into another.  The source tables must
+// come from files that follow the destination's files on the command line.
+static void merge_merged (MergedFiles& dest, MergedFiles& src, const string& src_name)
+{
+  for (auto titer = src.tables.begin(); titer != src.tables.end(); titer++) {
+    MergedTable& table = find_table(dest, titer->name, titer->keyval,
+                                    titer->columns, src_name);
+    for (auto riter = titer->rows.begin(); riter != titer->rows.end(); riter++)
+      merge_row(table, move(*riter));
+    table.rank_rows.insert(table.rank_rows.end(),
+                           make_move_iterator(titer->rank_rows.begin()),
+                           make_move_iterator(titer->rank_rows.end()));
+  }
+  src.tables.clear();
+  src.table_index.clear();
+}
+
+// Write data in Byfl's binary output format.
+class BinaryWriter {
+private:
+  ofstream outfile;      // Underlying output file
+
+public:
+  BinaryWriter (const string& filename) :
+    outfile(filename, ofstream::trunc|ofstream::binary)
+  {
+    if (!outfile.is_open())
+      cerr << progname << ": Failed to open " << filename << " for writing\n" << die;
+    outfile.write("BYFLBIN", 7);
+  }
+
+  // Write an 8-bit tag or Boolean.
+  BinaryWriter& operator<< (uint8_t val) {
+    outfile.put(char(val));
+    return *this;
+  }
+
+  // Write a big-endian 64-bit integer.
+  BinaryWriter& operator<< (uint64_t val) {
+    char bytes[8];
+    for (int i = 7; i >= 0; i--) {
+      bytes[i] = char(val & 0xFF);
+      val >>= 8;
+    }
+    outfile.write(bytes, 8);
+    return *this;
+  }
+
+  // Write a string as a big-endian 16-bit length followed by its
+  // characters.
+  BinaryWriter& operator<< (const string& str) {
+    size_t len = min(str.length(), size_t(0xFFFF));
+    outfile.put(char(len >> 8));
+    outfile.put(char(len & 0xFF));
+    outfile.write(str.data(), len);
+    return *this;
+  }
+
+  // Return true if all writes have succeeded.
+  bool good() { outfile.flush(); return outfile.good(); }
+};
+
+// Write a datum of a given type.
+static void write_datum (BinaryWriter& bfbin, BINOUT_COL_T type, const Datum& datum)
+{
+  switch (type) {
+    case BINOUT_COL_UINT64:
+      bfbin << datum.ival;
+      break;
+
+    case BINOUT_COL_STRING:
+      bfbin << datum.sval;
+      break;
+
+    case BINOUT_COL_BOOL:
+      bfbin << uint8_t(datum.ival);
+      break;
+
+    default:
+      cerr << progname << ": Internal error in " << __FILE__
+           << ", line " << __LINE__ << '\n' << die;
+      break;
+  }
+}
+
+// Write a merged table.  Each reduced column becomes a sum column (with
+// the original name), a minimum column, and a maximum column.  A final
+// column indicates how many input rows were merged into each row.
+static void write_merged_table (BinaryWriter& bfbin, const MergedTable& table)
+{
+  const uint64_t num_cols = table.columns.size();
+
+  // Write the table and column headers.  A key:value table, which
+  // interleaves headers with data, always has exactly one merged row.
+  bfbin << uint8_t(table.keyval ? BINOUT_TABLE_KEYVAL : BINOUT_TABLE_BASIC) << table.name;
+  if (table.keyval) {
+    const MergedRow& row = table.rows[0];
+    size_t r = 0;
+    for (size_t c = 0; c < num_cols; c++) {
+      const Column& col = table.columns[c];
+      if (col.role != ROLE_REDUCE) {
+        bfbin << uint8_t(col.type) << col.name;
+        write_datum(bfbin, col.type, row.values[c]);
+        continue;
+      }
+      bfbin << uint8_t(BINOUT_COL_UINT64) << col.name << row.sums[r]
+            << uint8_t(BINOUT_COL_UINT64) << col.name + " (min)" << row.mins[r]
+            << uint8_t(BINOUT_COL_UINT64) << col.name + " (max)" << row.maxes[r];
+      r++;
+    }
+    bfbin << uint8_t(BINOUT_COL_UINT64) << string("Merged rows") << row.num_rows
+          << uint8_t(BINOUT_COL_NONE);
+    return;
+  }
+  for (auto citer = table.columns.cbegin(); citer != table.columns.cend(); citer++)
+    if (citer->role == ROLE_REDUCE)
+      bfbin << uint8_t(BINOUT_COL_UINT64) << citer->name
+            << uint8_t(BINOUT_COL_UINT64) << citer->name + " (min)"
+            << uint8_t(BINOUT_COL_UINT64) << citer->name + " (max)";
+    else
+      bfbin << uint8_t(citer->type) << citer->name;
+  bfbin << uint8_t(BINOUT_COL_UINT64) << string("Merged rows")
+        << uint8_t(BINOUT_COL_NONE);
+
+  // Write each row.
+  for (auto riter = table.rows.cbegin(); riter != table.rows.cend(); riter++) {
+    bfbin << uint8_t(BINOUT_ROW_DATA);
+    size_t r = 0;
+    for (size_t c = 0; c < num_cols; c++) {
+      const Column& col = table.columns[c];
+      if (col.role == ROLE_REDUCE) {
+        bfbin << riter->sums[r] << riter->mins[r] << riter->maxes[r];
+        r++;
+      }
+      else
+        write_datum(bfbin, col.type, riter->values[c]);
+    }
+    bfbin << riter->num_rows;
+  }
+  bfbin << uint8_t(BINOUT_ROW_NONE);
+}
+
+// Write every unmerged row of a table, prefixed by the rank (position on
+// the command line) of the file it came from.
+static void write_rank_table (BinaryWriter& bfbin, const MergedTable& table)
+{
+  bfbin << uint8_t(BINOUT_TABLE_BASIC) << table.name + " (per rank)"
+        << uint8_t(BINOUT_COL_UINT64) << string("Rank");
+  for (auto citer = table.columns.cbegin(); citer != table.columns.cend(); citer++)
+    bfbin << uint8_t(citer->type) << citer->name;
+  bfbin << uint8_t(BINOUT_COL_NONE);
+  for (auto riter = table.rank_rows.cbegin(); riter != table.rank_rows.cend(); riter++) {
+    bfbin << uint8_t(BINOUT_ROW_DATA) << uint64_t(riter->rank);
+    for (size_t c = 0; c < table.columns.size(); c++)
+      write_datum(bfbin, table.columns[c].type, riter->values[c]);
+  }
+  bfbin << uint8_t(BINOUT_ROW_NONE);
+}
+
+int main (int argc, char *argv[])
+{
+  // Store the base filename of the current executable in progname.
+  progname = argv[0];
+  size_t slash_ofs = progname.rfind('/');
+  if (slash_ofs != string::npos)
+    progname.erase(0, slash_ofs + 1);
+
+  // Parse the command line.
+  Options options(argc, argv);
+
+  // Assign each thread a contiguous range of files so that merged rows
+  // appear in a deterministic order, and merge each range concurrently.
+  size_t num_files = options.infilenames.size();
+  vector<MergedFiles> partial(options.num_threads);
+  vector<thread> workers;
+  for (size_t t = 0; t < options.num_threads; t++)
+    workers.push_back(thread(merge_files, &options,
+                             t*num_files/options.num_threads,
+                             (t + 1)*num_files/options.num_threads,
+                             &partial[t]));
+  for (auto iter = workers.begin(); iter != workers.end(); iter++)
+    iter->join();
+
+  // Combine the per-thread results in file order.
+  for (size_t t = 1; t < options.num_threads; t++)
+    merge_merged(partial[0], partial[t],
+                 options.infilenames[t*num_files/options.num_threads]);
+
+  // Write the merged tables followed by the per-rank tables.
+  BinaryWriter bfbin(options.outfilename);
+  const MergedFiles& merged = partial[0];
+  for (auto iter = merged.tables.cbegin(); iter != merged.tables.cend(); iter++)
+    write_merged_table(bfbin, *iter);
+  if (options.per_rank)
+    for (auto iter = merged.tables.cbegin(); iter != merged.tables.cend(); iter++)
+      write_rank_table(bfbin, *iter);
+  bfbin << uint8_t(BINOUT_TABLE_NONE);
+  if (!bfbin.good())
+    cerr << progname << ": Failed to write " << options.outfilename << '\n' << die;
+  return 0;
+}
@@ -9,6 +9,15 @@
 #define _BFBIN_H_
 
 #include <inttypes.h>
+#include <stddef.h>
+
+/* Define a single datum in a row passed to row_data_cb.  The column's type
+ * determines which field is valid. */
+typedef union {
+  uint64_t uint64_value;      /* Unsigned 64-bit integer data */
+  const char *string_value;   /* String data */
+  uint8_t bool_value;         /* Boolean data (0 or 1) */
+} bfbin_value_t;
 
 /* Define a structure containing pointers to library callback functions. */
 typedef struct {
@@ -27,6 +36,8 @@ typedef struct {
   void (*data_string_cb)(void *user_data, const char *data);    /* String data */
   void (*data_bool_cb)(void *user_data, uint8_t data);          /* Boolean data (0 or 1) */
   void (*row_end_cb)(void *user_data);                          /* End of a row of data */
+  int (*table_filter_cb)(void *user_data, const char *name);    /* Return 0 to skip the named table */
+  void (*row_data_cb)(void *user_data, const bfbin_value_t *data, size_t num_data);  /* An entire row of data (replaces row_begin_cb through row_end_cb) */
 } bfbin_callback_t;
 
 /* Declare the parsing function. */
@@ -14,6 +14,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include "bfbin.h"
+#include "callpaths.h"
 
 using namespace std;
 
@@ -29,63 +30,10 @@ ostream& die (ostream& os)
   return os;
 }
 
-// Define a column (name, type, and data) data type.
-class Column {
-public:
-  enum column_t {
-    UINT64_T,               // Unsigned 64-bit integer column
-    STRING_T,               // String column
-    BOOL_T                  // Boolean column
-  };
-  string name;              // Column name
-  size_t number;            // Column number
-  column_t type;            // Column data type
-  union {
-    vector<uint64_t>* uint64_data;   // Integer data
-    vector<string>* string_data;     // String data
-    vector<bool>* bool_data;         // Boolean data
-  };
-
-  // Create a column given its name, number, and data type.
-  Column(string n, size_t no, column_t t) : name(n), number(no), type(t) {
-    switch (t) {
-      case UINT64_T:
-        uint64_data = new vector<uint64_t>;
-        break;
-
-      case STRING_T:
-        string_data = new vector<string>;
-        break;
-
-      case BOOL_T:
-        bool_data = new vector<bool>;
-        break;
-
-      default:
-        cerr << "Internal error: Invalid column type\n" << die;
-        break;
-    }
-  }
-
-  // Append data to the column.
-  void push_back(uint64_t v) { uint64_data->push_back(v); }
-  void push_back(string v)   { string_data->push_back(v); }
-  void push_back(bool v)     { bool_data->push_back(v); }
-};
-
 // Define a type for our local parsing state.
 class LocalState {
 private:
-  Column* func_col;            // Column in table_data corresponding to function names
-  Column* file_col;            // Column in table_data corresponding to file names
-  Column* lineno_col;          // Column in table_data corresponding to line numbers
-  Column* invoke_col;          // Column in table_data corresponding to invocation counts
   unordered_map<string, string> short_evname;   // Mapping from long to short event names
-  unordered_map<string, int> func2id;   // Map from a function name to an ID
-  unordered_map<int, string> id2func;   // Map from an ID to a function name
-  unordered_map<string, int> fname2id;  // Map from a file name to an ID
-  unordered_map<int, string> id2fname;  // Map from an ID to a file name
-  unordered_map<int, int> funcid2fnameid;   // Map from a function ID to a file ID
 
 public:
   enum table_state_t {
@@ -95,41 +43,41 @@ public:
     IN_CMDLINE                 // We're currently in the Command Line table
   };
 
-  // Define a node in a trie of call paths (sequences of functions but not
-  // finer resolution than that).
-  class TrieNode {
-  private:
-    LocalState* lstate;        // Local state on which to operate
-
-  public:
-    string funcname;                             // Name of a function
-    string filename;                             // File that defines the function
-    uint64_t lineno;                             // Line number at which the function definition begins
-    unordered_map<string, TrieNode*> children;   // All functions it calls
-    vector<uint64_t> self_data;                  // Metric data for this node only
-    vector<uint64_t> path_data;                  // Metric data for this node and all its descendants
-    uint64_t invocations;                        // Number of times this node was encountered
-
-    // Construct a TrieNode given the local state it should refer to.
-    TrieNode(LocalState* ls) : lstate(ls), invocations(0) { }
-
-    // Insert a call path into a trie given its column and row in table_data.
-    void insert(size_t func_col, size_t row);
-
-    // Accumulate data from children into their parent.
-    void propagate_data_upwards();
+  // Define the data type of a column in the Functions table.
+  enum column_t {
+    UINT64_T,                  // Unsigned 64-bit integer column
+    STRING_T,                  // String column
+    BOOL_T                     // Boolean column
+  };
 
-    // Output a node and, recursively, all of its children.
-    void output_callgrind(ostream& of);
+  // Define the role each column of the Functions table plays.
+  enum column_role_t {
+    IGNORED_COL,               // Column we don't use
+    FUNC_COL,                  // Demangled function name or call stack
+    FILE_COL,                  // File name
+    LINENO_COL,                // Line number
+    METRIC_COL                 // Integer-valued event
   };
 
   string infilename;           // Name of the input file
   string outfilename;          // Name of the output file
   ostream* outfile;            // Output file stream
   table_state_t table_state;   // Whether we're processing the current table or not
-  vector<Column*> table_data;  // All columns, all rows of data
+  vector<string> col_names;    // Name of each column in the Functions table
+  vector<column_t> col_types;  // Data type of each column in the Functions table
+  vector<column_role_t> col_roles;  // Role of each column in the Functions table
+  vector<string> metric_names; // Name of each METRIC_COL column
+  size_t invoke_metric;        // Index into metric_names of the invocation count
   size_t current_col;          // Current column number
-  TrieNode* call_forest;       // All function call paths with pointers to data
+  CallPathRow* current_row;    // Row of the Functions table currently being read
+  StringPool funcs;            // All function names
+  StringPool files;            // All file names
+  vector<uint32_t> func2id;    // Map from an interned leaf function to an ID (0=not a leaf)
+  vector<uint32_t> id2func;    // Map from an ID to an interned leaf function
+  vector<uint32_t> funcid2fnameid;  // Map from a function ID to a file ID
+  vector<CallPathRow*> rows;   // All rows of the Functions table
+  CallForest* call_forest;     // All function call paths with pointers to data
+  vector<uint64_t> summary;    // Total of each metric across all call paths
   bool have_func_table;        // true=seen Functions table
   bool have_sysinfo_table;     // true=seen System Information table
   bool have_cmdline_table;     // true=seen Command Line table
@@ -140,104 +88,14 @@ public:
   LocalState(int argc, char* argv[]);
   ~LocalState();
   string short_event_name(string longname);
+  void assign_column_roles();
+  void finish_row();
   void finalize();
+  void propagate_data_upwards(CallPathNode* node);
+  void output_callgrind(ostream& of, const CallPathNode* node);
   void output_callgrind();
 };
 
-// Insert a call path into a trie given its column and row in table_data.
-void LocalState::TrieNode::insert (size_t col, size_t row)
-{
-  // Split the call path into a vector of strings.
-  vector<string> call_path;
-  string& call_path_str = (*lstate->table_data[col]->string_data)[row];
-  const string sep(" # ");
-  size_t pos0, pos1;
-  for (pos0 = 0, pos1 = call_path_str.find(sep);
-       pos1 != string::npos;
-       pos0 = pos1 + sep.size(), pos1 = call_path_str.find(sep, pos0 + 1))
-    call_path.push_back(call_path_str.substr(pos0, pos1 - pos0));
-  call_path.push_back(call_path_str.substr(pos0, pos1 - pos0));
-
-  // Insert the call path into the trie.
-  TrieNode* node = lstate->call_forest;
-  if (node == nullptr)
-    node = new TrieNode(lstate);
-  for (int idx = call_path.size() - 1; idx >= 0; idx--) {
-    auto niter = node->children.find(call_path[idx]);
-    if (niter == node->children.end())
-      node = node->children[call_path[idx]] = new TrieNode(lstate);
-    else
-      node = niter->second;
-  }
-
-  // Copy all column data from the given row into the leaf node.
-  for (auto citer = lstate->table_data.begin(); citer != lstate->table_data.end(); citer++) {
-    // Include only integer columns (except line numbers).
-    Column* column = *citer;
-    if (column->type != Column::UINT64_T)
-      continue;
-    string cname(column->name);
-    if (cname == "Line number" || cname == "Leaf line number")
-      continue;
-    node->self_data.push_back((*column->uint64_data)[row]);
-    node->path_data.push_back((*column->uint64_data)[row]);
-    node->funcname = (*lstate->func_col->string_data)[row];
-    node->funcname = node->funcname.substr(0, node->funcname.find(" # "));
-    node->filename = (*lstate->file_col->string_data)[row];
-    node->lineno = (*lstate->lineno_col->uint64_data)[row];
-    node->invocations = (*lstate->invoke_col->uint64_data)[row];
-  }
-}
-
-// Accumulate data from children into their parent.
-void LocalState::TrieNode::propagate_data_upwards (void)
-{
-  for (auto citer = children.begin(); citer != children.end(); citer++) {
-    TrieNode* child = citer->second;
-    child->propagate_data_upwards();
-    for (size_t i = 0; i < self_data.size(); i++)
-      path_data[i] += child->path_data[i];
-    invocations += child->invocations;
-  }
-}
-
-// Output a node and, recursively, all of its children.
-void LocalState::TrieNode::output_callgrind (ostream& of)
-{
-  // Output our exclusive data.
-  int file_id = lstate->fname2id[filename];
-  int func_id = lstate->func2id[funcname];
-  of << "fl=(" << file_id << ")\n"
-     << "fn=(" << func_id << ")\n"
-     << lineno;
-  for (auto diter = self_data.begin(); diter != self_data.end(); diter++)
-    of << ' ' << *diter;
-  of << '\n';
-
-  // Output our immediate children's data.
-  for (auto citer = children.begin(); citer != children.end(); citer++) {
-    TrieNode* child = citer->second;
-    int cfile_id = lstate->fname2id[child->filename];
-    int cfunc_id = lstate->func2id[child->funcname];
-    if (cfile_id != file_id)
-      of << "cfl=(" << cfile_id << ")\n"
-         << "cfn=(" << cfunc_id << ")\n";
-    else
-      if (cfunc_id != func_id)
-        of << "cfn=(" << cfunc_id << ")\n";
-    of << "calls=" << child->invocations << ' ' << child->lineno << '\n'
-       << lineno;
-    for (auto diter = child->path_data.begin(); diter != child->path_data.end(); diter++)
-      of << ' ' << *diter;
-    of << '\n';
-  }
-  of << '\n';
-
-  // Recursively output each of our children.
-  for (auto citer = children.begin(); citer != children.end(); citer++)
-    citer->second->output_callgrind(of);
-}
-
 // Parse the command line into a LocalState.
 LocalState::LocalState (int argc, char* argv[])
 {
@@ -245,8 +103,14 @@ LocalState::LocalState (int argc, char* argv[])
   infilename = "";
   outfilename = "";
   outfile = &cout;
+  table_state = UNINTERESTING;
+  current_row = nullptr;
+  call_forest = new CallForest;
   have_func_table = false;
   have_sysinfo_table = false;
+  have_cmdline_table = false;
+  id2func.push_back(0);
+  funcid2fnameid.push_back(0);
 
   // Read an input file name and optional output file name.
   switch (argc - 1) {
@@ -312,6 +176,7 @@ LocalState::LocalState (int argc, char* argv[])
 // Flush the output stream and close it if it's a file.
 LocalState::~LocalState()
 {
+  delete call_forest;
   if (outfilename != "")
     delete outfile;
   else
@@ -337,108 +202,160 @@ string LocalState::short_event_name (string longname)
   return shortname;
 }
 
-// Construct various tables in preparation for output.
-void LocalState::finalize (void)
+// Once we've seen all of the Functions table's column headers, determine
+// which columns we need.
+void LocalState::assign_column_roles (void)
 {
   // Find the line-number column.
-  lineno_col = nullptr;
-  for (auto citer = table_data.begin(); citer != table_data.end(); citer++) {
-    Column* column = *citer;
-    string colname(column->name);
-    if (colname == "Line number" || colname == "Leaf line number")
-      lineno_col = column;
-  }
-  if (lineno_col == nullptr)
+  ssize_t lineno_col = -1;
+  for (size_t i = 0; i < col_names.size(); i++)
+    if (col_names[i] == "Line number" || col_names[i] == "Leaf line number")
+      lineno_col = i;
+  if (lineno_col == -1)
     cerr << progname << ": Failed to find a \"Line number\" or \"Leaf line number\" column in the \"Functions\" table_data\n" << die;
-  if (lineno_col->type != Column::UINT64_T)
+  if (col_types[lineno_col] != UINT64_T)
     cerr << progname << ": The \""
-         << lineno_col->name
+         << col_names[lineno_col]
          << "\" column does not contain integer data\n" << die;
 
   // Find the invocation-count column.
-  invoke_col = nullptr;
-  for (auto citer = table_data.begin(); citer != table_data.end(); citer++) {
-    Column* column = *citer;
-    string colname(column->name);
-    if (colname == "Invocations")
-      invoke_col = column;
-  }
-  if (invoke_col == nullptr)
+  ssize_t invoke_col = -1;
+  for (size_t i = 0; i < col_names.size(); i++)
+    if (col_names[i] == "Invocations")
+      invoke_col = i;
+  if (invoke_col == -1)
     cerr << progname << ": Failed to find an \"Invocations\" column in the \"Functions\" table_data\n" << die;
-  if (invoke_col->type != Column::UINT64_T)
+  if (col_types[invoke_col] != UINT64_T)
     cerr << progname << ": The \""
-         << invoke_col->name
+         << col_names[invoke_col]
          << "\" column does not contain integer data\n" << die;
 
-  // Construct a mapping from file name to ID and back.
-  size_t id = 1;
-  file_col = nullptr;
-  for (size_t i = 0; i < table_data.size(); i++)
-    if (table_data[i]->name == "File name" || table_data[i]->name == "Leaf file name") {
-      file_col = table_data[i];
+  // Find the file-name column.
+  ssize_t file_col = -1;
+  for (size_t i = 0; i < col_names.size(); i++)
+    if (col_names[i] == "File name" || col_names[i] == "Leaf file name") {
+      file_col = i;
       break;
     }
-  if (file_col == nullptr)
+  if (file_col == -1)
     cerr << progname << ": Failed to find a \"File name\" or \"Leaf file name\" column in the \"Functions\" table_data\n" << die;
-  if (file_col->type != Column::STRING_T)
+  if (col_types[file_col] != STRING_T)
     cerr << progname << ": The \""
-         << file_col->name
+         << col_names[file_col]
          << "\" column does not contain string data\n" << die;
-  for (auto riter = file_col->string_data->begin();
-       riter != file_col->string_data->end();
-       riter++) {
-    string fname = *riter;
-    if (fname2id.find(fname) != fname2id.end())
-      continue;
-    fname2id[fname] = id;
-    id2fname[id] = fname;
-    id++;
-  }
 
-  // Construct a mapping from demangled function name or demangled call stack
-  // to ID and back.
-  id = 1;
-  func_col = nullptr;
-  for (size_t i = 0; i < table_data.size(); i++)
-    if (table_data[i]->name == "Demangled function name" || table_data[i]->name == "Demangled call stack") {
-      func_col = table_data[i];
+  // Find the demangled function name or demangled call stack column.
+  ssize_t func_col = -1;
+  for (size_t i = 0; i < col_names.size(); i++)
+    if (col_names[i] == "Demangled function name" || col_names[i] == "Demangled call stack") {
+      func_col = i;
       break;
     }
-  if (func_col == nullptr)
+  if (func_col == -1)
     cerr << progname << ": Failed to find a \"Demangled function name\" or \"Demangled call stack\" column in the \"Functions\" table\n" << die;
-  if (func_col->type != Column::STRING_T)
+  if (col_types[func_col] != STRING_T)
     cerr << progname << ": The \""
-         << func_col->name
+         << col_names[func_col]
          << "\" column does not contain string data\n" << die;
-  size_t row = 0;
-  for (auto riter = func_col->string_data->begin();
-       riter != func_col->string_data->end();
-       riter++, row++) {
-    string func = *riter;
-    string func_only(func.substr(0, func.find(" # ")));
-    if (func2id.find(func_only) != func2id.end())
-      continue;
-    func2id[func_only] = id;
-    id2func[id] = func_only;
-    funcid2fnameid[id] = fname2id[(*file_col->string_data)[row]];
-    id++;
+
+  // Assign each column a role.  Integer columns other than line numbers
+  // are treated as metrics.
+  col_roles.resize(col_names.size(), IGNORED_COL);
+  for (size_t i = 0; i < col_names.size(); i++)
+    if (col_types[i] == UINT64_T &&
+        col_names[i] != "Line number" && col_names[i] != "Leaf line number") {
+      if (ssize_t(i) == invoke_col)
+        invoke_metric = metric_names.size();
+      col_roles[i] = METRIC_COL;
+      metric_names.push_back(col_names[i]);
+    }
+  col_roles[lineno_col] = LINENO_COL;
+  col_roles[file_col] = FILE_COL;
+  col_roles[func_col] = FUNC_COL;
+}
+
+// Number each leaf function and file in order of appearance then hand the
+// current row to the worker threads.
+void LocalState::finish_row (void)
+{
+  CallPathRow* row = current_row;
+  uint32_t leaf = row->path[0];
+  if (leaf >= func2id.size())
+    func2id.resize(funcs.size(), 0);
+  if (func2id[leaf] == 0) {
+    func2id[leaf] = uint32_t(id2func.size());
+    id2func.push_back(leaf);
+    funcid2fnameid.push_back(row->file + 1);
+  }
+  rows.push_back(row);
+  call_forest->insert(row);
+  current_row = nullptr;
+}
+
+// Accumulate data from children, which must already have accumulated
+// data from their own children, into their parent.
+void LocalState::propagate_data_upwards (CallPathNode* node)
+{
+  if (node->row == nullptr)
+    node->path_data.resize(metric_names.size(), 0);
+  else
+    node->path_data = node->row->metrics;
+  for (auto citer = node->children.begin(); citer != node->children.end(); citer++) {
+    CallPathNode* child = citer->second;
+    for (size_t i = 0; i < node->path_data.size(); i++)
+      node->path_data[i] += child->path_data[i];
   }
+}
+
+// Compute inclusive metrics for every call path.
+void LocalState::finalize (void)
+{
+  call_forest->finish();
+  call_forest->for_each_node([this] (CallPathNode* node) {
+      propagate_data_upwards(node);
+    });
+  summary.resize(metric_names.size(), 0);
+  for (auto riter = call_forest->roots.begin(); riter != call_forest->roots.end(); riter++)
+    for (size_t i = 0; i < summary.size(); i++)
+      summary[i] += (*riter)->path_data[i];
+}
+
+// Output a node and its immediate children.
+void LocalState::output_callgrind (ostream& of, const CallPathNode* node)
+{
+  // Output our exclusive data.
+  const CallPathRow* row = node->row;
+  uint32_t file_id = row == nullptr ? 0 : row->file + 1;
+  uint32_t func_id = row == nullptr ? 0 : func2id[row->path[0]];
+  uint64_t lineno = row == nullptr ? 0 : row->lineno;
+  of << "fl=(" << file_id << ")\n"
+     << "fn=(" << func_id << ")\n"
+     << lineno;
+  if (row != nullptr)
+    for (auto diter = row->metrics.begin(); diter != row->metrics.end(); diter++)
+      of << ' ' << *diter;
+  of << '\n';
 
-  // Insert each call path into a trie forest.  Compute inclusive and exclude
-  // metrics.
-  size_t func_col_num = func_col->number;
-  size_t nrows = func_col->string_data->size();
-  call_forest = new LocalState::TrieNode(this);
-  for (size_t r = 0; r < nrows; r++)
-    call_forest->insert(func_col_num, r);
-  auto citer = call_forest->children.begin();
-  if (citer != call_forest->children.end()) {
-    // Initialize the root to have all-zero data.
-    TrieNode* child = citer->second;
-    call_forest->self_data.resize(child->self_data.size(), 0);
-    call_forest->path_data.resize(child->path_data.size(), 0);
+  // Output our immediate children's data.
+  for (auto citer = node->children.begin(); citer != node->children.end(); citer++) {
+    CallPathNode* child = citer->second;
+    const CallPathRow* crow = child->row;
+    uint32_t cfile_id = crow == nullptr ? 0 : crow->file + 1;
+    uint32_t cfunc_id = crow == nullptr ? 0 : func2id[crow->path[0]];
+    if (cfile_id != file_id)
+      of << "cfl=(" << cfile_id << ")\n"
+         << "cfn=(" << cfunc_id << ")\n";
+    else
+      if (cfunc_id != func_id)
+        of << "cfn=(" << cfunc_id << ")\n";
+    of << "calls=" << child->path_data[invoke_metric] << ' '
+       << (crow == nullptr ? 0 : crow->lineno) << '\n'
+       << lineno;
+    for (auto diter = child->path_data.begin(); diter != child->path_data.end(); diter++)
+      of << ' ' << *diter;
+    of << '\n';
   }
-  call_forest->propagate_data_upwards();
+  of << '\n';
 }
 
 // Output our table in Callgrind Profile Format, version 1.
@@ -460,14 +377,8 @@ void LocalState::output_callgrind (void)
   // Output all event definitions (table columns).
   of << "# Define all of the events represented in the .byfl file.\n";
   vector<string> all_short_events;
-  for (auto citer = table_data.begin(); citer != table_data.end(); citer++) {
-    // Include only integer columns (except line numbers).
-    Column* column = *citer;
-    if (column->type != Column::UINT64_T)
-      continue;
-    string cname(column->name);
-    if (cname == "Line number" || cname == "Leaf line number")
-      continue;
+  for (auto citer = metric_names.begin(); citer != metric_names.end(); citer++) {
+    const string& cname = *citer;
     string sh_event(short_event_name(cname));
     all_short_events.push_back(sh_event);
     of << "event: " << sh_event << " : " << cname << '\n';
@@ -488,9 +399,7 @@ void LocalState::output_callgrind (void)
   // Report the totals of each event counter.
   of << "# Precompute each event's total across all positions.\n"
      << "summary:";
-  for (auto eviter = call_forest->path_data.begin();
-       eviter != call_forest->path_data.end();
-       eviter++)
+  for (auto eviter = summary.begin(); eviter != summary.end(); eviter++)
     of << ' ' << *eviter;
   of << "\n\n";
 
@@ -502,8 +411,8 @@ void LocalState::output_callgrind (void)
 
   // Output a mapping from file name to ID.
   of << "# Associate a small integer with each file name.\n";
-  for (size_t id = 1; id <= id2fname.size(); id++) {
-    string fname = id2fname[id];
+  for (size_t id = 1; id <= files.size(); id++) {
+    const string& fname = files[id - 1];
     if (fname == "")
       of << "fl=(" << id << ") ???\n";
     else
@@ -515,8 +424,8 @@ void LocalState::output_callgrind (void)
   // to ID.
   of << "# Associate a small integer with each function name.\n";
   int prev_file_id = -1;
-  for (size_t id = 1; id <= id2func.size(); id++) {
-    string func = id2func[id];
+  for (size_t id = 1; id < id2func.size(); id++) {
+    const string& func = funcs[id2func[id]];
     int file_id = funcid2fnameid[id];
     if (file_id != prev_file_id) {
       of << "fl=(" << file_id << ")\n";
@@ -528,10 +437,9 @@ void LocalState::output_callgrind (void)
 
   // Output all call paths.
   of << "# List event values for each function on each call path.\n";
-  for (auto riter = call_forest->children.begin();
-       riter != call_forest->children.end();
-       riter++)
-    riter->second->output_callgrind(of);
+  call_forest->output_in_order(of, [this] (ostream& os, const CallPathNode* node, size_t, size_t) {
+      output_callgrind(os, node);
+    });
 }
 
 // Report a parse error and abort.
@@ -565,7 +473,8 @@ static void store_uint64_header (void* state, const char* colname)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data.push_back(new Column(colname, lstate->table_data.size(), Column::UINT64_T));
+  lstate->col_names.push_back(colname);
+  lstate->col_types.push_back(LocalState::UINT64_T);
 }
 
 // Store the name and data type of a string-typed column.
@@ -574,7 +483,8 @@ static void store_string_header (void* state, const char* colname)
   LocalState* lstate = (LocalState*) state;
   switch (lstate->table_state) {
     case LocalState::IN_FUNCS:
-      lstate->table_data.push_back(new Column(colname, lstate->table_data.size(), Column::STRING_T));
+      lstate->col_names.push_back(colname);
+      lstate->col_types.push_back(LocalState::STRING_T);
       break;
 
     case LocalState::IN_SYSINFO:
@@ -592,7 +502,17 @@ static void store_boolean_header (void* state, const char* colname)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data.push_back(new Column(colname, lstate->table_data.size(), Column::BOOL_T));
+  lstate->col_names.push_back(colname);
+  lstate->col_types.push_back(LocalState::BOOL_T);
+}
+
+// Determine which Functions-table columns we need once we've seen them all.
+static void end_column_headers (void* state)
+{
+  LocalState* lstate = (LocalState*) state;
+  if (lstate->table_state != LocalState::IN_FUNCS)
+    return;
+  lstate->assign_column_roles();
 }
 
 // Reset the column counter at the beginning of each row.
@@ -604,6 +524,10 @@ static void begin_data_row (void* state)
       lstate->table_state != LocalState::IN_CMDLINE)
     return;
   lstate->current_col = 0;
+  if (lstate->table_state == LocalState::IN_FUNCS) {
+    lstate->current_row = new CallPathRow;
+    lstate->current_row->metrics.reserve(lstate->metric_names.size());
+  }
 }
 
 // Store a 64-bit unsigned integer value in the current column.
@@ -612,7 +536,18 @@ static void store_uint64_value (void* state, uint64_t value)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data[lstate->current_col++]->push_back(value);
+  switch (lstate->col_roles[lstate->current_col++]) {
+    case LocalState::LINENO_COL:
+      lstate->current_row->lineno = value;
+      break;
+
+    case LocalState::METRIC_COL:
+      lstate->current_row->metrics.push_back(value);
+      break;
+
+    default:
+      break;
+  }
 }
 
 // Store a string value in the current column.
@@ -621,7 +556,18 @@ static void store_string_value (void* state, const char* value)
   LocalState* lstate = (LocalState*) state;
   switch (lstate->table_state) {
     case LocalState::IN_FUNCS:
-      lstate->table_data[lstate->current_col++]->push_back(string(value));
+      switch (lstate->col_roles[lstate->current_col++]) {
+        case LocalState::FUNC_COL:
+          intern_call_path(lstate->funcs, value, lstate->current_row->path);
+          break;
+
+        case LocalState::FILE_COL:
+          lstate->current_row->file = lstate->files.intern(value);
+          break;
+
+        default:
+          break;
+      }
       break;
 
     case LocalState::IN_SYSINFO:
@@ -643,7 +589,16 @@ static void store_bool_value (void* state, uint8_t value)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data[lstate->current_col++]->push_back(bool(value));
+  lstate->current_col++;
+}
+
+// Aggregate each row of the Functions table as soon as we've read it.
+static void end_data_row (void* state)
+{
+  LocalState* lstate = (LocalState*) state;
+  if (lstate->table_state != LocalState::IN_FUNCS)
+    return;
+  lstate->finish_row();
 }
 
 // Note that we finished processing the current table.
@@ -673,10 +628,12 @@ int main (int argc, char *argv[])
   callbacks.column_uint64_cb = store_uint64_header;
   callbacks.column_string_cb = store_string_header;
   callbacks.column_bool_cb = store_boolean_header;
+  callbacks.column_end_cb = end_column_headers;
   callbacks.row_begin_cb = begin_data_row;
   callbacks.data_uint64_cb = store_uint64_value;
   callbacks.data_string_cb = store_string_value;
   callbacks.data_bool_cb = store_bool_value;
+  callbacks.row_end_cb = end_data_row;
   callbacks.table_end_basic_cb = end_any_table;
   callbacks.table_end_keyval_cb = end_any_table;
 
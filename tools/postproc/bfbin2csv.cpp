@@ -297,6 +297,17 @@ static void error_callback (void* state, const char* message)
   cerr << progname << ": " << message << endl << die;
 }
 
+// Return 1 if a table should be output, 0 if it should be skipped.
+static int want_table (void* state, const char* tablename)
+{
+  LocalState* lstate = (LocalState*) state;
+  string name(tablename);
+
+  if (lstate->included_tables.size() > 0 && lstate->included_tables.find(name) == lstate->included_tables.cend())
+    return 0;
+  return lstate->excluded_tables.find(name) == lstate->excluded_tables.cend();
+}
+
 // Begin outputting a table (either type).
 static void begin_any_table (void* state, const char* tablename)
 {
@@ -304,9 +315,7 @@ static void begin_any_table (void* state, const char* tablename)
   string name(tablename);
 
   // Determine if we should show or suppress the current table.
-  lstate->suppress_table =
-    (lstate->included_tables.size() > 0 && lstate->included_tables.find(name) == lstate->included_tables.cend())
-    || lstate->excluded_tables.find(name) != lstate->excluded_tables.cend();
+  lstate->suppress_table = !want_table(state, tablename);
   if (lstate->suppress_table)
     return;
 
@@ -478,6 +487,7 @@ int main (int argc, char *argv[])
   callbacks.data_string_cb = write_string_value;
   callbacks.data_bool_cb = write_bool_value;
   callbacks.row_end_cb = end_row;
+  callbacks.table_filter_cb = want_table;
 
   // Process the input file.
   bf_process_byfl_file(state.infilename.c_str(), &callbacks, &state, int(state.live_data));
@@ -6,8 +6,10 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <unordered_set>
 #include <H5Cpp.h>
 #include <string.h>
+#include <stdlib.h>
 #include "bfbin.h"
 
 using namespace H5;
@@ -25,29 +27,48 @@ typedef pair<string, byfl_datatype_t> column_info_t;
 
 // Define our local program state.
 typedef struct {
-  H5File hdf5file;               // HDF5 file to write to
+  Group* group;                  // HDF5 group in which to create datasets
   string table_name;             // Name of the current table
   vector<column_info_t> column_info;   // Information about each column
   CompType datatype;             // HDF5 compound datatype for the current table's lone column
+  size_t row_bytes;              // Number of bytes in one row of the above
   DataSet dataset;               // HDF5 dataset for the current table's data
+  bool have_dataset;             // true=dataset has been created; false=not yet
   hsize_t current_dims;          // Current dimensions of the HDF5 dataset (1-D)
-  vector<uint8_t> row_data;      // A single row's worth of data
+  hsize_t chunk_rows;            // Number of rows per HDF5 chunk in the current dataset
+  vector<uint8_t> row_data;      // Rows not yet written to the dataset
+  hsize_t buffered_rows;         // Number of rows in row_data
+  unordered_set<string> strings; // Every distinct string in the current table
 } program_state_t;
 
+// Enumerate the compression filters we know how to apply.
+typedef enum {
+  COMPRESS_NONE,
+  COMPRESS_DEFLATE
+} compression_t;
+
+// Define the options that control how datasets are laid out.
+typedef struct {
+  hsize_t chunk_rows;            // Rows per chunk (0=choose automatically)
+  hsize_t buffer_rows;           // Rows per write (0=one chunk's worth)
+  compression_t compression;     // Compression filter to apply to each chunk
+  int deflate_level;             // Compression level for COMPRESS_DEFLATE
+  bool shuffle;                  // true=shuffle bytes before compressing; false=don't
+} layout_options_t;
+layout_options_t layout = {0, 0, COMPRESS_DEFLATE, 9, false};
+
 // Store the name of the current executable.
 string progname;
 
-// Define a chunk size to use for our data (required for
-// unlimited-extent data).
-const hsize_t chunk_size = 1024;
+// When choosing a chunk size automatically, aim for chunks of
+// approximately this many bytes.  This matches the size of HDF5's
+// default per-dataset chunk cache.
+const size_t target_chunk_bytes = 1024*1024;
 
 // Define a variable-length string datatype and a boolean datatype.
 StrType strtype;
 EnumType booltype;
 
-// Define a single-row memory dataspace.
-DataSpace mem_dataspace;
-
 // Abort the program.  This is expected to be used at the end of a
 // stream write.
 ostream& die (ostream& os)
@@ -121,40 +142,60 @@ void construct_hdf5_datatype (program_state_t* s)
     }
   }
   s->datatype = datatype;
+  s->row_bytes = datatype_bytes;
 }
 
-// Free C strings that appear in raw row data.
-void free_c_strings (program_state_t* s)
+// Create a dataset for the current table.  We defer this until either
+// a full chunk of rows is buffered or the table ends so that we can cap
+// the chunk size at the table's row count.  Otherwise, a one-row table
+// would be given a ~1 MiB chunk.
+void create_dataset (program_state_t* s)
 {
-  uint8_t* rawptr = s->row_data.data();    // Pointer into the raw data
-  for (auto iter = s->column_info.cbegin();
-       iter != s->column_info.cend();
-       iter++) {
-    byfl_datatype_t coltype = iter->second;
-    switch (coltype) {
-      case BYFL_UINT64:
-        rawptr += sizeof(uint64_t);
-        break;
+  // Create a global dataspace.
+  hsize_t max_dims = H5S_UNLIMITED;
+  DataSpace global_dataspace(1, &s->current_dims, &max_dims);
 
-      case BYFL_STRING:
-        {
-          char* charptr = *(char**) rawptr;
-          free((void*) charptr);
-          rawptr += sizeof(char*);
-        }
-        break;
+  // Never make a chunk larger than the table.
+  if (s->chunk_rows > s->buffered_rows)
+    s->chunk_rows = s->buffered_rows;
+  if (s->chunk_rows == 0)
+    s->chunk_rows = 1;
 
-      case BYFL_BOOL:
-        rawptr += sizeof(uint8_t);
-        break;
+  // Enable chunking (required because of the H5S_UNLIMITED dimension)
+  // and whatever compression the user requested.
+  DSetCreatPropList proplist;
+  proplist.setChunk(1, &s->chunk_rows);
+  if (layout.shuffle)
+    proplist.setShuffle();
+  if (layout.compression == COMPRESS_DEFLATE)
+    proplist.setDeflate(layout.deflate_level);
+  s->dataset = s->group->createDataSet(s->table_name, s->datatype,
+                                       global_dataspace, proplist);
+  s->have_dataset = true;
+}
 
-      default:
-        cerr << progname << ": Internal error at "
-             << __FILE__ << ", line " << __LINE__ << endl
-             << die;
-        break;
-    }
-  }
+// Write all buffered rows to the end of the current dataset.
+void flush_rows (program_state_t* s)
+{
+  if (!s->have_dataset)
+    create_dataset(s);
+  if (s->buffered_rows == 0)
+    return;
+
+  // Extend the dataset to make room for the buffered rows.
+  hsize_t data_offset = s->current_dims;
+  s->current_dims += s->buffered_rows;
+  s->dataset.extend(&s->current_dims);
+
+  // Point the file dataspace to the newly added rows.
+  DataSpace file_dataspace = s->dataset.getSpace();
+  file_dataspace.selectHyperslab(H5S_SELECT_SET, &s->buffered_rows, &data_offset);
+
+  // Write the raw row data to the dataspace.
+  DataSpace mem_dataspace(1, &s->buffered_rows);
+  s->dataset.write(s->row_data.data(), s->datatype, mem_dataspace, file_dataspace);
+  s->row_data.clear();
+  s->buffered_rows = 0;
 }
 
 // Report a parse error and abort.
@@ -180,8 +221,8 @@ void add_column(void* state, const char* column_name)
   s->column_info.push_back(column_info_t(name, coltype));
 }
 
-// When the column header is complete, create a table with
-// appropriately typed columns and prepare to write data to it.
+// When the column header is complete, prepare to write data to a
+// table with appropriately typed columns.
 void end_column (void* state)
 {
   program_state_t* s = (program_state_t*)state;
@@ -189,53 +230,27 @@ void end_column (void* state)
   // Ignore empty tables.
   if (s->column_info.size() == 0)
     return;
-
-  // Create a global dataspace.
   s->current_dims = 0;
-  hsize_t max_dims = H5S_UNLIMITED;
-  DataSpace global_dataspace(1, &s->current_dims, &max_dims);
+  s->buffered_rows = 0;
+  s->have_dataset = false;
 
   // Define an HDF5 datatype based on the Byfl column header.
   construct_hdf5_datatype(s);
 
-  // Create a dataset.  Enable chunking (required because of the
-  // H5S_UNLIMITED dimension) and deflate compression (optional).
-  DSetCreatPropList proplist;
-  proplist.setChunk(1, &chunk_size);
-  proplist.setDeflate(9);    // Maximal compression
-  s->dataset = s->hdf5file.createDataSet(s->table_name, s->datatype,
-                                         global_dataspace, proplist);
-}
-
-// Push a 64-bit unsigned integer onto the current row.
-void write_uint64 (void* state, uint64_t value)
-{
-  program_state_t* s = (program_state_t*)state;
-  for (size_t i = 0; i < sizeof(uint64_t); i++) {
-    uint8_t onebyte = ((uint8_t*)&value)[i];
-    s->row_data.push_back(onebyte);
+  // Choose a chunk size.  Unless the user specified otherwise, aim
+  // for chunks of roughly target_chunk_bytes bytes so that partial
+  // reads decompress only a modest amount of unneeded data.
+  s->chunk_rows = layout.chunk_rows;
+  if (s->chunk_rows == 0) {
+    s->chunk_rows = target_chunk_bytes/s->row_bytes;
+    if (s->chunk_rows == 0)
+      s->chunk_rows = 1;
   }
 }
 
-// Push a pointer to a C string onto the current row.
-void write_string (void* state, const char *str)
-{
-  program_state_t* s = (program_state_t*)state;
-  const char* sptr = strdup(str);                 // String pointer
-  const uint8_t* sptrp = (const uint8_t*) &sptr;  // Address of the above, cast to an array of bytes
-  for (size_t i = 0; i < sizeof(uint8_t*); i++)
-    s->row_data.push_back(sptrp[i]);
-}
-
-// Push a Boolean value onto the current row as an 8-bit unsigned integer.
-void write_bool (void* state, uint8_t value)
-{
-  program_state_t* s = (program_state_t*)state;
-  s->row_data.push_back(value);
-}
-
-// At the end of row of data, write the data to the HDF5 file.
-void end_row (void* state)
+// Append a row of data to the row buffer.  Write the buffer to the
+// HDF5 file when it holds a full write's worth of rows.
+void write_row (void* state, const bfbin_value_t* data, size_t num_data)
 {
   program_state_t* s = (program_state_t*)state;
 
@@ -243,36 +258,65 @@ void end_row (void* state)
   if (s->column_info.size() == 0)
     return;
 
-  // Extend the dataset by one row.
-  s->current_dims++;
-  s->dataset.extend(&s->current_dims);
+  // Append each datum to the row buffer.  HDF5 expects a char* for
+  // each variable-length string so we store a pointer to a copy of
+  // the string that persists until the end of the table.
+  size_t ofs = s->row_data.size();
+  s->row_data.resize(ofs + s->row_bytes);
+  uint8_t* rawptr = s->row_data.data() + ofs;
+  for (size_t c = 0; c < num_data; c++)
+    switch (s->column_info[c].second) {
+      case BYFL_UINT64:
+        memcpy(rawptr, &data[c].uint64_value, sizeof(uint64_t));
+        rawptr += sizeof(uint64_t);
+        break;
 
-  // Create a file dataspace.
-  DataSpace file_dataspace = s->dataset.getSpace();
+      case BYFL_STRING:
+        {
+          const char* sptr = s->strings.insert(data[c].string_value).first->c_str();
+          memcpy(rawptr, &sptr, sizeof(char*));
+          rawptr += sizeof(char*);
+        }
+        break;
 
-  // Point the file dataspace to the last row of the dataset.
-  hsize_t data_offset = s->current_dims - 1;
-  hsize_t num_rows = 1;
-  file_dataspace.selectHyperslab(H5S_SELECT_SET, &num_rows, &data_offset);
+      case BYFL_BOOL:
+        *rawptr++ = data[c].bool_value;
+        break;
 
-  // Write the raw row data to the dataspace.
-  uint8_t* raw_row_data = s->row_data.data();
-  s->dataset.write(raw_row_data, s->datatype, mem_dataspace, file_dataspace);
+      default:
+        cerr << progname << ": Internal error at "
+             << __FILE__ << ", line " << __LINE__ << endl
+             << die;
+        break;
+    }
 
-  // Free the memory consumed by all of the C strings and by the row data.
-  free_c_strings(s);
-  s->row_data.clear();
+  // Write the rows once we have enough of them.  By default, we write
+  // one chunk at a time so that each chunk is compressed only once.
+  // The dataset does not exist until we know the table holds at least
+  // a full chunk, so we never flush before then.
+  s->buffered_rows++;
+  hsize_t buffer_rows = layout.buffer_rows == 0 ? s->chunk_rows : layout.buffer_rows;
+  if (!s->have_dataset && buffer_rows < s->chunk_rows)
+    buffer_rows = s->chunk_rows;
+  if (s->buffered_rows >= buffer_rows)
+    flush_rows(s);
 }
 
 // Clean up when we finish writing a table.
 void end_any_table (void* state)
 {
   program_state_t* s = (program_state_t*)state;
+  if (s->column_info.size() > 0) {
+    flush_rows(s);
+    s->dataset.close();
+  }
   s->column_info.clear();
+  s->strings.clear();
 }
 
-// Convert a Byfl binary output file to an HDF5 file.
-static void convert_byfl_to_hdf5 (string byflfilename, string hdf5filename)
+// Convert a Byfl binary output file to HDF5 datasets within a given
+// group.
+static void convert_byfl_to_hdf5 (string byflfilename, Group group)
 {
   // Register an error-handling callback.
   bfbin_callback_t callbacks;
@@ -287,29 +331,87 @@ static void convert_byfl_to_hdf5 (string byflfilename, string hdf5filename)
   callbacks.column_string_cb = add_column<BYFL_STRING>;
   callbacks.column_bool_cb = add_column<BYFL_BOOL>;
   callbacks.column_end_cb = end_column;
-  callbacks.data_uint64_cb = write_uint64;
-  callbacks.data_string_cb = write_string;
-  callbacks.data_bool_cb = write_bool;
-  callbacks.row_end_cb = end_row;
+  callbacks.row_data_cb = write_row;
   callbacks.table_end_basic_cb = end_any_table;
   callbacks.table_end_keyval_cb = end_any_table;
 
-  // Create the output file.
-  H5File hdf5file(hdf5filename, H5F_ACC_TRUNC);
-
   // Define our local state.
   program_state_t state;
-  state.hdf5file = hdf5file;
+  state.group = &group;
 
   // Convert a Byfl binary output file to an HDF5 file.  We currently assume
   // that the input file is complete, not being generated as we run.
   bf_process_byfl_file(byflfilename.c_str(), &callbacks, &state, 0);
 }
 
+// Output a usage message and exit.
+static void show_usage (ostream& os, int exit_code)
+{
+  os << "Usage: " << progname << " [<option>...] <input.byfl> [<output.h5>]\n"
+     << "       " << progname << " [<option>...] --output=<output.h5> <input.byfl>...\n"
+     << "Options: --chunk-rows=<number>\n"
+     << "         --buffer-rows=<number>\n"
+     << "         --compress={none|deflate[:<level>]}\n"
+     << "         --shuffle\n";
+  os.flush();
+  exit(exit_code);
+}
+
+// Parse a positive integer argument to a command-line option.
+static hsize_t parse_count (const string& option, const char* value)
+{
+  char* endptr;
+  unsigned long long count = strtoull(value, &endptr, 10);
+  if (*value == '\0' || *endptr != '\0' || count == 0)
+    cerr << progname << ": " << option << " requires a positive integer\n" << die;
+  return hsize_t(count);
+}
+
+// Parse the argument to --compress.
+static void parse_compression (const char* value)
+{
+  string method(value);
+  string level;
+  size_t colon_ofs = method.find(':');
+  if (colon_ofs != string::npos) {
+    level = method.substr(colon_ofs + 1);
+    method.erase(colon_ofs);
+  }
+  if (method == "none" && level == "") {
+    layout.compression = COMPRESS_NONE;
+    return;
+  }
+  if (method == "deflate") {
+    layout.compression = COMPRESS_DEFLATE;
+    if (level == "")
+      return;
+    if (level.length() == 1 && level[0] >= '0' && level[0] <= '9') {
+      layout.deflate_level = level[0] - '0';
+      return;
+    }
+    cerr << progname << ": The deflate level must be an integer from 0 to 9\n" << die;
+  }
+  cerr << progname << ": Unrecognized compression method \"" << value << "\"\n" << die;
+}
+
+// Return the base name of a file sans directory and extension.
+static string group_name (const string& filename)
+{
+  string name(filename);
+  size_t slash_ofs = name.rfind('/');
+  if (slash_ofs != string::npos)
+    name.erase(0, slash_ofs + 1);
+  size_t dot_ofs = name.rfind('.');
+  if (dot_ofs != string::npos && dot_ofs > 0)
+    name.erase(dot_ofs);
+  return name;
+}
+
 int main (int argc, const char *argv[])
 {
-  string byflfilename;      // Name of input file
-  string h5filename;        // Name of output file
+  vector<string> byflfilenames;   // Names of input files
+  string h5filename;              // Name of output file
+  bool combine = false;           // true=one group per input file; false=single input into the root group
 
   // Store the base filename of the current executable in progname.
   progname = argv[0];
@@ -318,13 +420,52 @@ int main (int argc, const char *argv[])
     progname.erase(0, slash_ofs + 1);
 
   // Parse the command line.
-  if (argc < 2 || argc > 3)
-    cerr << "Usage: " << progname << " <input.byfl> [<output.h5>]\n" << die;
-  byflfilename = argv[1];
-  if (argc > 2)
-    h5filename = argv[2];
-  else
-    h5filename = replace_extension(byflfilename, ".h5");
+  for (int i = 1; i < argc; i++) {
+    string arg(argv[i]);
+    if (arg.compare(0, 2, "--") != 0 || arg == "--") {
+      byflfilenames.push_back(arg);
+      continue;
+    }
+    string option(arg);
+    const char* value = nullptr;
+    size_t eq_ofs = arg.find('=');
+    if (eq_ofs != string::npos) {
+      option.erase(eq_ofs);
+      value = argv[i] + eq_ofs + 1;
+    }
+    if (option == "--help")
+      show_usage(cout, 0);
+    else if (option == "--shuffle" && value == nullptr)
+      layout.shuffle = true;
+    else if (value == nullptr)
+      show_usage(cerr, 1);
+    else if (option == "--chunk-rows")
+      layout.chunk_rows = parse_count(option, value);
+    else if (option == "--buffer-rows")
+      layout.buffer_rows = parse_count(option, value);
+    else if (option == "--compress")
+      parse_compression(value);
+    else if (option == "--output") {
+      h5filename = value;
+      combine = true;
+    }
+    else
+      show_usage(cerr, 1);
+  }
+  if (combine) {
+    if (byflfilenames.size() == 0)
+      show_usage(cerr, 1);
+  }
+  else {
+    if (byflfilenames.size() < 1 || byflfilenames.size() > 2)
+      show_usage(cerr, 1);
+    if (byflfilenames.size() > 1) {
+      h5filename = byflfilenames[1];
+      byflfilenames.pop_back();
+    }
+    else
+      h5filename = replace_extension(byflfilenames[0], ".h5");
+  }
 
   // Define a variable-length string datatype and a boolean datatype.
   strtype = StrType(PredType::C_S1, H5T_VARIABLE);
@@ -334,11 +475,21 @@ int main (int argc, const char *argv[])
   boolval = 1;
   booltype.insert("Yes", &boolval);
 
-  // Define a single-row memory dataspace.
-  hsize_t num_rows = 1;
-  mem_dataspace = DataSpace(1, &num_rows);
-
-  // Convert the file format.
-  convert_byfl_to_hdf5(byflfilename, h5filename);
+  // Convert the file format.  When combining files (typically one per
+  // MPI rank), put each file's tables in a group named after the file.
+  H5File hdf5file(h5filename, H5F_ACC_TRUNC);
+  if (combine) {
+    unordered_set<string> seen_groups;
+    for (auto iter = byflfilenames.cbegin(); iter != byflfilenames.cend(); iter++) {
+      string gname = group_name(*iter);
+      if (!seen_groups.insert(gname).second)
+        cerr << progname << ": Input files " << *iter
+             << " and another file both map to HDF5 group \"" << gname << "\"\n"
+             << die;
+      convert_byfl_to_hdf5(*iter, hdf5file.createGroup(gname));
+    }
+  }
+  else
+    convert_byfl_to_hdf5(byflfilenames[0], hdf5file.openGroup("/"));
   return 0;
 }
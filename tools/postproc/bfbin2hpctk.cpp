@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include "bfbin.h"
 #include "bfbin2hpctk.h"
+#include "callpaths.h"
 
 using namespace std;
 
@@ -30,49 +31,23 @@ ostream& die (ostream& os)
   return os;
 }
 
-// Define a column (name, type, and data) data type.
-class Column {
+// Hash a call path of interned function names.
+class PathHash {
 public:
-  enum column_t {
-    UINT64_T,               // Unsigned 64-bit integer column
-    STRING_T,               // String column
-    BOOL_T                  // Boolean column
-  };
-  string name;              // Column name
-  column_t type;            // Column data type
-  union {
-    vector<uint64_t>* uint64_data;   // Integer data
-    vector<string>* string_data;     // String data
-    vector<bool>* bool_data;         // Boolean data
-  };
-
-  // Create a column given its name and data type.
-  Column(string n, column_t t) {
-    name = n;
-    type = t;
-    switch (t) {
-      case UINT64_T:
-        uint64_data = new vector<uint64_t>;
-        break;
-
-      case STRING_T:
-        string_data = new vector<string>;
-        break;
-
-      case BOOL_T:
-        bool_data = new vector<bool>;
-        break;
-
-      default:
-        cerr << "Internal error: Invalid column type\n" << die;
-        break;
-    }
+  size_t operator() (const vector<uint32_t>* path) const {
+    size_t hash = 0;
+    for (auto piter = path->begin(); piter != path->end(); piter++)
+      hash = hash*31 + *piter;
+    return hash;
   }
+};
 
-  // Append data to the column.
-  void push_back(uint64_t v) { uint64_data->push_back(v); }
-  void push_back(string v)   { string_data->push_back(v); }
-  void push_back(bool v)     { bool_data->push_back(v); }
+// Compare two call paths of interned function names.
+class PathEqual {
+public:
+  bool operator() (const vector<uint32_t>* path1, const vector<uint32_t>* path2) const {
+    return *path1 == *path2;
+  }
 };
 
 // Define a type for our local parsing state.
@@ -84,111 +59,157 @@ public:
     POST_FUNCS                 // We already processed the Functions table
   };
 
-  // Define a node in a trie of call paths (sequences of functions but not
-  // finer resolution than that).
-  class TrieNode {
-  private:
-    LocalState* lstate;        // Local state on which to operate
-
-  public:
-    unordered_map<string, TrieNode*> children;   // All functions it calls
-    size_t row;                                  // Row in table_data representing the node if it's a leaf
-
-    // Construct a TrieNode given the local state it should refer to.
-    TrieNode(LocalState* ls) : lstate(ls), row(~0) { }
-
-    // Insert a call path into a trie given its column and row in table_data.
-    void insert(size_t func_col, size_t row);
+  // Define the data type of a column in the Functions table.
+  enum column_t {
+    UINT64_T,                  // Unsigned 64-bit integer column
+    STRING_T,                  // String column
+    BOOL_T                     // Boolean column
+  };
 
-    // Output a call path in XML format given an indentation level.
-    void output_xml(ostream& of, int level);
+  // Define the role each column of the Functions table plays.
+  enum column_role_t {
+    IGNORED_COL,               // Column we don't use
+    FUNC_COL,                  // Demangled function name or call stack
+    FILE_COL,                  // File name
+    LINENO_COL,                // Line number
+    METRIC_COL                 // Integer-valued metric
   };
 
   string infilename;           // Name of the input file
   string short_infilename;     // Shortened version of the above (base name, no extension)
   ostream* xmlfile;            // Handle to experiment.xml file
   table_state_t table_state;   // Whether we're processing the current table or not
-  vector<Column*> table_data;  // All columns, all rows of data
+  vector<string> col_names;    // Name of each column in the Functions table
+  vector<column_t> col_types;  // Data type of each column in the Functions table
+  vector<column_role_t> col_roles;  // Role of each column in the Functions table
+  vector<string> metric_names; // Name of each METRIC_COL column
   size_t current_col;          // Current column number
-  TrieNode* call_forest;       // All function call paths with pointers to data
+  CallPathRow* current_row;    // Row of the Functions table currently being read
+  StringPool funcs;            // All function names
+  StringPool files;            // All file names
+  vector<const vector<uint32_t>*> procedures;   // Each distinct call path, in order of appearance
+  unordered_map<const vector<uint32_t>*, uint32_t, PathHash, PathEqual> path2proc;  // Map from a call path to its index in procedures
+  CallForest* call_forest;     // All function call paths with pointers to data
   size_t id;                   // Unique ID for an arbitrary XML tag
   size_t loadmod_id;           // Unique ID for our one load module (executable)
-  unordered_map<string, int> func2id;   // Map from a function name to an ID
-  unordered_map<string, int> fname2id;  // Map from a file name to an ID
-  Column* func_col;            // Column in table_data corresponding to function names
-  Column* file_col;            // Column in table_data corresponding to file names
-  Column* lineno_col;          // Column in table_data corresponding to line numbers
+  size_t first_file_id;        // Unique ID of the first file
+  size_t first_proc_id;        // Unique ID of the first procedure
   string db_name;              // Name of the database (directory) to generate
 
   LocalState (int argc, char* argv[]);
   string quote_for_xml(const string& in_str);
+  void assign_column_roles();
+  void finish_row();
+  void output_xml_open(ostream& of, const CallPathNode* node, int level, size_t node_id);
+  void output_xml_close(ostream& of, int level);
   void create_database_dir();
   void copy_file(const string fname);
   void output_xml(ostream& of);
   void output_database();
 };
 
-// Insert a call path into a trie given its column and row in table_data.
-void LocalState::TrieNode::insert (size_t col, size_t row)
+// Once we've seen all of the Functions table's column headers, determine
+// which columns we need.
+void LocalState::assign_column_roles (void)
 {
-  // Split the call path into a vector of strings.
-  vector<string> call_path;
-  string& call_path_str = (*lstate->table_data[col]->string_data)[row];
-  const string sep(" # ");
-  size_t pos0, pos1;
-  for (pos0 = 0, pos1 = call_path_str.find(sep);
-       pos1 != string::npos;
-       pos0 = pos1 + sep.size(), pos1 = call_path_str.find(sep, pos0 + 1))
-    call_path.push_back(call_path_str.substr(pos0, pos1 - pos0));
-  call_path.push_back(call_path_str.substr(pos0, pos1 - pos0));
-
-  // Insert the call path into the trie.
-  TrieNode* node = lstate->call_forest;
-  if (node == nullptr)
-    node = new TrieNode(lstate);
-  for (int idx = call_path.size() - 1; idx >= 0; idx--) {
-    auto niter = node->children.find(call_path[idx]);
-    if (niter == node->children.end())
-      node = node->children[call_path[idx]] = new TrieNode(lstate);
-    else
-      node = niter->second;
+  // Find the line-number column.
+  ssize_t lineno_col = -1;
+  for (size_t i = 0; i < col_names.size(); i++)
+    if (col_names[i] == "Line number" || col_names[i] == "Leaf line number")
+      lineno_col = i;
+  if (lineno_col == -1)
+    cerr << progname << ": Failed to find a \"Line number\" or \"Leaf line number\" column in the \"Functions\" table\n" << die;
+  if (col_types[lineno_col] != UINT64_T)
+    cerr << progname << ": The \""
+         << col_names[lineno_col]
+         << "\" column does not contain integer data\n" << die;
+
+  // Find the file-name column.
+  ssize_t file_col = -1;
+  for (size_t i = 0; i < col_names.size(); i++)
+    if (col_names[i] == "File name" || col_names[i] == "Leaf file name") {
+      file_col = i;
+      break;
+    }
+  if (file_col == -1)
+    cerr << progname << ": Failed to find a \"File name\" or \"Leaf file name\" column in the \"Functions\" table\n" << die;
+  if (col_types[file_col] != STRING_T)
+    cerr << progname << ": The \""
+         << col_names[file_col]
+         << "\" column does not contain string data\n" << die;
+
+  // Find the demangled function name or demangled call stack column.
+  ssize_t func_col = -1;
+  for (size_t i = 0; i < col_names.size(); i++)
+    if (col_names[i] == "Demangled function name" || col_names[i] == "Demangled call stack") {
+      func_col = i;
+      break;
+    }
+  if (func_col == -1)
+    cerr << progname << ": Failed to find a \"Demangled function name\" or \"Demangled call stack\" column in the \"Functions\" table\n" << die;
+  if (col_types[func_col] != STRING_T)
+    cerr << progname << ": The \""
+         << col_names[func_col]
+         << "\" column does not contain string data\n" << die;
+
+  // Assign each column a role.  Integer columns other than line numbers
+  // are treated as metrics.
+  col_roles.resize(col_names.size(), IGNORED_COL);
+  for (size_t i = 0; i < col_names.size(); i++)
+    if (col_types[i] == UINT64_T &&
+        col_names[i] != "Line number" && col_names[i] != "Leaf line number") {
+      col_roles[i] = METRIC_COL;
+      metric_names.push_back(col_names[i]);
+    }
+  col_roles[lineno_col] = LINENO_COL;
+  col_roles[file_col] = FILE_COL;
+  col_roles[func_col] = FUNC_COL;
+}
+
+// Number each distinct call path in order of appearance then hand the
+// current row to the worker threads.
+void LocalState::finish_row (void)
+{
+  CallPathRow* row = current_row;
+  auto piter = path2proc.find(&row->path);
+  if (piter == path2proc.end()) {
+    row->ordinal = uint32_t(procedures.size());
+    path2proc[&row->path] = row->ordinal;
+    procedures.push_back(&row->path);
   }
-  node->row = row;
+  else
+    row->ordinal = piter->second;
+  call_forest->insert(row);
+  current_row = nullptr;
 }
 
-// Output a call path in XML format.
-void LocalState::TrieNode::output_xml (ostream& of, int level)
+// Begin outputting a call path in XML format given an indentation level
+// and the unique ID to assign the path.
+void LocalState::output_xml_open (ostream& of, const CallPathNode* node, int level, size_t node_id)
 {
   // Output the load-module ID, function ID, file ID, and line number.
+  const CallPathRow* row = node->row;
   for (int i = 0; i < level; i++)
     of << "  ";
-  of << "      <PF i=\"" << lstate->id++ << '"'
-     << " lm=\"" << lstate->loadmod_id << '"'
-     << " n=\"" << lstate->func2id[(*lstate->func_col->string_data)[row]] << '"'
-     << " f=\"" << lstate->fname2id[(*lstate->file_col->string_data)[row]] << '"'
-     << " l=\"" << (*lstate->lineno_col->uint64_data)[row] << "\">\n";
+  of << "      <PF i=\"" << node_id << '"'
+     << " lm=\"" << loadmod_id << '"'
+     << " n=\"" << (row == nullptr ? 0 : first_proc_id + row->ordinal) << '"'
+     << " f=\"" << (row == nullptr ? 0 : first_file_id + row->file) << '"'
+     << " l=\"" << (row == nullptr ? 0 : row->lineno) << "\">\n";
 
   // Output metrics for the node itself.
   int mid = 1;   // Metric ID (starts at 1; 0 is the ID for the entire profile)
-  for (auto citer = lstate->table_data.begin(); citer != lstate->table_data.end(); citer++) {
-    // Process only integer columns (except line numbers).
-    Column* column = *citer;
-    if (column->type != Column::UINT64_T)
-      continue;
-    string cname(column->name);
-    if (cname == "Line number" || cname == "Leaf line number")
-      continue;
-    for (int i = 0; i < level; i++)
-      of << "  ";
-    of << "        <M n=\"" << mid++ << "\" v=\""
-       << (*column->uint64_data)[row] << "\"/>\n";
-  }
-
-  // Output metrics for each of the node's children.
-  for (auto titer = children.begin(); titer != children.end(); titer++)
-    titer->second->output_xml(of, level + 1);
+  if (row != nullptr)
+    for (auto miter = row->metrics.begin(); miter != row->metrics.end(); miter++) {
+      for (int i = 0; i < level; i++)
+        of << "  ";
+      of << "        <M n=\"" << mid++ << "\" v=\"" << *miter << "\"/>\n";
+    }
+}
 
-  // Finish this node.
+// Finish outputting a call path in XML format given an indentation level.
+void LocalState::output_xml_close (ostream& of, int level)
+{
   for (int i = 0; i < level; i++)
     of << "  ";
   of << "      </PF>\n";
@@ -200,7 +221,8 @@ LocalState::LocalState(int argc, char* argv[])
   // Initialize the current state.
   infilename = "";
   table_state = PRE_FUNCS;
-  call_forest = nullptr;
+  current_row = nullptr;
+  call_forest = new CallForest;
 
   // Read an input file name and optional output file name.
   switch (argc - 1) {
@@ -275,23 +297,12 @@ void LocalState::output_xml (ostream& of)
      << "  <SecCallPathProfile i=\"" << id++ << "\" n=\"" << short_infilename << "\">\n"
      << "    <SecHeader>\n";
 
-  // Define each of our metrics (table columns).
-  vector<Column*>& table = table_data;
+  // Define each of our metrics (integer table columns except line numbers).
   of << "      <MetricTable>\n";
-  for (auto citer = table.begin(); citer != table.end(); citer++) {
-    // Include only integer columns (except line numbers).
-    Column* column = *citer;
-    if (column->type != Column::UINT64_T)
-      continue;
-    string cname(column->name);
-    if (cname == "Line number" || cname == "Leaf line number")
-      continue;
-
-    // Output the column name as a metric.
+  for (auto citer = metric_names.begin(); citer != metric_names.end(); citer++)
     of << "        <Metric i=\"" << id++ << "\" n=\""
-       << cname
+       << *citer
        << "\" v=\"raw\" t=\"exclusive\" show=\"1\" show-percent=\"0\" />\n";
-  }
   of << "      </MetricTable>\n";
 
   // Output an empty metric-database table.
@@ -309,42 +320,11 @@ void LocalState::output_xml (ostream& of)
      << load_module << "\"/>\n"
      << "      </LoadModuleTable>\n";
 
-  // Find the line-number column.
-  lineno_col = nullptr;
-  for (auto citer = table.begin(); citer != table.end(); citer++) {
-    Column* column = *citer;
-    string colname(column->name);
-    if (colname == "Line number" || colname == "Leaf line number")
-      lineno_col = column;
-  }
-  if (lineno_col == nullptr)
-    cerr << progname << ": Failed to find a \"Line number\" or \"Leaf line number\" column in the \"Functions\" table\n" << die;
-  if (lineno_col->type != Column::UINT64_T)
-    cerr << progname << ": The \""
-         << lineno_col->name
-         << "\" column does not contain integer data\n" << die;
-
-  // Construct a mapping from file name to ID.
-  file_col = nullptr;
-  for (size_t i = 0; i < table.size(); i++)
-    if (table[i]->name == "File name" || table[i]->name == "Leaf file name") {
-      file_col = table[i];
-      break;
-    }
-  if (file_col == nullptr)
-    cerr << progname << ": Failed to find a \"File name\" or \"Leaf file name\" column in the \"Functions\" table\n" << die;
-  if (file_col->type != Column::STRING_T)
-    cerr << progname << ": The \""
-         << file_col->name
-         << "\" column does not contain string data\n" << die;
+  // Output a mapping from file name to ID.
+  first_file_id = id;
   of << "      <FileTable>\n";
-  for (auto riter = file_col->string_data->begin();
-       riter != file_col->string_data->end();
-       riter++) {
-    string fname = *riter;
-    if (fname2id.find(fname) != fname2id.end())
-      continue;
-    fname2id[fname] = id;
+  for (size_t f = 0; f < files.size(); f++) {
+    const string& fname = files[f];
     if (fname == "")
       of << "        <File i=\"" << id << "\" n=\"~unknown-file~\"/>\n";
     else
@@ -354,48 +334,29 @@ void LocalState::output_xml (ostream& of)
   }
   of << "      </FileTable>\n";
 
-  // Construct a mapping from demangled function name or demangled call stack
+  // Output a mapping from demangled function name or demangled call stack
   // to ID.
-  size_t func_col_num = (size_t)(-1);
-  func_col = nullptr;
-  for (size_t i = 0; i < table.size(); i++)
-    if (table[i]->name == "Demangled function name" || table[i]->name == "Demangled call stack") {
-      func_col_num = i;
-      func_col = table[i];
-      break;
-    }
-  if (func_col == nullptr)
-    cerr << progname << ": Failed to find a \"Demangled function name\" or \"Demangled call stack\" column in the \"Functions\" table\n" << die;
-  if (func_col->type != Column::STRING_T)
-    cerr << progname << ": The \""
-         << func_col->name
-         << "\" column does not contain string data\n" << die;
+  first_proc_id = id;
   of << "      <ProcedureTable>\n";
-  for (auto riter = func_col->string_data->begin();
-       riter != func_col->string_data->end();
-       riter++) {
-    string func = *riter;
-    if (func2id.find(func) != func2id.end())
-      continue;
-    func2id[func] = id;
+  for (auto piter = procedures.begin(); piter != procedures.end(); piter++) {
     of << "        <Procedure i=\"" << id
-       << "\" n=\"" << quote_for_xml(func.substr(0, func.find(" # "))) << "\"/>\n";
+       << "\" n=\"" << quote_for_xml(funcs[(**piter)[0]]) << "\"/>\n";
     id++;
   }
   of << "      </ProcedureTable>\n"
      << "    </SecHeader>\n";
 
-  // Insert each call path into a trie forest then output the trie (except the
-  // root, which exists solely to store the forest).
-  size_t nrows = func_col->string_data->size();
-  call_forest = new LocalState::TrieNode(this);
-  for (size_t r = 0; r < nrows; r++)
-    call_forest->insert(func_col_num, r);
+  // Output the trie forest.  Each node's ID follows from its position in a
+  // preorder traversal of the forest.
+  size_t first_node_id = id;
   of << "    <SecCallPathProfileData>\n";
-  for (auto titer = call_forest->children.begin();
-       titer != call_forest->children.end();
-       titer++)
-    titer->second->output_xml(of, 0);
+  id += call_forest->output_in_order(of,
+    [this, first_node_id] (ostream& os, const CallPathNode* node, size_t depth, size_t n) {
+      output_xml_open(os, node, int(depth), first_node_id + n);
+    },
+    [this] (ostream& os, const CallPathNode*, size_t depth, size_t) {
+      output_xml_close(os, int(depth));
+    });
   of << "    </SecCallPathProfileData>\n";
 
   // Output the trailer boilerplate.
@@ -486,8 +447,8 @@ void LocalState::output_database (void)
          << " (" << strerror(errno) << ")\n" << die;
 
   // Copy all files referenced by experiment.xml into the database directory.
-  for (auto fiter = fname2id.begin(); fiter != fname2id.end(); fiter++) {
-    const string& fname = fiter->first;
+  for (size_t f = 0; f < files.size(); f++) {
+    const string& fname = files[f];
     if (fname != "")
       copy_file(fname);
   }
@@ -515,7 +476,8 @@ static void store_uint64_header (void* state, const char* colname)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data.push_back(new Column(colname, Column::UINT64_T));
+  lstate->col_names.push_back(colname);
+  lstate->col_types.push_back(LocalState::UINT64_T);
 }
 
 // Store the name and data type of a string-typed column.
@@ -524,7 +486,8 @@ static void store_string_header (void* state, const char* colname)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data.push_back(new Column(colname, Column::STRING_T));
+  lstate->col_names.push_back(colname);
+  lstate->col_types.push_back(LocalState::STRING_T);
 }
 
 // Store the name and data type of a Boolean-typed column.
@@ -533,7 +496,17 @@ static void store_boolean_header (void* state, const char* colname)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data.push_back(new Column(colname, Column::BOOL_T));
+  lstate->col_names.push_back(colname);
+  lstate->col_types.push_back(LocalState::BOOL_T);
+}
+
+// Determine which Functions-table columns we need once we've seen them all.
+static void end_column_headers (void* state)
+{
+  LocalState* lstate = (LocalState*) state;
+  if (lstate->table_state != LocalState::IN_FUNCS)
+    return;
+  lstate->assign_column_roles();
 }
 
 // Reset the column counter at the beginning of each row.
@@ -543,6 +516,8 @@ static void begin_data_row (void* state)
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
   lstate->current_col = 0;
+  lstate->current_row = new CallPathRow;
+  lstate->current_row->metrics.reserve(lstate->metric_names.size());
 }
 
 // Store a 64-bit unsigned integer value in the current column.
@@ -551,7 +526,18 @@ static void store_uint64_value (void* state, uint64_t value)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data[lstate->current_col++]->push_back(value);
+  switch (lstate->col_roles[lstate->current_col++]) {
+    case LocalState::LINENO_COL:
+      lstate->current_row->lineno = value;
+      break;
+
+    case LocalState::METRIC_COL:
+      lstate->current_row->metrics.push_back(value);
+      break;
+
+    default:
+      break;
+  }
 }
 
 // Store a string value in the current column.
@@ -560,7 +546,18 @@ static void store_string_value (void* state, const char* value)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data[lstate->current_col++]->push_back(string(value));
+  switch (lstate->col_roles[lstate->current_col++]) {
+    case LocalState::FUNC_COL:
+      intern_call_path(lstate->funcs, value, lstate->current_row->path);
+      break;
+
+    case LocalState::FILE_COL:
+      lstate->current_row->file = lstate->files.intern(value);
+      break;
+
+    default:
+      break;
+  }
 }
 
 // Store a Boolean value in the current column.
@@ -569,7 +566,16 @@ static void store_bool_value (void* state, uint8_t value)
   LocalState* lstate = (LocalState*) state;
   if (lstate->table_state != LocalState::IN_FUNCS)
     return;
-  lstate->table_data[lstate->current_col++]->push_back(bool(value));
+  lstate->current_col++;
+}
+
+// Aggregate each row of the Functions table as soon as we've read it.
+static void end_data_row (void* state)
+{
+  LocalState* lstate = (LocalState*) state;
+  if (lstate->table_state != LocalState::IN_FUNCS)
+    return;
+  lstate->finish_row();
 }
 
 // Determine what table we finished.  If it's the Functions table we do all of
@@ -583,6 +589,7 @@ static void end_any_table (void* state)
   lstate->table_state = LocalState::POST_FUNCS;
 
   // Output the table state as a database suitable for input by hpcviewer.
+  lstate->call_forest->finish();
   lstate->output_database();
 }
 
@@ -606,10 +613,12 @@ int main (int argc, char *argv[])
   callbacks.column_uint64_cb = store_uint64_header;
   callbacks.column_string_cb = store_string_header;
   callbacks.column_bool_cb = store_boolean_header;
+  callbacks.column_end_cb = end_column_headers;
   callbacks.row_begin_cb = begin_data_row;
   callbacks.data_uint64_cb = store_uint64_value;
   callbacks.data_string_cb = store_string_value;
   callbacks.data_bool_cb = store_bool_value;
+  callbacks.row_end_cb = end_data_row;
   callbacks.table_end_basic_cb = end_any_table;
   callbacks.table_end_keyval_cb = end_any_table;
 
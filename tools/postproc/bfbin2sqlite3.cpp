@@ -4,11 +4,13 @@
  **********************************************/
 
 #include <iostream>
+#include <vector>
 #include <sqlite3.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include "bfbin.h"
+#include "binarytagdefs.h"
 
 using namespace std;
 
@@ -39,11 +41,14 @@ public:
   string create_table;        // Current CREATE TABLE statement as text
   string insert_into;         // Current INSERT INTO statement as text
   sqlite3_stmt* insert_stmt;  // Compiled INSERT INTO statement template
-  size_t num_rows;            // Number of rows written to the current table
+  vector<BINOUT_COL_T> column_types;  // Data type of each column in the current table
+  bool empty_table;           // true=current table has no columns; false=at least one column
+  size_t num_rows;            // Number of rows written to the current transaction
   const size_t rows_per_transaction = 1000000;   // Maximum number of rows per transaction
   int column;                 // Current column number
   bool issued_overflow_warning;  // true=an integer already overflowed in the current table; false=not yet
   bool live_data;             // true=wait for more data to arrive; false=fail if data aren't available
+  bool fast;                  // true=trade crash safety for insertion speed; false=use SQLite's defaults
 
   LocalState(int argc, char *argv[]);
   ~LocalState();
@@ -55,6 +60,7 @@ void LocalState::show_usage (ostream& os)
   os << "Usage: " << progname
      << " [--output=<filename.db>]"
      << " [--live-data]"
+     << " [--fast]"
      << " <filename.byfl>\n";
 }
 
@@ -64,17 +70,19 @@ LocalState::LocalState (int argc, char *argv[])
   // Initialize our local state.
   db = nullptr;
   live_data = false;
+  fast = false;
 
   // Walk the command line and process each option we encounter.
   static struct option cmd_line_options[] = {
     { "help",            no_argument,       NULL, 'h' },
     { "output",          required_argument, NULL, 'o' },
     { "live-data",       no_argument,       NULL, 'l' },
+    { "fast",            no_argument,       NULL, 'f' },
     { NULL,              0,                 NULL, 0 }
   };
   int opt_index = 0;
   while (true) {
-    int c = getopt_long(argc, argv, "ho:l", cmd_line_options, &opt_index);
+    int c = getopt_long(argc, argv, "ho:lf", cmd_line_options, &opt_index);
     if (c == -1)
       break;
     switch (c) {
@@ -91,6 +99,10 @@ LocalState::LocalState (int argc, char *argv[])
         live_data = true;
         break;
 
+      case 'f':
+        fast = true;
+        break;
+
       case 0:
         cerr << progname << ": Internal error in " << __FILE__
              << ", line " << __LINE__ << '\n' << die;
@@ -134,6 +146,22 @@ LocalState::LocalState (int argc, char *argv[])
   if (retval != SQLITE_OK)
     cerr << progname << ": " << sqlite3_errstr(retval)
          << " (" << sqlite3filename << ")\n" << die;
+
+  // In fast mode, disable the rollback journal and don't wait for
+  // data to reach the disk.  A crash mid-import will corrupt the
+  // database, but the input file can simply be converted again.
+  if (fast) {
+    const char* pragmas =
+      "PRAGMA journal_mode=OFF;"
+      " PRAGMA synchronous=OFF;"
+      " PRAGMA locking_mode=EXCLUSIVE;"
+      " PRAGMA cache_size=-262144;";
+    char *errmsg = nullptr;
+    retval = sqlite3_exec(db, pragmas, NULL, NULL, &errmsg);
+    if (retval != SQLITE_OK)
+      cerr << progname << ": Failed to configure " << sqlite3filename
+           << " for fast insertion (" << errmsg << ")\n" << die;
+  }
 }
 
 // Close the database.
@@ -217,39 +245,44 @@ static void begin_any_table (void* state, const char* tablename)
   string tablesym = sql_symbol(lstate->tablename);
   lstate->create_table = "CREATE TABLE " + tablesym + " (";
   lstate->insert_into = "INSERT INTO " + tablesym + " VALUES (";
+  lstate->column_types.clear();
+  lstate->empty_table = true;
   lstate->num_rows = 0;
   lstate->issued_overflow_warning = false;
 }
 
 // Append a column of a given data type to the column description.
-static void add_any_column (void* state, const char* colname, const char* coltype)
+static void add_any_column (void* state, const char* colname, const char* coltype,
+                            BINOUT_COL_T bftype)
 {
   LocalState* lstate = (LocalState*) state;
-  if (lstate->create_table[lstate->create_table.length() - 1] != '(') {
+  if (!lstate->empty_table) {
     lstate->create_table += ", ";
     lstate->insert_into += ", ";
   }
   string colsym = sql_symbol(colname);
   lstate->create_table += colsym + ' ' + coltype;
   lstate->insert_into += '?';
+  lstate->column_types.push_back(bftype);
+  lstate->empty_table = false;
 }
 
 // Append an integer column to the column description.
 static void column_header_integer (void* state, const char* colname)
 {
-  add_any_column(state, colname, "INTEGER");
+  add_any_column(state, colname, "INTEGER", BINOUT_COL_UINT64);
 }
 
 // Append a string column to the column description.
 static void column_header_string (void* state, const char* colname)
 {
-  add_any_column(state, colname, "TEXT");
+  add_any_column(state, colname, "TEXT", BINOUT_COL_STRING);
 }
 
 // Append a boolean column to the column description.
 static void column_header_boolean (void* state, const char* colname)
 {
-  add_any_column(state, colname, "INTEGER");  // SQLite doesn't have a Boolean type.
+  add_any_column(state, colname, "INTEGER", BINOUT_COL_BOOL);  // SQLite doesn't have a Boolean type.
 }
 
 // Execute the SQL CREATE TABLE statement we constructed and prepare
@@ -259,7 +292,7 @@ static void end_column_header (void* state)
   LocalState* lstate = (LocalState*) state;
 
   // Ignore empty tables.
-  if (lstate->create_table[lstate->create_table.length() - 1] == '(')
+  if (lstate->empty_table)
     return;
 
   // Create a table.
@@ -288,11 +321,10 @@ static void begin_row (void* state)
   lstate->column = 0;
 }
 
-// Write an integer value.  If the integer is too big, issue a warning
-// and write a double instead.
-static void write_integer_value (void* state, uint64_t value)
+// Bind an integer value to a given column.  If the integer is too
+// big, issue a warning and bind a double instead.
+static void bind_integer_value (LocalState* lstate, int column, uint64_t value)
 {
-  LocalState* lstate = (LocalState*) state;
   if (value > UINT64_C(9223372036854775807)) {
     // Value is too big for an int64 -- complain and write a double instead.
     if (!lstate->issued_overflow_warning) {
@@ -301,15 +333,22 @@ static void write_integer_value (void* state, uint64_t value)
            << " using floating-point instead" << endl;
       lstate->issued_overflow_warning = true;
     }
-    check_return_value(sqlite3_bind_double(lstate->insert_stmt, lstate->column + 1,
+    check_return_value(sqlite3_bind_double(lstate->insert_stmt, column + 1,
                                            double(value)),
                        lstate, "Failed to insert an integer (cast to double) into");
   }
   else
     // Common case (we hope) -- write the uint64 as an int64.
-    check_return_value(sqlite3_bind_int64(lstate->insert_stmt, lstate->column + 1,
+    check_return_value(sqlite3_bind_int64(lstate->insert_stmt, column + 1,
                                           sqlite3_int64(value)),
                        lstate, "Failed to insert an integer into");
+}
+
+// Write an integer value.
+static void write_integer_value (void* state, uint64_t value)
+{
+  LocalState* lstate = (LocalState*) state;
+  bind_integer_value(lstate, lstate->column, value);
   lstate->column++;
 }
 
@@ -340,7 +379,7 @@ static void end_row (void* state)
   LocalState* lstate = (LocalState*) state;
 
   // Ignore empty tables.
-  if (lstate->create_table[lstate->create_table.length() - 1] == '(')
+  if (lstate->empty_table)
     return;
 
   // Execute the INSERT INTO statement.
@@ -352,8 +391,11 @@ static void end_row (void* state)
                      lstate, "Failed to reset the insertion template for");
 
   // Periodically commit the current transaction and begin a new one.
+  // In fast mode, there's nothing to gain from this so we use a
+  // single transaction per table.
   lstate->num_rows++;
-  if (lstate->live_data || lstate->num_rows == lstate->rows_per_transaction) {
+  if (lstate->live_data
+      || (!lstate->fast && lstate->num_rows == lstate->rows_per_transaction)) {
     execute_sql_statement(lstate, "END TRANSACTION;",
                           "Failed to commit a transaction for table \"" + lstate->tablename + '"');
     execute_sql_statement(lstate, "BEGIN IMMEDIATE TRANSACTION;",
@@ -362,13 +404,56 @@ static void end_row (void* state)
   }
 }
 
+// Bind an entire row of data at once then write it to the database.
+// This avoids a callback per datum, and because the parser keeps
+// strings valid until we return, they can be bound without copying.
+static void write_row (void* state, const bfbin_value_t* data, size_t num_data)
+{
+  LocalState* lstate = (LocalState*) state;
+
+  // Ignore empty tables.
+  if (lstate->empty_table)
+    return;
+
+  // Bind each value to the INSERT INTO template.
+  for (size_t c = 0; c < num_data; c++)
+    switch (lstate->column_types[c]) {
+      case BINOUT_COL_UINT64:
+        bind_integer_value(lstate, int(c), data[c].uint64_value);
+        break;
+
+      case BINOUT_COL_STRING:
+        check_return_value(sqlite3_bind_text(lstate->insert_stmt, int(c) + 1,
+                                             data[c].string_value, -1, SQLITE_STATIC),
+                           lstate, "Failed to insert a string into");
+        break;
+
+      case BINOUT_COL_BOOL:
+        check_return_value(sqlite3_bind_int(lstate->insert_stmt, int(c) + 1,
+                                            int(data[c].bool_value)),
+                           lstate, "Failed to insert a Boolean into");
+        break;
+
+      default:
+        cerr << progname << ": Internal error in " << __FILE__
+             << ", line " << __LINE__ << '\n' << die;
+        break;
+    }
+
+  // Write the row, then drop the string bindings before the parser
+  // reclaims the memory they point to.
+  end_row(state);
+  check_return_value(sqlite3_clear_bindings(lstate->insert_stmt),
+                     lstate, "Failed to clear the insertion template for");
+}
+
 // End the current table, cleaning up any resources used.
 static void end_any_table (void* state)
 {
   LocalState* lstate = (LocalState*) state;
 
   // Ignore empty tables.
-  if (lstate->create_table[lstate->create_table.length() - 1] == '(')
+  if (lstate->empty_table)
     return;
 
   // Commit the current transaction.
@@ -404,6 +489,7 @@ int main (int argc, char *argv[])
   callbacks.data_string_cb = write_text_value;
   callbacks.data_bool_cb = write_boolean_value;
   callbacks.row_end_cb = end_row;
+  callbacks.row_data_cb = write_row;
   callbacks.table_end_basic_cb = end_any_table;
   callbacks.table_end_keyval_cb = end_any_table;
 
@@ -0,0 +1,427 @@
+/****************************************
+ * Aggregate call paths from a Byfl     *
+ * Functions table using multiple       *
+ * threads                              *
+ *                                      *
+ * By Scott Pakin <pakin@lanl.gov>      *
+ ****************************************/
+
+#ifndef _CALLPATHS_H_
+#define _CALLPATHS_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Intern strings as small, consecutive integers (in order of first
+// appearance) so each distinct function or file name is stored only once
+// regardless of how many call paths mention it.  Only the parsing thread
+// may intern strings.
+class StringPool {
+private:
+  std::unordered_map<std::string, uint32_t> str2id;  // Map from a string to its ID
+  std::vector<const std::string*> id2str;            // Map from an ID to its string
+
+public:
+  // Return a string's ID, assigning a new one if necessary.
+  uint32_t intern (const std::string& str) {
+    auto iter = str2id.find(str);
+    if (iter != str2id.end())
+      return iter->second;
+    uint32_t id = uint32_t(id2str.size());
+    iter = str2id.emplace(str, id).first;
+    id2str.push_back(&iter->first);   // Keys don't move when the map grows.
+    return id;
+  }
+
+  // Map an ID back to a string.
+  const std::string& operator[] (uint32_t id) const { return *id2str[id]; }
+
+  // Return the number of distinct strings.
+  size_t size (void) const { return id2str.size(); }
+};
+
+// Represent one row of the Functions table compactly.
+class CallPathRow {
+public:
+  std::vector<uint32_t> path;     // Interned function names, leaf first
+  uint32_t file;                  // Interned file name
+  uint64_t lineno;                // Line number at which the leaf function begins
+  std::vector<uint64_t> metrics;  // All integer columns except the line number
+  uint32_t ordinal;               // Tool-specific number for the row
+};
+
+// Split a " # "-separated call stack into a vector of interned function
+// names, leaf first.
+static inline void intern_call_path (StringPool& funcs, const char* call_path_str,
+                                     std::vector<uint32_t>& path)
+{
+  static const std::string sep(" # ");
+  std::string call_path(call_path_str);
+  size_t pos0, pos1;
+  path.clear();
+  for (pos0 = 0, pos1 = call_path.find(sep);
+       pos1 != std::string::npos;
+       pos0 = pos1 + sep.size(), pos1 = call_path.find(sep, pos0 + 1))
+    path.push_back(funcs.intern(call_path.substr(pos0, pos1 - pos0)));
+  path.push_back(funcs.intern(call_path.substr(pos0)));
+}
+
+// Define a node in a trie of call paths (sequences of functions but not
+// finer resolution than that).
+class CallPathNode {
+public:
+  uint32_t func;                                       // Interned function name
+  std::unordered_map<uint32_t, CallPathNode*> children;   // All functions it calls
+  const CallPathRow* row;                              // Row whose call path ends here, if any
+  std::vector<uint64_t> path_data;                     // Tool-specific inclusive data
+
+  CallPathNode(uint32_t f) : func(f), row(nullptr) { }
+};
+
+// Build a forest of call-path tries in parallel with parsing.  The
+// parsing thread builds the top shard_depth levels of each tree itself and
+// routes each row to the worker thread that owns the subtree rooted at the
+// row's shard_depth-deep prefix, so even a single tree (e.g., one rooted at
+// main) is split across threads, and no two threads ever modify the same
+// node.  The same pool of worker threads later processes the subtrees in
+// parallel, leaving only the top levels to process serially.
+class CallForest {
+private:
+  typedef std::pair<CallPathNode*, const CallPathRow*> work_t;   // A row and its subtree
+  typedef std::function<void(std::ostream&, const CallPathNode*, size_t, size_t)> render_t;
+
+  // Represent one worker thread's queue of tasks.
+  class Worker {
+  public:
+    std::thread thread;                          // Thread performing the work
+    std::mutex lock;                             // Protect all of the following
+    std::condition_variable ready;               // Signal that work is available
+    std::deque<std::function<void()> > queue;    // Tasks to perform in order
+    bool done;                                   // true=no more tasks will arrive
+
+    Worker() : done(false) { }
+  };
+
+  // Represent a piece of the text output_in_order() writes: the text that
+  // precedes or follows a top-level node's children or an entire subtree.
+  class Piece {
+  public:
+    enum { OPEN, CLOSE, SUBTREE } kind;   // Kind of text to render
+    const CallPathNode* node;             // Node to render
+    size_t depth;                         // Node's depth in its tree
+    size_t id;                            // Node's position in a preorder traversal of the forest
+  };
+
+  static const size_t batch_size = 1024;     // Rows per batch handed to a worker
+  static const size_t shard_depth = 2;       // Depth of the subtrees handed to workers
+  std::vector<Worker*> workers;              // All worker threads
+  std::vector<std::vector<work_t>*> batches; // Batches currently being filled
+  std::unordered_map<uint32_t, size_t> root_index;   // Map from an outermost caller to its index in roots
+  std::vector<CallPathNode*> shards;         // Subtrees the workers build, in order of first appearance
+  std::unordered_map<const CallPathNode*, size_t> shard_index;   // Map from a subtree to its index in shards
+  std::mutex idle_lock;                      // Protect pending
+  std::condition_variable idle;              // Signal that pending dropped to zero
+  size_t pending;                            // Number of tasks submitted but not yet completed
+
+  // Perform tasks until told to stop.
+  void run_tasks (Worker* worker) {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> guard(worker->lock);
+        worker->ready.wait(guard, [worker] { return worker->done || !worker->queue.empty(); });
+        if (worker->queue.empty())
+          return;
+        task = std::move(worker->queue.front());
+        worker->queue.pop_front();
+      }
+      task();
+      std::lock_guard<std::mutex> guard(idle_lock);
+      if (--pending == 0)
+        idle.notify_all();
+    }
+  }
+
+  // Hand a task to a worker.  Tasks handed to the same worker are
+  // performed in order.
+  void submit (size_t w, std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      pending++;
+    }
+    Worker* worker = workers[w%workers.size()];
+    {
+      std::lock_guard<std::mutex> guard(worker->lock);
+      worker->queue.push_back(std::move(task));
+    }
+    worker->ready.notify_one();
+  }
+
+  // Wait for all submitted tasks to complete.
+  void wait_for_tasks (void) {
+    std::unique_lock<std::mutex> guard(idle_lock);
+    idle.wait(guard, [this] { return pending == 0; });
+  }
+
+  // Insert a batch of rows into their subtrees.
+  static void insert_rows (std::vector<work_t>* batch) {
+    for (auto witer = batch->begin(); witer != batch->end(); witer++) {
+      CallPathNode* node = witer->first;
+      const std::vector<uint32_t>& path = witer->second->path;
+      for (int idx = int(path.size()) - 2 - int(shard_depth); idx >= 0; idx--) {
+        CallPathNode*& child = node->children[path[idx]];
+        if (child == nullptr)
+          child = new CallPathNode(path[idx]);
+        node = child;
+      }
+      node->row = witer->second;
+    }
+    delete batch;
+  }
+
+  // Hand a batch of rows to a worker.
+  void enqueue (size_t w) {
+    std::vector<work_t>* batch = batches[w];
+    submit(w, [batch] { insert_rows(batch); });
+    batches[w] = new std::vector<work_t>;
+    batches[w]->reserve(batch_size);
+  }
+
+  // Invoke a function on every node in a subtree, children before parents.
+  static void visit_subtree (CallPathNode* node,
+                             const std::function<void(CallPathNode*)>& func) {
+    for (auto citer = node->children.begin(); citer != node->children.end(); citer++)
+      visit_subtree(citer->second, func);
+    func(node);
+  }
+
+  // Invoke a function on every node in the top levels of a tree, children
+  // before parents.
+  static void visit_top_levels (CallPathNode* node, size_t depth,
+                                const std::function<void(CallPathNode*)>& func) {
+    if (depth == shard_depth)
+      return;
+    for (auto citer = node->children.begin(); citer != node->children.end(); citer++)
+      visit_top_levels(citer->second, depth + 1, func);
+    func(node);
+  }
+
+  // Count the nodes in a subtree.
+  static size_t count_nodes (const CallPathNode* node) {
+    size_t num = 1;
+    for (auto citer = node->children.begin(); citer != node->children.end(); citer++)
+      num += count_nodes(citer->second);
+    return num;
+  }
+
+  // Divide the top levels of a tree into pieces of text to render.
+  void lay_out (const CallPathNode* node, size_t depth, size_t& next_id,
+                const std::vector<size_t>& shard_nodes, std::vector<Piece>& pieces) {
+    if (depth == shard_depth) {
+      pieces.push_back(Piece{Piece::SUBTREE, node, depth, next_id});
+      next_id += shard_nodes[shard_index[node]];
+      return;
+    }
+    size_t id = next_id++;
+    pieces.push_back(Piece{Piece::OPEN, node, depth, id});
+    for (auto citer = node->children.begin(); citer != node->children.end(); citer++)
+      lay_out(citer->second, depth + 1, next_id, shard_nodes, pieces);
+    pieces.push_back(Piece{Piece::CLOSE, node, depth, id});
+  }
+
+  // Render a subtree to text.
+  static void render_subtree (std::ostream& os, const CallPathNode* node,
+                              size_t depth, size_t& next_id,
+                              const render_t& open, const render_t& close) {
+    size_t id = next_id++;
+    open(os, node, depth, id);
+    for (auto citer = node->children.begin(); citer != node->children.end(); citer++)
+      render_subtree(os, citer->second, depth + 1, next_id, open, close);
+    if (close)
+      close(os, node, depth, id);
+  }
+
+public:
+  std::vector<CallPathNode*> roots;   // Outermost callers, in order of first appearance
+
+  // Start a given number of worker threads (0=one per hardware thread).
+  CallForest (size_t num_threads=0) : pending(0) {
+    size_t nthreads = num_threads;
+    if (nthreads == 0)
+      nthreads = std::thread::hardware_concurrency();
+    if (nthreads == 0)
+      nthreads = 1;
+    for (size_t w = 0; w < nthreads; w++) {
+      workers.push_back(new Worker);
+      batches.push_back(new std::vector<work_t>);
+      batches.back()->reserve(batch_size);
+      workers.back()->thread = std::thread(&CallForest::run_tasks, this, workers.back());
+    }
+  }
+
+  // Stop all of the worker threads.
+  ~CallForest() {
+    for (size_t w = 0; w < workers.size(); w++) {
+      {
+        std::lock_guard<std::mutex> guard(workers[w]->lock);
+        workers[w]->done = true;
+      }
+      workers[w]->ready.notify_one();
+    }
+    for (size_t w = 0; w < workers.size(); w++) {
+      workers[w]->thread.join();
+      delete workers[w];
+      delete batches[w];
+    }
+  }
+
+  // Insert a row's call path into the forest asynchronously.  The row
+  // must remain valid for the lifetime of the forest.
+  void insert (const CallPathRow* row) {
+    // Find or create the tree rooted at the outermost caller.
+    const std::vector<uint32_t>& path = row->path;
+    uint32_t outermost = path.back();
+    auto riter = root_index.find(outermost);
+    CallPathNode* node;
+    if (riter == root_index.end()) {
+      root_index[outermost] = roots.size();
+      node = new CallPathNode(outermost);
+      roots.push_back(node);
+    }
+    else
+      node = roots[riter->second];
+
+    // Walk the top levels of the tree ourselves.  If the call path ends
+    // there, we're done.
+    int idx = int(path.size()) - 2;
+    for (size_t depth = 1; depth <= shard_depth && idx >= 0; depth++, idx--) {
+      CallPathNode*& child = node->children[path[idx]];
+      if (child == nullptr) {
+        child = new CallPathNode(path[idx]);
+        if (depth == shard_depth) {
+          shard_index[child] = shards.size();
+          shards.push_back(child);
+        }
+      }
+      node = child;
+    }
+    if (idx < 0) {
+      node->row = row;
+      return;
+    }
+
+    // Hand the rest of the call path to the subtree's worker.
+    size_t w = shard_index[node]%workers.size();
+    batches[w]->push_back(work_t(node, row));
+    if (batches[w]->size() >= batch_size)
+      enqueue(w);
+  }
+
+  // Wait for all pending insertions to complete.
+  void finish (void) {
+    for (size_t w = 0; w < workers.size(); w++)
+      if (!batches[w]->empty())
+        enqueue(w);
+    wait_for_tasks();
+  }
+
+  // Invoke a function on every node in the forest, children before
+  // parents.  The subtrees are processed in parallel, then the top levels
+  // serially.
+  void for_each_node (std::function<void(CallPathNode*)> func) {
+    for (size_t s = 0; s < shards.size(); s++) {
+      CallPathNode* shard = shards[s];
+      submit(s, [shard, &func] { visit_subtree(shard, func); });
+    }
+    wait_for_tasks();
+    for (auto riter = roots.begin(); riter != roots.end(); riter++)
+      visit_top_levels(*riter, 0, func);
+  }
+
+  // Render the forest to text in parallel but write the text in order.
+  // For each node, open renders the text that precedes the node's
+  // children and close (if provided) the text that follows them.  Both
+  // are passed the node, its depth in its tree, and its position in a
+  // preorder traversal of the forest.  The workers render the subtrees; to
+  // bound memory usage, only a few subtrees per thread are held in memory
+  // at once.  The top levels are rendered as they're written.  Return the
+  // number of nodes in the forest.
+  size_t output_in_order (std::ostream& of, render_t open, render_t close=nullptr) {
+    // Count the nodes in each subtree so we can number every node.
+    std::vector<size_t> shard_nodes(shards.size());
+    for (size_t s = 0; s < shards.size(); s++)
+      submit(s, [this, s, &shard_nodes] { shard_nodes[s] = count_nodes(shards[s]); });
+    wait_for_tasks();
+
+    // Divide the top levels of each tree into pieces, and note which
+    // pieces are entire subtrees.
+    std::vector<Piece> pieces;
+    size_t num_nodes = 0;
+    for (auto riter = roots.begin(); riter != roots.end(); riter++)
+      lay_out(*riter, 0, num_nodes, shard_nodes, pieces);
+    std::vector<const Piece*> subtrees;
+    for (auto piter = pieces.begin(); piter != pieces.end(); piter++)
+      if (piter->kind == Piece::SUBTREE)
+        subtrees.push_back(&*piter);
+
+    // Render a window of subtrees at a time, starting the next subtree as
+    // soon as one is written.
+    size_t window = 4*workers.size();
+    std::vector<std::string> text(window);
+    std::vector<bool> rendered(window, false);
+    std::mutex rendered_lock;
+    std::condition_variable rendered_cond;
+    auto start_rendering = [&] (size_t s) {
+      submit(s, [&, s] {
+          std::ostringstream oss;
+          size_t next_id = subtrees[s]->id;
+          render_subtree(oss, subtrees[s]->node, subtrees[s]->depth, next_id, open, close);
+          std::lock_guard<std::mutex> guard(rendered_lock);
+          text[s%window] = oss.str();
+          rendered[s%window] = true;
+          rendered_cond.notify_all();
+        });
+    };
+    for (size_t s = 0; s < window && s < subtrees.size(); s++)
+      start_rendering(s);
+    size_t s = 0;
+    for (auto piter = pieces.begin(); piter != pieces.end(); piter++)
+      switch (piter->kind) {
+        case Piece::OPEN:
+          open(of, piter->node, piter->depth, piter->id);
+          break;
+
+        case Piece::CLOSE:
+          if (close)
+            close(of, piter->node, piter->depth, piter->id);
+          break;
+
+        case Piece::SUBTREE:
+          {
+            std::unique_lock<std::mutex> guard(rendered_lock);
+            rendered_cond.wait(guard, [&] { return bool(rendered[s%window]); });
+            of << text[s%window];
+            std::string().swap(text[s%window]);
+            rendered[s%window] = false;
+          }
+          if (s + window < subtrees.size())
+            start_rendering(s + window);
+          s++;
+          break;
+      }
+    wait_for_tasks();
+    return num_nodes;
+  }
+};
+
+#endif
@@ -10,40 +10,48 @@
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <fcntl.h>
 #include <setjmp.h>
 #include "bfbin.h"
 #include "binarytagdefs.h"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 /* Buffer this many bytes of input data for improved performance. */
 #define READ_BUFFER_SIZE (10*1024*1024)
 
 /* Invoke a 0-argument (excluding user data) callback function, but
- * only if non-NULL.  Otherwise, do nothing. */
-#define INVOKE_CB_0(FUNC)                               \
-  do {                                                  \
-    if (state->callback_list->FUNC != NULL)             \
-      state->callback_list->FUNC(state->user_data);     \
-  }                                                     \
+ * only if non-NULL and we're not skipping the current table.  Otherwise,
+ * do nothing. */
+#define INVOKE_CB_0(FUNC)                                       \
+  do {                                                          \
+    if (!state->skipping && state->callback_list->FUNC != NULL) \
+      state->callback_list->FUNC(state->user_data);             \
+  }                                                             \
   while (0)
 
 /* Invoke a 1-argument (excluding user data) callback function, but
- * only if non-NULL.  Otherwise, do nothing. */
+ * only if non-NULL and we're not skipping the current table.  Otherwise,
+ * do nothing. */
 #define INVOKE_CB_1(FUNC, ARG)                                  \
   do {                                                          \
-    if (state->callback_list->FUNC != NULL)                     \
+    if (!state->skipping && state->callback_list->FUNC != NULL) \
       state->callback_list->FUNC(state->user_data, ARG);        \
   }                                                             \
   while (0)
 
 /* Invoke a 2-argument (excluding user data) callback function, but
- * only if non-NULL.  Otherwise, do nothing. */
+ * only if non-NULL and we're not skipping the current table.  Otherwise,
+ * do nothing. */
 #define INVOKE_CB_2(FUNC, ARG1, ARG2)                           \
   do {                                                          \
-    if (state->callback_list->FUNC != NULL)                     \
+    if (!state->skipping && state->callback_list->FUNC != NULL) \
       state->callback_list->FUNC(state->user_data, ARG1, ARG2); \
   }                                                             \
   while (0)
@@ -69,6 +77,23 @@ typedef struct {
   void *last_value;                  /* Storage for data to pass to a callback */
   size_t value_space;                /* Number of bytes allocated for last_value */
   int patient;                       /* 1=wait for data; 0=fail if data are not available */
+  int compressed;                    /* 1=input is a sequence of compressed blocks */
+  int version;                       /* Binary-output format version (1 or 2) */
+  int skipping;                      /* 1=suppress callbacks for the current table */
+#ifdef HAVE_ZSTD
+  ZSTD_DCtx *zstd_dctx;              /* zstd decompression context */
+#endif
+  uint8_t *zdata;                    /* One compressed block of data */
+  size_t zdata_space;                /* Number of bytes allocated for zdata */
+  uint8_t *block;                    /* One decompressed block of data */
+  size_t block_space;                /* Number of bytes allocated for block */
+  size_t block_len;                  /* Number of valid bytes in block */
+  size_t block_pos;                  /* Number of bytes of block already consumed */
+  uint8_t *chunk;                    /* One version 2 column chunk */
+  size_t chunk_space;                /* Number of bytes allocated for chunk */
+  const uint8_t *map;                /* Memory-mapped input file, or NULL if not mapped */
+  size_t map_len;                    /* Number of bytes in map */
+  size_t map_pos;                    /* Number of bytes of map already consumed */
 } parse_state_t;
 
 #ifndef HAVE_ASPRINTF
@@ -125,54 +150,321 @@ static size_t patient_fread (int patient, void *ptr, size_t size, size_t nmemb,
   }
 }
 
+/* Read nbytes bytes of raw (possibly compressed) data from the input file
+ * or its memory mapping.  Return the number of bytes actually read. */
+static size_t read_file (parse_state_t *state, void *ptr, size_t nbytes)
+{
+  if (state->map == NULL)
+    return patient_fread(state->patient, ptr, sizeof(uint8_t), nbytes, state->fd);
+  if (nbytes > state->map_len - state->map_pos)
+    nbytes = state->map_len - state->map_pos;
+  memcpy(ptr, state->map + state->map_pos, nbytes);
+  state->map_pos += nbytes;
+  return nbytes;
+}
+
+/* Return the current raw-data position in the input file (for error
+ * messages). */
+static long file_position (parse_state_t *state)
+{
+  return state->map == NULL ? ftell(state->fd) : (long)state->map_pos;
+}
+
+/* Read and decompress the next block of a compressed input file into
+ * state->block.  Return 1 on success, 0 on EOF. */
+static int read_compressed_block (parse_state_t *state)
+{
+  uint8_t header[2*sizeof(uint32_t)];  /* Compressed and uncompressed sizes */
+  size_t header_len;                   /* Number of header bytes read */
+  const uint8_t *zsrc;                 /* Compressed data */
+  size_t zsize;                        /* Compressed size */
+  size_t usize;                        /* Uncompressed size */
+  size_t i;
+
+  /* Read the block header. */
+  header_len = read_file(state, header, sizeof(header));
+  if (header_len == 0 && (state->map != NULL || feof(state->fd)))
+    return 0;
+  if (header_len != sizeof(header))
+    THROW_ERROR("Failed to read a compressed-block header from %s at position %ld (%s)",
+                state->filename, file_position(state), strerror(errno));
+  zsize = 0;
+  usize = 0;
+  for (i = 0; i < sizeof(uint32_t); i++) {
+    zsize = (zsize<<8) | header[i];
+    usize = (usize<<8) | header[i + sizeof(uint32_t)];
+  }
+  if (usize > BINOUT_ZSTD_MAX_BLOCK)
+    THROW_ERROR("Compressed block in %s at position %ld claims an excessive size (%lu bytes)",
+                state->filename, file_position(state), (unsigned long)usize);
+
+  /* Ensure we have enough space. */
+  if (state->block_space < usize) {
+    state->block_space = usize;
+    state->block = realloc(state->block, state->block_space);
+    if (!state->block)
+      THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                  (unsigned long)state->block_space, strerror(errno));
+  }
+
+  /* Locate the compressed data in the memory-mapped file or, if the file
+   * is not mapped, read it into memory. */
+  if (state->map != NULL) {
+    if (zsize > state->map_len - state->map_pos)
+      THROW_ERROR("Failed to read a %lu-byte compressed block from %s (file is truncated)",
+                  (unsigned long)zsize, state->filename);
+    zsrc = state->map + state->map_pos;
+    state->map_pos += zsize;
+  }
+  else {
+    if (state->zdata_space < zsize) {
+      state->zdata_space = zsize;
+      state->zdata = realloc(state->zdata, state->zdata_space);
+      if (!state->zdata)
+        THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                    (unsigned long)state->zdata_space, strerror(errno));
+    }
+    if (read_file(state, state->zdata, zsize) != zsize)
+      THROW_ERROR("Failed to read a %lu-byte compressed block from %s (%s)",
+                  (unsigned long)zsize, state->filename, strerror(errno));
+    zsrc = state->zdata;
+  }
+
+  /* Decompress the block. */
+#ifdef HAVE_ZSTD
+  {
+    size_t result = ZSTD_decompressDCtx(state->zstd_dctx, state->block, usize,
+                                        zsrc, zsize);
+    if (ZSTD_isError(result))
+      THROW_ERROR("Failed to decompress a block of %s at position %ld (%s)",
+                  state->filename, file_position(state), ZSTD_getErrorName(result));
+    if (result != usize)
+      THROW_ERROR("Compressed block of %s at position %ld decompressed to %lu bytes, not %lu",
+                  state->filename, file_position(state), (unsigned long)result, (unsigned long)usize);
+  }
+#else
+  (void) zsrc;
+#endif
+  state->block_len = usize;
+  state->block_pos = 0;
+  return 1;
+}
+
+/* Read nbytes bytes of (decompressed) data from the input file.  Return the
+ * number of bytes actually read. */
+static size_t read_input (parse_state_t *state, void *ptr, size_t nbytes)
+{
+  uint8_t *bytes = (uint8_t *)ptr;   /* Byte-oriented version of ptr */
+  size_t total_read = 0;             /* Bytes read so far */
+
+  /* Read uncompressed data directly from the file. */
+  if (!state->compressed)
+    return read_file(state, ptr, nbytes);
+
+  /* Read compressed data from the current block, decompressing more blocks
+   * as necessary. */
+  while (total_read < nbytes) {
+    size_t avail = state->block_len - state->block_pos;
+    if (avail == 0) {
+      if (!read_compressed_block(state))
+        break;
+      continue;
+    }
+    if (avail > nbytes - total_read)
+      avail = nbytes - total_read;
+    memcpy(bytes + total_read, state->block + state->block_pos, avail);
+    state->block_pos += avail;
+    total_read += avail;
+  }
+  return total_read;
+}
+
+/* Consume nbytes bytes of (decompressed) data from the input file, and
+ * return a pointer to them if they are contiguous in memory (i.e., in the
+ * memory-mapped file or in the current decompressed block).  Otherwise,
+ * consume nothing and return NULL. */
+static const uint8_t *peek_input (parse_state_t *state, size_t nbytes)
+{
+  const uint8_t *data;
+
+  if (state->compressed) {
+    if (nbytes > state->block_len - state->block_pos)
+      return NULL;
+    data = state->block + state->block_pos;
+    state->block_pos += nbytes;
+    return data;
+  }
+  if (state->map == NULL || nbytes > state->map_len - state->map_pos)
+    return NULL;
+  data = state->map + state->map_pos;
+  state->map_pos += nbytes;
+  return data;
+}
+
+/* Discard nbytes bytes of (decompressed) data from the input file. */
+static void skip_input (parse_state_t *state, uint64_t nbytes)
+{
+  uint8_t scratch[4096];   /* Storage for discarded data */
+
+  /* Seek past uncompressed data unless we might have to wait for it. */
+  if (!state->compressed && state->map != NULL) {
+    if (nbytes > state->map_len - state->map_pos)
+      THROW_ERROR("Failed to seek forward %lu bytes in %s (file is truncated)",
+                  (unsigned long)nbytes, state->filename);
+    state->map_pos += nbytes;
+    return;
+  }
+  if (!state->compressed && !state->patient && nbytes <= (uint64_t)LONG_MAX) {
+    if (fseek(state->fd, (long)nbytes, SEEK_CUR) != 0)
+      THROW_ERROR("Failed to seek forward %lu bytes in %s (%s)",
+                  (unsigned long)nbytes, state->filename, strerror(errno));
+    return;
+  }
+
+  /* Read and discard data in all other cases. */
+  while (nbytes > 0) {
+    size_t len = nbytes > sizeof(scratch) ? sizeof(scratch) : (size_t)nbytes;
+    if (read_input(state, scratch, len) != len)
+      THROW_ERROR("Failed to read %lu bytes from %s (%s)",
+                  (unsigned long)len, state->filename, strerror(errno));
+    nbytes -= len;
+  }
+}
+
+/* Move to a given byte offset in an uncompressed input file.  Return 1 on
+ * success, 0 on failure. */
+static int seek_input (parse_state_t *state, uint64_t offset)
+{
+  if (state->map != NULL) {
+    if (offset > state->map_len)
+      return 0;
+    state->map_pos = (size_t)offset;
+    return 1;
+  }
+  return offset <= (uint64_t)LONG_MAX && fseek(state->fd, (long)offset, SEEK_SET) == 0;
+}
+
 /* Open the Byfl binary-output file and enable a fair amount of
  * buffering.  Invoke the caller-provided callback function on
  * error. */
 static void open_binary_file (parse_state_t *state)
 {
-  char header[7];    /* The string "BYFLBIN" if given a valid file */
+  char header[7];    /* The string "BYFLBIN" or "BYFLBI2" if given a valid file */
 
   /* Open the file for reading. */
   state->fd = fopen(state->filename, "rb");
   if (state->fd == NULL)
     THROW_ERROR("Failed to open %s (%s)", state->filename, strerror(errno));
 
-  /* If possible, provide a buffer for reading. */
-  state->read_buffer = malloc(READ_BUFFER_SIZE);
-  if (!state->read_buffer)
-    THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
-                (unsigned long)READ_BUFFER_SIZE, strerror(errno));
-  if (setvbuf(state->fd, (char *)state->read_buffer, _IOFBF, READ_BUFFER_SIZE)) {
-    /* It's not critical if setvbuf fails. */
-    free(state->read_buffer);
-    state->read_buffer = NULL;
+  /* Unless we need to wait for data to be written, map the entire file
+   * into memory.  If that fails, fall back to buffered reads. */
+  if (!state->patient) {
+    struct stat info;
+    if (fstat(fileno(state->fd), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+      void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE,
+                       fileno(state->fd), 0);
+      if (map != MAP_FAILED) {
+        state->map = (const uint8_t *)map;
+        state->map_len = (size_t)info.st_size;
+        state->map_pos = 0;
+      }
+    }
   }
 
-  /* Read and validate the magic header sequence. */
-  if (patient_fread(state->patient, header, sizeof(char), 7, state->fd) != 7)
+  /* If the file is not mapped, provide a buffer for reading if possible. */
+  if (state->map == NULL) {
+    state->read_buffer = malloc(READ_BUFFER_SIZE);
+    if (!state->read_buffer)
+      THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                  (unsigned long)READ_BUFFER_SIZE, strerror(errno));
+    if (setvbuf(state->fd, (char *)state->read_buffer, _IOFBF, READ_BUFFER_SIZE)) {
+      /* It's not critical if setvbuf fails. */
+      free(state->read_buffer);
+      state->read_buffer = NULL;
+    }
+  }
+
+  /* Read the magic header sequence.  If it indicates a compressed file,
+   * prepare to decompress the file, and read the magic header sequence
+   * from the decompressed data. */
+  if (read_input(state, header, 7) != 7)
     THROW_ERROR("Failed to read the file header from %s (%s)",
                 state->filename, strerror(errno));
-  if (memcmp(header, "BYFLBIN", 7) != 0)
+  if (memcmp(header, BINOUT_ZSTD_MAGIC, 7) == 0) {
+#ifdef HAVE_ZSTD
+    state->zstd_dctx = ZSTD_createDCtx();
+    if (state->zstd_dctx == NULL)
+      THROW_ERROR("Failed to create a zstd decompression context for %s",
+                  state->filename);
+    state->compressed = 1;
+    if (read_input(state, header, 7) != 7)
+      THROW_ERROR("Failed to read the file header from %s (%s)",
+                  state->filename, strerror(errno));
+#else
+    THROW_ERROR("File %s is compressed, but the Byfl binary-output parser was built without zstd support",
+                state->filename);
+#endif
+  }
+
+  /* Validate the magic header sequence, and determine the format version. */
+  if (memcmp(header, "BYFLBIN", 7) == 0)
+    state->version = 1;
+  else if (memcmp(header, BINOUT_V2_MAGIC, 7) == 0)
+    state->version = 2;
+  else
     THROW_ERROR("File %s does not appear to be a Byfl binary-output file",
                 state->filename);
 }
 
+/* Close the Byfl binary-output file and free all memory associated with
+ * reading it. */
+static void close_binary_file (parse_state_t *state)
+{
+  if (state->map != NULL)
+    munmap((void *)state->map, state->map_len);
+  if (state->fd != NULL)
+    fclose(state->fd);
+#ifdef HAVE_ZSTD
+  ZSTD_freeDCtx(state->zstd_dctx);
+#endif
+  free(state->zdata);
+  free(state->block);
+  free(state->chunk);
+  free(state->read_buffer);
+}
+
+/* Decode a big-endian integer of a given size from memory. */
+static uint64_t decode_big_endian (const uint8_t *bytes, size_t word_size)
+{
+  uint64_t result = 0;
+  size_t i;
+
+  for (i = 0; i < word_size; i++)
+    result = (result<<8) | bytes[i];
+  return result;
+}
+
 /* Read a big-endian word of a given size into state->last_value. */
 static void read_big_endian (parse_state_t *state, size_t word_size)
 {
+  const uint8_t *bytes;
   size_t i;
   uint64_t result = 0;
 
-  /* Read big-endian data. */
-  for (i = 0; i < word_size; i++) {
-    uint8_t c;
-    if (patient_fread(state->patient, &c, sizeof(uint8_t), 1, state->fd) != 1) {
-      char *syserr = strerror(errno);
-      THROW_ERROR("Failed to read a byte from %s at position %ld (%s)",
-                  state->filename, ftell(state->fd), syserr);
+  /* Read big-endian data, directly from memory if possible. */
+  bytes = peek_input(state, word_size);
+  if (bytes != NULL)
+    result = decode_big_endian(bytes, word_size);
+  else
+    for (i = 0; i < word_size; i++) {
+      uint8_t c;
+      if (read_input(state, &c, 1) != 1) {
+        char *syserr = strerror(errno);
+        THROW_ERROR("Failed to read a byte from %s at position %ld (%s)",
+                    state->filename, file_position(state), syserr);
+      }
+      result = (result<<8) | c;
     }
-    result = (result<<8) | c;
-  }
 
   /* Store the result at the given pointer. */
   switch (word_size) {
@@ -201,6 +493,7 @@ static void read_big_endian (parse_state_t *state, size_t word_size)
 /* Read a string into state->last_value. */
 static void read_string (parse_state_t *state)
 {
+  const uint8_t *bytes;
   uint16_t string_len;
 
   /* Determine the number of bytes to read. */
@@ -216,13 +509,125 @@ static void read_string (parse_state_t *state)
                   state->value_space, strerror(errno));
   }
 
-  /* Read the string and null-terminate it. */
-  if (patient_fread(state->patient, state->last_value, sizeof(char), string_len, state->fd) != string_len)
+  /* Read the string, directly from memory if possible, and null-terminate
+   * it. */
+  bytes = peek_input(state, string_len);
+  if (bytes != NULL)
+    memcpy(state->last_value, bytes, string_len);
+  else if (read_input(state, state->last_value, string_len) != string_len)
     THROW_ERROR("Failed to read a %u-byte string from %s (%s)",
                 string_len, state->filename, strerror(errno));
   ((char *)state->last_value)[string_len] = '\0';
 }
 
+/* Define storage for one row of a basic table to pass to row_data_cb. */
+typedef struct {
+  bfbin_value_t *values;              /* One value per column */
+  size_t values_alloced;              /* Number of entries allocated for values */
+  char *strings;                      /* Null-terminated string data */
+  size_t strings_alloced;             /* Number of bytes allocated for strings */
+} row_buffer_t;
+
+/* Read one row of a basic Byfl table into a row buffer, and pass it to the
+ * row_data_cb callback. */
+static void process_byfl_basic_row (parse_state_t *state, const BINOUT_COL_T *columntypes,
+                                    size_t numcols, row_buffer_t *rowbuf)
+{
+  size_t strings_used = 0;            /* Number of valid bytes in rowbuf->strings */
+  size_t i;
+
+  /* Ensure we have space for every column. */
+  if (rowbuf->values_alloced < numcols) {
+    rowbuf->values_alloced = numcols;
+    rowbuf->values = realloc(rowbuf->values, numcols*sizeof(bfbin_value_t));
+    if (!rowbuf->values)
+      THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                  (unsigned long)(numcols*sizeof(bfbin_value_t)), strerror(errno));
+  }
+
+  /* Read each datum.  Because rowbuf->strings may move as it grows, string
+   * columns temporarily store an offset instead of a pointer. */
+  for (i = 0; i < numcols; i++)
+    switch (columntypes[i]) {
+      case BINOUT_COL_UINT64:
+        read_big_endian(state, sizeof(uint64_t));
+        rowbuf->values[i].uint64_value = *(uint64_t *)state->last_value;
+        break;
+
+      case BINOUT_COL_STRING:
+        {
+          size_t string_len;
+          read_string(state);
+          string_len = strlen(state->last_value) + 1;
+          if (strings_used + string_len > rowbuf->strings_alloced) {
+            rowbuf->strings_alloced = (strings_used + string_len)*2;
+            rowbuf->strings = realloc(rowbuf->strings, rowbuf->strings_alloced);
+            if (!rowbuf->strings)
+              THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                          (unsigned long)rowbuf->strings_alloced, strerror(errno));
+          }
+          memcpy(rowbuf->strings + strings_used, state->last_value, string_len);
+          rowbuf->values[i].uint64_value = strings_used;
+          strings_used += string_len;
+        }
+        break;
+
+      case BINOUT_COL_BOOL:
+        read_big_endian(state, sizeof(uint8_t));
+        rowbuf->values[i].bool_value = *(uint8_t *)state->last_value;
+        break;
+
+      default:
+        THROW_ERROR("Internal error at %s, line %d", __FILE__, __LINE__);
+        break;
+    }
+
+  /* Convert string offsets to pointers, and invoke the callback. */
+  for (i = 0; i < numcols; i++)
+    if (columntypes[i] == BINOUT_COL_STRING)
+      rowbuf->values[i].string_value = rowbuf->strings + rowbuf->values[i].uint64_value;
+  INVOKE_CB_2(row_data_cb, rowbuf->values, numcols);
+}
+
+/* Read the remainder of a BINOUT_ROW_SPARSE row, and apply the
+ * differences it encodes to the previous row's values. */
+static void read_sparse_row (parse_state_t *state, uint64_t *prev_row, size_t numcols)
+{
+  uint8_t bitmap = 0;                 /* Current byte of the column bitmap */
+  uint8_t changed[128];               /* Bitmap of columns that differ */
+  size_t bitmap_len = (numcols + 7)/8;
+  size_t i;
+
+  /* Read the bitmap of changed columns. */
+  if (bitmap_len > sizeof(changed))
+    THROW_ERROR("Too many columns (%lu) for a sparse row in %s",
+                (unsigned long)numcols, state->filename);
+  for (i = 0; i < bitmap_len; i++) {
+    read_big_endian(state, sizeof(uint8_t));
+    changed[i] = *(uint8_t *)state->last_value;
+  }
+
+  /* Read a zigzag-encoded varint for each changed column. */
+  for (i = 0; i < numcols; i++) {
+    uint64_t zigzag = 0;
+    unsigned int shift = 0;
+    if (i%8 == 0)
+      bitmap = changed[i/8];
+    if ((bitmap & (1<<(i%8))) == 0)
+      continue;
+    do {
+      if (shift >= 64)
+        THROW_ERROR("Malformed sparse row in %s at position %ld",
+                    state->filename, file_position(state));
+      read_big_endian(state, sizeof(uint8_t));
+      zigzag |= (uint64_t)(*(uint8_t *)state->last_value & 0x7F) << shift;
+      shift += 7;
+    }
+    while ((*(uint8_t *)state->last_value & 0x80) != 0);
+    prev_row[i] += (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+  }
+}
+
 /* Process a basic Byfl table. */
 static void process_byfl_basic_table (parse_state_t *state)
 {
@@ -230,8 +635,12 @@ static void process_byfl_basic_table (parse_state_t *state)
   size_t numcols = 0;                 /* Number of valid entries in columntypes */
   size_t cols_alloced = 0;            /* Number of entries allocated for columntypes */
   BINOUT_COL_T coltype;               /* Type of a single column */
+  row_buffer_t rowbuf;                /* Storage for row_data_cb's arguments */
+  uint64_t *prev_row = NULL;          /* Previous row if all columns are integers */
+  size_t i;
 
   /* Read and parse each column header. */
+  memset(&rowbuf, 0, sizeof(row_buffer_t));
   INVOKE_CB_0(column_begin_cb);
   do {
     /* Read and store a column header. */
@@ -277,10 +686,22 @@ static void process_byfl_basic_table (parse_state_t *state)
   }
   while (coltype != BINOUT_COL_NONE);
 
+  /* Rows of tables containing only integer columns may be encoded
+   * relative to their predecessor so we need to remember the previous
+   * row's values. */
+  for (i = 0; i < numcols; i++)
+    if (columntypes[i] != BINOUT_COL_UINT64)
+      break;
+  if (i == numcols) {
+    prev_row = calloc(numcols + 1, sizeof(uint64_t));
+    if (!prev_row)
+      THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                  (unsigned long)((numcols + 1)*sizeof(uint64_t)), strerror(errno));
+  }
+
   /* Read and parse each row of data and invoke callback functions. */
   while (1) {
     BINOUT_ROW_T rowtype;               /* Type of a single row */
-    size_t i;
 
     /* Determine if the row contains any data. */
     read_big_endian(state, sizeof(uint8_t));
@@ -288,12 +709,54 @@ static void process_byfl_basic_table (parse_state_t *state)
     if (rowtype == BINOUT_ROW_NONE)
       break;
 
+    /* Reconstruct a sparse row from the previous row, and pass it to the
+     * callbacks as though it were an ordinary row. */
+    if (rowtype == BINOUT_ROW_SPARSE) {
+      if (prev_row == NULL)
+        THROW_ERROR("Sparse row in a table with non-integer columns in %s at position %ld",
+                    state->filename, file_position(state));
+      read_sparse_row(state, prev_row, numcols);
+      if (state->callback_list->row_data_cb != NULL && !state->skipping) {
+        if (rowbuf.values_alloced < numcols) {
+          rowbuf.values_alloced = numcols;
+          rowbuf.values = realloc(rowbuf.values, numcols*sizeof(bfbin_value_t));
+          if (!rowbuf.values)
+            THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                        (unsigned long)(numcols*sizeof(bfbin_value_t)), strerror(errno));
+        }
+        for (i = 0; i < numcols; i++)
+          rowbuf.values[i].uint64_value = prev_row[i];
+        INVOKE_CB_2(row_data_cb, rowbuf.values, numcols);
+        continue;
+      }
+      INVOKE_CB_0(row_begin_cb);
+      for (i = 0; i < numcols; i++)
+        INVOKE_CB_1(data_uint64_cb, prev_row[i]);
+      INVOKE_CB_0(row_end_cb);
+      continue;
+    }
+    if (rowtype != BINOUT_ROW_DATA)
+      THROW_ERROR("Unexpected row type %d in %s at position %ld",
+                  (int)rowtype, state->filename, file_position(state));
+
+    /* If the caller wants entire rows, gather the row's data, then invoke
+     * the row callback. */
+    if (state->callback_list->row_data_cb != NULL && !state->skipping) {
+      process_byfl_basic_row(state, columntypes, numcols, &rowbuf);
+      if (prev_row != NULL)
+        for (i = 0; i < numcols; i++)
+          prev_row[i] = rowbuf.values[i].uint64_value;
+      continue;
+    }
+
     /* Invoke the appropriate callbacks. */
     INVOKE_CB_0(row_begin_cb);
     for (i = 0; i < numcols; i++)
       switch (columntypes[i]) {
         case BINOUT_COL_UINT64:
           read_big_endian(state, sizeof(uint64_t));
+          if (prev_row != NULL)
+            prev_row[i] = *(uint64_t *)state->last_value;
           INVOKE_CB_1(data_uint64_cb, *(uint64_t *)state->last_value);
           break;
 
@@ -313,6 +776,9 @@ static void process_byfl_basic_table (parse_state_t *state)
       }
     INVOKE_CB_0(row_end_cb);
   }
+  free(prev_row);
+  free(rowbuf.values);
+  free(rowbuf.strings);
   free(columntypes);
 }
 
@@ -326,6 +792,7 @@ static void process_byfl_keyval_table (parse_state_t *state)
   size_t bytes_alloced = 0;       /* Number of bytes allocated for the above */
   size_t valid_bytes = 0;         /* Number of valid row-data bytes */
   uint8_t *datap;                 /* Pointer into row_data */
+  bfbin_value_t *values = NULL;   /* Row data to pass to row_data_cb */
   size_t col;                     /* Current column index */
 
   INVOKE_CB_0(column_begin_cb);
@@ -419,22 +886,38 @@ static void process_byfl_keyval_table (parse_state_t *state)
 
   /* Now that we've read all of our columns and have all of our row
    * data, invoke the appropriate callback functions. */
-  INVOKE_CB_0(row_begin_cb);
+  if (state->callback_list->row_data_cb != NULL) {
+    values = (bfbin_value_t *) malloc((num_cols + 1)*sizeof(bfbin_value_t));
+    if (!values)
+      THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                  (unsigned long)((num_cols + 1)*sizeof(bfbin_value_t)), strerror(errno));
+  }
+  else
+    INVOKE_CB_0(row_begin_cb);
   datap = row_data;
   for (col = 0; col < num_cols; col++)
     switch (column_types[col]) {
       case BINOUT_COL_UINT64:
-        INVOKE_CB_1(data_uint64_cb, *(uint64_t *)datap);
+        if (values != NULL)
+          memcpy(&values[col].uint64_value, datap, sizeof(uint64_t));
+        else
+          INVOKE_CB_1(data_uint64_cb, *(uint64_t *)datap);
         datap += sizeof(uint64_t);
         break;
 
       case BINOUT_COL_STRING:
-        INVOKE_CB_1(data_string_cb, (char *)datap);
+        if (values != NULL)
+          values[col].string_value = (char *)datap;
+        else
+          INVOKE_CB_1(data_string_cb, (char *)datap);
         datap += strlen((char *)datap) + 1;
         break;
 
       case BINOUT_COL_BOOL:
-        INVOKE_CB_1(data_bool_cb, *(uint8_t *)datap);
+        if (values != NULL)
+          values[col].bool_value = *(uint8_t *)datap;
+        else
+          INVOKE_CB_1(data_bool_cb, *(uint8_t *)datap);
         datap++;
         break;
 
@@ -442,13 +925,220 @@ static void process_byfl_keyval_table (parse_state_t *state)
         THROW_ERROR("Internal error at %s, line %d", __FILE__, __LINE__);
         break;
     }
-  INVOKE_CB_0(row_end_cb);
+  if (values != NULL)
+    INVOKE_CB_2(row_data_cb, values, num_cols);
+  else
+    INVOKE_CB_0(row_end_cb);
 
   /* Deallocate all of the column and row data we had allocated. */
+  free((void *)values);
   free((void *)row_data);
   free((void *)column_types);
 }
 
+/* Process a version 2 (columnar) Byfl table of either type.  A key:value
+ * table is stored as a basic table with a single row.  If the file is
+ * memory-mapped, column data and dictionary strings are used in place;
+ * otherwise, each chunk that adds strings to the dictionary is retained
+ * until the end of the table. */
+static void process_byfl_v2_table (parse_state_t *state)
+{
+  BINOUT_COL_T *columntypes;          /* List of column types */
+  const uint8_t **columndata;         /* Pointer to each column's data within a chunk */
+  bfbin_value_t *values;              /* One row of data for row_data_cb */
+  size_t numcols;                     /* Number of entries in each of the above */
+  const char **dictionary = NULL;     /* Table of strings referenced by string columns */
+  size_t dict_len = 0;                /* Number of valid entries in dictionary */
+  size_t dict_alloced = 0;            /* Number of entries allocated for dictionary */
+  uint8_t **kept_chunks = NULL;       /* Chunks containing dictionary strings */
+  size_t num_kept = 0;                /* Number of valid entries in kept_chunks */
+  size_t kept_alloced = 0;            /* Number of entries allocated for kept_chunks */
+  int batch_rows;                     /* 1=invoke row_data_cb; 0=invoke per-datum callbacks */
+  size_t i;
+
+  /* Read and parse each column header. */
+  read_big_endian(state, sizeof(uint64_t));
+  numcols = (size_t) (*(uint64_t *)state->last_value);
+  columntypes = malloc((numcols + 1)*sizeof(BINOUT_COL_T));
+  columndata = malloc((numcols + 1)*sizeof(const uint8_t *));
+  values = malloc((numcols + 1)*sizeof(bfbin_value_t));
+  if (!columntypes || !columndata || !values)
+    THROW_ERROR("Failed to allocate memory for %lu columns (%s)",
+                (unsigned long)numcols, strerror(errno));
+  INVOKE_CB_0(column_begin_cb);
+  for (i = 0; i < numcols; i++) {
+    read_big_endian(state, sizeof(uint8_t));
+    columntypes[i] = (BINOUT_COL_T) (*(uint8_t *)state->last_value);
+    read_string(state);
+    switch (columntypes[i]) {
+      case BINOUT_COL_UINT64:
+        INVOKE_CB_1(column_uint64_cb, state->last_value);
+        break;
+
+      case BINOUT_COL_STRING:
+        INVOKE_CB_1(column_string_cb, state->last_value);
+        break;
+
+      case BINOUT_COL_BOOL:
+        INVOKE_CB_1(column_bool_cb, state->last_value);
+        break;
+
+      default:
+        THROW_ERROR("Invalid column type %d in %s",
+                    (int)columntypes[i], state->filename);
+        break;
+    }
+  }
+  INVOKE_CB_0(column_end_cb);
+  batch_rows = state->callback_list->row_data_cb != NULL;
+
+  /* Read and parse each chunk of rows. */
+  while (1) {
+    uint64_t numrows;                 /* Number of rows in the current chunk */
+    uint64_t chunk_len;               /* Number of bytes in the current chunk */
+    uint64_t numstrings;              /* Number of strings to add to the dictionary */
+    const uint8_t *chunk;             /* The current chunk */
+    const uint8_t *datap;             /* Pointer into the current chunk */
+    const uint8_t *endp;              /* Pointer past the end of the current chunk */
+    uint64_t row;
+
+    /* Read the chunk header. */
+    read_big_endian(state, sizeof(uint64_t));
+    numrows = *(uint64_t *)state->last_value;
+    if (numrows == 0)
+      break;
+    read_big_endian(state, sizeof(uint64_t));
+    chunk_len = *(uint64_t *)state->last_value;
+
+    /* If we're skipping the current table, don't even read the chunk. */
+    if (state->skipping) {
+      skip_input(state, chunk_len);
+      continue;
+    }
+
+    /* Use the chunk in place if the file is memory-mapped.  Otherwise,
+     * read the entire chunk into memory. */
+    chunk = state->compressed ? NULL : peek_input(state, chunk_len);
+    if (chunk == NULL) {
+      if (state->chunk_space < chunk_len) {
+        state->chunk_space = chunk_len;
+        state->chunk = realloc(state->chunk, state->chunk_space);
+        if (!state->chunk)
+          THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                      (unsigned long)state->chunk_space, strerror(errno));
+      }
+      if (read_input(state, state->chunk, chunk_len) != chunk_len)
+        THROW_ERROR("Failed to read a %lu-byte column chunk from %s (%s)",
+                    (unsigned long)chunk_len, state->filename, strerror(errno));
+      chunk = state->chunk;
+    }
+    datap = chunk;
+    endp = chunk + chunk_len;
+
+    /* Append the chunk's strings to the dictionary. */
+    if (chunk_len < sizeof(uint64_t))
+      THROW_ERROR("Truncated column chunk in %s", state->filename);
+    numstrings = decode_big_endian(datap, sizeof(uint64_t));
+    datap += sizeof(uint64_t);
+    for (; numstrings > 0; numstrings--) {
+      size_t string_len;
+      if ((size_t)(endp - datap) < sizeof(uint16_t))
+        THROW_ERROR("Truncated string dictionary in %s", state->filename);
+      string_len = (size_t) decode_big_endian(datap, sizeof(uint16_t));
+      datap += sizeof(uint16_t);
+      if ((size_t)(endp - datap) <= string_len || datap[string_len] != '\0')
+        THROW_ERROR("Corrupt string dictionary in %s", state->filename);
+      if (dict_len == dict_alloced) {
+        dict_alloced = dict_alloced == 0 ? 256 : dict_alloced*2;
+        dictionary = realloc(dictionary, dict_alloced*sizeof(const char *));
+        if (!dictionary)
+          THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                      (unsigned long)(dict_alloced*sizeof(const char *)), strerror(errno));
+      }
+      dictionary[dict_len++] = (const char *)datap;
+      datap += string_len + 1;
+    }
+
+    /* If the dictionary now points into our read buffer, retain the
+     * buffer until the end of the table. */
+    if (chunk == state->chunk && datap != chunk + sizeof(uint64_t)) {
+      if (num_kept == kept_alloced) {
+        kept_alloced = kept_alloced == 0 ? 16 : kept_alloced*2;
+        kept_chunks = realloc(kept_chunks, kept_alloced*sizeof(uint8_t *));
+        if (!kept_chunks)
+          THROW_ERROR("Failed to allocate %lu bytes of memory (%s)",
+                      (unsigned long)(kept_alloced*sizeof(uint8_t *)), strerror(errno));
+      }
+      kept_chunks[num_kept++] = state->chunk;
+      state->chunk = NULL;
+      state->chunk_space = 0;
+    }
+
+    /* Locate each column's data. */
+    for (i = 0; i < numcols; i++) {
+      columndata[i] = datap;
+      datap += numrows*BINOUT_V2_COLUMN_WIDTH(columntypes[i]);
+    }
+    if (datap != endp)
+      THROW_ERROR("Column chunk in %s contains %ld bytes, not %lu",
+                  state->filename, (long)(datap - chunk),
+                  (unsigned long)chunk_len);
+
+    /* Invoke callbacks for each row in turn. */
+    for (row = 0; row < numrows; row++) {
+      if (!batch_rows)
+        INVOKE_CB_0(row_begin_cb);
+      for (i = 0; i < numcols; i++) {
+        size_t width = BINOUT_V2_COLUMN_WIDTH(columntypes[i]);
+        uint64_t value = decode_big_endian(columndata[i], width);
+        columndata[i] += width;
+        switch (columntypes[i]) {
+          case BINOUT_COL_UINT64:
+            if (batch_rows)
+              values[i].uint64_value = value;
+            else
+              INVOKE_CB_1(data_uint64_cb, value);
+            break;
+
+          case BINOUT_COL_STRING:
+            if (value >= dict_len)
+              THROW_ERROR("Invalid string index %lu in %s",
+                          (unsigned long)value, state->filename);
+            if (batch_rows)
+              values[i].string_value = dictionary[value];
+            else
+              INVOKE_CB_1(data_string_cb, dictionary[value]);
+            break;
+
+          case BINOUT_COL_BOOL:
+            if (batch_rows)
+              values[i].bool_value = (uint8_t)value;
+            else
+              INVOKE_CB_1(data_bool_cb, (uint8_t)value);
+            break;
+
+          default:
+            THROW_ERROR("Internal error at %s, line %d", __FILE__, __LINE__);
+            break;
+        }
+      }
+      if (batch_rows)
+        INVOKE_CB_2(row_data_cb, values, numcols);
+      else
+        INVOKE_CB_0(row_end_cb);
+    }
+  }
+
+  /* Deallocate the dictionary and column information. */
+  for (i = 0; i < num_kept; i++)
+    free(kept_chunks[i]);
+  free(kept_chunks);
+  free((void *)dictionary);
+  free(values);
+  free((void *)columndata);
+  free(columntypes);
+}
+
 /* Process a complete Byfl table.  Return 1 on success, 0 on EOF. */
 static int process_byfl_table (parse_state_t *state)
 {
@@ -461,17 +1151,28 @@ static int process_byfl_table (parse_state_t *state)
     return 0;
   read_string(state);
 
+  /* Ask the caller if we should process or skip the table. */
+  state->skipping =
+    state->callback_list->table_filter_cb != NULL
+    && !state->callback_list->table_filter_cb(state->user_data, state->last_value);
+
   /* Invoke the appropriate function to parse the table. */
   switch (tabletype) {
     case BINOUT_TABLE_BASIC:
       INVOKE_CB_1(table_begin_basic_cb, state->last_value);
-      process_byfl_basic_table(state);
+      if (state->version == 2)
+        process_byfl_v2_table(state);
+      else
+        process_byfl_basic_table(state);
       INVOKE_CB_0(table_end_basic_cb);
       break;
 
     case BINOUT_TABLE_KEYVAL:
       INVOKE_CB_1(table_begin_keyval_cb, state->last_value);
-      process_byfl_keyval_table(state);
+      if (state->version == 2)
+        process_byfl_v2_table(state);
+      else
+        process_byfl_keyval_table(state);
       INVOKE_CB_0(table_end_keyval_cb);
       break;
 
@@ -479,6 +1180,79 @@ static int process_byfl_table (parse_state_t *state)
       THROW_ERROR("Internal error at %s, line %d", __FILE__, __LINE__);
       break;
   }
+  state->skipping = 0;
+  return 1;
+}
+
+/* Use a version 2 file's table of contents to seek directly to each table
+ * the caller's table filter accepts, and process only those tables.
+ * Return 1 on success or 0 if the file lacks a usable table of contents
+ * (e.g., because the program that wrote it terminated abnormally). */
+static int process_byfl_tables_by_toc (parse_state_t *state)
+{
+  char magic[7];            /* The string "BYFLTOC" if given a valid trailer */
+  uint8_t trailer[sizeof(uint64_t) + sizeof(magic)];  /* Table-of-contents offset and magic */
+  uint64_t toc_offset;      /* Byte offset of the table of contents */
+  uint64_t numtables;       /* Number of tables in the file */
+  uint64_t *offsets;        /* Offset of each table to process */
+  size_t numoffsets = 0;    /* Number of valid entries in offsets */
+  long start = file_position(state);  /* Position following the magic header sequence */
+  uint64_t i;
+
+  /* Read the trailer.  On failure, return to where we started. */
+  if (start == -1)
+    return 0;
+  if (state->map != NULL) {
+    if (state->map_len < sizeof(trailer))
+      return 0;
+    memcpy(trailer, state->map + state->map_len - sizeof(trailer), sizeof(trailer));
+  }
+  else if (fseek(state->fd, -(long)sizeof(trailer), SEEK_END) != 0
+           || fread(trailer, sizeof(uint8_t), sizeof(trailer), state->fd) != sizeof(trailer)) {
+    (void) seek_input(state, (uint64_t)start);
+    return 0;
+  }
+  memcpy(magic, trailer + sizeof(uint64_t), sizeof(magic));
+  toc_offset = decode_big_endian(trailer, sizeof(uint64_t));
+  if (memcmp(magic, BINOUT_V2_TOC_MAGIC, sizeof(magic)) != 0
+      || !seek_input(state, toc_offset)) {
+    (void) seek_input(state, (uint64_t)start);
+    return 0;
+  }
+
+  /* Read the table of contents, and retain the offsets of the tables the
+   * caller wants to see. */
+  read_big_endian(state, sizeof(uint64_t));
+  numtables = *(uint64_t *)state->last_value;
+  offsets = malloc((numtables + 1)*sizeof(uint64_t));
+  if (!offsets)
+    THROW_ERROR("Failed to allocate memory for %lu table offsets (%s)",
+                (unsigned long)numtables, strerror(errno));
+  for (i = 0; i < numtables; i++) {
+    uint64_t offset;
+    read_big_endian(state, sizeof(uint8_t));   /* Table type */
+    read_string(state);                        /* Table name */
+    if (state->callback_list->table_filter_cb(state->user_data, state->last_value)) {
+      read_big_endian(state, sizeof(uint64_t));
+      offset = *(uint64_t *)state->last_value;
+      offsets[numoffsets++] = offset;
+    }
+    else
+      read_big_endian(state, sizeof(uint64_t));
+    read_big_endian(state, sizeof(uint64_t));  /* Row count */
+  }
+
+  /* Process each selected table. */
+  for (i = 0; i < numoffsets; i++) {
+    if (!seek_input(state, offsets[i])) {
+      unsigned long bad_offset = (unsigned long)offsets[i];
+      free(offsets);
+      THROW_ERROR("Failed to seek to position %lu in %s",
+                  bad_offset, state->filename);
+    }
+    process_byfl_table(state);
+  }
+  free(offsets);
   return 1;
 }
 
@@ -509,8 +1283,7 @@ void bf_process_byfl_file (const char *byfl_filename,
     }
 
     /* Close the input file. */
-    if (local_state.fd != NULL)
-      fclose(local_state.fd);
+    close_binary_file(&local_state);
     return;
   }
 
@@ -526,12 +1299,16 @@ void bf_process_byfl_file (const char *byfl_filename,
   /* Open the Byfl binary-output file for input.*/
   open_binary_file(&local_state);
 
-  /* Process each table in turn. */
-  while (process_byfl_table(&local_state))
-    ;
+  /* If the caller wants to see only some tables and the file has a
+   * seekable table of contents, jump directly to those tables.  Otherwise,
+   * process each table in turn. */
+  if (local_state.version != 2 || local_state.compressed || local_state.patient
+      || callback_list->table_filter_cb == NULL
+      || !process_byfl_tables_by_toc(&local_state))
+    while (process_byfl_table(&local_state))
+      ;
 
   /* Close the Byfl binary-output file and free allocated memory. */
-  fclose(local_state.fd);
-  free(local_state.read_buffer);
+  close_binary_file(&local_state);
   free(local_state.last_value);
 }